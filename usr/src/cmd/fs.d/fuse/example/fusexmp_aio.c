@@ -0,0 +1,939 @@
+/*
+  FUSE: Filesystem in Userspace
+  Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+
+  cc -D_FILE_OFFSET_BITS=64 fusexmp_aio.c -lfuse -o fusexmp_aio
+*/
+
+/*
+ * fusexmp_aio: the fusexmp passthrough, with the back-end file I/O
+ * done asynchronously so that it overlaps with the door upcalls.
+ *
+ * The kernel asks for at most FUSE_MAX_IOSIZE at a time, and each
+ * request waits for its reply, so a plain pread() per request leaves
+ * the disk idle between upcalls.  Here:
+ *
+ *  - Sequential reads start read-ahead: the next aio_depth chunks of
+ *    aio_ra KB are submitted as one lio_listio() batch, and later
+ *    reads are answered from those buffers.  There's no read-ahead
+ *    on a file while any handle to it is open for writing, so the
+ *    buffers never hold data that has since been written.
+ *
+ *  - Writes are copied and queued with aio_write(), and the reply is
+ *    sent at once (write-behind).  At most aio_wb writes per file are
+ *    in flight.  An error from one is returned by the next write,
+ *    flush, fsync or release of that file.  Overlapping writes wait,
+ *    so writes to the same range reach the file in order.
+ *
+ * Completions of both are delivered to one event port and reaped in
+ * batches with port_getn() by the aio_reaper thread.
+ *
+ * Calls that look at the file's data or size by path (getattr,
+ * truncate) first wait for write-behind on open handles to the same
+ * file, found by device and inode in the open_files list.
+ *
+ * Options: -o aio_ra=KB,aio_depth=N,aio_wb=N
+ */
+
+#define FUSE_USE_VERSION 26
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <fuse.h>
+#include <fuse_opt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <aio.h>
+#include <port.h>
+#include <sys/time.h>
+
+#define RA_MAX		16	/* read-ahead buffers per file */
+#define REAP_MAX	64	/* completions taken per port_getn() */
+
+struct xmp_conf {
+	unsigned ra_size;	/* KB per read-ahead request */
+	unsigned ra_depth;	/* read-ahead requests ahead of the reader */
+	unsigned wb_max;	/* write-behind requests in flight, per file */
+};
+
+static struct xmp_conf conf = { 128, 4, 32 };
+
+#define XMP_OPT(t, p) { t, offsetof(struct xmp_conf, p), 0 }
+
+static struct fuse_opt xmp_opts[] = {
+	XMP_OPT("aio_ra=%u",	ra_size),
+	XMP_OPT("aio_depth=%u",	ra_depth),
+	XMP_OPT("aio_wb=%u",	wb_max),
+	FUSE_OPT_END
+};
+
+static int aio_port = -1;
+
+enum { REQ_READ, REQ_WRITE };
+
+struct xmp_file;
+
+struct xmp_req {
+	aiocb_t cb;
+	port_notify_t pn;
+	struct xmp_file *file;
+	int kind;
+	int done;
+	ssize_t res;		/* bytes, or -errno */
+	struct xmp_req *next;	/* file's write list */
+};
+
+struct xmp_file {
+	int fd;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	off_t next_off;		/* where a sequential read goes next */
+	struct xmp_req *ra[RA_MAX];
+	struct xmp_req *writes;	/* write-behind in flight */
+	unsigned nwrites;
+	int werr;		/* first write-behind error, -errno */
+	int writable;		/* open for writing */
+	unsigned nwriters;	/* writable handles to this file (both locks) */
+	dev_t dev;
+	ino_t ino;
+	struct xmp_file *next;	/* open_files */
+};
+
+static pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct xmp_file *open_files;
+
+static inline struct xmp_file *get_file(struct fuse_file_info *fi)
+{
+	return (struct xmp_file *) (uintptr_t) fi->fh;
+}
+
+static size_t ra_bytes(void)
+{
+	return (size_t) conf.ra_size * 1024;
+}
+
+static struct xmp_req *req_alloc(struct xmp_file *f, int kind, off_t off,
+				 size_t size)
+{
+	struct xmp_req *r = calloc(1, sizeof(*r));
+
+	if (r == NULL)
+		return NULL;
+	r->cb.aio_buf = malloc(size);
+	if (r->cb.aio_buf == NULL) {
+		free(r);
+		return NULL;
+	}
+	r->cb.aio_fildes = f->fd;
+	r->cb.aio_offset = off;
+	r->cb.aio_nbytes = size;
+	r->cb.aio_lio_opcode = kind == REQ_READ ? LIO_READ : LIO_WRITE;
+	r->pn.portnfy_port = aio_port;
+	r->pn.portnfy_user = r;
+	r->cb.aio_sigevent.sigev_notify = SIGEV_PORT;
+	r->cb.aio_sigevent.sigev_value.sival_ptr = &r->pn;
+	r->file = f;
+	r->kind = kind;
+	return r;
+}
+
+static void req_free(struct xmp_req *r)
+{
+	free((void *) r->cb.aio_buf);
+	free(r);
+}
+
+/* A write-behind request completed, with f->lock held */
+static void wb_done(struct xmp_file *f, struct xmp_req *r, ssize_t res)
+{
+	struct xmp_req **rp;
+
+	if (res >= 0 && (size_t) res != r->cb.aio_nbytes)
+		res = -EIO;
+	if (res < 0 && f->werr == 0)
+		f->werr = res;
+	for (rp = &f->writes; *rp != r; rp = &(*rp)->next)
+		;
+	*rp = r->next;
+	f->nwrites--;
+	req_free(r);
+}
+
+/*
+ * Take completions off the port, many at a time, and hand the
+ * results to whoever is waiting on the file.
+ */
+static void *aio_reaper(void *arg)
+{
+	port_event_t ev[REAP_MAX];
+	uint_t i, n;
+
+	(void) arg;
+
+	for (;;) {
+		n = 1;
+		if (port_getn(aio_port, ev, REAP_MAX, &n, NULL) == -1) {
+			if (errno == EINTR || errno == ETIME)
+				continue;
+			perror("fusexmp_aio: port_getn");
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			struct xmp_req *r = ev[i].portev_user;
+			struct xmp_file *f = r->file;
+			int err = aio_error(&r->cb);
+			ssize_t res = aio_return(&r->cb);
+
+			if (res == -1)
+				res = -err;
+
+			pthread_mutex_lock(&f->lock);
+			if (r->kind == REQ_WRITE) {
+				wb_done(f, r, res);
+			} else {
+				r->res = res;
+				r->done = 1;
+			}
+			pthread_cond_broadcast(&f->cond);
+			pthread_mutex_unlock(&f->lock);
+		}
+	}
+	return NULL;
+}
+
+/* Wait for write-behind; returns and clears a pending error. */
+static int wb_drain(struct xmp_file *f)
+{
+	int err;
+
+	while (f->nwrites != 0)
+		pthread_cond_wait(&f->cond, &f->lock);
+	err = f->werr;
+	f->werr = 0;
+	return err;
+}
+
+static int wb_overlaps(struct xmp_file *f, off_t off, size_t size)
+{
+	struct xmp_req *r;
+
+	for (r = f->writes; r != NULL; r = r->next) {
+		if (off < r->cb.aio_offset + (off_t) r->cb.aio_nbytes &&
+		    r->cb.aio_offset < off + (off_t) size)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Throw away read-ahead buffers that overlap [off, off + size), or all
+ * of them if size is zero.  Ones still in flight are waited for.
+ */
+static void ra_drop(struct xmp_file *f, off_t off, size_t size)
+{
+	int i;
+
+	for (i = 0; i < RA_MAX; i++) {
+		struct xmp_req *r = f->ra[i];
+
+		if (r == NULL)
+			continue;
+		if (size != 0 &&
+		    (off >= r->cb.aio_offset + (off_t) r->cb.aio_nbytes ||
+		     r->cb.aio_offset >= off + (off_t) size))
+			continue;
+		while (!r->done)
+			pthread_cond_wait(&f->cond, &f->lock);
+		f->ra[i] = NULL;
+		req_free(r);
+	}
+}
+
+/*
+ * Wait for write-behind on every open handle to the file at path,
+ * so that what is done by path sees the data.  With drop_ra, their
+ * read-ahead is thrown away too (the data is about to change).
+ */
+static void wb_drain_path(const char *path, int drop_ra)
+{
+	struct xmp_file *f;
+	struct stat st;
+
+	if (open_files == NULL || lstat(path, &st) == -1 ||
+	    !S_ISREG(st.st_mode))
+		return;
+
+	pthread_mutex_lock(&open_lock);
+	for (f = open_files; f != NULL; f = f->next) {
+		if (f->dev != st.st_dev || f->ino != st.st_ino)
+			continue;
+		pthread_mutex_lock(&f->lock);
+		while (f->nwrites != 0)
+			pthread_cond_wait(&f->cond, &f->lock);
+		if (drop_ra)
+			ra_drop(f, 0, 0);
+		pthread_mutex_unlock(&f->lock);
+	}
+	pthread_mutex_unlock(&open_lock);
+}
+
+/*
+ * Keep conf.ra_depth chunks queued from the one holding off onward.
+ * Buffers wholly behind off are recycled.  New requests go out as
+ * one lio_listio() batch.
+ */
+static void ra_issue(struct xmp_file *f, off_t off)
+{
+	size_t len = ra_bytes();
+	off_t start = off - off % len;
+	aiocb_t *list[RA_MAX];
+	int nlist = 0;
+	unsigned depth = conf.ra_depth > RA_MAX ? RA_MAX : conf.ra_depth;
+	unsigned c;
+	int i;
+
+	for (i = 0; i < RA_MAX; i++) {
+		struct xmp_req *r = f->ra[i];
+
+		if (r != NULL && r->done &&
+		    r->cb.aio_offset + (off_t) len <= start) {
+			f->ra[i] = NULL;
+			req_free(r);
+		}
+	}
+
+	for (c = 0; c < depth; c++) {
+		off_t coff = start + (off_t) c * len;
+		struct xmp_req *r;
+		int slot = -1;
+
+		for (i = 0; i < RA_MAX; i++) {
+			if (f->ra[i] == NULL) {
+				if (slot == -1)
+					slot = i;
+			} else if (f->ra[i]->cb.aio_offset == coff)
+				break;
+		}
+		if (i < RA_MAX)
+			continue;	/* already queued */
+		if (slot == -1)
+			break;
+
+		r = req_alloc(f, REQ_READ, coff, len);
+		if (r == NULL)
+			break;
+		f->ra[slot] = r;
+		list[nlist++] = &r->cb;
+	}
+
+	if (nlist == 0)
+		return;
+
+	if (lio_listio(LIO_NOWAIT, list, nlist, NULL) == -1) {
+		int lerr = errno;
+
+		/*
+		 * Some may have been queued anyway (EAGAIN, EIO).
+		 * Those not in progress are marked done and failed.
+		 * aio_error() fails (-1) for those never queued.
+		 */
+		for (i = 0; i < nlist; i++) {
+			struct xmp_req *r = (struct xmp_req *)
+			    ((char *) list[i] - offsetof(struct xmp_req, cb));
+			int err = aio_error(&r->cb);
+
+			if (err == -1)
+				err = lerr ? lerr : EIO;
+			if (err != EINPROGRESS && err != 0) {
+				r->res = -err;
+				r->done = 1;
+			}
+		}
+	}
+}
+
+/*
+ * Answer a read from a completed (or in-flight) read-ahead buffer.
+ * Returns -1 if no buffer covers the whole range.
+ */
+static int ra_read(struct xmp_file *f, char *buf, size_t size, off_t offset)
+{
+	int i;
+
+	for (i = 0; i < RA_MAX; i++) {
+		struct xmp_req *r = f->ra[i];
+		off_t skip;
+
+		if (r == NULL || offset < r->cb.aio_offset ||
+		    offset + (off_t) size >
+		    r->cb.aio_offset + (off_t) r->cb.aio_nbytes)
+			continue;
+
+		while (!r->done)
+			pthread_cond_wait(&f->cond, &f->lock);
+		if (r->res < 0) {
+			f->ra[i] = NULL;
+			req_free(r);
+			return -1;
+		}
+		skip = offset - r->cb.aio_offset;
+		if (skip >= r->res)
+			return 0;
+		if (size > (size_t) (r->res - skip))
+			size = r->res - skip;
+		memcpy(buf, (char *) r->cb.aio_buf + skip, size);
+		return size;
+	}
+	return -1;
+}
+
+static void *xmp_init(struct fuse_conn_info *conn)
+{
+	pthread_t tid;
+
+	(void) conn;
+
+	/* Here, not in main: fuse_main() may fork to go to background */
+	aio_port = port_create();
+	if (aio_port == -1) {
+		perror("fusexmp_aio: port_create");
+		exit(1);
+	}
+	errno = pthread_create(&tid, NULL, aio_reaper, NULL);
+	if (errno != 0) {
+		perror("fusexmp_aio: pthread_create");
+		exit(1);
+	}
+	pthread_detach(tid);
+
+	return NULL;
+}
+
+static int xmp_getattr(const char *path, struct stat *stbuf)
+{
+	int res;
+
+	wb_drain_path(path, 0);
+	res = lstat(path, stbuf);
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
+
+static int xmp_access(const char *path, int mask)
+{
+	int res;
+
+	res = access(path, mask);
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
+
+static int xmp_readlink(const char *path, char *buf, size_t size)
+{
+	int res;
+
+	res = readlink(path, buf, size - 1);
+	if (res == -1)
+		return -errno;
+
+	buf[res] = '\0';
+	return 0;
+}
+
+
+static int xmp_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+		       off_t offset, struct fuse_file_info *fi)
+{
+	DIR *dp;
+	struct dirent *de;
+
+	(void) offset;
+	(void) fi;
+
+	dp = opendir(path);
+	if (dp == NULL)
+		return -errno;
+
+	while ((de = readdir(dp)) != NULL) {
+		struct stat st;
+		memset(&st, 0, sizeof(st));
+		st.st_ino = de->d_ino;
+		/* st.st_mode = de->d_type << 12; XXX */
+		if (filler(buf, de->d_name, &st, 0))
+			break;
+	}
+
+	closedir(dp);
+	return 0;
+}
+
+static int xmp_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+	int res;
+
+	/* On Linux this could just be 'mknod(path, mode, rdev)' but this
+	   is more portable */
+	if (S_ISREG(mode)) {
+		res = open(path, O_CREAT | O_EXCL | O_WRONLY, mode);
+		if (res >= 0)
+			res = close(res);
+	} else if (S_ISFIFO(mode))
+		res = mkfifo(path, mode);
+	else
+		res = mknod(path, mode, rdev);
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
+
+static int xmp_mkdir(const char *path, mode_t mode)
+{
+	int res;
+
+	res = mkdir(path, mode);
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
+
+static int xmp_unlink(const char *path)
+{
+	int res;
+
+	res = unlink(path);
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
+
+static int xmp_rmdir(const char *path)
+{
+	int res;
+
+	res = rmdir(path);
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
+
+static int xmp_symlink(const char *from, const char *to)
+{
+	int res;
+
+	res = symlink(from, to);
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
+
+static int xmp_rename(const char *from, const char *to)
+{
+	int res;
+
+	res = rename(from, to);
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
+
+static int xmp_link(const char *from, const char *to)
+{
+	int res;
+
+	res = link(from, to);
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
+
+static int xmp_chmod(const char *path, mode_t mode)
+{
+	int res;
+
+	res = chmod(path, mode);
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
+
+static int xmp_chown(const char *path, uid_t uid, gid_t gid)
+{
+	int res;
+
+	res = lchown(path, uid, gid);
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
+
+static int xmp_truncate(const char *path, off_t size)
+{
+	int res;
+
+	wb_drain_path(path, 1);
+	res = truncate(path, size);
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
+
+static int xmp_utimens(const char *path, const struct timespec ts[2])
+{
+	int res;
+	struct timeval tv[2];
+
+	tv[0].tv_sec = ts[0].tv_sec;
+	tv[0].tv_usec = ts[0].tv_nsec / 1000;
+	tv[1].tv_sec = ts[1].tv_sec;
+	tv[1].tv_usec = ts[1].tv_nsec / 1000;
+
+	res = utimes(path, tv);
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
+
+
+static int xmp_ftruncate(const char *path, off_t size,
+			 struct fuse_file_info *fi)
+{
+	struct xmp_file *f = get_file(fi);
+	int res;
+
+	(void) path;
+
+	pthread_mutex_lock(&f->lock);
+	res = wb_drain(f);
+	ra_drop(f, 0, 0);
+	if (res == 0 && ftruncate(f->fd, size) == -1)
+		res = -errno;
+	pthread_mutex_unlock(&f->lock);
+
+	return res;
+}
+
+static int xmp_fgetattr(const char *path, struct stat *stbuf,
+			struct fuse_file_info *fi)
+{
+	struct xmp_file *f = get_file(fi);
+	int res = 0;
+
+	(void) path;
+
+	pthread_mutex_lock(&f->lock);
+	while (f->nwrites != 0)
+		pthread_cond_wait(&f->cond, &f->lock);
+	pthread_mutex_unlock(&f->lock);
+
+	if (fstat(f->fd, stbuf) == -1)
+		res = -errno;
+
+	return res;
+}
+
+static int file_open(int fd, struct fuse_file_info *fi)
+{
+	struct xmp_file *f, *g;
+	struct stat st;
+
+	if (fstat(fd, &st) == -1 ||
+	    (f = calloc(1, sizeof(*f))) == NULL) {
+		int res = -errno;
+		close(fd);
+		return res;
+	}
+	f->fd = fd;
+	f->dev = st.st_dev;
+	f->ino = st.st_ino;
+	f->writable = (fi->flags & O_ACCMODE) != O_RDONLY;
+	pthread_mutex_init(&f->lock, NULL);
+	pthread_cond_init(&f->cond, NULL);
+
+	/*
+	 * Count the writers.  A new one stops read-ahead on the other
+	 * handles and throws away what they have.
+	 */
+	pthread_mutex_lock(&open_lock);
+	for (g = open_files; g != NULL; g = g->next) {
+		if (g->dev != f->dev || g->ino != f->ino)
+			continue;
+		if (g->writable)
+			f->nwriters++;
+		if (f->writable) {
+			pthread_mutex_lock(&g->lock);
+			g->nwriters++;
+			ra_drop(g, 0, 0);
+			pthread_mutex_unlock(&g->lock);
+		}
+	}
+	if (f->writable)
+		f->nwriters++;
+	f->next = open_files;
+	open_files = f;
+	pthread_mutex_unlock(&open_lock);
+
+	fi->fh = (unsigned long) f;
+	return 0;
+}
+
+static int xmp_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	int fd;
+
+	fd = open(path, fi->flags, mode);
+	if (fd == -1)
+		return -errno;
+
+	return file_open(fd, fi);
+}
+
+static int xmp_open(const char *path, struct fuse_file_info *fi)
+{
+	int fd;
+
+	fd = open(path, fi->flags);
+	if (fd == -1)
+		return -errno;
+
+	return file_open(fd, fi);
+}
+
+static int xmp_read(const char *path, char *buf, size_t size, off_t offset,
+		    struct fuse_file_info *fi)
+{
+	struct xmp_file *f = get_file(fi);
+	int res;
+
+	(void) path;
+
+	pthread_mutex_lock(&f->lock);
+	if (wb_overlaps(f, offset, size)) {
+		while (f->nwrites != 0)
+			pthread_cond_wait(&f->cond, &f->lock);
+	}
+
+	/*
+	 * Sequential: make sure what comes next is on its way.  Not
+	 * while the file is open for writing, as read-ahead could
+	 * miss the writes.
+	 */
+	if (offset == f->next_off && f->nwriters == 0)
+		ra_issue(f, offset);
+
+	res = ra_read(f, buf, size, offset);
+	if (res == -1) {
+		pthread_mutex_unlock(&f->lock);
+		res = pread(f->fd, buf, size, offset);
+		if (res == -1)
+			res = -errno;
+		pthread_mutex_lock(&f->lock);
+	}
+	if (res >= 0)
+		f->next_off = offset + res;
+	pthread_mutex_unlock(&f->lock);
+
+	return res;
+}
+
+static int xmp_write(const char *path, const char *buf, size_t size,
+		     off_t offset, struct fuse_file_info *fi)
+{
+	struct xmp_file *f = get_file(fi);
+	struct xmp_req *r;
+	int res;
+
+	(void) path;
+
+	pthread_mutex_lock(&f->lock);
+	if (f->werr != 0) {
+		res = f->werr;
+		f->werr = 0;
+		pthread_mutex_unlock(&f->lock);
+		return res;
+	}
+	while (f->nwrites >= conf.wb_max || wb_overlaps(f, offset, size))
+		pthread_cond_wait(&f->cond, &f->lock);
+	ra_drop(f, offset, size);
+
+	r = req_alloc(f, REQ_WRITE, offset, size);
+	if (r != NULL) {
+		memcpy((void *) r->cb.aio_buf, buf, size);
+		r->next = f->writes;
+		f->writes = r;
+		f->nwrites++;
+		if (aio_write(&r->cb) == 0) {
+			pthread_mutex_unlock(&f->lock);
+			return size;
+		}
+		f->writes = r->next;
+		f->nwrites--;
+		req_free(r);
+	}
+
+	/* Could not queue it: do it now */
+	res = pwrite(f->fd, buf, size, offset);
+	if (res == -1)
+		res = -errno;
+	pthread_mutex_unlock(&f->lock);
+
+	return res;
+}
+
+static int xmp_statfs(const char *path, struct statvfs *stbuf)
+{
+	int res;
+
+	res = statvfs(path, stbuf);
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
+
+
+static int xmp_flush(const char *path, struct fuse_file_info *fi)
+{
+	struct xmp_file *f = get_file(fi);
+	int res;
+
+	(void) path;
+
+	pthread_mutex_lock(&f->lock);
+	res = wb_drain(f);
+	pthread_mutex_unlock(&f->lock);
+
+	return res;
+}
+
+static int xmp_release(const char *path, struct fuse_file_info *fi)
+{
+	struct xmp_file *f = get_file(fi);
+	struct xmp_file **fp, *g;
+
+	(void) path;
+
+	pthread_mutex_lock(&open_lock);
+	for (fp = &open_files; *fp != f; fp = &(*fp)->next)
+		;
+	*fp = f->next;
+	for (g = open_files; f->writable && g != NULL; g = g->next) {
+		if (g->dev != f->dev || g->ino != f->ino)
+			continue;
+		pthread_mutex_lock(&g->lock);
+		g->nwriters--;
+		pthread_mutex_unlock(&g->lock);
+	}
+	pthread_mutex_unlock(&open_lock);
+
+	pthread_mutex_lock(&f->lock);
+	(void) wb_drain(f);
+	ra_drop(f, 0, 0);
+	pthread_mutex_unlock(&f->lock);
+
+	close(f->fd);
+	pthread_cond_destroy(&f->cond);
+	pthread_mutex_destroy(&f->lock);
+	free(f);
+
+	return 0;
+}
+
+static int xmp_fsync(const char *path, int isdatasync,
+		     struct fuse_file_info *fi)
+{
+	struct xmp_file *f = get_file(fi);
+	int res;
+
+	(void) path;
+
+	pthread_mutex_lock(&f->lock);
+	res = wb_drain(f);
+	pthread_mutex_unlock(&f->lock);
+	if (res != 0)
+		return res;
+
+	if (isdatasync)
+		res = fdatasync(f->fd);
+	else
+		res = fsync(f->fd);
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
+
+static struct fuse_operations xmp_oper = {
+	.init		= xmp_init,
+	.getattr	= xmp_getattr,
+	.fgetattr	= xmp_fgetattr,
+	.access		= xmp_access,
+	.readlink	= xmp_readlink,
+	.readdir	= xmp_readdir,
+	.mknod		= xmp_mknod,
+	.mkdir		= xmp_mkdir,
+	.symlink	= xmp_symlink,
+	.unlink		= xmp_unlink,
+	.rmdir		= xmp_rmdir,
+	.rename		= xmp_rename,
+	.link		= xmp_link,
+	.chmod		= xmp_chmod,
+	.chown		= xmp_chown,
+	.truncate	= xmp_truncate,
+	.ftruncate	= xmp_ftruncate,
+	.utimens	= xmp_utimens,
+	.create		= xmp_create,
+	.open		= xmp_open,
+	.read		= xmp_read,
+	.write		= xmp_write,
+	.statfs		= xmp_statfs,
+	.flush		= xmp_flush,
+	.release	= xmp_release,
+	.fsync		= xmp_fsync,
+
+	.flag_nullpath_ok = 1,
+};
+
+int main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	int res;
+
+	if (fuse_opt_parse(&args, &conf, xmp_opts, NULL) == -1)
+		return 1;
+	if (conf.ra_size == 0 || conf.wb_max == 0) {
+		fprintf(stderr, "fusexmp_aio: aio_ra and aio_wb must be > 0\n");
+		return 1;
+	}
+
+	umask(0);
+	res = fuse_main(args.argc, args.argv, &xmp_oper, NULL);
+	fuse_opt_free_args(&args);
+	return res;
+}
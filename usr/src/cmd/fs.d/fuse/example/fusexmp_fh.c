@@ -280,6 +280,42 @@ static int xmp_ftruncate(const char *path, off_t size,
 	return 0;
 }
 
+static int xmp_fallocate(const char *path, int mode, off_t offset,
+			 off_t length, struct fuse_file_info *fi)
+{
+	(void) path;
+
+	if (mode == (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) {
+#ifdef F_FREESP
+		struct flock fl;
+		struct stat st;
+
+		/* F_FREESP past EOF may extend the file: keep the size. */
+		if (fstat(fi->fh, &st) == -1)
+			return -errno;
+		if (offset >= st.st_size)
+			return 0;
+		if (length > st.st_size - offset)
+			length = st.st_size - offset;
+
+		memset(&fl, 0, sizeof(fl));
+		fl.l_whence = SEEK_SET;
+		fl.l_start = offset;
+		fl.l_len = length;
+		if (fcntl(fi->fh, F_FREESP, &fl) == -1)
+			/* Not every file system frees a range. */
+			return errno == EINVAL ? -EOPNOTSUPP : -errno;
+		return 0;
+#else
+		return -EOPNOTSUPP;
+#endif
+	}
+	if (mode)
+		return -EOPNOTSUPP;
+
+	return -posix_fallocate(fi->fh, offset, length);
+}
+
 static int xmp_utimens(const char *path, const struct timespec ts[2])
 {
 	int res;
@@ -484,6 +520,7 @@ static struct fuse_operations xmp_oper = {
 	.removexattr	= xmp_removexattr,
 #endif
 	.lock		= xmp_lock,
+	.fallocate	= xmp_fallocate,
 
 	.flag_nullpath_ok = 1,
 };
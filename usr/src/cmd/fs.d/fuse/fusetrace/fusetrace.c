@@ -0,0 +1,524 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Merge fusefs request traces and show where the time went.
+ *
+ * Input is the output of fusetrace.d (kernel records, "K" lines)
+ * and the file written by a FUSE daemon run with -o trace=FILE
+ * (daemon records, "D" lines), in any order.  Records with the
+ * same request ID are put together, and each request's time is
+ * split into stages:
+ *
+ *	vop		fusefs entry point, up to the upcall
+ *	limits		waiting on I/O limits (rbw, wbw, iops)
+ *	door		door call, until the daemon got it
+ *	queue		waiting for a slot (max_active)
+ *	dispatch	libfuse, until the first filesystem layer
+ *	layer:op	in that filesystem layer (and libfuse after
+ *			it), until the next layer was called
+ *	return		door return, back in the kernel
+ *	daemon		all of the above from door to return, when
+ *			there's no daemon record to split it
+ *
+ * With -v each request is printed; by default (and always at the
+ * end) we print counts, averages and percentiles per stage, and
+ * with -H the log2 histograms as well.
+ */
+
+#include <sys/types.h>
+#include <sys/fs/fuse_door.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define	NSTAGE		16	/* as in libfuse */
+#define	NBUCKET		64
+#define	HASHSIZE	4096
+
+typedef struct trace_stage {
+	char		*ts_name;	/* layer:op */
+	int64_t		ts_t;
+} trace_stage_t;
+
+typedef struct trace_req {
+	struct trace_req *tr_next;
+	uint64_t	tr_reqid;
+	uint32_t	tr_op;
+	int		tr_err;
+	boolean_t	tr_have_k;
+	boolean_t	tr_have_d;
+	char		*tr_vop;
+	int64_t		tr_t_vop;
+	int64_t		tr_t_enter;
+	int64_t		tr_t_call;
+	int64_t		tr_t_recv;
+	int64_t		tr_t_gate;
+	int64_t		tr_t_ret;
+	int64_t		tr_t_done;
+	int		tr_nstage;
+	trace_stage_t	tr_stage[NSTAGE];
+} trace_req_t;
+
+typedef struct stage_stats {
+	struct stage_stats *ss_next;
+	char		*ss_name;
+	uint64_t	ss_count;
+	int64_t		ss_total;
+	uint64_t	ss_hist[NBUCKET];
+} stage_stats_t;
+
+static trace_req_t *req_hash[HASHSIZE];
+static uint64_t nreqs;
+static stage_stats_t *stats_list;
+static stage_stats_t **stats_tail = &stats_list;
+static int vflag;
+static int Hflag;
+
+static const char *opnames[] = {
+	[FUSE_OP_INIT] = "init",
+	[FUSE_OP_DESTROY] = "destroy",
+	[FUSE_OP_STATVFS] = "statvfs",
+	[FUSE_OP_FGETATTR] = "fgetattr",
+	[FUSE_OP_GETATTR] = "getattr",
+	[FUSE_OP_OPENDIR] = "opendir",
+	[FUSE_OP_CLOSEDIR] = "closedir",
+	[FUSE_OP_READDIR] = "readdir",
+	[FUSE_OP_OPEN] = "open",
+	[FUSE_OP_CLOSE] = "close",
+	[FUSE_OP_READ] = "read",
+	[FUSE_OP_WRITE] = "write",
+	[FUSE_OP_FLUSH] = "flush",
+	[FUSE_OP_CREATE] = "create",
+	[FUSE_OP_FTRUNC] = "ftrunc",
+	[FUSE_OP_UTIMES] = "utimes",
+	[FUSE_OP_CHMOD] = "chmod",
+	[FUSE_OP_CHOWN] = "chown",
+	[FUSE_OP_DELETE] = "delete",
+	[FUSE_OP_RENAME] = "rename",
+	[FUSE_OP_MKDIR] = "mkdir",
+	[FUSE_OP_RMDIR] = "rmdir",
+	[FUSE_OP_POLL] = "poll",
+	[FUSE_OP_NOTIFY] = "notify",
+	[FUSE_OP_CREATE2] = "create2",
+	[FUSE_OP_IOCTL] = "ioctl",
+	[FUSE_OP_DEVREAD] = "devread",
+	[FUSE_OP_DEVWRITE] = "devwrite",
+	[FUSE_OP_FALLOCATE] = "fallocate",
+};
+
+static const char *
+opname(uint32_t op)
+{
+	static char buf[16];
+
+	if (op < sizeof (opnames) / sizeof (opnames[0]) &&
+	    opnames[op] != NULL)
+		return (opnames[op]);
+	(void) snprintf(buf, sizeof (buf), "op%u", op);
+	return (buf);
+}
+
+static void *
+xalloc(size_t size)
+{
+	void *p;
+
+	if ((p = calloc(1, size)) == NULL) {
+		perror("fusetrace");
+		exit(1);
+	}
+	return (p);
+}
+
+static char *
+xstrdup(const char *s)
+{
+	char *p;
+
+	if ((p = strdup(s)) == NULL) {
+		perror("fusetrace");
+		exit(1);
+	}
+	return (p);
+}
+
+static trace_req_t *
+req_lookup(uint64_t reqid)
+{
+	trace_req_t **trp, *tr;
+
+	trp = &req_hash[reqid % HASHSIZE];
+	for (tr = *trp; tr != NULL; tr = tr->tr_next) {
+		if (tr->tr_reqid == reqid)
+			return (tr);
+	}
+	tr = xalloc(sizeof (*tr));
+	tr->tr_reqid = reqid;
+	tr->tr_next = *trp;
+	*trp = tr;
+	nreqs++;
+	return (tr);
+}
+
+/*
+ * K reqid opcode vop t_vop t_enter t_call t_done err
+ */
+static int
+parse_k(char *line)
+{
+	trace_req_t *tr;
+	unsigned long long reqid;
+	long long t_vop, t_enter, t_call, t_done;
+	unsigned op;
+	char vop[64];
+	int err;
+
+	if (sscanf(line, "K %llu %u %63s %lld %lld %lld %lld %d",
+	    &reqid, &op, vop, &t_vop, &t_enter, &t_call, &t_done,
+	    &err) != 8)
+		return (-1);
+
+	tr = req_lookup(reqid);
+	tr->tr_have_k = B_TRUE;
+	tr->tr_op = op;
+	if (strcmp(vop, "-") != 0)
+		tr->tr_vop = xstrdup(vop);
+	tr->tr_t_vop = t_vop;
+	tr->tr_t_enter = t_enter;
+	tr->tr_t_call = t_call;
+	tr->tr_t_done = t_done;
+	if (err != 0)
+		tr->tr_err = err;
+	return (0);
+}
+
+/*
+ * D reqid opcode t_enter t_call t_recv t_gate t_ret err [layer:op:t ...]
+ */
+static int
+parse_d(char *line)
+{
+	trace_req_t *tr;
+	unsigned long long reqid;
+	long long t_enter, t_call, t_recv, t_gate, t_ret;
+	unsigned op;
+	char *p, *tok, *colon;
+	int err, n;
+
+	if (sscanf(line, "D %llu %u %lld %lld %lld %lld %lld %d%n",
+	    &reqid, &op, &t_enter, &t_call, &t_recv, &t_gate, &t_ret,
+	    &err, &n) != 8)
+		return (-1);
+
+	tr = req_lookup(reqid);
+	tr->tr_have_d = B_TRUE;
+	tr->tr_op = op;
+	tr->tr_t_enter = t_enter;
+	tr->tr_t_call = t_call;
+	tr->tr_t_recv = t_recv;
+	tr->tr_t_gate = t_gate;
+	tr->tr_t_ret = t_ret;
+	if (err != 0)
+		tr->tr_err = err;
+
+	p = line + n;
+	while ((tok = strtok(p, " \t\n")) != NULL) {
+		p = NULL;
+		if (tr->tr_nstage >= NSTAGE)
+			break;
+		if ((colon = strrchr(tok, ':')) == NULL)
+			return (-1);
+		*colon++ = '\0';
+		tr->tr_stage[tr->tr_nstage].ts_name = xstrdup(tok);
+		tr->tr_stage[tr->tr_nstage].ts_t = strtoll(colon, NULL, 10);
+		tr->tr_nstage++;
+	}
+	return (0);
+}
+
+static void
+read_file(const char *name)
+{
+	char line[2048];
+	FILE *fp;
+	int lineno = 0;
+	int bad = 0;
+
+	if (strcmp(name, "-") == 0) {
+		fp = stdin;
+	} else if ((fp = fopen(name, "r")) == NULL) {
+		(void) fprintf(stderr, "fusetrace: %s: %s\n",
+		    name, strerror(errno));
+		exit(1);
+	}
+
+	while (fgets(line, sizeof (line), fp) != NULL) {
+		lineno++;
+		switch (line[0]) {
+		case 'K':
+			if (parse_k(line) != 0)
+				bad++;
+			break;
+		case 'D':
+			if (parse_d(line) != 0)
+				bad++;
+			break;
+		default:
+			/* dtrace chatter, blank lines */
+			break;
+		}
+	}
+	if (bad != 0) {
+		(void) fprintf(stderr,
+		    "fusetrace: %s: %d bad records (of %d lines)\n",
+		    name, bad, lineno);
+	}
+	if (fp != stdin)
+		(void) fclose(fp);
+}
+
+static stage_stats_t *
+stats_lookup(const char *name)
+{
+	stage_stats_t *ss;
+
+	for (ss = stats_list; ss != NULL; ss = ss->ss_next) {
+		if (strcmp(ss->ss_name, name) == 0)
+			return (ss);
+	}
+	ss = xalloc(sizeof (*ss));
+	ss->ss_name = xstrdup(name);
+	*stats_tail = ss;
+	stats_tail = &ss->ss_next;
+	return (ss);
+}
+
+static int
+bucket(int64_t ns)
+{
+	int b = 0;
+
+	while (ns > 1 && b < NBUCKET - 1) {
+		ns >>= 1;
+		b++;
+	}
+	return (b);
+}
+
+/*
+ * Count one stage of one request, and print it with -v.
+ */
+static void
+stage(const char *name, int64_t start, int64_t end)
+{
+	stage_stats_t *ss;
+	int64_t ns;
+
+	if (start == 0 || end == 0)
+		return;
+	ns = end - start;
+	if (ns < 0)
+		ns = 0;
+
+	ss = stats_lookup(name);
+	ss->ss_count++;
+	ss->ss_total += ns;
+	ss->ss_hist[bucket(ns)]++;
+
+	if (vflag)
+		(void) printf(" %s=%lld", name, (long long)(ns / 1000));
+}
+
+static void
+do_req(trace_req_t *tr)
+{
+	char name[128];
+	int64_t t, start, end;
+	int i;
+
+	if (tr->tr_have_k) {
+		start = tr->tr_t_vop;
+		end = tr->tr_t_done;
+	} else {
+		start = tr->tr_t_enter;
+		end = tr->tr_t_ret;
+	}
+
+	if (vflag) {
+		(void) printf("%llu %s", (unsigned long long)tr->tr_reqid,
+		    opname(tr->tr_op));
+		if (tr->tr_vop != NULL)
+			(void) printf(" (%s)", tr->tr_vop);
+		if (tr->tr_err != 0)
+			(void) printf(" err=%d", tr->tr_err);
+		(void) printf(":");
+	}
+
+	(void) snprintf(name, sizeof (name), "total:%s", opname(tr->tr_op));
+	stage(name, start, end);
+	if (tr->tr_have_k)
+		stage("vop", tr->tr_t_vop, tr->tr_t_enter);
+	stage("limits", tr->tr_t_enter, tr->tr_t_call);
+
+	if (tr->tr_have_d) {
+		stage("door", tr->tr_t_call, tr->tr_t_recv);
+		stage("queue", tr->tr_t_recv, tr->tr_t_gate);
+		t = tr->tr_nstage > 0 ? tr->tr_stage[0].ts_t : tr->tr_t_ret;
+		stage("dispatch", tr->tr_t_gate, t);
+		for (i = 0; i < tr->tr_nstage; i++) {
+			t = i + 1 < tr->tr_nstage ?
+			    tr->tr_stage[i + 1].ts_t : tr->tr_t_ret;
+			stage(tr->tr_stage[i].ts_name, tr->tr_stage[i].ts_t, t);
+		}
+		if (tr->tr_have_k)
+			stage("return", tr->tr_t_ret, tr->tr_t_done);
+	} else {
+		stage("daemon", tr->tr_t_call, tr->tr_t_done);
+	}
+
+	if (vflag)
+		(void) printf("\n");
+}
+
+/*
+ * Upper bound (ns) of the bucket holding the given fraction.
+ */
+static int64_t
+percentile(stage_stats_t *ss, double frac)
+{
+	uint64_t want, sum = 0;
+	int b;
+
+	want = (uint64_t)(ss->ss_count * frac);
+	if (want == 0)
+		want = 1;
+	for (b = 0; b < NBUCKET; b++) {
+		sum += ss->ss_hist[b];
+		if (sum >= want)
+			break;
+	}
+	return ((int64_t)1 << (b + 1));
+}
+
+static void
+print_hist(stage_stats_t *ss)
+{
+	uint64_t max = 0;
+	int b, lo, hi, n;
+
+	for (b = 0; b < NBUCKET; b++) {
+		if (ss->ss_hist[b] > max)
+			max = ss->ss_hist[b];
+	}
+	for (lo = 0; lo < NBUCKET && ss->ss_hist[lo] == 0; lo++)
+		;
+	for (hi = NBUCKET - 1; hi > lo && ss->ss_hist[hi] == 0; hi--)
+		;
+
+	(void) printf("\n  %s\n  %16s  %-40s %s\n", ss->ss_name,
+	    "ns", "distribution", "count");
+	for (b = lo; b <= hi; b++) {
+		n = max == 0 ? 0 : (int)(ss->ss_hist[b] * 40 / max);
+		(void) printf("  %16lld |%-40.*s %llu\n",
+		    (long long)1 << b, n,
+		    "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@",
+		    (unsigned long long)ss->ss_hist[b]);
+	}
+}
+
+static void
+print_stats(void)
+{
+	stage_stats_t *ss;
+
+	(void) printf("%-32s %10s %10s %10s %10s\n",
+	    "STAGE", "COUNT", "AVG(us)", "P50(us)", "P99(us)");
+	for (ss = stats_list; ss != NULL; ss = ss->ss_next) {
+		(void) printf("%-32s %10llu %10lld %10lld %10lld\n",
+		    ss->ss_name, (unsigned long long)ss->ss_count,
+		    (long long)(ss->ss_total / ss->ss_count / 1000),
+		    (long long)(percentile(ss, 0.5) / 1000),
+		    (long long)(percentile(ss, 0.99) / 1000));
+	}
+
+	if (Hflag) {
+		for (ss = stats_list; ss != NULL; ss = ss->ss_next)
+			print_hist(ss);
+	}
+}
+
+static int
+req_cmp(const void *a, const void *b)
+{
+	const trace_req_t *ta = *(trace_req_t * const *)a;
+	const trace_req_t *tb = *(trace_req_t * const *)b;
+
+	if (ta->tr_reqid < tb->tr_reqid)
+		return (-1);
+	return (ta->tr_reqid > tb->tr_reqid);
+}
+
+static void
+usage(void)
+{
+	(void) fprintf(stderr,
+	    "usage: fusetrace [-Hv] file ...\n"
+	    "\tfiles are fusetrace.d output and/or daemon -o trace=FILE\n"
+	    "\t-v\tprint each request (times in us)\n"
+	    "\t-H\tprint a histogram per stage\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	trace_req_t *tr, **reqs;
+	size_t n = 0, j;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "Hv")) != -1) {
+		switch (c) {
+		case 'H':
+			Hflag++;
+			break;
+		case 'v':
+			vflag++;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind == argc)
+		usage();
+
+	for (i = optind; i < argc; i++)
+		read_file(argv[i]);
+
+	/* In request ID order, which is the order they were made. */
+	reqs = xalloc((nreqs + 1) * sizeof (*reqs));
+	for (i = 0; i < HASHSIZE; i++) {
+		for (tr = req_hash[i]; tr != NULL; tr = tr->tr_next)
+			reqs[n++] = tr;
+	}
+	qsort(reqs, n, sizeof (*reqs), req_cmp);
+	for (j = 0; j < n; j++)
+		do_req(reqs[j]);
+	if (vflag)
+		(void) printf("\n");
+	print_stats();
+
+	return (0);
+}
@@ -54,6 +54,7 @@
 #include <pwd.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <limits.h>
 #include <errno.h>
 #include <err.h>
 #include <libintl.h>
@@ -137,6 +138,24 @@ static const char * const optlist[] = {
 	"fileperms",
 #define	OPT_NOPROMPT	24
 	"noprompt",
+#define	OPT_MEMLIMIT	25
+	"memlimit",
+#define	OPT_RBW		26
+	"rbw",
+#define	OPT_WBW		27
+	"wbw",
+#define	OPT_IOPS	28
+	"iops",
+#define	OPT_QOSZONE	29
+	"qoszone",
+#define	OPT_SWR		30
+	"swr",
+#define	OPT_ASYNCNS	31
+	"asyncns",
+#define	OPT_BLKDEV	32
+	"blkdev",
+#define	OPT_ACL		33
+	"acl",
 
 	NULL
 };
@@ -144,6 +163,7 @@ static const char * const optlist[] = {
 static int Oflg = 0;    /* Overlay mounts */
 static int qflg = 0;    /* quiet - don't print warnings on bad options */
 static int noprompt = 0;	/* don't prompt for password */
+static char *blkdev = NULL;	/* device the file system is on */
 
 /* Note: fusefs uses _both_ kinds of options. */
 static int mntflags = MS_DATA | MS_OPTIONSTR;
@@ -322,6 +342,23 @@ main(int argc, char *argv[])
 	}
 	mdata.doorfd = fd;
 
+	/*
+	 * The device (or image file) the file system is on, for
+	 * direct I/O.  Opened with the user's own privileges, so
+	 * this gives the kernel no access the user doesn't have.
+	 */
+	mdata.blkfd = -1;
+	if (blkdev != NULL) {
+		fd = open(blkdev, (mntflags & MS_RDONLY) ? O_RDONLY : O_RDWR);
+		if (fd == -1) {
+			fprintf(stderr, gettext("%s: open failed, %s\n"),
+				blkdev, strerror(errno));
+			exit(RET_ERR);
+		}
+		mdata.blkfd = fd;
+		mdata.flags |= FUSEFS_MF_BLKDEV;
+	}
+
 	/*
 	 * Have FUSE helper door, now mount.
 	 */
@@ -354,6 +391,38 @@ main(int argc, char *argv[])
 
 #define	bad(val) (val == NULL || !isdigit(*val))
 
+/*
+ * Parse a size in KB, or followed by k, m, or g.
+ */
+static int
+getkb(const char *val, uint_t *kbp)
+{
+	u_longlong_t kb;
+	char *p;
+
+	if (bad(val))
+		return (-1);
+	errno = 0;
+	kb = strtoull(val, &p, 10);
+	if (errno)
+		return (-1);
+	switch (*p) {
+	case 'g': case 'G':
+		kb *= 1024;
+		/* FALLTHROUGH */
+	case 'm': case 'M':
+		kb *= 1024;
+		/* FALLTHROUGH */
+	case 'k': case 'K':
+		p++;
+		break;
+	}
+	if (*p != 0 || kb > UINT_MAX)
+		return (-1);
+	*kbp = (uint_t)kb;
+	return (0);
+}
+
 int
 setsubopt(struct fusefs_args *mdatap, char *subopt)
 {
@@ -361,6 +430,7 @@ setsubopt(struct fusefs_args *mdatap, char *subopt)
 	struct passwd *pwd;
 	struct group *grp;
 	long val;
+	u_long uval;
 	int rc = EX_OK;
 	int index;
 	char *p;
@@ -539,6 +609,87 @@ setsubopt(struct fusefs_args *mdatap, char *subopt)
 		noprompt++;
 		break;
 
+	/*
+	 * Cache memory limit, in KB unless
+	 * followed by k, m, or g.  Zero: none.
+	 */
+	case OPT_MEMLIMIT:
+		if (getkb(optarg, &mdatap->memlimit) != 0)
+			goto badval;
+		mdatap->flags |= FUSEFS_MF_MEMLIMIT;
+		break;
+
+	/*
+	 * I/O limits: bandwidth in KB/sec (or with k, m, g),
+	 * and upcalls per second.  Zero: none.
+	 */
+	case OPT_RBW:
+		if (getkb(optarg, &mdatap->rbw) != 0)
+			goto badval;
+		mdatap->flags |= FUSEFS_MF_QOS;
+		break;
+
+	case OPT_WBW:
+		if (getkb(optarg, &mdatap->wbw) != 0)
+			goto badval;
+		mdatap->flags |= FUSEFS_MF_QOS;
+		break;
+
+	case OPT_IOPS:
+		if (bad(optarg))
+			goto badval;
+		errno = 0;
+		uval = strtoul(optarg, &p, 10);
+		if (errno || *p != 0 || uval > UINT_MAX)
+			goto badval;
+		mdatap->iops = (uint_t)uval;
+		mdatap->flags |= FUSEFS_MF_QOS;
+		break;
+
+	case OPT_QOSZONE:
+		mdatap->flags |= FUSEFS_MF_QOSZONE;
+		break;
+
+	/*
+	 * Stale-while-revalidate: serve attributes and
+	 * statvfs up to this many seconds past expiry.
+	 */
+	case OPT_SWR:
+		errno = 0;
+		val = strtol(optarg, &p, 10);
+		if (errno || *p != 0 || val < 0)
+			goto badval;
+		mdatap->swr = val;
+		mdatap->flags |= FUSEFS_MF_SWR;
+		break;
+
+	/*
+	 * Create files and directories in the background.
+	 */
+	case OPT_ASYNCNS:
+		mdatap->flags |= FUSEFS_MF_ASYNCNS;
+		break;
+
+	/*
+	 * Read and write file data on this device, where
+	 * the file system says it is (bmap).
+	 */
+	case OPT_BLKDEV:
+		if (optarg == NULL || *optarg == '\0')
+			goto badval;
+		free(blkdev);
+		if ((blkdev = strdup(optarg)) == NULL)
+			err(EX_OPT, NULL);
+		break;
+
+	/*
+	 * Check access with each file's owner, mode and ACL
+	 * (not the mount's uid, gid and modes).
+	 */
+	case OPT_ACL:
+		mdatap->flags |= FUSEFS_MF_ACL;
+		break;
+
 	default:
 	badopt:
 		if (!qflg)
@@ -0,0 +1,784 @@
+/*
+  CUSE: Character device in Userspace
+  Copyright (C) 2008       SUSE Linux Products GmbH
+  Copyright (C) 2008       Tejun Heo <teheo@suse.de>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+/*
+ * Copyright 2012 Nexenta Systems, Inc.  All rights reserved.
+ */
+
+/*
+ * CUSE over Solaris doors.
+ *
+ * The daemon serves a door, as a file system daemon does, and
+ * attaches it to the cuse driver with an ioctl on /dev/cuse/ctl,
+ * which makes /dev/cuse/NAME (from DEVNAME= in the dev_info).
+ * The kernel calls us with the fusefs door protocol; the device
+ * ops use FUSE_OP_DEVREAD, FUSE_OP_DEVWRITE and FUSE_OP_IOCTL.
+ * The device goes away when we close the control node.
+ *
+ * The CUSE ops are "lowlevel": they reply with fuse_reply_*,
+ * maybe later, from another thread.  The door thread that got
+ * the call waits for the reply (struct sol_reply) and returns
+ * it to the kernel.  See sol_reply in fuse_ll_doorsvc.c
+ *
+ * The major and minor numbers in cuse_info are not used;
+ * the driver gives out its own.
+ */
+
+#include "cuse_lowlevel.h"
+#include "fuse_i.h"
+#include "fuse_opt.h"
+#include "fuse_misc.h"
+
+#include <sys/fs/fuse_door.h>	/* Solaris doors */
+#include <sys/cuse.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/note.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <door.h>
+#include <ucred.h>
+
+struct cuse_data {
+	struct cuse_lowlevel_ops	clop;
+	unsigned			flags;
+	char				name[CUSE_NAMELEN];
+	int				ctl_fd;
+	int				door_fd;
+};
+
+/* There's one device per process, like one mount. */
+static struct fuse_ll *cuse_ll;
+
+/*
+ * door_return doesn't come back, so each door thread keeps
+ * its reply buffer for its next call.
+ */
+static __thread char *cuse_tbuf;
+static __thread size_t cuse_tbufsize;
+
+static struct cuse_lowlevel_ops *req_clop(fuse_req_t req)
+{
+	return &req->f->cuse_data->clop;
+}
+
+static void *cuse_retbuf(size_t size)
+{
+	char *buf;
+
+	if (size > cuse_tbufsize) {
+		buf = realloc(cuse_tbuf, size);
+		if (buf == NULL)
+			return NULL;
+		cuse_tbuf = buf;
+		cuse_tbufsize = size;
+	}
+	return cuse_tbuf;
+}
+
+static void cuse_return(void *data, size_t size)
+{
+	door_return(data, size, NULL, 0);
+}
+
+/*
+ * Set up the request for a door call.  Reply data (up to
+ * bufsize) goes to buf.
+ */
+static void cuse_req_init(struct fuse_req *req, struct sol_reply *r,
+			  char *buf, size_t bufsize)
+{
+	ucred_t *uc = NULL;
+
+	memset(r, 0, sizeof(*r));
+	fuse_mutex_init(&r->lock);
+	pthread_cond_init(&r->cond, NULL);
+	r->buf = buf;
+	r->bufsize = bufsize;
+
+	memset(req, 0, sizeof(*req));
+	req->f = cuse_ll;
+	req->ctr = 1;
+	req->reply = r;
+	fuse_mutex_init(&req->lock);
+	if (door_ucred(&uc) == 0) {
+		req->ctx.uid = ucred_geteuid(uc);
+		req->ctx.gid = ucred_getegid(uc);
+		req->ctx.pid = ucred_getpid(uc);
+		ucred_free(uc);
+	}
+}
+
+/* Wait for the op's reply, and clean up.  Returns the error. */
+static int cuse_req_wait(struct fuse_req *req)
+{
+	struct sol_reply *r = req->reply;
+
+	pthread_mutex_lock(&r->lock);
+	while (!r->done)
+		pthread_cond_wait(&r->cond, &r->lock);
+	pthread_mutex_unlock(&r->lock);
+
+	pthread_cond_destroy(&r->cond);
+	pthread_mutex_destroy(&r->lock);
+	pthread_mutex_destroy(&req->lock);
+	return r->err;
+}
+
+/* sys/file.h flags (from the kernel) to open(2) flags */
+static int cuse_oflags(uint32_t fflags)
+{
+	int oflags;
+
+	switch (fflags & (FREAD | FWRITE)) {
+	case FWRITE:
+		oflags = O_WRONLY;
+		break;
+	case FREAD | FWRITE:
+		oflags = O_RDWR;
+		break;
+	default:
+		oflags = O_RDONLY;
+		break;
+	}
+	if (fflags & (FNONBLOCK | FNDELAY))
+		oflags |= O_NONBLOCK;
+	return oflags;
+}
+
+/* FUSE_OP_INIT, made from our CUSE_IOC_ATTACH */
+static void
+cuse_do_init(struct fuse_ll *ll, void *vargp, size_t argsz)
+{
+	_NOTE(ARGUNUSED(vargp, argsz));
+	struct cuse_data *cd = ll->cuse_data;
+	struct fuse_generic_ret ret = { 0 };
+
+	if (ll->debug)
+		fprintf(stderr, "CUSE_INIT: %s\n", cd->name);
+
+	ll->conn.capable = 0;
+	ll->conn.want = 0;
+	if (ll->conn.max_write > FUSE_DEVIO_MAX)
+		ll->conn.max_write = FUSE_DEVIO_MAX;
+	ll->got_init = 1;
+	if (cd->clop.init)
+		cd->clop.init(ll->userdata, &ll->conn);
+
+	ret.ret_flags = FUSE_INIT_CUSE;
+	/* Pollers get woken with FUSE_OP_NOTIFY */
+	if (cd->clop.poll)
+		ret.ret_flags |= FUSE_INIT_NOTIFY;
+
+	cuse_return((void *)&ret, sizeof (ret));
+}
+
+/* FUSE_OP_DESTROY, when we close the control node */
+static void
+cuse_do_destroy(struct fuse_ll *ll, void *vargp, size_t argsz)
+{
+	_NOTE(ARGUNUSED(vargp, argsz));
+	struct cuse_data *cd = ll->cuse_data;
+	struct fuse_generic_ret ret = { 0 };
+
+	if (ll->debug)
+		fprintf(stderr, "got destroy request\n");
+	ll->got_destroy = 1;
+
+	/* The notify thread goes away. */
+	fuse_sol_notify_shutdown();
+	if (cd->clop.destroy)
+		cd->clop.destroy(ll->userdata);
+
+	cuse_return((void *)&ret, sizeof (ret));
+}
+
+/* FUSE_OP_OPEN (the path is always "/") */
+static void
+cuse_do_open(struct fuse_ll *ll, void *vargp, size_t argsz)
+{
+	struct fuse_path_arg *arg = vargp;
+	struct fuse_fid_ret ret = { 0 };
+	struct fuse_file_info fi;
+	struct fuse_req req;
+	struct sol_reply r;
+	int err = 0;
+
+	if (argsz != sizeof (*arg)) {
+		err = EINVAL;
+		goto out;
+	}
+
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = cuse_oflags(arg->arg_val[0]);
+	if (ll->cuse_data->clop.open == NULL)
+		goto out;
+
+	cuse_req_init(&req, &r, NULL, 0);
+	req_clop(&req)->open(&req, &fi);
+	err = cuse_req_wait(&req);
+	if (err == 0)
+		ret.ret_fid = r.val;
+
+out:
+	ret.ret_err = err;
+	cuse_return((void *)&ret, sizeof (ret));
+}
+
+/* FUSE_OP_FLUSH, FUSE_OP_CLOSE */
+static void
+cuse_do_release(struct fuse_ll *ll, void *vargp, size_t argsz,
+		int flush)
+{
+	struct cuse_lowlevel_ops *clop = &ll->cuse_data->clop;
+	struct fuse_fid_arg *arg = vargp;
+	struct fuse_generic_ret ret = { 0 };
+	struct fuse_file_info fi;
+	struct fuse_req req;
+	struct sol_reply r;
+	void (*func)(fuse_req_t, struct fuse_file_info *);
+	int err = 0;
+
+	if (argsz != sizeof (*arg)) {
+		err = EINVAL;
+		goto out;
+	}
+	func = flush ? clop->flush : clop->release;
+	if (func == NULL)
+		goto out;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.fh = arg->arg_fid;
+	fi.fh_old = fi.fh;
+	fi.flush = flush;
+
+	cuse_req_init(&req, &r, NULL, 0);
+	func(&req, &fi);
+	err = cuse_req_wait(&req);
+
+out:
+	ret.ret_err = err;
+	cuse_return((void *)&ret, sizeof (ret));
+}
+
+/*
+ * FUSE_OP_DEVREAD
+ *
+ * The read op gets O_NONBLOCK in fi->flags if the caller
+ * has it set, for this read.
+ */
+static void
+cuse_do_read(struct fuse_ll *ll, void *vargp, size_t argsz)
+{
+	struct fuse_devio_arg *arg = vargp;
+	struct fuse_devio_ret *retp, eret = { 0 };
+	struct fuse_file_info fi;
+	struct fuse_req req;
+	struct sol_reply r;
+	int err;
+
+	if (argsz != sizeof (*arg) || arg->arg_length > FUSE_DEVIO_MAX) {
+		err = EINVAL;
+		goto errout;
+	}
+	if (ll->cuse_data->clop.read == NULL) {
+		err = ENOSYS;
+		goto errout;
+	}
+	retp = cuse_retbuf(sizeof (*retp) + arg->arg_length);
+	if (retp == NULL) {
+		err = ENOMEM;
+		goto errout;
+	}
+	memset(retp, 0, sizeof (*retp));
+
+	memset(&fi, 0, sizeof(fi));
+	fi.fh = arg->arg_fid;
+	fi.fh_old = fi.fh;
+	fi.direct_io = 1;
+	if (arg->arg_flags & FUSE_DEVIO_NONBLOCK)
+		fi.flags = O_NONBLOCK;
+
+	cuse_req_init(&req, &r, (char *)(retp + 1), arg->arg_length);
+	req_clop(&req)->read(&req, arg->arg_length, arg->arg_offset, &fi);
+	retp->ret_err = cuse_req_wait(&req);
+	if (retp->ret_err == 0)
+		retp->ret_length = r.len;
+
+	cuse_return((void *)retp, sizeof (*retp) + retp->ret_length);
+	return;
+
+errout:
+	eret.ret_err = err;
+	cuse_return((void *)&eret, sizeof (eret));
+}
+
+/* FUSE_OP_DEVWRITE */
+static void
+cuse_do_write(struct fuse_ll *ll, void *vargp, size_t argsz)
+{
+	struct fuse_devio_arg *arg = vargp;
+	struct fuse_devio_ret ret = { 0 };
+	struct fuse_file_info fi;
+	struct fuse_req req;
+	struct sol_reply r;
+	int err;
+
+	if (argsz < sizeof (*arg) ||
+	    argsz - sizeof (*arg) < arg->arg_length ||
+	    arg->arg_length > FUSE_DEVIO_MAX) {
+		err = EINVAL;
+		goto out;
+	}
+	if (ll->cuse_data->clop.write == NULL) {
+		err = ENOSYS;
+		goto out;
+	}
+
+	memset(&fi, 0, sizeof(fi));
+	fi.fh = arg->arg_fid;
+	fi.fh_old = fi.fh;
+	fi.direct_io = 1;
+	if (arg->arg_flags & FUSE_DEVIO_NONBLOCK)
+		fi.flags = O_NONBLOCK;
+
+	cuse_req_init(&req, &r, NULL, 0);
+	req_clop(&req)->write(&req, (const char *)(arg + 1),
+			      arg->arg_length, arg->arg_offset, &fi);
+	err = cuse_req_wait(&req);
+	if (err == 0)
+		ret.ret_length = r.val > arg->arg_length ?
+			arg->arg_length : r.val;
+
+out:
+	ret.ret_err = err;
+	cuse_return((void *)&ret, sizeof (ret));
+}
+
+/*
+ * FUSE_OP_IOCTL
+ *
+ * The kernel always lets us ask for a retry; we only do so
+ * if the device was set up with CUSE_UNRESTRICTED_IOCTL.
+ */
+static void
+cuse_do_ioctl(struct fuse_ll *ll, void *vargp, size_t argsz)
+{
+	struct cuse_data *cd = ll->cuse_data;
+	struct fuse_ioctl_arg *arg = vargp;
+	struct fuse_ioctl_ret *retp, eret = { 0 };
+	struct fuse_file_info fi;
+	struct fuse_req req;
+	struct sol_reply r;
+	size_t bufsize;
+	unsigned flags = 0;
+	int err;
+
+	if (argsz < sizeof (*arg) ||
+	    argsz - sizeof (*arg) < arg->arg_insize ||
+	    arg->arg_outsize > FUSE_IOCTL_MAXDATA) {
+		err = EINVAL;
+		goto errout;
+	}
+	if (cd->clop.ioctl == NULL) {
+		err = ENOTTY;
+		goto errout;
+	}
+	/* Room for the data or the retry iovecs */
+	bufsize = arg->arg_outsize;
+	if (bufsize < FUSE_IOCTL_MAXIOV * sizeof(struct fuse_ioctl_iovec))
+		bufsize = FUSE_IOCTL_MAXIOV * sizeof(struct fuse_ioctl_iovec);
+	retp = cuse_retbuf(sizeof (*retp) + bufsize);
+	if (retp == NULL) {
+		err = ENOMEM;
+		goto errout;
+	}
+	memset(retp, 0, sizeof (*retp));
+
+	if ((arg->arg_flags & FUSE_IOCTLF_UNRESTRICTED) &&
+	    (cd->flags & CUSE_UNRESTRICTED_IOCTL))
+		flags |= FUSE_IOCTL_UNRESTRICTED;
+	if (arg->arg_flags & FUSE_IOCTLF_32BIT)
+		flags |= FUSE_IOCTL_COMPAT;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.fh = arg->arg_fid;
+	fi.fh_old = fi.fh;
+
+	cuse_req_init(&req, &r, (char *)(retp + 1), bufsize);
+	req_clop(&req)->ioctl(&req, (int)arg->arg_cmd,
+			      (void *)(uintptr_t)arg->arg_arg, &fi, flags,
+			      arg->arg_insize ? (void *)(arg + 1) : NULL,
+			      arg->arg_insize, arg->arg_outsize);
+	err = cuse_req_wait(&req);
+	if (err == 0 && r.retry &&
+	    (flags & FUSE_IOCTL_UNRESTRICTED) == 0)
+		err = EIO;
+	if (err == 0 && !r.retry && r.len > arg->arg_outsize)
+		err = EIO;
+	if (err != 0)
+		goto errout;
+
+	if (r.retry) {
+		retp->ret_flags = FUSE_IOCTLF_RETRY;
+		retp->ret_in_iovs = r.in_iovs;
+		retp->ret_out_iovs = r.out_iovs;
+	} else {
+		retp->ret_result = (int32_t)r.val;
+		retp->ret_outsize = r.len;
+	}
+	cuse_return((void *)retp, sizeof (*retp) + r.len);
+	return;
+
+errout:
+	eret.ret_err = err;
+	cuse_return((void *)&eret, sizeof (eret));
+}
+
+/* FUSE_OP_POLL */
+static void
+cuse_do_poll(struct fuse_ll *ll, void *vargp, size_t argsz)
+{
+	struct fuse_poll_arg *arg = vargp;
+	struct fuse_poll_ret ret = { 0 };
+	struct fuse_file_info fi;
+	struct fuse_pollhandle *ph = NULL;
+	struct fuse_req req;
+	struct sol_reply r;
+	int err;
+
+	if (argsz != sizeof (*arg)) {
+		err = EINVAL;
+		goto out;
+	}
+	if (ll->cuse_data->clop.poll == NULL) {
+		/* The kernel takes this as "always ready". */
+		err = ENOSYS;
+		goto out;
+	}
+
+	memset(&fi, 0, sizeof(fi));
+	fi.fh = arg->arg_fid;
+	fi.fh_old = fi.fh;
+
+	if (arg->arg_flags & FUSE_POLL_SCHEDULE_NOTIFY) {
+		ph = fuse_sol_pollhandle_new(ll, arg->arg_kh);
+		if (ph == NULL) {
+			err = ENOMEM;
+			goto out;
+		}
+	}
+
+	/* The op owns ph now, unless it says it has no poll. */
+	cuse_req_init(&req, &r, NULL, 0);
+	req_clop(&req)->poll(&req, &fi, ph);
+	err = cuse_req_wait(&req);
+	if (err == ENOSYS && ph != NULL)
+		fuse_pollhandle_destroy(ph);
+	if (err == 0)
+		ret.ret_revents = r.val;
+
+out:
+	ret.ret_err = err;
+	cuse_return((void *)&ret, sizeof (ret));
+}
+
+/*ARGSUSED*/
+static void
+cuse_dispatch(void *door_cookie, char *cargp, size_t argsz,
+    door_desc_t *dp, uint_t n_desc)
+{
+	void *vargp = cargp;
+	struct fuse_generic_arg *argp = vargp;
+	struct fuse_generic_ret ret = { 0 };
+	struct fuse_ll *ll = cuse_ll;
+	uint32_t opcode;
+	int err = 0;
+
+	/* A NULL arg call checks if we're running. */
+	if (vargp == NULL)
+		goto out;
+
+	if (ll == NULL || ll->got_destroy) {
+		err = ESRCH;
+		goto out;
+	}
+	if (argsz < sizeof (*argp)) {
+		err = EINVAL;
+		goto out;
+	}
+
+	/* These return only on errors. */
+	opcode = FUSE_OP_CODE(argp->arg_opcode);
+	switch (opcode) {
+	case FUSE_OP_INIT:
+		cuse_do_init(ll, vargp, argsz);
+		break;
+
+	case FUSE_OP_DESTROY:
+		cuse_do_destroy(ll, vargp, argsz);
+		break;
+
+	case FUSE_OP_OPEN:
+		cuse_do_open(ll, vargp, argsz);
+		break;
+
+	case FUSE_OP_FLUSH:
+		cuse_do_release(ll, vargp, argsz, 1);
+		break;
+
+	case FUSE_OP_CLOSE:
+		cuse_do_release(ll, vargp, argsz, 0);
+		break;
+
+	case FUSE_OP_DEVREAD:
+		cuse_do_read(ll, vargp, argsz);
+		break;
+
+	case FUSE_OP_DEVWRITE:
+		cuse_do_write(ll, vargp, argsz);
+		break;
+
+	case FUSE_OP_IOCTL:
+		cuse_do_ioctl(ll, vargp, argsz);
+		break;
+
+	case FUSE_OP_POLL:
+		cuse_do_poll(ll, vargp, argsz);
+		break;
+
+	case FUSE_OP_NOTIFY:
+		fuse_sol_notify(ll, vargp, argsz);
+		break;
+
+	default:
+		fprintf(stderr, "cuse_dispatch, unimpl. op %d\n", opcode);
+		err = ENOSYS;
+		break;
+	}
+
+out:
+	ret.ret_err = err;
+	cuse_return((void *)&ret, sizeof (ret));
+}
+
+/*
+ * Create our door, and give it to the driver.  This makes the
+ * INIT call, and the device node.
+ */
+static int cuse_attach(struct cuse_data *cd)
+{
+	cuse_attach_t ca;
+	sigset_t tmpmask;
+	int fd;
+
+	/*
+	 * Create the door service threads with signals blocked.
+	 * (They inherit from this thread.)  See fuse_sol_door_create
+	 */
+	sigfillset(&tmpmask);
+	sigprocmask(SIG_BLOCK, &tmpmask, NULL);
+
+	fd = door_create(cuse_dispatch, NULL, DOOR_REFUSE_DESC);
+	if (fd < 0) {
+		perror("cuse: door_create");
+		return -1;
+	}
+	(void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+	cd->door_fd = fd;
+
+	memset(&ca, 0, sizeof(ca));
+	ca.ca_doorfd = fd;
+	strlcpy(ca.ca_name, cd->name, sizeof(ca.ca_name));
+	if (ioctl(cd->ctl_fd, CUSE_IOC_ATTACH, &ca) == -1) {
+		fprintf(stderr, "cuse: failed to attach %s: %s\n",
+			cd->name, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static const struct fuse_opt kill_subtype_opts[] = {
+	FUSE_OPT_KEY("subtype=",  FUSE_OPT_KEY_DISCARD),
+	FUSE_OPT_END
+};
+
+struct fuse_session *cuse_lowlevel_new(struct fuse_args *args,
+				       const struct cuse_info *ci,
+				       const struct cuse_lowlevel_ops *clop,
+				       void *userdata)
+{
+	struct fuse_session *se;
+	struct fuse_ll *ll;
+	struct cuse_data *cd;
+	const char *name = NULL;
+	unsigned i;
+
+	for (i = 0; i < ci->dev_info_argc; i++) {
+		if (strncmp(ci->dev_info_argv[i], "DEVNAME=", 8) == 0)
+			name = ci->dev_info_argv[i] + 8;
+	}
+	if (name == NULL || name[0] == '\0' || strlen(name) >= CUSE_NAMELEN) {
+		fprintf(stderr, "cuse: missing or bad DEVNAME\n");
+		return NULL;
+	}
+
+	cd = calloc(1, sizeof(*cd));
+	if (cd == NULL) {
+		fprintf(stderr, "cuse: failed to allocate cuse_data\n");
+		return NULL;
+	}
+	memcpy(&cd->clop, clop, sizeof(cd->clop));
+	cd->flags = ci->flags;
+	strlcpy(cd->name, name, sizeof(cd->name));
+	cd->ctl_fd = -1;
+	cd->door_fd = -1;
+
+	if (fuse_opt_parse(args, NULL, kill_subtype_opts, NULL) == -1) {
+		free(cd);
+		return NULL;
+	}
+
+	/* The same session as a file system's, but for the door. */
+	se = fuse_solaris_new_common(args, userdata);
+	if (se == NULL) {
+		free(cd);
+		return NULL;
+	}
+	ll = fuse_session_data(se);
+	ll->cuse_data = cd;
+	cuse_ll = ll;
+
+	return se;
+}
+
+/* Detach the device, and free the session. */
+static void cuse_close(struct fuse_session *se)
+{
+	struct fuse_ll *ll = fuse_session_data(se);
+	struct cuse_data *cd = ll->cuse_data;
+
+	/* The device goes away, with a FUSE_OP_DESTROY call. */
+	if (cd->ctl_fd != -1) {
+		close(cd->ctl_fd);
+		cd->ctl_fd = -1;
+	}
+	if (cd->door_fd != -1) {
+		door_revoke(cd->door_fd);
+		cd->door_fd = -1;
+	}
+	cuse_ll = NULL;
+	fuse_session_destroy(se);
+}
+
+struct fuse_session *cuse_lowlevel_setup(int argc, char *argv[],
+					 const struct cuse_info *ci,
+					 const struct cuse_lowlevel_ops *clop,
+					 int *multithreaded, void *userdata)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_session *se;
+	struct fuse_chan *ch;
+	struct cuse_data *cd;
+	int fd;
+	int foreground;
+	int res;
+
+	res = fuse_parse_cmdline(&args, NULL, multithreaded, &foreground);
+	if (res == -1) {
+		fuse_opt_free_args(&args);
+		return NULL;
+	}
+
+	se = cuse_lowlevel_new(&args, ci, clop, userdata);
+	fuse_opt_free_args(&args);
+	if (se == NULL)
+		return NULL;
+	cd = cuse_ll->cuse_data;
+
+	fd = open(CUSE_CTL_PATH, O_RDWR);
+	if (fd == -1) {
+		if (errno == ENOENT || errno == ENXIO)
+			fprintf(stderr, "cuse: device not found, "
+				"try 'add_drv cuse' first\n");
+		else
+			fprintf(stderr, "cuse: failed to open %s: %s\n",
+				CUSE_CTL_PATH, strerror(errno));
+		goto err_se;
+	}
+	/* Children mustn't keep the device around. */
+	(void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+	cd->ctl_fd = fd;
+
+	ch = fuse_sol_chan_new(fd);
+	if (!ch)
+		goto err_se;
+	fuse_session_add_chan(se, ch);
+
+	res = fuse_set_signal_handlers(se);
+	if (res == -1)
+		goto err_se;
+
+	res = fuse_daemonize(foreground);
+	if (res == -1)
+		goto err_sig;
+
+	/* After daemonize: door threads don't follow a fork. */
+	if (cuse_attach(cd) == -1)
+		goto err_sig;
+
+	if (clop->init_done)
+		clop->init_done(userdata);
+
+	return se;
+
+err_sig:
+	fuse_remove_signal_handlers(se);
+err_se:
+	cuse_close(se);
+	return NULL;
+}
+
+void cuse_lowlevel_teardown(struct fuse_session *se)
+{
+	fuse_remove_signal_handlers(se);
+	cuse_close(se);
+}
+
+int cuse_lowlevel_main(int argc, char *argv[], const struct cuse_info *ci,
+		       const struct cuse_lowlevel_ops *clop, void *userdata)
+{
+	struct fuse_session *se;
+	int multithreaded;
+	int res;
+
+	se = cuse_lowlevel_setup(argc, argv, ci, clop, &multithreaded,
+				 userdata);
+	if (se == NULL)
+		return 1;
+
+	/* The door calls are served by door threads either way. */
+	if (multithreaded)
+		res = fuse_session_loop_mt(se);
+	else
+		res = fuse_session_loop(se);
+
+	cuse_lowlevel_teardown(se);
+	if (res == -1)
+		return 1;
+
+	return 0;
+}
@@ -46,6 +46,18 @@
 
 #define FUSE_DEFAULT_INTR_SIGNAL SIGUSR1
 
+/* Note each filesystem layer a traced request passes through. */
+#ifdef	__SOLARIS__
+#define fuse_fs_trace(fs)	fuse_sol_trace_stage(fs, __func__)
+#else	/* __SOLARIS__ */
+#define fuse_fs_trace(fs)	((void) 0)
+#endif	/* __SOLARIS__ */
+
+#define fuse_fs_enter(fs) do {					\
+	fuse_get_context()->private_data = (fs)->user_data;	\
+	fuse_fs_trace(fs);					\
+} while (0)
+
 #define FUSE_UNKNOWN_INO 0xffffffff
 #define OFFSET_MAX 0x7fffffffffffffffLL
 
@@ -1026,7 +1038,7 @@ static inline int fuse_compat_statfs(struct fuse_fs *fs, const char *path,
 
 int fuse_fs_getattr(struct fuse_fs *fs, const char *path, struct stat *buf)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.getattr) {
 		if (fs->debug)
 			fprintf(stderr, "getattr %s\n", path);
@@ -1040,7 +1052,7 @@ int fuse_fs_getattr(struct fuse_fs *fs, const char *path, struct stat *buf)
 int fuse_fs_fgetattr(struct fuse_fs *fs, const char *path, struct stat *buf,
 		     struct fuse_file_info *fi)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.fgetattr) {
 		if (fs->debug)
 			fprintf(stderr, "fgetattr[%llu] %s\n",
@@ -1060,7 +1072,7 @@ int fuse_fs_fgetattr(struct fuse_fs *fs, const char *path, struct stat *buf,
 int fuse_fs_rename(struct fuse_fs *fs, const char *oldpath,
 		   const char *newpath)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.rename) {
 		if (fs->debug)
 			fprintf(stderr, "rename %s %s\n", oldpath, newpath);
@@ -1073,7 +1085,7 @@ int fuse_fs_rename(struct fuse_fs *fs, const char *oldpath,
 
 int fuse_fs_unlink(struct fuse_fs *fs, const char *path)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.unlink) {
 		if (fs->debug)
 			fprintf(stderr, "unlink %s\n", path);
@@ -1086,7 +1098,7 @@ int fuse_fs_unlink(struct fuse_fs *fs, const char *path)
 
 int fuse_fs_rmdir(struct fuse_fs *fs, const char *path)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.rmdir) {
 		if (fs->debug)
 			fprintf(stderr, "rmdir %s\n", path);
@@ -1099,7 +1111,7 @@ int fuse_fs_rmdir(struct fuse_fs *fs, const char *path)
 
 int fuse_fs_symlink(struct fuse_fs *fs, const char *linkname, const char *path)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.symlink) {
 		if (fs->debug)
 			fprintf(stderr, "symlink %s %s\n", linkname, path);
@@ -1112,7 +1124,7 @@ int fuse_fs_symlink(struct fuse_fs *fs, const char *linkname, const char *path)
 
 int fuse_fs_link(struct fuse_fs *fs, const char *oldpath, const char *newpath)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.link) {
 		if (fs->debug)
 			fprintf(stderr, "link %s %s\n", oldpath, newpath);
@@ -1126,7 +1138,7 @@ int fuse_fs_link(struct fuse_fs *fs, const char *oldpath, const char *newpath)
 int fuse_fs_release(struct fuse_fs *fs,	 const char *path,
 		    struct fuse_file_info *fi)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.release) {
 		if (fs->debug)
 			fprintf(stderr, "release%s[%llu] flags: 0x%x\n",
@@ -1142,7 +1154,7 @@ int fuse_fs_release(struct fuse_fs *fs,	 const char *path,
 int fuse_fs_opendir(struct fuse_fs *fs, const char *path,
 		    struct fuse_file_info *fi)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.opendir) {
 		int err;
 
@@ -1165,7 +1177,7 @@ int fuse_fs_opendir(struct fuse_fs *fs, const char *path,
 int fuse_fs_open(struct fuse_fs *fs, const char *path,
 		 struct fuse_file_info *fi)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.open) {
 		int err;
 
@@ -1188,7 +1200,7 @@ int fuse_fs_open(struct fuse_fs *fs, const char *path,
 int fuse_fs_read(struct fuse_fs *fs, const char *path, char *buf, size_t size,
 		 off_t off, struct fuse_file_info *fi)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.read) {
 		int res;
 
@@ -1217,7 +1229,7 @@ int fuse_fs_read(struct fuse_fs *fs, const char *path, char *buf, size_t size,
 int fuse_fs_write(struct fuse_fs *fs, const char *path, const char *buf,
 		  size_t size, off_t off, struct fuse_file_info *fi)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.write) {
 		int res;
 
@@ -1248,7 +1260,7 @@ int fuse_fs_write(struct fuse_fs *fs, const char *path, const char *buf,
 int fuse_fs_fsync(struct fuse_fs *fs, const char *path, int datasync,
 		  struct fuse_file_info *fi)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.fsync) {
 		if (fs->debug)
 			fprintf(stderr, "fsync[%llu] datasync: %i\n",
@@ -1263,7 +1275,7 @@ int fuse_fs_fsync(struct fuse_fs *fs, const char *path, int datasync,
 int fuse_fs_fsyncdir(struct fuse_fs *fs, const char *path, int datasync,
 		     struct fuse_file_info *fi)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.fsyncdir) {
 		if (fs->debug)
 			fprintf(stderr, "fsyncdir[%llu] datasync: %i\n",
@@ -1278,7 +1290,7 @@ int fuse_fs_fsyncdir(struct fuse_fs *fs, const char *path, int datasync,
 int fuse_fs_flush(struct fuse_fs *fs, const char *path,
 		  struct fuse_file_info *fi)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.flush) {
 		if (fs->debug)
 			fprintf(stderr, "flush[%llu]\n",
@@ -1292,7 +1304,7 @@ int fuse_fs_flush(struct fuse_fs *fs, const char *path,
 
 int fuse_fs_statfs(struct fuse_fs *fs, const char *path, struct statvfs *buf)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.statfs) {
 		if (fs->debug)
 			fprintf(stderr, "statfs %s\n", path);
@@ -1308,7 +1320,7 @@ int fuse_fs_statfs(struct fuse_fs *fs, const char *path, struct statvfs *buf)
 int fuse_fs_releasedir(struct fuse_fs *fs, const char *path,
 		       struct fuse_file_info *fi)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.releasedir) {
 		if (fs->debug)
 			fprintf(stderr, "releasedir[%llu] flags: 0x%x\n",
@@ -1338,7 +1350,7 @@ int fuse_fs_readdir(struct fuse_fs *fs, const char *path, void *buf,
 		    fuse_fill_dir_t filler, off_t off,
 		    struct fuse_file_info *fi)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.readdir) {
 		if (fs->debug)
 			fprintf(stderr, "readdir[%llu] from %llu\n",
@@ -1368,6 +1380,7 @@ int fuse_fs_create(struct fuse_fs *fs, const char *path, mode_t mode,
 	int err;
 
 	ctx->private_data = fs->user_data;
+	fuse_fs_trace(fs);
 	if (fs->op.create) {
 
 		if (fs->debug)
@@ -1391,7 +1404,7 @@ int fuse_fs_create(struct fuse_fs *fs, const char *path, mode_t mode,
 int fuse_fs_lock(struct fuse_fs *fs, const char *path,
 		 struct fuse_file_info *fi, int cmd, struct flock *lock)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.lock) {
 		if (fs->debug)
 			fprintf(stderr, "lock[%llu] %s %s start: %llu len: %llu pid: %llu\n",
@@ -1415,7 +1428,7 @@ int fuse_fs_lock(struct fuse_fs *fs, const char *path,
 
 int fuse_fs_chown(struct fuse_fs *fs, const char *path, uid_t uid, gid_t gid)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.chown) {
 		if (fs->debug)
 			fprintf(stderr, "chown %s %lu %lu\n", path,
@@ -1429,7 +1442,7 @@ int fuse_fs_chown(struct fuse_fs *fs, const char *path, uid_t uid, gid_t gid)
 
 int fuse_fs_truncate(struct fuse_fs *fs, const char *path, off_t size)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.truncate) {
 		if (fs->debug)
 			fprintf(stderr, "truncate %s %llu\n", path,
@@ -1444,7 +1457,7 @@ int fuse_fs_truncate(struct fuse_fs *fs, const char *path, off_t size)
 int fuse_fs_ftruncate(struct fuse_fs *fs, const char *path, off_t size,
 		      struct fuse_file_info *fi)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.ftruncate) {
 		if (fs->debug)
 			fprintf(stderr, "ftruncate[%llu] %s %llu\n",
@@ -1466,7 +1479,7 @@ int fuse_fs_ftruncate(struct fuse_fs *fs, const char *path, off_t size,
 int fuse_fs_utimens(struct fuse_fs *fs, const char *path,
 		    const struct timespec tv[2])
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.utimens) {
 		if (fs->debug)
 			fprintf(stderr, "utimens %s %li.%09lu %li.%09lu\n",
@@ -1491,7 +1504,7 @@ int fuse_fs_utimens(struct fuse_fs *fs, const char *path,
 
 int fuse_fs_access(struct fuse_fs *fs, const char *path, int mask)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.access) {
 		if (fs->debug)
 			fprintf(stderr, "access %s 0%o\n", path, mask);
@@ -1505,7 +1518,7 @@ int fuse_fs_access(struct fuse_fs *fs, const char *path, int mask)
 int fuse_fs_readlink(struct fuse_fs *fs, const char *path, char *buf,
 		     size_t len)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.readlink) {
 		if (fs->debug)
 			fprintf(stderr, "readlink %s %lu\n", path,
@@ -1523,6 +1536,7 @@ int fuse_fs_mknod(struct fuse_fs *fs, const char *path, mode_t mode,
 	struct fuse_context *ctx = fuse_get_context();
 
 	ctx->private_data = fs->user_data;
+	fuse_fs_trace(fs);
 	if (fs->op.mknod) {
 		if (fs->debug)
 			fprintf(stderr, "mknod %s 0%o 0x%llx umask=0%03o\n",
@@ -1540,6 +1554,7 @@ int fuse_fs_mkdir(struct fuse_fs *fs, const char *path, mode_t mode)
 	struct fuse_context *ctx = fuse_get_context();
 
 	ctx->private_data = fs->user_data;
+	fuse_fs_trace(fs);
 	if (fs->op.mkdir) {
 		if (fs->debug)
 			fprintf(stderr, "mkdir %s 0%o umask=0%03o\n",
@@ -1554,7 +1569,7 @@ int fuse_fs_mkdir(struct fuse_fs *fs, const char *path, mode_t mode)
 int fuse_fs_setxattr(struct fuse_fs *fs, const char *path, const char *name,
 		     const char *value, size_t size, int flags)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.setxattr) {
 		if (fs->debug)
 			fprintf(stderr, "setxattr %s %s %lu 0x%x\n",
@@ -1569,7 +1584,7 @@ int fuse_fs_setxattr(struct fuse_fs *fs, const char *path, const char *name,
 int fuse_fs_getxattr(struct fuse_fs *fs, const char *path, const char *name,
 		     char *value, size_t size)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.getxattr) {
 		if (fs->debug)
 			fprintf(stderr, "getxattr %s %s %lu\n",
@@ -1584,7 +1599,7 @@ int fuse_fs_getxattr(struct fuse_fs *fs, const char *path, const char *name,
 int fuse_fs_listxattr(struct fuse_fs *fs, const char *path, char *list,
 		      size_t size)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.listxattr) {
 		if (fs->debug)
 			fprintf(stderr, "listxattr %s %lu\n",
@@ -1599,7 +1614,7 @@ int fuse_fs_listxattr(struct fuse_fs *fs, const char *path, char *list,
 int fuse_fs_bmap(struct fuse_fs *fs, const char *path, size_t blocksize,
 		 uint64_t *idx)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.bmap) {
 		if (fs->debug)
 			fprintf(stderr, "bmap %s blocksize: %lu index: %llu\n",
@@ -1614,7 +1629,7 @@ int fuse_fs_bmap(struct fuse_fs *fs, const char *path, size_t blocksize,
 
 int fuse_fs_removexattr(struct fuse_fs *fs, const char *path, const char *name)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.removexattr) {
 		if (fs->debug)
 			fprintf(stderr, "removexattr %s %s\n", path, name);
@@ -1628,7 +1643,7 @@ int fuse_fs_removexattr(struct fuse_fs *fs, const char *path, const char *name)
 int fuse_fs_ioctl(struct fuse_fs *fs, const char *path, int cmd, void *arg,
 		  struct fuse_file_info *fi, unsigned int flags, void *data)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.ioctl) {
 		if (fs->debug)
 			fprintf(stderr, "ioctl[%llu] 0x%x flags: 0x%x\n",
@@ -1643,7 +1658,7 @@ int fuse_fs_poll(struct fuse_fs *fs, const char *path,
 		 struct fuse_file_info *fi, struct fuse_pollhandle *ph,
 		 unsigned *reventsp)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.poll) {
 		int res;
 
@@ -1662,6 +1677,94 @@ int fuse_fs_poll(struct fuse_fs *fs, const char *path,
 		return -ENOSYS;
 }
 
+int fuse_fs_fallocate(struct fuse_fs *fs, const char *path, int mode,
+		      off_t offset, off_t length, struct fuse_file_info *fi)
+{
+	fuse_fs_enter(fs);
+	if (fs->op.fallocate) {
+		if (fs->debug)
+			fprintf(stderr, "fallocate[%llu] %s mode: 0x%x, "
+				"offset: %llu, length: %llu\n",
+				(unsigned long long) fi->fh, path, mode,
+				(unsigned long long) offset,
+				(unsigned long long) length);
+
+		return fs->op.fallocate(path, mode, offset, length, fi);
+	} else
+		return -ENOSYS;
+}
+
+static int is_digest_xattr(const char *name)
+{
+	return strncmp(name, FUSE_DIGEST_XATTR,
+		       sizeof(FUSE_DIGEST_XATTR) - 1) == 0;
+}
+
+int fuse_fs_digest(struct fuse_fs *fs, const char *path, const char *alg,
+		   char *buf, size_t size)
+{
+	char name[sizeof(FUSE_DIGEST_XATTR) + 16];
+	const char *s;
+	int res;
+	int i;
+
+	for (s = alg; *s; s++)
+		if (!((*s >= 'a' && *s <= 'z') || (*s >= '0' && *s <= '9') ||
+		      *s == '-'))
+			return -EINVAL;
+	if (s == alg || strlen(alg) >= 16)
+		return -EINVAL;
+	if (size < 2)
+		return -ERANGE;
+
+	snprintf(name, sizeof(name), "%s%s", FUSE_DIGEST_XATTR, alg);
+	res = fuse_fs_getxattr(fs, path, name, buf, size - 1);
+	if (res == -ENODATA || res == -ENOSYS || res == -EOPNOTSUPP)
+		return -ENOTSUP;
+	if (res < 0)
+		return res;
+	if (res == 0 || (size_t) res >= size)
+		return -EIO;
+
+	for (i = 0; i < res; i++) {
+		if (buf[i] >= 'A' && buf[i] <= 'F')
+			buf[i] += 'a' - 'A';
+		else if (!((buf[i] >= '0' && buf[i] <= '9') ||
+			   (buf[i] >= 'a' && buf[i] <= 'f')))
+			return -EIO;
+	}
+	buf[res] = '\0';
+
+	return res;
+}
+
+int fuse_fs_rmtree(struct fuse_fs *fs, const char *path)
+{
+	fuse_fs_enter(fs);
+	if (fs->op.rmtree) {
+		if (fs->debug)
+			fprintf(stderr, "rmtree %s\n", path);
+
+		return fs->op.rmtree(path);
+	} else {
+		return -ENOSYS;
+	}
+}
+
+int fuse_fs_sumtree(struct fuse_fs *fs, const char *path,
+		    struct fuse_treesum *sum)
+{
+	fuse_fs_enter(fs);
+	if (fs->op.sumtree) {
+		if (fs->debug)
+			fprintf(stderr, "sumtree %s\n", path);
+
+		return fs->op.sumtree(path, sum);
+	} else {
+		return -ENOSYS;
+	}
+}
+
 static int is_open(struct fuse *f, fuse_ino_t dir, const char *name)
 {
 	struct node *node;
@@ -1892,7 +1995,7 @@ static void reply_entry(fuse_req_t req, const struct fuse_entry_param *e,
 
 void fuse_fs_init(struct fuse_fs *fs, struct fuse_conn_info *conn)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.init)
 		fs->user_data = fs->op.init(conn);
 }
@@ -1910,7 +2013,7 @@ static void fuse_lib_init(void *data, struct fuse_conn_info *conn)
 
 void fuse_fs_destroy(struct fuse_fs *fs)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.destroy)
 		fs->op.destroy(fs->user_data);
 	if (fs->m)
@@ -2035,7 +2138,7 @@ static void fuse_lib_getattr(fuse_req_t req, fuse_ino_t ino,
 
 int fuse_fs_chmod(struct fuse_fs *fs, const char *path, mode_t mode)
 {
-	fuse_get_context()->private_data = fs->user_data;
+	fuse_fs_enter(fs);
 	if (fs->op.chmod)
 		return fs->op.chmod(path, mode);
 	else
@@ -2835,6 +2938,11 @@ static void fuse_lib_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 	char *path;
 	int err;
 
+	if (is_digest_xattr(name)) {
+		reply_err(req, -EPERM);
+		return;
+	}
+
 	err = get_path(f, ino, &path);
 	if (!err) {
 		struct fuse_intr_data d;
@@ -2940,6 +3048,11 @@ static void fuse_lib_removexattr(fuse_req_t req, fuse_ino_t ino,
 	char *path;
 	int err;
 
+	if (is_digest_xattr(name)) {
+		reply_err(req, -EPERM);
+		return;
+	}
+
 	err = get_path(f, ino, &path);
 	if (!err) {
 		struct fuse_intr_data d;
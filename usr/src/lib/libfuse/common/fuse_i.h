@@ -76,6 +76,27 @@ struct fuse_session {
 	struct fuse_chan *ch;
 };
 
+#ifdef	__SOLARIS__
+/*
+ * Where the reply to a lowlevel request goes.  Only CUSE uses
+ * the lowlevel API here; the door thread that made the request
+ * waits for this to be filled in.  See cuse_ll_doorsvc.c
+ */
+struct sol_reply {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int done;
+	int err;		/* positive errno */
+	uint64_t val;		/* fh, count, revents or ioctl result */
+	int retry;		/* ioctl retry, iovecs in buf */
+	unsigned in_iovs;
+	unsigned out_iovs;
+	char *buf;		/* reply data */
+	size_t bufsize;
+	size_t len;
+};
+#endif	/* __SOLARIS__ */
+
 struct fuse_req {
 	struct fuse_ll *f;
 	uint64_t unique;
@@ -95,6 +116,9 @@ struct fuse_req {
 	} u;
 	struct fuse_req *next;
 	struct fuse_req *prev;
+#ifdef	__SOLARIS__
+	struct sol_reply *reply;
+#endif
 };
 
 struct fuse_dh {
@@ -130,6 +154,9 @@ struct fuse_ll {
 	int big_writes;
 #ifdef	__SOLARIS__
 	/* Not doing "lowlevel" stuff */
+	unsigned max_active;	/* requests run at once, 0 = no limit */
+	unsigned prio_reserve;	/* of max_active, kept for high priority */
+	char *trace_file;	/* per-request trace records go here */
 #else
 	struct fuse_lowlevel_ops op;
 #endif
@@ -173,6 +200,11 @@ int fuse_sol_mount2(const char *mountpoint, struct fuse *f);
 void fuse_sol_unmount(const char *mountpoint, int fd);
 int fuse_fill_dir(void *dh_, const char *name, const struct stat *statp,
 		  off_t off);
+void fuse_sol_trace_stage(struct fuse_fs *fs, const char *func);
+void fuse_sol_notify(struct fuse_ll *ll, void *vargp, size_t argsz);
+void fuse_sol_notify_shutdown(void);
+struct fuse_pollhandle *fuse_sol_pollhandle_new(struct fuse_ll *ll,
+						uint64_t kh);
 
 #endif	/* __SOLARIS__ */
 
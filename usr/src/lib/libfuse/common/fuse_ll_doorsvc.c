@@ -17,6 +17,7 @@
 #include <sys/file.h>
 #include <sys/fcntl.h>
 #include <sys/note.h>
+#include <sys/acl.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -62,6 +63,621 @@ static struct fuse_session	*solaris_se;
 static struct fuse_ll		*solaris_ll;
 int solaris_debug = 0;
 
+/*
+ * Notifications for the kernel, waiting for it to
+ * pick them up with a FUSE_OP_NOTIFY call.
+ * See do_notify()
+ */
+struct sol_notify {
+	uint32_t code;
+	uint64_t kh;
+	char *path1;
+	char *path2;
+};
+
+static struct sol_notify_q {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int dead;		/* no more FUSE_OP_NOTIFY calls */
+	unsigned count;
+	unsigned size;
+	struct sol_notify *ents;
+} solaris_nq = {
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+};
+
+static void sol_notify_free(struct sol_notify *sn)
+{
+	free(sn->path1);
+	free(sn->path2);
+}
+
+static int sol_notify_post(uint32_t code, uint64_t kh,
+			   const char *path1, const char *path2)
+{
+	struct sol_notify_q *nq = &solaris_nq;
+	struct sol_notify *sn, new;
+	unsigned i, size;
+	int res = 0;
+
+	memset(&new, 0, sizeof(new));
+	new.code = code;
+	new.kh = kh;
+	if ((path1 && strlen(path1) >= MAXPATHLEN) ||
+	    (path2 && strlen(path2) >= MAXPATHLEN))
+		return -ENAMETOOLONG;
+	if ((path1 && (new.path1 = strdup(path1)) == NULL) ||
+	    (path2 && (new.path2 = strdup(path2)) == NULL)) {
+		sol_notify_free(&new);
+		return -ENOMEM;
+	}
+
+	pthread_mutex_lock(&nq->lock);
+	if (nq->dead) {
+		res = -ENOTCONN;
+		goto out;
+	}
+
+	/*
+	 * One pending poll wakeup per handle is enough,
+	 * and likewise one "modified" per path.
+	 */
+	for (i = 0; i < nq->count; i++) {
+		sn = &nq->ents[i];
+		if (sn->code != code)
+			continue;
+		if (code == FUSE_NOTIFY_POLL && sn->kh == kh)
+			goto out;
+		if (code == FUSE_NOTIFY_MODIFIED &&
+		    strcmp(sn->path1, path1) == 0)
+			goto out;
+	}
+
+	if (nq->count == nq->size) {
+		size = nq->size ? nq->size * 2 : FUSE_NOTIFY_MAX;
+		sn = realloc(nq->ents, size * sizeof(*sn));
+		if (sn == NULL) {
+			res = -ENOMEM;
+			goto out;
+		}
+		nq->ents = sn;
+		nq->size = size;
+	}
+
+	nq->ents[nq->count++] = new;
+	new.path1 = new.path2 = NULL;
+	pthread_cond_signal(&nq->cond);
+
+out:
+	pthread_mutex_unlock(&nq->lock);
+	sol_notify_free(&new);
+	return res;
+}
+
+/*
+ * Copy a path into the ret_paths area of a FUSE_OP_NOTIFY
+ * reply, and put its offset in *nep.  Returns -1 if the
+ * path doesn't fit.
+ */
+static int sol_notify_path(struct fuse_notify_ret *ret, unsigned *offp,
+			   const char *path, uint32_t *nep)
+{
+	size_t len;
+
+	if (path == NULL) {
+		*nep = FUSE_NOTIFY_NOPATH;
+		return 0;
+	}
+	len = strlen(path) + 1;
+	if (*offp + len > sizeof(ret->ret_paths))
+		return -1;
+	memcpy(ret->ret_paths + *offp, path, len);
+	*nep = *offp;
+	*offp += len;
+	return 0;
+}
+
+/*
+ * Requests waiting their turn, by priority (FUSE_OP_PRIO).
+ * With -o max_active=N, at most N requests are run at once,
+ * and when one finishes, the next is taken from the highest
+ * priority class that has waiters.  With -o prio_reserve=M,
+ * the last M of those slots are only for high priority.
+ * Without max_active, every request runs as soon as it comes
+ * (each door call has its own thread).
+ */
+static struct sol_gate {
+	pthread_mutex_t lock;
+	pthread_cond_t cond[FUSE_PRIO_MAX];
+	unsigned waiting[FUSE_PRIO_MAX];
+	unsigned active;
+} solaris_gate = {
+	PTHREAD_MUTEX_INITIALIZER,
+	{ PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+	  PTHREAD_COND_INITIALIZER },
+};
+
+/* Priority classes, most urgent first */
+static const unsigned sol_prio_order[FUSE_PRIO_MAX] = {
+	FUSE_PRIO_HIGH, FUSE_PRIO_NORMAL, FUSE_PRIO_LOW
+};
+
+/* Set while this door thread holds a slot */
+static __thread int sol_gated;
+
+static int sol_gate_open(sol_ll_t *ll, struct sol_gate *g, unsigned prio)
+{
+	unsigned i, limit = ll->max_active;
+
+	if (prio != FUSE_PRIO_HIGH)
+		limit = limit > ll->prio_reserve ?
+			limit - ll->prio_reserve : 1;
+	if (g->active >= limit)
+		return 0;
+	/* Don't jump ahead of more urgent waiters. */
+	for (i = 0; sol_prio_order[i] != prio; i++)
+		if (g->waiting[sol_prio_order[i]])
+			return 0;
+	return 1;
+}
+
+static void sol_gate_enter(sol_ll_t *ll, unsigned prio)
+{
+	struct sol_gate *g = &solaris_gate;
+
+	if (ll->max_active == 0)
+		return;
+	if (prio >= FUSE_PRIO_MAX)
+		prio = FUSE_PRIO_NORMAL;
+
+	pthread_mutex_lock(&g->lock);
+	while (!sol_gate_open(ll, g, prio)) {
+		g->waiting[prio]++;
+		pthread_cond_wait(&g->cond[prio], &g->lock);
+		g->waiting[prio]--;
+	}
+	g->active++;
+	pthread_mutex_unlock(&g->lock);
+	sol_gated = 1;
+}
+
+static void sol_gate_exit(void)
+{
+	struct sol_gate *g = &solaris_gate;
+	unsigned i, prio;
+
+	if (!sol_gated)
+		return;
+	sol_gated = 0;
+
+	pthread_mutex_lock(&g->lock);
+	g->active--;
+	for (i = 0; i < FUSE_PRIO_MAX; i++) {
+		prio = sol_prio_order[i];
+		if (g->waiting[prio]) {
+			pthread_cond_signal(&g->cond[prio]);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&g->lock);
+}
+
+/*
+ * Request tracing (-o trace=FILE).  The kernel then sends each
+ * request behind a FUSE_OP_TRACE header with its request ID and
+ * kernel times, and we append a line per request to FILE:
+ *
+ *   D reqid opcode t_enter t_call t_recv t_gate t_ret err [stage ...]
+ *
+ * t_enter and t_call are the kernel's, t_recv is when the door call
+ * got here, t_gate when it got past max_active and t_ret when we
+ * answered.  Each stage is "layer:op:t", for each filesystem layer
+ * the request went through (the module name, or "fs" for the
+ * filesystem itself).  Times are gethrtime() nanoseconds, so they
+ * line up with the kernel's.  fusetrace merges these files with the
+ * kernel side (fusetrace.d) into per-request breakdowns.
+ */
+#define	SOL_TRACE_NSTAGE	16
+
+struct sol_trace {
+	uint64_t reqid;
+	uint32_t opcode;
+	hrtime_t t_enter;
+	hrtime_t t_call;
+	hrtime_t t_recv;
+	hrtime_t t_gate;
+	unsigned nstage;
+	struct {
+		const char *layer;
+		const char *func;
+		hrtime_t t;
+	} stage[SOL_TRACE_NSTAGE];
+};
+
+static FILE *sol_trace_fp;
+
+/* The request this door thread is serving, if traced */
+static __thread struct sol_trace *sol_trace_cur;
+
+void fuse_sol_trace_stage(struct fuse_fs *fs, const char *func)
+{
+	struct sol_trace *tr = sol_trace_cur;
+
+	if (tr == NULL || tr->nstage >= SOL_TRACE_NSTAGE)
+		return;
+	tr->stage[tr->nstage].layer = fs->m ? fs->m->name : "fs";
+	tr->stage[tr->nstage].func = func;
+	tr->stage[tr->nstage].t = gethrtime();
+	tr->nstage++;
+}
+
+static void sol_trace_end(int err)
+{
+	struct sol_trace *tr = sol_trace_cur;
+	const char *func;
+	char buf[1024];
+	size_t len;
+	unsigned i;
+
+	sol_trace_cur = NULL;
+	len = snprintf(buf, sizeof(buf),
+		       "D %llu %u %lld %lld %lld %lld %lld %d",
+		       (unsigned long long) tr->reqid, tr->opcode,
+		       (long long) tr->t_enter, (long long) tr->t_call,
+		       (long long) tr->t_recv, (long long) tr->t_gate,
+		       (long long) gethrtime(), err);
+	for (i = 0; i < tr->nstage && len < sizeof(buf); i++) {
+		func = tr->stage[i].func;
+		if (strncmp(func, "fuse_fs_", 8) == 0)
+			func += 8;
+		len += snprintf(buf + len, sizeof(buf) - len, " %s:%s:%lld",
+				tr->stage[i].layer, func,
+				(long long) tr->stage[i].t);
+	}
+	/* One call, so lines from different threads don't mix. */
+	fprintf(sol_trace_fp, "%s\n", buf);
+}
+
+/*
+ * Answer the door call, giving up our slot (if any) first.
+ * Every ret starts with the error number.
+ */
+static void sol_return(void *data, size_t size)
+{
+	sol_gate_exit();
+	if (sol_trace_cur != NULL)
+		sol_trace_end(size >= sizeof(int32_t) ? *(int32_t *)data : 0);
+	door_return(data, size, NULL, 0);
+}
+
+/*
+ * Make the outstanding (and any later) FUSE_OP_NOTIFY
+ * call return, so the kernel thread making it exits.
+ */
+void fuse_sol_notify_shutdown(void)
+{
+	struct sol_notify_q *nq = &solaris_nq;
+	unsigned i;
+
+	pthread_mutex_lock(&nq->lock);
+	nq->dead = 1;
+	for (i = 0; i < nq->count; i++)
+		sol_notify_free(&nq->ents[i]);
+	nq->count = 0;
+	pthread_cond_broadcast(&nq->cond);
+	pthread_mutex_unlock(&nq->lock);
+}
+
+/*
+ * File handles for NFS (FUSE_OP_FHLOOKUP).  The kernel makes them
+ * from st_ino and st_gen, so they need the file system's inode
+ * numbers (-o use_ino).  We remember a path for each inode number
+ * we've told the kernel about, and a generation, bumped when we
+ * see an inode's last name go, so a handle for a deleted file
+ * doesn't find a new file given its number.  Generations start at
+ * zero, so handles still work after the daemon restarts.  Past
+ * SOL_FH_MAX the least recently used inode is forgotten; it will
+ * be generation zero again, as after a restart.  A path is checked
+ * before it's used; if it's stale, or the inode is one we don't
+ * know, we look for it by walking the tree.
+ */
+#define	SOL_FH_NHASH	4096
+#define	SOL_FH_MAX	(64 * 1024)	/* inodes remembered */
+#define	SOL_FH_EVICT	16		/* looked at to pick one to drop */
+#define	SOL_FH_WALK	(100 * 1000)	/* most names seen in one walk */
+
+struct sol_fh {
+	struct sol_fh *next;
+	struct sol_fh *lru_prev;	/* most recently used first */
+	struct sol_fh *lru_next;
+	uint64_t ino;
+	uint32_t gen;
+	char *path;		/* NULL once removed, gen kept */
+};
+
+static struct sol_fh_tab {
+	pthread_mutex_t lock;
+	int on;			/* FUSE_INIT_FHANDLE */
+	unsigned count;
+	struct sol_fh *lru_head;
+	struct sol_fh *lru_tail;
+	struct sol_fh *hash[SOL_FH_NHASH];
+} solaris_fh = {
+	PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void sol_fh_lru_unlink(struct sol_fh *fh)
+{
+	if (fh->lru_prev != NULL)
+		fh->lru_prev->lru_next = fh->lru_next;
+	else
+		solaris_fh.lru_head = fh->lru_next;
+	if (fh->lru_next != NULL)
+		fh->lru_next->lru_prev = fh->lru_prev;
+	else
+		solaris_fh.lru_tail = fh->lru_prev;
+}
+
+static void sol_fh_lru_insert(struct sol_fh *fh)
+{
+	fh->lru_prev = NULL;
+	fh->lru_next = solaris_fh.lru_head;
+	if (fh->lru_next != NULL)
+		fh->lru_next->lru_prev = fh;
+	else
+		solaris_fh.lru_tail = fh;
+	solaris_fh.lru_head = fh;
+}
+
+/* Find ino, and make it the most recently used. */
+static struct sol_fh *sol_fh_find(uint64_t ino)
+{
+	struct sol_fh *fh;
+
+	fh = solaris_fh.hash[ino % SOL_FH_NHASH];
+	while (fh != NULL && fh->ino != ino)
+		fh = fh->next;
+	if (fh != NULL && fh != solaris_fh.lru_head) {
+		sol_fh_lru_unlink(fh);
+		sol_fh_lru_insert(fh);
+	}
+	return fh;
+}
+
+/*
+ * Forget the least recently used inode.  One still at generation
+ * zero loses nothing a tree walk can't find again, so prefer one
+ * of those from near the end.
+ */
+static void sol_fh_evict(void)
+{
+	struct sol_fh *fh, **fhp;
+	unsigned n;
+
+	fh = solaris_fh.lru_tail;
+	for (n = 0; fh != NULL && fh->gen != 0 && n < SOL_FH_EVICT; n++)
+		fh = fh->lru_prev;
+	if (fh == NULL || fh->gen != 0)
+		fh = solaris_fh.lru_tail;
+	if (fh == NULL)
+		return;
+	sol_fh_lru_unlink(fh);
+	fhp = &solaris_fh.hash[fh->ino % SOL_FH_NHASH];
+	while (*fhp != fh)
+		fhp = &(*fhp)->next;
+	*fhp = fh->next;
+	solaris_fh.count--;
+	free(fh->path);
+	free(fh);
+}
+
+/* Find or add ino; NULL if out of memory.  Called with the lock held. */
+static struct sol_fh *sol_fh_get(uint64_t ino)
+{
+	struct sol_fh *fh;
+
+	fh = sol_fh_find(ino);
+	if (fh == NULL) {
+		if (solaris_fh.count >= SOL_FH_MAX)
+			sol_fh_evict();
+		fh = calloc(1, sizeof(*fh));
+		if (fh != NULL) {
+			fh->ino = ino;
+			fh->next = solaris_fh.hash[ino % SOL_FH_NHASH];
+			solaris_fh.hash[ino % SOL_FH_NHASH] = fh;
+			sol_fh_lru_insert(fh);
+			solaris_fh.count++;
+		}
+	}
+	return fh;
+}
+
+static uint32_t sol_fh_gen(uint64_t ino)
+{
+	struct sol_fh *fh;
+	uint32_t gen = 0;
+
+	pthread_mutex_lock(&solaris_fh.lock);
+	if ((fh = sol_fh_find(ino)) != NULL)
+		gen = fh->gen;
+	pthread_mutex_unlock(&solaris_fh.lock);
+	return gen;
+}
+
+/* path is where st->st_ino is now. */
+static void sol_fh_learn(const char *path, const struct stat *st)
+{
+	struct sol_fh *fh;
+	char *p;
+
+	if (!solaris_fh.on || st->st_ino == 0)
+		return;
+
+	pthread_mutex_lock(&solaris_fh.lock);
+	fh = sol_fh_get(st->st_ino);
+	if (fh != NULL && (fh->path == NULL || strcmp(fh->path, path))) {
+		p = strdup(path);
+		if (p != NULL) {
+			free(fh->path);
+			fh->path = p;
+		}
+	}
+	pthread_mutex_unlock(&solaris_fh.lock);
+}
+
+/* A name of st->st_ino was removed; was it the last one? */
+static void sol_fh_removed(const struct stat *st)
+{
+	struct sol_fh *fh;
+
+	if (!solaris_fh.on || st->st_ino == 0 ||
+	    (!S_ISDIR(st->st_mode) && st->st_nlink > 1))
+		return;
+
+	pthread_mutex_lock(&solaris_fh.lock);
+	fh = sol_fh_get(st->st_ino);
+	if (fh != NULL) {
+		fh->gen++;
+		free(fh->path);
+		fh->path = NULL;
+	}
+	pthread_mutex_unlock(&solaris_fh.lock);
+}
+
+/*
+ * Everything under path was removed (FUSE_OP_RMTREE).  We don't know
+ * what was there, only the inodes whose paths we remember under it.
+ * One of those with another link outside the tree gets a new
+ * generation it didn't need, so its old handles go stale.
+ */
+static void sol_fh_removed_tree(const char *path)
+{
+	struct sol_fh *fh;
+	size_t len = strlen(path);
+	unsigned i;
+
+	if (!solaris_fh.on)
+		return;
+
+	pthread_mutex_lock(&solaris_fh.lock);
+	for (i = 0; i < SOL_FH_NHASH; i++) {
+		for (fh = solaris_fh.hash[i]; fh != NULL; fh = fh->next) {
+			if (fh->path == NULL ||
+			    strncmp(fh->path, path, len) != 0 ||
+			    (fh->path[len] != '\0' && fh->path[len] != '/'))
+				continue;
+			fh->gen++;
+			free(fh->path);
+			fh->path = NULL;
+		}
+	}
+	pthread_mutex_unlock(&solaris_fh.lock);
+}
+
+struct sol_fh_names {
+	char **names;
+	unsigned count;
+	unsigned size;
+};
+
+static int sol_fh_fill(void *buf, const char *name, const struct stat *stbuf,
+		       off_t off)
+{
+	struct sol_fh_names *dn = buf;
+	char **names;
+
+	(void) stbuf;
+	(void) off;
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		return 0;
+	if (dn->count == dn->size) {
+		dn->size = dn->size ? dn->size * 2 : 64;
+		names = realloc(dn->names, dn->size * sizeof(char *));
+		if (names == NULL)
+			return 1;
+		dn->names = names;
+	}
+	if ((dn->names[dn->count] = strdup(name)) == NULL)
+		return 1;
+	dn->count++;
+	return 0;
+}
+
+/*
+ * Look for ino by walking the tree, breadth first (what was
+ * looked up recently is often near the top).  Everything seen
+ * is remembered on the way.
+ */
+static int sol_fh_walk(struct fuse *f, uint64_t ino, char **pathp,
+		       struct stat *stp)
+{
+	struct sol_fh_names dirs = { NULL, 0, 0 };
+	struct sol_fh_names dn;
+	struct fuse_file_info fi;
+	struct stat st;
+	unsigned d, i, seen = 0;
+	char *path, *dir;
+	size_t len;
+	int err;
+
+	err = fuse_fs_getattr(f->fs, "/", &st);
+	if (err)
+		return err;
+	sol_fh_learn("/", &st);
+	if (st.st_ino == ino) {
+		*stp = st;
+		return (*pathp = strdup("/")) ? 0 : -ENOMEM;
+	}
+	if (sol_fh_fill(&dirs, "/", NULL, 0))
+		return -ENOMEM;
+
+	err = -ESTALE;
+	for (d = 0; d < dirs.count && seen < SOL_FH_WALK; d++) {
+		dir = dirs.names[d];
+		memset(&fi, 0, sizeof(fi));
+		if (fuse_fs_opendir(f->fs, dir, &fi) != 0)
+			continue;
+		memset(&dn, 0, sizeof(dn));
+		(void) fuse_fs_readdir(f->fs, dir, &dn, sol_fh_fill, 0, &fi);
+		(void) fuse_fs_releasedir(f->fs, dir, &fi);
+
+		for (i = 0; i < dn.count; i++) {
+			len = strlen(dir) + strlen(dn.names[i]) + 2;
+			path = malloc(len);
+			if (path == NULL)
+				break;
+			snprintf(path, len, "%s%s%s", dir,
+				 strcmp(dir, "/") ? "/" : "", dn.names[i]);
+			seen++;
+			if (fuse_fs_getattr(f->fs, path, &st) == 0) {
+				sol_fh_learn(path, &st);
+				if (st.st_ino == ino) {
+					*stp = st;
+					*pathp = path;
+					err = 0;
+					break;
+				}
+				if (S_ISDIR(st.st_mode) &&
+				    sol_fh_fill(&dirs, path, NULL, 0) == 0) {
+					free(path);
+					continue;
+				}
+			}
+			free(path);
+		}
+		for (i = 0; i < dn.count; i++)
+			free(dn.names[i]);
+		free(dn.names);
+		if (err == 0)
+			break;
+	}
+	for (d = 0; d < dirs.count; d++)
+		free(dirs.names[d]);
+	free(dirs.names);
+	return err;
+}
+
 static void convert_stat(const struct stat *stbuf,
 	struct fuse_stat *kst)
 {
@@ -84,6 +700,8 @@ static void convert_stat(const struct stat *stbuf,
 	kst->st_gid	= stbuf->st_gid;
 	kst->st_rdev	= stbuf->st_rdev;
 	kst->st_blksize = stbuf->st_blksize;
+	if (solaris_fh.on && kst->st_ino != 0)
+		kst->st_gen = sol_fh_gen(kst->st_ino);
 }
 
 static void list_init_req(struct fuse_req *req)
@@ -92,10 +710,46 @@ static void list_init_req(struct fuse_req *req)
 	req->prev = req;
 }
 
-/* ARGSUSED */
+/*
+ * Replies to lowlevel requests (only CUSE makes those) are left
+ * in req->reply, for the door thread waiting there to return.
+ * A request that didn't come from a door call can't be answered.
+ */
+static int sol_reply(fuse_req_t req, int err, uint64_t val,
+		     const struct iovec *iov, int count)
+{
+	struct sol_reply *r = req->reply;
+	size_t len = 0;
+	int i, res = 0;
+
+	if (r == NULL)
+		return -ENOSYS;
+
+	pthread_mutex_lock(&r->lock);
+	for (i = 0; err == 0 && i < count; i++) {
+		if (iov[i].iov_len > r->bufsize - len) {
+			/* More than the caller asked for */
+			err = EIO;
+			res = -EIO;
+			len = 0;
+			break;
+		}
+		memcpy(r->buf + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+	r->err = err;
+	r->val = val;
+	r->len = len;
+	r->done = 1;
+	pthread_cond_signal(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+
+	return res;
+}
+
 int fuse_reply_iov(fuse_req_t req, const struct iovec *iov, int count)
 {
-	return -ENOSYS;
+	return sol_reply(req, 0, 0, iov, count);
 }
 
 size_t fuse_dirent_size(size_t namelen)
@@ -151,15 +805,14 @@ static void convert_statvfs(const struct statvfs *stbuf,
 	kstatfs->f_flag		= stbuf->f_flag;
 }
 
-/* ARGSUSED */
 int fuse_reply_err(fuse_req_t req, int err)
 {
-	return -ENOSYS;
+	return sol_reply(req, err, 0, NULL, 0);
 }
 
-/* ARGSUSED */
 void fuse_reply_none(fuse_req_t req)
 {
+	(void) sol_reply(req, 0, 0, NULL, 0);
 }
 
 static unsigned long calc_timeout_sec(double t)
@@ -214,22 +867,23 @@ int fuse_reply_readlink(fuse_req_t req, const char *linkname)
 	return -ENOSYS;
 }
 
-/* ARGSUSED */
 int fuse_reply_open(fuse_req_t req, const struct fuse_file_info *f)
 {
-	return -ENOSYS;
+	return sol_reply(req, 0, f->fh, NULL, 0);
 }
 
-/* ARGSUSED */
 int fuse_reply_write(fuse_req_t req, size_t count)
 {
-	return -ENOSYS;
+	return sol_reply(req, 0, count, NULL, 0);
 }
 
-/* ARGSUSED */
 int fuse_reply_buf(fuse_req_t req, const char *buf, size_t size)
 {
-	return -ENOSYS;
+	struct iovec iov;
+
+	iov.iov_base = (void *) buf;
+	iov.iov_len = size;
+	return sol_reply(req, 0, 0, &iov, 1);
 }
 
 /* ARGSUSED */
@@ -256,31 +910,60 @@ int fuse_reply_bmap(fuse_req_t req, uint64_t idx)
 	return -ENOSYS;
 }
 
-/* ARGSUSED */
+/*
+ * Ask the kernel to call again with these of the caller's
+ * buffers copied in and out.  They go as fuse_ioctl_iovec.
+ */
 int fuse_reply_ioctl_retry(fuse_req_t req,
 			   const struct iovec *in_iov, size_t in_count,
 			   const struct iovec *out_iov, size_t out_count)
 {
-	return -ENOSYS;
+	struct fuse_ioctl_iovec fiov[FUSE_IOCTL_MAXIOV];
+	struct sol_reply *r = req->reply;
+	struct iovec iov;
+	size_t i;
+
+	if (in_count + out_count > FUSE_IOCTL_MAXIOV)
+		return sol_reply(req, EINVAL, 0, NULL, 0);
+	for (i = 0; i < in_count; i++) {
+		fiov[i].iov_base = (uintptr_t) in_iov[i].iov_base;
+		fiov[i].iov_len = in_iov[i].iov_len;
+	}
+	for (i = 0; i < out_count; i++) {
+		fiov[in_count + i].iov_base = (uintptr_t) out_iov[i].iov_base;
+		fiov[in_count + i].iov_len = out_iov[i].iov_len;
+	}
+
+	if (r != NULL) {
+		pthread_mutex_lock(&r->lock);
+		r->retry = 1;
+		r->in_iovs = in_count;
+		r->out_iovs = out_count;
+		pthread_mutex_unlock(&r->lock);
+	}
+	iov.iov_base = fiov;
+	iov.iov_len = (in_count + out_count) * sizeof(fiov[0]);
+	return sol_reply(req, 0, 0, &iov, 1);
 }
 
-/* ARGSUSED */
 int fuse_reply_ioctl(fuse_req_t req, int result, const void *buf, size_t size)
 {
-	return -ENOSYS;
+	struct iovec iov;
+
+	iov.iov_base = (void *) buf;
+	iov.iov_len = size;
+	return sol_reply(req, 0, (uint64_t) result, &iov, buf ? 1 : 0);
 }
 
-/* ARGSUSED */
 int fuse_reply_ioctl_iov(fuse_req_t req, int result, const struct iovec *iov,
 			 int count)
 {
-	return -ENOSYS;
+	return sol_reply(req, 0, (uint64_t) result, iov, count);
 }
 
-/* ARGSUSED */
 int fuse_reply_poll(fuse_req_t req, unsigned revents)
 {
-	return -ENOSYS;
+	return sol_reply(req, 0, revents, NULL, 0);
 }
 
 /*
@@ -403,6 +1086,39 @@ do_init(sol_ll_t *f, void *vargp, size_t argsz)
 	f->got_init = 1;
 	sol_lib_init(f->userdata, &f->conn);
 
+	/* We answer FUSE_OP_NOTIFY (poll wakeups, etc.) */
+	ret.ret_flags |= FUSE_INIT_NOTIFY;
+	/* and take caller priorities in the op code. */
+	ret.ret_flags |= FUSE_INIT_PRIO;
+	/* Create, open and getattr in one call. */
+	ret.ret_flags |= FUSE_INIT_CREATE2;
+	/* With -o use_ino, st_ino comes from the file system. */
+	if (((struct fuse *)f->userdata)->conf.use_ino)
+		ret.ret_flags |= FUSE_INIT_INO;
+	/* Writes of zeros can become holes, if the fs can punch them. */
+	if (((struct fuse *)f->userdata)->fs->op.fallocate != NULL)
+		ret.ret_flags |= FUSE_INIT_FALLOCATE;
+	/* Direct I/O on the device (-o blkdev) needs the block map. */
+	if (((struct fuse *)f->userdata)->fs->op.bmap != NULL)
+		ret.ret_flags |= FUSE_INIT_BMAP;
+	/* ACLs, if the file system has xattrs to keep them in. */
+	if (((struct fuse *)f->userdata)->fs->op.getxattr != NULL)
+		ret.ret_flags |= FUSE_INIT_ACL;
+	/* File handles for NFS need real inode numbers too. */
+	if (((struct fuse *)f->userdata)->conf.use_ino) {
+		solaris_fh.on = 1;
+		ret.ret_flags |= FUSE_INIT_FHANDLE;
+	}
+
+	if (f->trace_file != NULL && sol_trace_fp == NULL) {
+		sol_trace_fp = fopen(f->trace_file, "a");
+		if (sol_trace_fp == NULL)
+			fprintf(stderr, "fuse: failed to open %s: %s\n",
+				f->trace_file, strerror(errno));
+	}
+	if (sol_trace_fp != NULL)
+		ret.ret_flags |= FUSE_INIT_TRACE;
+
 #if 0	/* XXX - needed? */
 	if (f->conn.async_read || (f->conn.want & FUSE_CAP_ASYNC_READ))
 		ret.ret_flags |= FUSE_ASYNC_READ;
@@ -418,7 +1134,7 @@ do_init(sol_ll_t *f, void *vargp, size_t argsz)
 		ret.ret_flags |= FUSE_DONT_MASK;
 #endif	/* XXX */
 
-	door_return((void *)&ret, sizeof (ret), NULL, 0);
+	sol_return((void *)&ret, sizeof (ret));
 }
 
 /* FUSE_OP_DESTROY */
@@ -433,13 +1149,16 @@ do_destroy(sol_ll_t *ll, void *vargp, size_t argsz)
 	ll->got_destroy = 1;
 
 	/* Make sure door calls stop. */
+	fuse_sol_notify_shutdown();
 	fuse_sol_door_destroy();
 	sol_lib_destroy(ll->userdata);
+	if (sol_trace_fp != NULL)
+		fflush(sol_trace_fp);
 
 	/* Make the sigwait quit (soon). */
 	alarm(1);
 
-	door_return((void *)&ret, sizeof (ret), NULL, 0);
+	sol_return((void *)&ret, sizeof (ret));
 }
 
 /* FUSE_OP_STATVFS */
@@ -460,7 +1179,7 @@ do_statfs(sol_ll_t *ll, void *vargp, size_t argsz)
 	}
 
 	ret.ret_err = -err;
-	door_return((void *)&ret, sizeof (ret), NULL, 0);
+	sol_return((void *)&ret, sizeof (ret));
 }
 
 /* FUSE_OP_FGETATTR */
@@ -492,7 +1211,7 @@ do_fgetattr(sol_ll_t *ll, void *vargp, size_t argsz)
 
 out:
 	ret.ret_err = -err;
-	door_return((void *)&ret, sizeof (ret), NULL, 0);
+	sol_return((void *)&ret, sizeof (ret));
 }
 
 /* FUSE_OP_GETATTR */
@@ -514,12 +1233,13 @@ do_getattr(sol_ll_t *ll, void *vargp, size_t argsz)
 	memset(&st, 0, sizeof(st));
 	err = fuse_fs_getattr(f->fs, arg->arg_path, &st);
 	if (err == 0) {
+		sol_fh_learn(arg->arg_path, &st);
 		convert_stat(&st, &ret.ret_st);
 	}
 
 out:
 	ret.ret_err = -err;
-	door_return((void *)&ret, sizeof (ret), NULL, 0);
+	sol_return((void *)&ret, sizeof (ret));
 }
 
 /* FUSE_OP_OPENDIR */
@@ -579,7 +1299,7 @@ do_opendir(sol_ll_t *ll, void *vargp, size_t argsz)
 		}
 	}
 	ret.ret_err = -err;
-	door_return((void *)&ret, sizeof (ret), NULL, 0);
+	sol_return((void *)&ret, sizeof (ret));
 }
 
 /* FUSE_OP_CLOSEDIR */
@@ -611,7 +1331,7 @@ do_closedir(sol_ll_t *ll, void *vargp, size_t argsz)
 
 out:
 	ret.ret_err = -err;
-	door_return((void *)&ret, sizeof (ret), NULL, 0);
+	sol_return((void *)&ret, sizeof (ret));
 }
 
 /* FUSE_OP_READDIR */
@@ -708,6 +1428,7 @@ do_readdir(sol_ll_t *ll, void *vargp, size_t argsz)
 		err = fuse_fs_getattr(f->fs, path, &st);
 		if (err)
 			goto out;
+		sol_fh_learn(path, &st);
 		convert_stat(&st, &ret.ret_st);
 	}
 
@@ -737,7 +1458,7 @@ out2:
 	if (ll->debug)
 		fprintf(stderr, "readdir, err=%d\n", err);
 	ret.ret_err = -err;
-	door_return((void *)&ret, sizeof (ret), NULL, 0);
+	sol_return((void *)&ret, sizeof (ret));
 }
 
 /* FUSE_OP_OPEN */
@@ -769,7 +1490,7 @@ do_open(sol_ll_t *ll, void *vargp, size_t argsz)
 
 out:
 	ret.ret_err = -err;
-	door_return((void *)&ret, sizeof (ret), NULL, 0);
+	sol_return((void *)&ret, sizeof (ret));
 }
 
 /* FUSE_OP_CLOSE */
@@ -794,7 +1515,7 @@ do_close(sol_ll_t *ll, void *vargp, size_t argsz)
 #endif	/* XXX */
 	fuse_fs_release(f->fs, path, &fi);
 
-	door_return((void *)&ret, sizeof (ret), NULL, 0);
+	sol_return((void *)&ret, sizeof (ret));
 }
 
 /* FUSE_OP_READ */
@@ -828,7 +1549,7 @@ do_read(sol_ll_t *ll, void *vargp, size_t argsz)
 
 out:
 	ret.ret_err = -err;
-	door_return((void *)&ret, sizeof (ret), NULL, 0);
+	sol_return((void *)&ret, sizeof (ret));
 }
 
 /* FUSE_OP_WRITE */
@@ -863,7 +1584,7 @@ do_write(sol_ll_t *ll, void *vargp, size_t argsz)
 
 out:
 	ret.ret_err = -err;
-	door_return((void *)&ret, sizeof (ret), NULL, 0);
+	sol_return((void *)&ret, sizeof (ret));
 }
 
 /* FUSE_OP_FLUSH */
@@ -886,7 +1607,32 @@ do_flush(sol_ll_t *ll, void *vargp, size_t argsz)
 	fuse_fs_flush(f->fs, path, &fi);
 
 out:
-	door_return((void *)&ret, sizeof (ret), NULL, 0);
+	sol_return((void *)&ret, sizeof (ret));
+}
+
+/* Create and open a file, for do_create, do_create2 */
+static int sol_create(struct fuse *f, const char *path, mode_t mode,
+		      struct fuse_file_info *fi)
+{
+	int flags = fi->flags;
+	int err;
+
+	err = fuse_fs_create(f->fs, path, mode, fi);
+	if (err != -ENOSYS)
+		return err;
+
+	/*
+	 * OK, _create gave ENOSYS.  Try mknod+open
+	 */
+	memset(fi, 0, sizeof(*fi));
+	fi->flags = flags;
+	err = fuse_fs_mknod(f->fs, path, mode, 0);
+	if (err == 0) {
+		err = fuse_fs_open(f->fs, path, fi);
+		if (err != 0)
+			(void) fuse_fs_unlink(f->fs, path);
+	}
+	return err;
 }
 
 /* FUSE_OP_CREATE */
@@ -911,40 +1657,40 @@ do_create(sol_ll_t *ll, void *vargp, size_t argsz)
 	 */
 	mode = arg->arg_val[0] | S_IFREG | S_IRUSR;
 	memset(&fi, 0, sizeof(fi));
-	err = fuse_fs_create(f->fs, arg->arg_path, mode, &fi);
-	if (err == 0) {
-		ret.ret_fid = fi.fh;
-		goto out;
-	}
-
-	if (err != -ENOSYS)
-		goto out;
-
-	/*
-	 * OK, _create gave ENOSYS.  Try mknod+open
-	 */
-	memset(&fi, 0, sizeof(fi));
-	err = fuse_fs_mknod(f->fs, arg->arg_path, mode, 0);
+	fi.flags = O_CREAT | O_EXCL | O_RDWR;
+	err = sol_create(f, arg->arg_path, mode, &fi);
 	if (err == 0) {
+		ret.ret_flags = FUSE_CREATE_CREATED;
+	} else if (err == -EEXIST) {
+		/* Someone else created it: open theirs, as O_CREAT would. */
+		memset(&fi, 0, sizeof(fi));
+		fi.flags = O_RDWR;
 		err = fuse_fs_open(f->fs, arg->arg_path, &fi);
-		if (err == 0)
-			goto out;
-		(void) fuse_fs_unlink(f->fs, arg->arg_path);
 	}
+	if (err == 0)
+		ret.ret_fid = fi.fh;
 
 out:
 	ret.ret_err = -err;
-	door_return((void *)&ret, sizeof (ret), NULL, 0);
+	sol_return((void *)&ret, sizeof (ret));
 }
 
-/* FUSE_OP_FTRUNC */
+/*
+ * FUSE_OP_CREATE2
+ *
+ * Like open(2) with O_CREAT etc. as asked, then fstat,
+ * so the kernel needs just this one call to create (or
+ * open) a file and have it ready for VOP_OPEN.
+ */
 static void
-do_ftruncate(sol_ll_t *ll, void *vargp, size_t argsz)
+do_create2(sol_ll_t *ll, void *vargp, size_t argsz)
 {
 	struct fuse *f = ll->userdata;
-	struct fuse_ftrunc_arg *arg = vargp;
-	struct fuse_generic_ret ret = { 0 };
+	struct fuse_create_arg *arg = vargp;
+	struct fuse_create_ret ret = { 0 };
 	struct fuse_file_info fi;
+	struct stat st;
+	int exists = 0;
 	int err;
 
 	if (argsz != sizeof (*arg)) {
@@ -952,12 +1698,94 @@ do_ftruncate(sol_ll_t *ll, void *vargp, size_t argsz)
 		goto out;
 	}
 
-	if (arg->arg_fid != 0) {
-		memset(&fi, 0, sizeof(fi));
-		fi.fh = arg->arg_fid;
-		fi.fh_old = fi.fh;
-
-		err = fuse_fs_ftruncate(f->fs, arg->arg_path,
+	memset(&fi, 0, sizeof(fi));
+	/* arg_rights are sys/file.h FREAD, FWRITE */
+	if (arg->arg_rights & FWRITE)
+		fi.flags = O_RDWR;
+	else
+		fi.flags = O_RDONLY;
+
+	memset(&st, 0, sizeof(st));
+	err = fuse_fs_getattr(f->fs, arg->arg_path, &st);
+	if (err == -ENOENT && (arg->arg_flags & FUSE_CREATE_CREAT)) {
+		fi.flags |= O_CREAT | O_EXCL;
+		err = sol_create(f, arg->arg_path,
+				 arg->arg_mode | S_IFREG, &fi);
+		if (err == 0)
+			ret.ret_flags |= FUSE_CREATE_CREATED;
+		/*
+		 * Someone else created it since the getattr.
+		 * Without O_EXCL, that's fine: open theirs.
+		 */
+		if (err == -EEXIST &&
+		    !(arg->arg_flags & FUSE_CREATE_EXCL)) {
+			fi.flags &= ~(O_CREAT | O_EXCL);
+			memset(&st, 0, sizeof(st));
+			err = fuse_fs_getattr(f->fs, arg->arg_path, &st);
+			exists = (err == 0);
+		}
+	} else if (err == 0) {
+		if (arg->arg_flags & FUSE_CREATE_EXCL) {
+			err = -EEXIST;
+			goto out;
+		}
+		exists = 1;
+	}
+	if (exists) {
+		/* Just the attributes for a non-file. */
+		if (!S_ISREG(st.st_mode))
+			goto done;
+		err = fuse_fs_open(f->fs, arg->arg_path, &fi);
+		if (err == 0 && (arg->arg_flags & FUSE_CREATE_TRUNC)) {
+			err = fuse_fs_ftruncate(f->fs, arg->arg_path, 0, &fi);
+			if (err != 0)
+				fuse_fs_release(f->fs, arg->arg_path, &fi);
+		}
+	}
+	if (err != 0)
+		goto out;
+	ret.ret_flags |= FUSE_CREATE_OPENED;
+	ret.ret_fid = fi.fh;
+
+	memset(&st, 0, sizeof(st));
+	err = fuse_fs_fgetattr(f->fs, arg->arg_path, &st, &fi);
+	if (err != 0) {
+		fuse_fs_release(f->fs, arg->arg_path, &fi);
+		ret.ret_flags = 0;
+		ret.ret_fid = 0;
+		goto out;
+	}
+
+done:
+	sol_fh_learn(arg->arg_path, &st);
+	convert_stat(&st, &ret.ret_st);
+
+out:
+	ret.ret_err = -err;
+	sol_return((void *)&ret, sizeof (ret));
+}
+
+/* FUSE_OP_FTRUNC */
+static void
+do_ftruncate(sol_ll_t *ll, void *vargp, size_t argsz)
+{
+	struct fuse *f = ll->userdata;
+	struct fuse_ftrunc_arg *arg = vargp;
+	struct fuse_generic_ret ret = { 0 };
+	struct fuse_file_info fi;
+	int err;
+
+	if (argsz != sizeof (*arg)) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	if (arg->arg_fid != 0) {
+		memset(&fi, 0, sizeof(fi));
+		fi.fh = arg->arg_fid;
+		fi.fh_old = fi.fh;
+
+		err = fuse_fs_ftruncate(f->fs, arg->arg_path,
 					arg->arg_offset, &fi);
 	} else {
 		err = fuse_fs_truncate(f->fs, arg->arg_path,
@@ -966,7 +1794,94 @@ do_ftruncate(sol_ll_t *ll, void *vargp, size_t argsz)
 
 out:
 	ret.ret_err = -err;
-	door_return((void *)&ret, sizeof (ret), NULL, 0);
+	sol_return((void *)&ret, sizeof (ret));
+}
+
+/*
+ * FUSE_OP_FALLOCATE
+ *
+ * FUSE_FALLOC_EXTEND is ours, not the file system's: after the
+ * fallocate, make the file at least offset + length long (but
+ * never shorter), so a hole punched past EOF reads as zeros.
+ */
+static void
+do_fallocate(sol_ll_t *ll, void *vargp, size_t argsz)
+{
+	struct fuse *f = ll->userdata;
+	struct fuse_fallocate_arg *arg = vargp;
+	struct fuse_generic_ret ret = { 0 };
+	struct fuse_file_info fi;
+	struct stat st;
+	off_t end;
+	int err;
+
+	if (argsz != sizeof (*arg)) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	memset(&fi, 0, sizeof(fi));
+	fi.fh = arg->arg_fid;
+	fi.fh_old = fi.fh;
+
+	err = fuse_fs_fallocate(f->fs, arg->arg_path,
+				arg->arg_mode & ~FUSE_FALLOC_EXTEND,
+				arg->arg_offset, arg->arg_length, &fi);
+	if (err == 0 && (arg->arg_mode & FUSE_FALLOC_EXTEND)) {
+		end = arg->arg_offset + arg->arg_length;
+		err = fuse_fs_fgetattr(f->fs, arg->arg_path, &st, &fi);
+		if (err == 0 && st.st_size < end)
+			err = fuse_fs_ftruncate(f->fs, arg->arg_path,
+						end, &fi);
+	}
+
+out:
+	ret.ret_err = -err;
+	sol_return((void *)&ret, sizeof (ret));
+}
+
+/*
+ * FUSE_OP_BMAP
+ *
+ * The file system maps one block at a time; keep asking while
+ * the blocks are contiguous on the device (or all holes), so
+ * the kernel gets a run it can do I/O on in one go.
+ */
+static void
+do_bmap(sol_ll_t *ll, void *vargp, size_t argsz)
+{
+	struct fuse *f = ll->userdata;
+	struct fuse_bmap_arg *arg = vargp;
+	struct fuse_bmap_ret ret = { 0 };
+	uint64_t idx, first;
+	uint32_t n;
+	int err;
+
+	if (argsz != sizeof (*arg) || arg->arg_blocksize == 0 ||
+	    arg->arg_nblocks == 0) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	idx = arg->arg_block;
+	err = fuse_fs_bmap(f->fs, arg->arg_path, arg->arg_blocksize, &idx);
+	if (err)
+		goto out;
+	first = idx;
+	for (n = 1; n < arg->arg_nblocks; n++) {
+		idx = arg->arg_block + n;
+		if (fuse_fs_bmap(f->fs, arg->arg_path,
+				 arg->arg_blocksize, &idx) != 0)
+			break;
+		if (first == 0 ? idx != 0 : idx != first + n)
+			break;
+	}
+	ret.ret_devblock = first;
+	ret.ret_nblocks = n;
+
+out:
+	ret.ret_err = -err;
+	sol_return((void *)&ret, sizeof (ret));
 }
 
 /* FUSE_OP_UTIMES */
@@ -995,7 +1910,7 @@ do_utimes(sol_ll_t *ll, void *vargp, size_t argsz)
 
 out:
 	ret.ret_err = -err;
-	door_return((void *)&ret, sizeof (ret), NULL, 0);
+	sol_return((void *)&ret, sizeof (ret));
 }
 
 /* FUSE_OP_CHMOD */
@@ -1017,7 +1932,7 @@ do_chmod(sol_ll_t *ll, void *vargp, size_t argsz)
 
 out:
 	ret.ret_err = -err;
-	door_return((void *)&ret, sizeof (ret), NULL, 0);
+	sol_return((void *)&ret, sizeof (ret));
 }
 
 /* FUSE_OP_CHOWN */
@@ -1039,7 +1954,7 @@ do_chown(sol_ll_t *ll, void *vargp, size_t argsz)
 
 out:
 	ret.ret_err = -err;
-	door_return((void *)&ret, sizeof (ret), NULL, 0);
+	sol_return((void *)&ret, sizeof (ret));
 }
 
 /* FUSE_OP_DELETE */
@@ -1049,18 +1964,25 @@ do_delete(sol_ll_t *ll, void *vargp, size_t argsz)
 	struct fuse *f = ll->userdata;
 	struct fuse_path_arg *arg = vargp;
 	struct fuse_generic_ret ret = { 0 };
-	int err;
+	struct stat st;
+	int err, gotst = 0;
 
 	if (argsz != sizeof (*arg)) {
 		err = -EINVAL;
 		goto out;
 	}
 
+	/* For file handles: is this the file's last name? */
+	memset(&st, 0, sizeof(st));
+	if (solaris_fh.on)
+		gotst = fuse_fs_getattr(f->fs, arg->arg_path, &st) == 0;
 	err = fuse_fs_unlink(f->fs, arg->arg_path);
+	if (err == 0 && gotst)
+		sol_fh_removed(&st);
 
 out:
 	ret.ret_err = -err;
-	door_return((void *)&ret, sizeof (ret), NULL, 0);
+	sol_return((void *)&ret, sizeof (ret));
 }
 
 /* FUSE_OP_RENAME */
@@ -1070,17 +1992,30 @@ do_rename(sol_ll_t *ll, void *vargp, size_t argsz)
 	struct fuse *f = ll->userdata;
 	struct fuse_path2_arg *arg = vargp;
 	struct fuse_generic_ret ret = { 0 };
-	int err;
+	struct stat st1, st2;
+	int err, got1 = 0, got2 = 0;
 
 	if (argsz != sizeof (*arg)) {
 		err = -EINVAL;
 		goto out;
 	}
+
+	/* For file handles: what moves, and what it replaces. */
+	memset(&st1, 0, sizeof(st1));
+	memset(&st2, 0, sizeof(st2));
+	if (solaris_fh.on) {
+		got1 = fuse_fs_getattr(f->fs, arg->arg_path1, &st1) == 0;
+		got2 = fuse_fs_getattr(f->fs, arg->arg_path2, &st2) == 0;
+	}
 	err = fuse_fs_rename(f->fs, arg->arg_path1, arg->arg_path2);
+	if (err == 0 && got2 && (!got1 || st1.st_ino != st2.st_ino))
+		sol_fh_removed(&st2);
+	if (err == 0 && got1)
+		sol_fh_learn(arg->arg_path2, &st1);
 
 out:
 	ret.ret_err = -err;
-	door_return((void *)&ret, sizeof (ret), NULL, 0);
+	sol_return((void *)&ret, sizeof (ret));
 }
 
 /* FUSE_OP_MKDIR */
@@ -1102,7 +2037,7 @@ do_mkdir(sol_ll_t *ll, void *vargp, size_t argsz)
 
 out:
 	ret.ret_err = -err;
-	door_return((void *)&ret, sizeof (ret), NULL, 0);
+	sol_return((void *)&ret, sizeof (ret));
 }
 
 /* FUSE_OP_RMDIR */
@@ -1112,17 +2047,606 @@ do_rmdir(sol_ll_t *ll, void *vargp, size_t argsz)
 	struct fuse *f = ll->userdata;
 	struct fuse_path_arg *arg = vargp;
 	struct fuse_generic_ret ret = { 0 };
-	int err;
+	struct stat st;
+	int err, gotst = 0;
 
 	if (argsz != sizeof (*arg)) {
 		err = -EINVAL;
 		goto out;
 	}
+
+	memset(&st, 0, sizeof(st));
+	if (solaris_fh.on)
+		gotst = fuse_fs_getattr(f->fs, arg->arg_path, &st) == 0;
 	err = fuse_fs_rmdir(f->fs, arg->arg_path);
+	if (err == 0 && gotst)
+		sol_fh_removed(&st);
+
+out:
+	ret.ret_err = -err;
+	sol_return((void *)&ret, sizeof (ret));
+}
+
+/*
+ * FUSE_OP_FHLOOKUP
+ *
+ * Where is the file with this inode number and generation now?
+ * Try the path we remember (checking it's still that file), then
+ * walk the tree.
+ */
+static void
+do_fhlookup(sol_ll_t *ll, void *vargp, size_t argsz)
+{
+	struct fuse *f = ll->userdata;
+	struct fuse_fhlookup_arg *arg = vargp;
+	struct fuse_fhlookup_ret ret;
+	struct sol_fh *fh;
+	struct stat st;
+	char *path = NULL;
+	size_t len;
+	int err;
+
+	memset(&ret, 0, sizeof(ret));
+	if (argsz != sizeof (*arg) || arg->arg_ino == 0) {
+		err = -EINVAL;
+		goto out;
+	}
+	if (!solaris_fh.on) {
+		err = -ENOSYS;
+		goto out;
+	}
+
+	err = 0;
+	pthread_mutex_lock(&solaris_fh.lock);
+	fh = sol_fh_find(arg->arg_ino);
+	if (fh != NULL) {
+		if (fh->gen != arg->arg_gen || fh->path == NULL)
+			err = -ESTALE;
+		else if ((path = strdup(fh->path)) == NULL)
+			err = -ENOMEM;
+	} else if (arg->arg_gen != 0) {
+		/* Not one we know, so it can't have a generation. */
+		err = -ESTALE;
+	}
+	pthread_mutex_unlock(&solaris_fh.lock);
+	if (err)
+		goto out;
+
+	memset(&st, 0, sizeof(st));
+	if (path != NULL && (fuse_fs_getattr(f->fs, path, &st) != 0 ||
+	    st.st_ino != arg->arg_ino)) {
+		free(path);
+		path = NULL;
+	}
+	if (path == NULL) {
+		err = sol_fh_walk(f, arg->arg_ino, &path, &st);
+		if (err)
+			goto out;
+	}
+
+	len = strlen(path);
+	if (len >= sizeof (ret.ret_path)) {
+		err = -ENAMETOOLONG;
+		goto out;
+	}
+	memcpy(ret.ret_path, path, len + 1);
+	ret.ret_pathlen = len;
+	convert_stat(&st, &ret.ret_st);
+
+out:
+	free(path);
+	ret.ret_err = -err;
+	sol_return((void *)&ret, sizeof (ret));
+}
+
+/*
+ * ACLs are kept by file systems as the Linux ACL xattrs: a version
+ * (2) and then tag, perm, id entries, little-endian.  The tags are
+ * the same numbers as aclent_t types (USER_OBJ ... OTHER_OBJ).
+ */
+#define	SOL_ACL_ACCESS	"system.posix_acl_access"
+#define	SOL_ACL_DEFAULT	"system.posix_acl_default"
+#define	SOL_ACL_VERSION	2
+#define	SOL_ACL_HDR	4
+#define	SOL_ACL_ENT	8
+#define	SOL_ACL_BUFSZ	(SOL_ACL_HDR + FUSE_ACL_MAX * SOL_ACL_ENT)
+
+static uint32_t sol_acl_get32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static void sol_acl_put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/*
+ * Get one of the xattrs into ent (room for max), with dflt in the
+ * types.  Returns the count (zero if there is none) or -errno.
+ */
+static int sol_acl_get(struct fuse *f, const char *path, const char *name,
+		       uint32_t dflt, struct fuse_aclent *ent, int max)
+{
+	unsigned char buf[SOL_ACL_BUFSZ], *p;
+	int i, n, res;
+
+	res = fuse_fs_getxattr(f->fs, path, name, (char *) buf, sizeof(buf));
+	if (res == -ENODATA)
+		return 0;
+	if (res == -ERANGE)
+		return -ENOSPC;
+	if (res < 0)
+		return res;
+	if (res < SOL_ACL_HDR || (res - SOL_ACL_HDR) % SOL_ACL_ENT != 0 ||
+	    sol_acl_get32(buf) != SOL_ACL_VERSION)
+		return -EIO;
+	n = (res - SOL_ACL_HDR) / SOL_ACL_ENT;
+	if (n > max)
+		return -ENOSPC;
+	for (i = 0; i < n; i++) {
+		p = buf + SOL_ACL_HDR + i * SOL_ACL_ENT;
+		ent[i].a_type = (p[0] | p[1] << 8) | dflt;
+		ent[i].a_perm = (p[2] | p[3] << 8) & 07;
+		ent[i].a_id = sol_acl_get32(p + 4);
+	}
+	return n;
+}
+
+static int sol_acl_set(struct fuse *f, const char *path, const char *name,
+		       const struct fuse_aclent *ent, int n)
+{
+	unsigned char buf[SOL_ACL_BUFSZ], *p;
+	uint32_t type;
+	int i, res;
+
+	if (n == 0) {
+		res = fuse_fs_removexattr(f->fs, path, name);
+		return res == -ENODATA ? 0 : res;
+	}
+	sol_acl_put32(buf, SOL_ACL_VERSION);
+	for (i = 0; i < n; i++) {
+		p = buf + SOL_ACL_HDR + i * SOL_ACL_ENT;
+		type = ent[i].a_type & ~ACL_DEFAULT;
+		p[0] = type;
+		p[1] = type >> 8;
+		p[2] = ent[i].a_perm & 07;
+		p[3] = 0;
+		sol_acl_put32(p + 4, (type == USER || type == GROUP) ?
+			      ent[i].a_id : (uint32_t) -1);
+	}
+	return fuse_fs_setxattr(f->fs, path, name, (char *) buf,
+				SOL_ACL_HDR + n * SOL_ACL_ENT, 0);
+}
+
+/*
+ * FUSE_OP_GETACL
+ *
+ * Attributes, the access ACL and (directories) the default ACL.
+ * A directory may have a default ACL and no access ACL, in which
+ * case the access entries are made from the mode.
+ */
+static void
+do_getacl(sol_ll_t *ll, void *vargp, size_t argsz)
+{
+	struct fuse *f = ll->userdata;
+	struct fuse_path_arg *arg = vargp;
+	struct fuse_getacl_ret ret;
+	struct stat st;
+	int n, an, dn, err;
+
+	memset(&ret, 0, sizeof(ret));
+	if (argsz != sizeof (*arg)) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	memset(&st, 0, sizeof(st));
+	err = fuse_fs_getattr(f->fs, arg->arg_path, &st);
+	if (err)
+		goto out;
+
+	n = sol_acl_get(f, arg->arg_path, SOL_ACL_ACCESS, 0,
+			ret.ret_ent, FUSE_ACL_MAX);
+	if (n < 0) {
+		err = n;
+		goto out;
+	}
+	if (S_ISDIR(st.st_mode)) {
+		/* Leave room for access entries from the mode. */
+		an = n ? n : 3;
+		dn = sol_acl_get(f, arg->arg_path, SOL_ACL_DEFAULT,
+				 ACL_DEFAULT, ret.ret_ent + an,
+				 FUSE_ACL_MAX - an);
+		if (dn < 0) {
+			err = dn;
+			goto out;
+		}
+		if (n == 0 && dn != 0) {
+			ret.ret_ent[0].a_type = USER_OBJ;
+			ret.ret_ent[0].a_perm = (st.st_mode >> 6) & 07;
+			ret.ret_ent[1].a_type = GROUP_OBJ;
+			ret.ret_ent[1].a_perm = (st.st_mode >> 3) & 07;
+			ret.ret_ent[2].a_type = OTHER_OBJ;
+			ret.ret_ent[2].a_perm = st.st_mode & 07;
+		}
+		if (dn != 0)
+			n = an + dn;
+	}
+	ret.ret_count = n;
+	sol_fh_learn(arg->arg_path, &st);
+	convert_stat(&st, &ret.ret_st);
+
+out:
+	ret.ret_err = -err;
+	sol_return((void *)&ret, sizeof (ret));
+}
+
+/*
+ * FUSE_OP_SETACL
+ *
+ * The mode follows the ACL (owner, mask or group, other), as
+ * chmod changes those entries.  An ACL of just those entries is
+ * no ACL at all.
+ */
+static void
+do_setacl(sol_ll_t *ll, void *vargp, size_t argsz)
+{
+	struct fuse *f = ll->userdata;
+	struct fuse_setacl_arg *arg = vargp;
+	struct fuse_generic_ret ret = { 0 };
+	struct stat st;
+	mode_t mode;
+	int i, n, named = 0, err;
+	int uperm = 0, gperm = 0, mperm = -1, operm = 0;
+
+	if (argsz != sizeof (*arg) || arg->arg_count > FUSE_ACL_MAX) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	/* Access entries first, then the default ones. */
+	for (n = 0; n < arg->arg_count; n++) {
+		if (arg->arg_ent[n].a_type & ACL_DEFAULT)
+			break;
+		switch (arg->arg_ent[n].a_type) {
+		case USER_OBJ:
+			uperm = arg->arg_ent[n].a_perm & 07;
+			break;
+		case GROUP_OBJ:
+			gperm = arg->arg_ent[n].a_perm & 07;
+			break;
+		case CLASS_OBJ:
+			mperm = arg->arg_ent[n].a_perm & 07;
+			break;
+		case OTHER_OBJ:
+			operm = arg->arg_ent[n].a_perm & 07;
+			break;
+		default:
+			named++;
+		}
+	}
+
+	for (i = n; i < arg->arg_count; i++) {
+		if ((arg->arg_ent[i].a_type & ACL_DEFAULT) == 0) {
+			err = -EINVAL;
+			goto out;
+		}
+	}
+
+	memset(&st, 0, sizeof(st));
+	err = fuse_fs_getattr(f->fs, arg->arg_path, &st);
+	if (err)
+		goto out;
+	if (n < arg->arg_count && !S_ISDIR(st.st_mode)) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	mode = (st.st_mode & 07000) | uperm << 6 |
+		(mperm != -1 ? mperm : gperm) << 3 | operm;
+	if (mode != (st.st_mode & 07777)) {
+		err = fuse_fs_chmod(f->fs, arg->arg_path, mode);
+		if (err)
+			goto out;
+	}
+	err = sol_acl_set(f, arg->arg_path, SOL_ACL_ACCESS,
+			  arg->arg_ent, (named || mperm != -1) ? n : 0);
+	if (err == 0 && S_ISDIR(st.st_mode))
+		err = sol_acl_set(f, arg->arg_path, SOL_ACL_DEFAULT,
+				  arg->arg_ent + n, arg->arg_count - n);
+
+out:
+	ret.ret_err = -err;
+	sol_return((void *)&ret, sizeof (ret));
+}
+
+/*
+ * FUSE_OP_DIGEST
+ */
+static void
+do_digest(sol_ll_t *ll, void *vargp, size_t argsz)
+{
+	struct fuse *f = ll->userdata;
+	struct fuse_digest_arg *arg = vargp;
+	struct fuse_digest_ret ret;
+	int res, err = 0;
+
+	memset(&ret, 0, sizeof(ret));
+	if (argsz != sizeof (*arg) ||
+	    memchr(arg->arg_alg, '\0', sizeof (arg->arg_alg)) == NULL) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	res = fuse_fs_digest(f->fs, arg->arg_path, arg->arg_alg,
+	    ret.ret_digest, sizeof (ret.ret_digest));
+	if (res < 0)
+		err = res;
+	else
+		ret.ret_len = res;
+
+out:
+	ret.ret_err = -err;
+	sol_return((void *)&ret, sizeof (ret));
+}
+
+/* FUSE_OP_RMTREE */
+static void
+do_rmtree(sol_ll_t *ll, void *vargp, size_t argsz)
+{
+	struct fuse *f = ll->userdata;
+	struct fuse_path_arg *arg = vargp;
+	struct fuse_generic_ret ret = { 0 };
+	int err;
+
+	if (argsz != sizeof (*arg)) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	err = fuse_fs_rmtree(f->fs, arg->arg_path);
+	/* Some of it may be gone even if it failed. */
+	if (err != -ENOSYS)
+		sol_fh_removed_tree(arg->arg_path);
 
 out:
 	ret.ret_err = -err;
-	door_return((void *)&ret, sizeof (ret), NULL, 0);
+	sol_return((void *)&ret, sizeof (ret));
+}
+
+/* FUSE_OP_SUMTREE */
+static void
+do_sumtree(sol_ll_t *ll, void *vargp, size_t argsz)
+{
+	struct fuse *f = ll->userdata;
+	struct fuse_path_arg *arg = vargp;
+	struct fuse_sumtree_ret ret;
+	struct fuse_treesum sum;
+	int err;
+
+	memset(&ret, 0, sizeof(ret));
+	if (argsz != sizeof (*arg)) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	memset(&sum, 0, sizeof(sum));
+	err = fuse_fs_sumtree(f->fs, arg->arg_path, &sum);
+	if (err == 0) {
+		ret.ret_sum.ts_bytes = sum.bytes;
+		ret.ret_sum.ts_blocks = sum.blocks;
+		ret.ret_sum.ts_entries = sum.entries;
+	}
+
+out:
+	ret.ret_err = -err;
+	sol_return((void *)&ret, sizeof (ret));
+}
+
+/*
+ * FUSE_OP_IOCTL
+ *
+ * File systems get "restricted" ioctls: the data is what the
+ * command's encoding says, in a buffer as big as the larger of
+ * the in and out sizes (as fuse_lib_ioctl does).
+ */
+static void
+do_ioctl(sol_ll_t *ll, void *vargp, size_t argsz)
+{
+	struct fuse *f = ll->userdata;
+	struct fuse_ioctl_arg *arg = vargp;
+	struct {
+		struct fuse_ioctl_ret ret;
+		char data[FUSE_IOCTL_MAXDATA];
+	} r;
+	struct fuse_file_info fi;
+	unsigned flags = 0;
+	int err, res;
+
+	memset(&r.ret, 0, sizeof (r.ret));
+	if (argsz < sizeof (*arg) ||
+	    argsz - sizeof (*arg) < arg->arg_insize ||
+	    arg->arg_insize > FUSE_IOCTL_MAXDATA ||
+	    arg->arg_outsize > FUSE_IOCTL_MAXDATA) {
+		err = -EINVAL;
+		goto out;
+	}
+	/* Retries are only for CUSE. */
+	if (arg->arg_flags & FUSE_IOCTLF_32BIT)
+		flags |= FUSE_IOCTL_COMPAT;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.fh = arg->arg_fid;
+	fi.fh_old = fi.fh;
+
+	memcpy(r.data, arg + 1, arg->arg_insize);
+	if (arg->arg_outsize > arg->arg_insize)
+		memset(r.data + arg->arg_insize, 0,
+		       arg->arg_outsize - arg->arg_insize);
+
+	res = fuse_fs_ioctl(f->fs, arg->arg_path, (int)arg->arg_cmd,
+			    (void *)(uintptr_t)arg->arg_arg, &fi, flags,
+			    (arg->arg_insize || arg->arg_outsize) ?
+			    r.data : NULL);
+	/*
+	 * ENOSYS tells the kernel we have no ioctl at all,
+	 * so don't pass it on from the file system's.
+	 */
+	if (res == -ENOSYS && f->fs->op.ioctl != NULL)
+		res = -ENOTTY;
+	if (res < 0) {
+		err = res;
+		goto out;
+	}
+	r.ret.ret_result = res;
+	r.ret.ret_outsize = arg->arg_outsize;
+	err = 0;
+
+out:
+	r.ret.ret_err = -err;
+	sol_return((void *)&r, sizeof (r.ret) + r.ret.ret_outsize);
+}
+
+/* FUSE_OP_POLL */
+static void
+do_poll(sol_ll_t *ll, void *vargp, size_t argsz)
+{
+	struct fuse *f = ll->userdata;
+	struct fuse_poll_arg *arg = vargp;
+	struct fuse_poll_ret ret = { 0 };
+	struct fuse_file_info fi;
+	struct fuse_pollhandle *ph = NULL;
+	unsigned revents = 0;
+	int err;
+
+	if (argsz != sizeof (*arg)) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	memset(&fi, 0, sizeof(fi));
+	fi.fh = arg->arg_fid;
+	fi.fh_old = fi.fh;
+
+	/* See do_poll in fuse_lowlevel.c */
+	if (arg->arg_flags & FUSE_POLL_SCHEDULE_NOTIFY) {
+		ph = fuse_sol_pollhandle_new(ll, arg->arg_kh);
+		if (ph == NULL) {
+			err = -ENOMEM;
+			goto out;
+		}
+	}
+
+	/* The file system owns ph now, unless it has no poll op. */
+	err = fuse_fs_poll(f->fs, arg->arg_path, &fi, ph, &revents);
+	if (err == -ENOSYS && ph != NULL)
+		fuse_pollhandle_destroy(ph);
+	if (err == 0)
+		ret.ret_revents = revents;
+
+out:
+	ret.ret_err = -err;
+	sol_return((void *)&ret, sizeof (ret));
+}
+
+/*
+ * FUSE_OP_NOTIFY
+ *
+ * The kernel keeps one of these calls outstanding, and we
+ * answer it when there are notifications to deliver.
+ * This ties up one door service thread per mount.
+ */
+static void
+do_notify(sol_ll_t *ll, void *vargp, size_t argsz)
+{
+	_NOTE(ARGUNUSED(vargp, argsz));
+	struct sol_notify_q *nq = &solaris_nq;
+	struct fuse_notify_ret ret;
+	struct fuse_notify_ent *ne;
+	struct sol_notify *sn;
+	unsigned n, off;
+	int err = 0;
+
+	memset(&ret, 0, sizeof (ret));
+
+	pthread_mutex_lock(&nq->lock);
+	while (nq->count == 0 && !nq->dead)
+		pthread_cond_wait(&nq->cond, &nq->lock);
+	if (nq->dead) {
+		err = ESRCH;
+		goto out;
+	}
+
+	/* Take as many as fit in the reply. */
+	off = 0;
+	for (n = 0; n < nq->count && n < FUSE_NOTIFY_MAX; n++) {
+		sn = &nq->ents[n];
+		ne = &ret.ret_ents[n];
+		if (sol_notify_path(&ret, &off, sn->path1, &ne->ne_path1) ||
+		    sol_notify_path(&ret, &off, sn->path2, &ne->ne_path2))
+			break;
+		ne->ne_code = sn->code;
+		ne->ne_kh = sn->kh;
+		sol_notify_free(sn);
+	}
+	nq->count -= n;
+	memmove(nq->ents, nq->ents + n, nq->count * sizeof(nq->ents[0]));
+	ret.ret_count = n;
+
+out:
+	pthread_mutex_unlock(&nq->lock);
+
+	if (ll->debug)
+		fprintf(stderr, "notify, count=%u, err=%d\n",
+			ret.ret_count, err);
+	ret.ret_err = err;
+	sol_return((void *)&ret, sizeof (ret));
+}
+
+/* FUSE_OP_NOTIFY for a CUSE device (cuse_ll_doorsvc.c) */
+void fuse_sol_notify(struct fuse_ll *ll, void *vargp, size_t argsz)
+{
+	do_notify(ll, vargp, argsz);
+}
+
+/*
+ * Let the kernel know about a change it didn't make.
+ * See fuse_notify_change in fuse.h
+ */
+int fuse_notify_change(struct fuse *f, enum fuse_change change,
+		       const char *path, const char *newpath)
+{
+	uint32_t code;
+
+	(void) f;
+	switch (change) {
+	case FUSE_CHANGE_MODIFIED:
+		code = FUSE_NOTIFY_MODIFIED;
+		break;
+	case FUSE_CHANGE_CREATED:
+		code = FUSE_NOTIFY_CREATED;
+		break;
+	case FUSE_CHANGE_REMOVED:
+		code = FUSE_NOTIFY_REMOVED;
+		break;
+	case FUSE_CHANGE_RENAMED:
+		code = FUSE_NOTIFY_RENAMED;
+		if (newpath == NULL)
+			return -EINVAL;
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (path == NULL || path[0] != '/')
+		return -EINVAL;
+	if (code != FUSE_NOTIFY_RENAMED)
+		newpath = NULL;
+
+	return sol_notify_post(code, 0, path, newpath);
 }
 
 /*ARGSUSED*/
@@ -1134,6 +2658,9 @@ sol_dispatch(void *door_cookie, char *cargp, size_t argsz,
 	struct fuse_generic_arg *argp = vargp;
 	struct fuse_generic_ret ret = { 0 };
 	sol_ll_t *ll = solaris_ll;
+	struct fuse_trace_arg *targ;
+	struct sol_trace tr;
+	uint32_t opcode;
 	int err = 0;
 
 	/*
@@ -1162,7 +2689,44 @@ sol_dispatch(void *door_cookie, char *cargp, size_t argsz,
 	}
 	memset(&ret, 0, sizeof (ret));
 
-	switch (argp->arg_opcode) {
+	/*
+	 * A traced request: note the times, and
+	 * serve the call behind the header.
+	 */
+	if (argp->arg_opcode == FUSE_OP_TRACE) {
+		if (argsz < sizeof (*targ) + sizeof (*argp)) {
+			err = EINVAL;
+			goto out;
+		}
+		targ = vargp;
+		memset(&tr, 0, sizeof (tr));
+		tr.t_recv = gethrtime();
+		tr.reqid = targ->arg_reqid;
+		tr.t_enter = targ->arg_t_enter;
+		tr.t_call = targ->arg_t_call;
+		vargp = cargp + sizeof (*targ);
+		argsz -= sizeof (*targ);
+		argp = vargp;
+		tr.opcode = FUSE_OP_CODE(argp->arg_opcode);
+		tr.t_gate = tr.t_recv;
+		sol_trace_cur = &tr;
+	}
+
+	opcode = FUSE_OP_CODE(argp->arg_opcode);
+	switch (opcode) {
+	case FUSE_OP_INIT:
+	case FUSE_OP_DESTROY:
+	case FUSE_OP_NOTIFY:
+		/* Never wait for these. */
+		break;
+	default:
+		sol_gate_enter(ll, FUSE_OP_PRIO(argp->arg_opcode));
+		if (sol_trace_cur != NULL)
+			tr.t_gate = gethrtime();
+		break;
+	}
+
+	switch (opcode) {
 
 	/*
 	 * Misc and VFS operations
@@ -1231,10 +2795,43 @@ sol_dispatch(void *door_cookie, char *cargp, size_t argsz,
 		do_create(ll, vargp, argsz);
 		break;
 
+	case FUSE_OP_CREATE2:
+		do_create2(ll, vargp, argsz);
+		break;
+
 	case FUSE_OP_FTRUNC:
 		do_ftruncate(ll, vargp, argsz);
 		break;
 
+	case FUSE_OP_FALLOCATE:
+		do_fallocate(ll, vargp, argsz);
+		break;
+
+	case FUSE_OP_BMAP:
+		do_bmap(ll, vargp, argsz);
+		break;
+	case FUSE_OP_FHLOOKUP:
+		do_fhlookup(ll, vargp, argsz);
+		break;
+	case FUSE_OP_GETACL:
+		do_getacl(ll, vargp, argsz);
+		break;
+	case FUSE_OP_SETACL:
+		do_setacl(ll, vargp, argsz);
+		break;
+
+	case FUSE_OP_DIGEST:
+		do_digest(ll, vargp, argsz);
+		break;
+
+	case FUSE_OP_RMTREE:
+		do_rmtree(ll, vargp, argsz);
+		break;
+
+	case FUSE_OP_SUMTREE:
+		do_sumtree(ll, vargp, argsz);
+		break;
+
 	case FUSE_OP_UTIMES:
 		do_utimes(ll, vargp, argsz);
 		break;
@@ -1263,9 +2860,23 @@ sol_dispatch(void *door_cookie, char *cargp, size_t argsz,
 		do_rmdir(ll, vargp, argsz);
 		break;
 
+	case FUSE_OP_IOCTL:
+		do_ioctl(ll, vargp, argsz);
+		break;
+
+	/*
+	 * Poll and notifications
+	 */
+	case FUSE_OP_POLL:
+		do_poll(ll, vargp, argsz);
+		break;
+
+	case FUSE_OP_NOTIFY:
+		do_notify(ll, vargp, argsz);
+		break;
+
 	default:
-		fprintf(stderr, "sol_dispatch, unimpl. op %d\n",
-			argp->arg_opcode);
+		fprintf(stderr, "sol_dispatch, unimpl. op %d\n", opcode);
 		err = ENOSYS;
 		break;
 	}
@@ -1274,19 +2885,33 @@ sol_dispatch(void *door_cookie, char *cargp, size_t argsz,
 
 out:
 	ret.ret_err = err;
-	door_return((void *)&ret, sizeof (ret), NULL, 0);
+	sol_return((void *)&ret, sizeof (ret));
 }
 
 
+/* For a FUSE_POLL_SCHEDULE_NOTIFY poll, here or in CUSE */
+struct fuse_pollhandle *fuse_sol_pollhandle_new(struct fuse_ll *ll,
+						uint64_t kh)
+{
+	struct fuse_pollhandle *ph;
+
+	ph = malloc(sizeof(struct fuse_pollhandle));
+	if (ph == NULL)
+		return NULL;
+	ph->kh = kh;
+	ph->ch = solaris_se->ch;
+	ph->f = ll;
+	return ph;
+}
+
 void fuse_pollhandle_destroy(struct fuse_pollhandle *ph)
 {
 	free(ph);
 }
 
-/* ARGSUSED */
 int fuse_lowlevel_notify_poll(struct fuse_pollhandle *ph)
 {
-	return 0;
+	return sol_notify_post(FUSE_NOTIFY_POLL, ph->kh, NULL, NULL);
 }
 
 /* ARGSUSED */
@@ -1420,6 +3045,9 @@ static struct fuse_opt fuse_sol_opts[] = {
 	{ "atomic_o_trunc", offsetof(struct fuse_ll, atomic_o_trunc), 1},
 	{ "no_remote_lock", offsetof(struct fuse_ll, no_remote_lock), 1},
 	{ "big_writes", offsetof(struct fuse_ll, big_writes), 1},
+	{ "max_active=%u", offsetof(struct fuse_ll, max_active), 0 },
+	{ "prio_reserve=%u", offsetof(struct fuse_ll, prio_reserve), 0 },
+	{ "trace=%s", offsetof(struct fuse_ll, trace_file), 0 },
 	FUSE_OPT_KEY("max_read=", FUSE_OPT_KEY_DISCARD),
 	FUSE_OPT_KEY("-h", KEY_HELP),
 	FUSE_OPT_KEY("--help", KEY_HELP),
@@ -1443,7 +3071,10 @@ static void fuse_sol_help(void)
 "    -o sync_read           perform reads synchronously\n"
 "    -o atomic_o_trunc      enable atomic open+truncate support\n"
 "    -o big_writes          enable larger than 4kB writes\n"
-"    -o no_remote_lock      disable remote file locking\n");
+"    -o no_remote_lock      disable remote file locking\n"
+"    -o max_active=N        run at most N requests at once, by priority\n"
+"    -o prio_reserve=N      of those, keep N for interactive callers\n"
+"    -o trace=FILE          append per-request trace records to FILE\n");
 }
 
 static int fuse_sol_opt_proc(void *data, const char *arg, int key,
@@ -1477,13 +3108,21 @@ static void fuse_sol_destroy(void *data)
 	struct fuse_ll *ll = (struct fuse_ll *) data;
 
 	/* Make sure door calls stop. */
+	fuse_sol_notify_shutdown();
 	fuse_sol_door_destroy();
 
-	if (ll->got_init && !ll->got_destroy) {
+	/* CUSE userdata is the application's, not a struct fuse. */
+	if (ll->got_init && !ll->got_destroy && ll->cuse_data == NULL) {
 		sol_lib_destroy(ll->userdata);
 	}
 
+	if (sol_trace_fp != NULL) {
+		fclose(sol_trace_fp);
+		sol_trace_fp = NULL;
+	}
+
 	pthread_mutex_destroy(&ll->lock);
+	free(ll->trace_file);
 	free(ll->cuse_data);
 	free(ll);
 }
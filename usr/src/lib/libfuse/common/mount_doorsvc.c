@@ -172,6 +172,15 @@ static const struct fuse_opt fuse_mount_opts[] = {
 	FUSE_DUAL_OPT_KEY("default_permissions",KEY_KERN),
 	FUSE_OPT_KEY("max_read=",		KEY_KERN),
 	FUSE_OPT_KEY("subtype=",		KEY_KERN),
+	FUSE_OPT_KEY("memlimit=",		KEY_KERN),
+	FUSE_OPT_KEY("rbw=",			KEY_KERN),
+	FUSE_OPT_KEY("wbw=",			KEY_KERN),
+	FUSE_OPT_KEY("iops=",			KEY_KERN),
+	FUSE_OPT_KEY("qoszone",		KEY_KERN),
+	FUSE_OPT_KEY("swr=",			KEY_KERN),
+	FUSE_OPT_KEY("asyncns",		KEY_KERN),
+	FUSE_OPT_KEY("blkdev=",			KEY_KERN),
+	FUSE_OPT_KEY("acl",			KEY_KERN),
 	/* FBSD FUSE specific mount options */
 	FUSE_DUAL_OPT_KEY("private",		KEY_KERN),
 	FUSE_DUAL_OPT_KEY("neglect_shares",	KEY_KERN),
@@ -197,6 +206,18 @@ static void mount_help(void)
 "    -o default_permissions enable permission checking by kernel\n"
 "    -o fsname=NAME         set filesystem name\n"
 "    -o subtype=NAME        set filesystem type\n"
+"    -o memlimit=N[kmg]     limit kernel cache memory (KB)\n"
+"    -o rbw=N[kmg]          limit read bandwidth (KB/sec)\n"
+"    -o wbw=N[kmg]          limit write bandwidth (KB/sec)\n"
+"    -o iops=N              limit requests per second\n"
+"    -o qoszone             also count against the zone's limits\n"
+"    -o swr=N               use attributes up to N secs stale, refresh\n"
+"                           them in the background\n"
+"    -o asyncns             create files and dirs in the background\n"
+"    -o blkdev=PATH         read and write file data directly on the\n"
+"                           device the file system is on (bmap)\n"
+"    -o acl                 check access with each file's owner, mode\n"
+"                           and ACL\n"
 "    -o large_read          issue large read requests (2.4 only)\n"
 "    -o max_read=N          set maximum size of read requests\n"
 "\n");
@@ -63,6 +63,13 @@ typedef struct fuse_dirhandle *fuse_dirh_t;
 typedef int (*fuse_dirfil_t) (fuse_dirh_t h, const char *name, int type,
 			      ino_t ino);
 
+/** Space used by a tree, for the sumtree operation */
+struct fuse_treesum {
+	uint64_t bytes;		/* sum of file sizes */
+	uint64_t blocks;	/* 512-byte blocks allocated */
+	uint64_t entries;	/* files and directories, the top too */
+};
+
 /**
  * The file system operations:
  *
@@ -259,7 +266,11 @@ struct fuse_operations {
 	/** Set extended attributes */
 	int (*setxattr) (const char *, const char *, const char *, size_t, int);
 
-	/** Get extended attributes */
+	/** Get extended attributes
+	 *
+	 * Names starting with FUSE_DIGEST_XATTR are reserved: see
+	 * fuse_fs_digest().
+	 */
 	int (*getxattr) (const char *, const char *, char *, size_t);
 
 	/** List extended attributes */
@@ -496,8 +507,64 @@ struct fuse_operations {
 	 */
 	int (*poll) (const char *, struct fuse_file_info *,
 		     struct fuse_pollhandle *ph, unsigned *reventsp);
+
+	/**
+	 * Allocates space for an open file
+	 *
+	 * This function ensures that required space is allocated for
+	 * specified file.  If this function returns success then any
+	 * subsequent write request to specified range is guaranteed
+	 * not to fail because of lack of space on the file system
+	 * media.
+	 *
+	 * With FALLOC_FL_PUNCH_HOLE (always together with
+	 * FALLOC_FL_KEEP_SIZE) the space is freed instead, and the
+	 * range reads as zeros afterwards.  The kernel uses this for
+	 * writes of zeros, so a filesystem that can make holes should
+	 * implement it, and return -EOPNOTSUPP for modes it doesn't
+	 * support.
+	 *
+	 * Introduced in version 2.9.1
+	 */
+	int (*fallocate) (const char *, int, off_t, off_t,
+			  struct fuse_file_info *);
+
+	/**
+	 * Remove a directory and everything under it
+	 *
+	 * For file systems that can do this in bulk, rather than
+	 * with an unlink or rmdir for each entry.  Return -ENOSYS
+	 * (or leave this NULL) to have the caller walk the tree.
+	 * If it fails part way, some of the tree may be gone.
+	 *
+	 * Only used with the Solaris (doors) kernel interface.
+	 */
+	int (*rmtree) (const char *);
+
+	/**
+	 * Space used by a file or directory and everything under it
+	 *
+	 * For file systems that can count this in bulk, rather than
+	 * with a getattr for each entry.  Fill in the fuse_treesum
+	 * as du(1) would count the tree; a file with several links
+	 * in the tree is counted once.  Return -ENOSYS (or leave
+	 * this NULL) to have the caller walk the tree.
+	 *
+	 * Only used with the Solaris (doors) kernel interface.
+	 */
+	int (*sumtree) (const char *, struct fuse_treesum *);
 };
 
+/*
+ * Modes for fallocate, as in Linux <linux/falloc.h>
+ */
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE	0x01
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE	0x02
+#endif
+
 /** Extra context that may be needed by some filesystems
  *
  * The uid, gid and pid fields are not filled in case of a writepage
@@ -755,11 +822,77 @@ int fuse_fs_ioctl(struct fuse_fs *fs, const char *path, int cmd, void *arg,
 int fuse_fs_poll(struct fuse_fs *fs, const char *path,
 		 struct fuse_file_info *fi, struct fuse_pollhandle *ph,
 		 unsigned *reventsp);
+int fuse_fs_fallocate(struct fuse_fs *fs, const char *path, int mode,
+		      off_t offset, off_t length, struct fuse_file_info *fi);
+
+/**
+ * Reserved extended attribute names for file digests
+ *
+ * A file system that can give the digest of a file's contents
+ * without reading them (e.g. it stores them, or the back end's
+ * server computes them) answers getxattr() of
+ * FUSE_DIGEST_XATTR "<alg>" with the digest in lowercase hex, no
+ * terminating NUL.  Algorithms are named "md5", "sha1", "sha256",
+ * "sha384" and "sha512".  If it can't, it returns -ENODATA (or
+ * has no getxattr).  These names can't be set or removed through
+ * the mount.  The "digest" module computes and caches them for
+ * file systems that don't.
+ */
+#define FUSE_DIGEST_XATTR	"user.fuse.digest."
+#define FUSE_DIGEST_MAX		128	/* hex digits of the longest */
+
+/**
+ * Get the digest of a file's contents
+ *
+ * Asks the file system for the FUSE_DIGEST_XATTR attribute.
+ *
+ * @param fs the filesystem
+ * @param path the file
+ * @param alg the algorithm, e.g. "sha256"
+ * @param buf where the digest is put, in lowercase hex, terminated
+ * @param size the size of buf
+ * @return length of the digest, -ENOTSUP if the file system can't
+ * give it, or other -errno for failure
+ */
+int fuse_fs_digest(struct fuse_fs *fs, const char *path, const char *alg,
+		   char *buf, size_t size);
+int fuse_fs_rmtree(struct fuse_fs *fs, const char *path);
+int fuse_fs_sumtree(struct fuse_fs *fs, const char *path,
+		    struct fuse_treesum *sum);
 void fuse_fs_init(struct fuse_fs *fs, struct fuse_conn_info *conn);
 void fuse_fs_destroy(struct fuse_fs *fs);
 
 int fuse_notify_poll(struct fuse_pollhandle *ph);
 
+/**
+ * Changes reported with fuse_notify_change()
+ */
+enum fuse_change {
+	FUSE_CHANGE_MODIFIED = 1,	/* contents or attributes of path */
+	FUSE_CHANGE_CREATED,		/* path was created */
+	FUSE_CHANGE_REMOVED,		/* path was removed */
+	FUSE_CHANGE_RENAMED,		/* path was renamed to newpath */
+};
+
+/**
+ * Notify the kernel of a change to the file system that was not
+ * made through the mount, e.g. by another client of the back end.
+ *
+ * The kernel discards what it has cached for the paths involved
+ * and reports the change to anyone watching them (event ports).
+ * Paths are absolute, as passed to the file system operations.
+ *
+ * Only available with the Solaris (doors) kernel interface.
+ *
+ * @param f the FUSE handle
+ * @param change what happened
+ * @param path the path that changed
+ * @param newpath the new name, for FUSE_CHANGE_RENAMED
+ * @return zero for success, -errno for failure
+ */
+int fuse_notify_change(struct fuse *f, enum fuse_change change,
+		       const char *path, const char *newpath);
+
 /**
  * Create a new fuse filesystem object
  *
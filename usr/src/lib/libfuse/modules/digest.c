@@ -0,0 +1,803 @@
+/*
+  fuse digest module: compute and cache file digests
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+*/
+
+/*
+ * Answers the reserved FUSE_DIGEST_XATTR attributes (see fuse.h) for
+ * file systems that can't.  The next filesystem is asked first; if it
+ * has no digest for the file, this module reads the file through it
+ * and hashes the contents.
+ *
+ * Digests are cached by path and algorithm, in an LRU of at most
+ * digest_max entries, with the file's size, mtime and ctime when the
+ * hashing started.  A cached digest is used only while getattr still
+ * gives those.  Writes, truncates and the like through this module
+ * drop the path's digests, and bump a generation count for the
+ * path's hash chain, so a digest worked out while the file was being
+ * written isn't cached.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <md5.h>
+#include <sha1.h>
+#include <sha2.h>
+
+#define DIGEST_HASH_SIZE	251
+#define DIGEST_MAX_DEFAULT	1024
+#define DIGEST_ALGLEN		16
+#define DIGEST_CHUNK		(64 * 1024)
+
+struct dg_entry {
+	char *path;
+	char alg[DIGEST_ALGLEN];
+	char hex[FUSE_DIGEST_MAX + 1];
+	size_t len;
+	off_t size;
+	struct timespec mtime;
+	struct timespec ctime;
+	struct dg_entry *hnext;		/* hash chain */
+	struct dg_entry *prev;		/* LRU list */
+	struct dg_entry *next;
+};
+
+struct digest {
+	struct fuse_fs *next;
+	pthread_mutex_t lock;
+	unsigned max;			/* digests kept */
+	unsigned count;
+	struct dg_entry lru;		/* list head, oldest first */
+	struct dg_entry *hash[DIGEST_HASH_SIZE];
+	unsigned gen[DIGEST_HASH_SIZE];
+};
+
+union dg_ctx {
+	MD5_CTX md5;
+	SHA1_CTX sha1;
+	SHA2_CTX sha2;
+};
+
+struct dg_alg {
+	const char *name;
+	int mech;			/* for SHA2Init */
+	size_t len;			/* bytes of digest */
+};
+
+static const struct dg_alg dg_algs[] = {
+	{ "md5",	-1,	16 },
+	{ "sha1",	-1,	20 },
+	{ "sha256",	SHA256,	32 },
+	{ "sha384",	SHA384,	48 },
+	{ "sha512",	SHA512,	64 },
+	{ NULL,		0,	0 }
+};
+
+static struct digest *digest_get(void)
+{
+	return fuse_get_context()->private_data;
+}
+
+static unsigned dg_hash(const char *path)
+{
+	unsigned h = 0;
+
+	for (; *path; path++)
+		h = h * 31 + (unsigned char) *path;
+	return h % DIGEST_HASH_SIZE;
+}
+
+static int is_digest_xattr(const char *name)
+{
+	return strncmp(name, FUSE_DIGEST_XATTR,
+		       sizeof(FUSE_DIGEST_XATTR) - 1) == 0;
+}
+
+static const struct dg_alg *dg_alg_find(const char *name)
+{
+	const struct dg_alg *a;
+
+	for (a = dg_algs; a->name; a++)
+		if (strcmp(a->name, name) == 0)
+			return a;
+	return NULL;
+}
+
+static void dg_init(const struct dg_alg *a, union dg_ctx *ctx)
+{
+	if (a->len == 16)
+		MD5Init(&ctx->md5);
+	else if (a->len == 20)
+		SHA1Init(&ctx->sha1);
+	else
+		SHA2Init(a->mech, &ctx->sha2);
+}
+
+static void dg_update(const struct dg_alg *a, union dg_ctx *ctx,
+		      const char *buf, size_t len)
+{
+	if (a->len == 16)
+		MD5Update(&ctx->md5, buf, len);
+	else if (a->len == 20)
+		SHA1Update(&ctx->sha1, buf, len);
+	else
+		SHA2Update(&ctx->sha2, buf, len);
+}
+
+static void dg_final(const struct dg_alg *a, union dg_ctx *ctx,
+		     unsigned char *out)
+{
+	if (a->len == 16)
+		MD5Final(out, &ctx->md5);
+	else if (a->len == 20)
+		SHA1Final(out, &ctx->sha1);
+	else
+		SHA2Final(out, &ctx->sha2);
+}
+
+static int dg_same(const struct dg_entry *e, const struct stat *st)
+{
+	return e->size == st->st_size &&
+		e->mtime.tv_sec == st->st_mtim.tv_sec &&
+		e->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+		e->ctime.tv_sec == st->st_ctim.tv_sec &&
+		e->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+static void dg_lru_remove(struct dg_entry *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void dg_lru_add(struct digest *d, struct dg_entry *e)
+{
+	e->prev = d->lru.prev;
+	e->next = &d->lru;
+	d->lru.prev->next = e;
+	d->lru.prev = e;
+}
+
+static void dg_free(struct dg_entry *e)
+{
+	free(e->path);
+	free(e);
+}
+
+/* Take an entry out of the cache; called with the lock held */
+static void dg_remove(struct digest *d, struct dg_entry *e)
+{
+	struct dg_entry **ep;
+
+	for (ep = &d->hash[dg_hash(e->path)]; *ep != e; ep = &(*ep)->hnext)
+		;
+	*ep = e->hnext;
+	dg_lru_remove(e);
+	d->count--;
+	dg_free(e);
+}
+
+/*
+ * Drop the digests of a path (and with "subtree", of everything under
+ * it), and stop any being worked out from being cached.
+ */
+static void dg_invalidate(struct digest *d, const char *path, int subtree)
+{
+	struct dg_entry *e, *enext;
+	size_t len = strlen(path);
+	unsigned i, first, last;
+
+	if (subtree) {
+		first = 0;
+		last = DIGEST_HASH_SIZE - 1;
+	} else {
+		first = last = dg_hash(path);
+	}
+
+	pthread_mutex_lock(&d->lock);
+	for (i = first; i <= last; i++) {
+		d->gen[i]++;
+		for (e = d->hash[i]; e; e = enext) {
+			enext = e->hnext;
+			if (strncmp(e->path, path, len) == 0 &&
+			    (e->path[len] == '\0' ||
+			     (subtree && e->path[len] == '/')))
+				dg_remove(d, e);
+		}
+	}
+	pthread_mutex_unlock(&d->lock);
+}
+
+/*
+ * Look for a digest that's still good for a file with these
+ * attributes, copying it to hex.  Returns its length, or 0.
+ */
+static size_t dg_lookup(struct digest *d, const char *path, const char *alg,
+			const struct stat *st, char *hex)
+{
+	struct dg_entry *e;
+	size_t len = 0;
+
+	pthread_mutex_lock(&d->lock);
+	for (e = d->hash[dg_hash(path)]; e; e = e->hnext)
+		if (strcmp(e->path, path) == 0 && strcmp(e->alg, alg) == 0)
+			break;
+	if (e && !dg_same(e, st)) {
+		dg_remove(d, e);
+		e = NULL;
+	}
+	if (e) {
+		len = e->len;
+		memcpy(hex, e->hex, len + 1);
+		dg_lru_remove(e);
+		dg_lru_add(d, e);
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	return len;
+}
+
+/*
+ * Cache a digest, unless the path's chain has been invalidated
+ * since gen was read.
+ */
+static void dg_enter(struct digest *d, const char *path, const char *alg,
+		     const struct stat *st, const char *hex, size_t len,
+		     unsigned gen)
+{
+	struct dg_entry *e, *old;
+	unsigned i = dg_hash(path);
+
+	e = calloc(1, sizeof(struct dg_entry));
+	if (e == NULL)
+		return;
+	e->path = strdup(path);
+	if (e->path == NULL) {
+		free(e);
+		return;
+	}
+	strcpy(e->alg, alg);
+	memcpy(e->hex, hex, len + 1);
+	e->len = len;
+	e->size = st->st_size;
+	e->mtime = st->st_mtim;
+	e->ctime = st->st_ctim;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->gen[i] != gen) {
+		pthread_mutex_unlock(&d->lock);
+		dg_free(e);
+		return;
+	}
+	for (old = d->hash[i]; old; old = old->hnext)
+		if (strcmp(old->path, path) == 0 && strcmp(old->alg, alg) == 0)
+			break;
+	if (old)
+		dg_remove(d, old);
+	e->hnext = d->hash[i];
+	d->hash[i] = e;
+	dg_lru_add(d, e);
+	d->count++;
+	while (d->count > d->max)
+		dg_remove(d, d->lru.next);
+	pthread_mutex_unlock(&d->lock);
+}
+
+/* Read the file through the next filesystem and hash it */
+static int dg_compute(struct digest *d, const char *path,
+		      const struct dg_alg *a, char *hex)
+{
+	static const char xdigit[] = "0123456789abcdef";
+	struct fuse_file_info fi;
+	unsigned char out[64];
+	union dg_ctx ctx;
+	off_t off = 0;
+	char *buf;
+	size_t i;
+	int res;
+
+	buf = malloc(DIGEST_CHUNK);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDONLY;
+	res = fuse_fs_open(d->next, path, &fi);
+	if (res) {
+		free(buf);
+		return res;
+	}
+
+	dg_init(a, &ctx);
+	for (;;) {
+		res = fuse_fs_read(d->next, path, buf, DIGEST_CHUNK, off, &fi);
+		if (res <= 0)
+			break;
+		if (res > DIGEST_CHUNK) {
+			res = -EIO;
+			break;
+		}
+		dg_update(a, &ctx, buf, res);
+		off += res;
+	}
+	fuse_fs_release(d->next, path, &fi);
+	free(buf);
+	if (res < 0)
+		return res;
+
+	dg_final(a, &ctx, out);
+	for (i = 0; i < a->len; i++) {
+		hex[2 * i] = xdigit[out[i] >> 4];
+		hex[2 * i + 1] = xdigit[out[i] & 0xf];
+	}
+	hex[2 * a->len] = '\0';
+
+	return 2 * a->len;
+}
+
+static int digest_getdigest(struct digest *d, const char *path,
+			    const char *name, char *value, size_t size)
+{
+	const char *alg = name + sizeof(FUSE_DIGEST_XATTR) - 1;
+	const struct dg_alg *a;
+	char hex[FUSE_DIGEST_MAX + 1];
+	struct stat st;
+	size_t len;
+	unsigned gen;
+	int res;
+
+	res = fuse_fs_getxattr(d->next, path, name, value, size);
+	if (res != -ENODATA && res != -ENOTSUP && res != -ENOSYS &&
+	    res != -EOPNOTSUPP)
+		return res;
+
+	a = dg_alg_find(alg);
+	if (a == NULL)
+		return -ENODATA;
+
+	/* What to check a cached digest against, read before hashing */
+	pthread_mutex_lock(&d->lock);
+	gen = d->gen[dg_hash(path)];
+	pthread_mutex_unlock(&d->lock);
+	res = fuse_fs_getattr(d->next, path, &st);
+	if (res)
+		return res;
+	if (!S_ISREG(st.st_mode))
+		return -ENODATA;
+
+	len = dg_lookup(d, path, alg, &st, hex);
+	if (len == 0) {
+		res = dg_compute(d, path, a, hex);
+		if (res < 0)
+			return res;
+		len = res;
+		dg_enter(d, path, alg, &st, hex, len, gen);
+	}
+
+	if (size == 0)
+		return len;
+	if (size < len)
+		return -ERANGE;
+	memcpy(value, hex, len);
+	return len;
+}
+
+static int digest_getxattr(const char *path, const char *name, char *value,
+			   size_t size)
+{
+	struct digest *d = digest_get();
+
+	if (is_digest_xattr(name))
+		return digest_getdigest(d, path, name, value, size);
+	return fuse_fs_getxattr(d->next, path, name, value, size);
+}
+
+static int digest_setxattr(const char *path, const char *name,
+			   const char *value, size_t size, int flags)
+{
+	if (is_digest_xattr(name))
+		return -EPERM;
+	return fuse_fs_setxattr(digest_get()->next, path, name, value, size,
+				flags);
+}
+
+static int digest_removexattr(const char *path, const char *name)
+{
+	if (is_digest_xattr(name))
+		return -EPERM;
+	return fuse_fs_removexattr(digest_get()->next, path, name);
+}
+
+static int digest_open(const char *path, struct fuse_file_info *fi)
+{
+	struct digest *d = digest_get();
+	int err;
+
+	err = fuse_fs_open(d->next, path, fi);
+	if (fi->flags & O_TRUNC)
+		dg_invalidate(d, path, 0);
+	return err;
+}
+
+static int digest_create(const char *path, mode_t mode,
+			 struct fuse_file_info *fi)
+{
+	struct digest *d = digest_get();
+	int err;
+
+	err = fuse_fs_create(d->next, path, mode, fi);
+	dg_invalidate(d, path, 0);
+	return err;
+}
+
+static int digest_write(const char *path, const char *buf, size_t size,
+			off_t offset, struct fuse_file_info *fi)
+{
+	struct digest *d = digest_get();
+	int res;
+
+	res = fuse_fs_write(d->next, path, buf, size, offset, fi);
+	dg_invalidate(d, path, 0);
+	return res;
+}
+
+static int digest_truncate(const char *path, off_t size)
+{
+	struct digest *d = digest_get();
+	int err;
+
+	err = fuse_fs_truncate(d->next, path, size);
+	dg_invalidate(d, path, 0);
+	return err;
+}
+
+static int digest_ftruncate(const char *path, off_t size,
+			    struct fuse_file_info *fi)
+{
+	struct digest *d = digest_get();
+	int err;
+
+	err = fuse_fs_ftruncate(d->next, path, size, fi);
+	dg_invalidate(d, path, 0);
+	return err;
+}
+
+static int digest_fallocate(const char *path, int mode, off_t offset,
+			    off_t length, struct fuse_file_info *fi)
+{
+	struct digest *d = digest_get();
+	int err;
+
+	err = fuse_fs_fallocate(d->next, path, mode, offset, length, fi);
+	dg_invalidate(d, path, 0);
+	return err;
+}
+
+static int digest_unlink(const char *path)
+{
+	struct digest *d = digest_get();
+	int err;
+
+	err = fuse_fs_unlink(d->next, path);
+	dg_invalidate(d, path, 0);
+	return err;
+}
+
+static int digest_rename(const char *from, const char *to)
+{
+	struct digest *d = digest_get();
+	int err;
+
+	err = fuse_fs_rename(d->next, from, to);
+	dg_invalidate(d, from, 1);
+	dg_invalidate(d, to, 1);
+	return err;
+}
+
+static int digest_rmtree(const char *path)
+{
+	struct digest *d = digest_get();
+	int err;
+
+	err = fuse_fs_rmtree(d->next, path);
+	dg_invalidate(d, path, 1);
+	return err;
+}
+
+static int digest_sumtree(const char *path, struct fuse_treesum *sum)
+{
+	return fuse_fs_sumtree(digest_get()->next, path, sum);
+}
+
+static int digest_utimens(const char *path, const struct timespec ts[2])
+{
+	struct digest *d = digest_get();
+	int err;
+
+	err = fuse_fs_utimens(d->next, path, ts);
+	dg_invalidate(d, path, 0);
+	return err;
+}
+
+static int digest_getattr(const char *path, struct stat *stbuf)
+{
+	return fuse_fs_getattr(digest_get()->next, path, stbuf);
+}
+
+static int digest_fgetattr(const char *path, struct stat *stbuf,
+			   struct fuse_file_info *fi)
+{
+	return fuse_fs_fgetattr(digest_get()->next, path, stbuf, fi);
+}
+
+static int digest_access(const char *path, int mask)
+{
+	return fuse_fs_access(digest_get()->next, path, mask);
+}
+
+static int digest_readlink(const char *path, char *buf, size_t size)
+{
+	return fuse_fs_readlink(digest_get()->next, path, buf, size);
+}
+
+static int digest_opendir(const char *path, struct fuse_file_info *fi)
+{
+	return fuse_fs_opendir(digest_get()->next, path, fi);
+}
+
+static int digest_readdir(const char *path, void *buf,
+			  fuse_fill_dir_t filler, off_t offset,
+			  struct fuse_file_info *fi)
+{
+	return fuse_fs_readdir(digest_get()->next, path, buf, filler, offset,
+			       fi);
+}
+
+static int digest_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	return fuse_fs_releasedir(digest_get()->next, path, fi);
+}
+
+static int digest_fsyncdir(const char *path, int isdatasync,
+			   struct fuse_file_info *fi)
+{
+	return fuse_fs_fsyncdir(digest_get()->next, path, isdatasync, fi);
+}
+
+static int digest_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+	return fuse_fs_mknod(digest_get()->next, path, mode, rdev);
+}
+
+static int digest_mkdir(const char *path, mode_t mode)
+{
+	return fuse_fs_mkdir(digest_get()->next, path, mode);
+}
+
+static int digest_rmdir(const char *path)
+{
+	return fuse_fs_rmdir(digest_get()->next, path);
+}
+
+static int digest_symlink(const char *from, const char *path)
+{
+	return fuse_fs_symlink(digest_get()->next, from, path);
+}
+
+static int digest_link(const char *from, const char *to)
+{
+	return fuse_fs_link(digest_get()->next, from, to);
+}
+
+static int digest_chmod(const char *path, mode_t mode)
+{
+	return fuse_fs_chmod(digest_get()->next, path, mode);
+}
+
+static int digest_chown(const char *path, uid_t uid, gid_t gid)
+{
+	return fuse_fs_chown(digest_get()->next, path, uid, gid);
+}
+
+static int digest_read(const char *path, char *buf, size_t size, off_t offset,
+		       struct fuse_file_info *fi)
+{
+	return fuse_fs_read(digest_get()->next, path, buf, size, offset, fi);
+}
+
+static int digest_statfs(const char *path, struct statvfs *stbuf)
+{
+	return fuse_fs_statfs(digest_get()->next, path, stbuf);
+}
+
+static int digest_flush(const char *path, struct fuse_file_info *fi)
+{
+	return fuse_fs_flush(digest_get()->next, path, fi);
+}
+
+static int digest_release(const char *path, struct fuse_file_info *fi)
+{
+	return fuse_fs_release(digest_get()->next, path, fi);
+}
+
+static int digest_fsync(const char *path, int isdatasync,
+			struct fuse_file_info *fi)
+{
+	return fuse_fs_fsync(digest_get()->next, path, isdatasync, fi);
+}
+
+static int digest_listxattr(const char *path, char *list, size_t size)
+{
+	return fuse_fs_listxattr(digest_get()->next, path, list, size);
+}
+
+static int digest_lock(const char *path, struct fuse_file_info *fi, int cmd,
+		       struct flock *lock)
+{
+	return fuse_fs_lock(digest_get()->next, path, fi, cmd, lock);
+}
+
+static int digest_bmap(const char *path, size_t blocksize, uint64_t *idx)
+{
+	return fuse_fs_bmap(digest_get()->next, path, blocksize, idx);
+}
+
+/* The ioctl may have changed the data. */
+static int digest_ioctl(const char *path, int cmd, void *arg,
+			struct fuse_file_info *fi, unsigned int flags,
+			void *data)
+{
+	struct digest *d = digest_get();
+	int res;
+
+	res = fuse_fs_ioctl(d->next, path, cmd, arg, fi, flags, data);
+	dg_invalidate(d, path, 0);
+	return res;
+}
+
+static int digest_poll(const char *path, struct fuse_file_info *fi,
+		       struct fuse_pollhandle *ph, unsigned *reventsp)
+{
+	return fuse_fs_poll(digest_get()->next, path, fi, ph, reventsp);
+}
+
+static void *digest_init(struct fuse_conn_info *conn)
+{
+	struct digest *d = digest_get();
+	fuse_fs_init(d->next, conn);
+	return d;
+}
+
+static void digest_destroy(void *data)
+{
+	struct digest *d = data;
+
+	while (d->lru.next != &d->lru)
+		dg_remove(d, d->lru.next);
+
+	fuse_fs_destroy(d->next);
+	pthread_mutex_destroy(&d->lock);
+	free(d);
+}
+
+static struct fuse_operations digest_oper = {
+	.destroy	= digest_destroy,
+	.init		= digest_init,
+	.getattr	= digest_getattr,
+	.fgetattr	= digest_fgetattr,
+	.access		= digest_access,
+	.readlink	= digest_readlink,
+	.opendir	= digest_opendir,
+	.readdir	= digest_readdir,
+	.releasedir	= digest_releasedir,
+	.mknod		= digest_mknod,
+	.mkdir		= digest_mkdir,
+	.symlink	= digest_symlink,
+	.unlink		= digest_unlink,
+	.rmdir		= digest_rmdir,
+	.rename		= digest_rename,
+	.link		= digest_link,
+	.chmod		= digest_chmod,
+	.chown		= digest_chown,
+	.truncate	= digest_truncate,
+	.ftruncate	= digest_ftruncate,
+	.utimens	= digest_utimens,
+	.create		= digest_create,
+	.open		= digest_open,
+	.read		= digest_read,
+	.write		= digest_write,
+	.statfs		= digest_statfs,
+	.flush		= digest_flush,
+	.release	= digest_release,
+	.fsync		= digest_fsync,
+	.fsyncdir	= digest_fsyncdir,
+	.setxattr	= digest_setxattr,
+	.getxattr	= digest_getxattr,
+	.listxattr	= digest_listxattr,
+	.removexattr	= digest_removexattr,
+	.lock		= digest_lock,
+	.bmap		= digest_bmap,
+	.ioctl		= digest_ioctl,
+	.poll		= digest_poll,
+	.fallocate	= digest_fallocate,
+	.rmtree		= digest_rmtree,
+	.sumtree	= digest_sumtree,
+};
+
+static struct fuse_opt digest_opts[] = {
+	FUSE_OPT_KEY("-h", 0),
+	FUSE_OPT_KEY("--help", 0),
+	{ "digest_max=%u", offsetof(struct digest, max), 0 },
+	FUSE_OPT_END
+};
+
+static void digest_help(void)
+{
+	fprintf(stderr,
+"    -o digest_max=N        file digests cached (%u)\n",
+		DIGEST_MAX_DEFAULT);
+}
+
+static int digest_opt_proc(void *data, const char *arg, int key,
+			   struct fuse_args *outargs)
+{
+	(void) data; (void) arg; (void) outargs;
+
+	if (!key) {
+		digest_help();
+		return -1;
+	}
+
+	return 1;
+}
+
+static struct fuse_fs *digest_new(struct fuse_args *args,
+				  struct fuse_fs *next[])
+{
+	struct fuse_fs *fs;
+	struct digest *d;
+
+	d = calloc(1, sizeof(struct digest));
+	if (d == NULL) {
+		fprintf(stderr, "fuse-digest: memory allocation failed\n");
+		return NULL;
+	}
+
+	d->max = DIGEST_MAX_DEFAULT;
+	if (fuse_opt_parse(args, d, digest_opts, digest_opt_proc) == -1)
+		goto out_free;
+
+	if (!next[0] || next[1]) {
+		fprintf(stderr, "fuse-digest: exactly one next filesystem required\n");
+		goto out_free;
+	}
+
+	pthread_mutex_init(&d->lock, NULL);
+	d->lru.prev = d->lru.next = &d->lru;
+	d->next = next[0];
+	fs = fuse_fs_new(&digest_oper, sizeof(digest_oper), d);
+	if (!fs)
+		goto out_destroy;
+	return fs;
+
+out_destroy:
+	pthread_mutex_destroy(&d->lock);
+out_free:
+	free(d);
+	return NULL;
+}
+
+FUSE_REGISTER_MODULE(digest, digest_new);
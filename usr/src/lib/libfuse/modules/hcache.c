@@ -0,0 +1,771 @@
+/*
+  fuse hcache module: keep back-end file handles open across opens
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+*/
+
+/*
+ * Opening a file on some back ends is expensive (a remote handle, or
+ * a host open/close), and the kernel opens and releases files far
+ * more often than their contents change.  This module keeps the next
+ * filesystem's handles open after release, in an LRU of idle handles
+ * keyed by path, access mode and the caller's credentials (uid, gid
+ * and groups, from fuse_get_context), and hands them out again to
+ * later opens of the same path by the same caller.  A handle opened
+ * for one caller is never given to another, since the next filesystem
+ * may have checked the caller's access when it opened it.  Truncates
+ * of a path are done through a cached handle where there is one.
+ *
+ * Handles for a path are dropped from the cache (and closed once idle)
+ * when the path is unlinked, renamed over, or renamed, and when it's
+ * created anew.  Opens with flags other than the access mode and
+ * O_TRUNC, or by callers in more than HCACHE_NGROUPS groups, get a
+ * private handle, released as usual.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define HCACHE_HASH_SIZE	251
+#define HCACHE_MAX_DEFAULT	64
+#define HCACHE_NGROUPS		32
+
+/* Open flags that don't stop a handle from being shared */
+#define HCACHE_SHARE_FLAGS	(O_ACCMODE | O_TRUNC | O_NOCTTY | O_LARGEFILE)
+
+/* Who a handle was opened for */
+struct hc_cred {
+	uid_t uid;
+	gid_t gid;
+	int ngroups;
+	gid_t groups[HCACHE_NGROUPS];
+};
+
+struct hc_file {
+	char *path;
+	int accmode;
+	struct hc_cred cred;
+	unsigned refs;
+	int hashed;
+	struct fuse_file_info fi;	/* the next filesystem's handle */
+	struct hc_file *hnext;		/* hash chain */
+	struct hc_file *prev;		/* idle list */
+	struct hc_file *next;
+};
+
+struct hcache {
+	struct fuse_fs *next;
+	pthread_mutex_t lock;
+	unsigned max;			/* idle handles kept open */
+	unsigned nidle;
+	struct hc_file idle;		/* LRU list head, oldest first */
+	struct hc_file *hash[HCACHE_HASH_SIZE];
+};
+
+static struct hcache *hcache_get(void)
+{
+	return fuse_get_context()->private_data;
+}
+
+static struct hc_file *hc_file(struct fuse_file_info *fi)
+{
+	return (struct hc_file *) (uintptr_t) fi->fh;
+}
+
+static unsigned hc_hash(const char *path)
+{
+	unsigned h = 0;
+
+	for (; *path; path++)
+		h = h * 31 + (unsigned char) *path;
+	return h % HCACHE_HASH_SIZE;
+}
+
+static void hc_idle_remove(struct hcache *h, struct hc_file *f)
+{
+	f->prev->next = f->next;
+	f->next->prev = f->prev;
+	f->prev = f->next = NULL;
+	h->nidle--;
+}
+
+static void hc_idle_add(struct hcache *h, struct hc_file *f)
+{
+	f->prev = h->idle.prev;
+	f->next = &h->idle;
+	h->idle.prev->next = f;
+	h->idle.prev = f;
+	h->nidle++;
+}
+
+static void hc_unhash(struct hcache *h, struct hc_file *f)
+{
+	struct hc_file **fp;
+
+	for (fp = &h->hash[hc_hash(f->path)]; *fp != f; fp = &(*fp)->hnext)
+		;
+	*fp = f->hnext;
+	f->hnext = NULL;
+	f->hashed = 0;
+}
+
+/* Close a handle that's no longer in the cache */
+static void hc_close(struct hcache *h, struct hc_file *f)
+{
+	fuse_fs_release(h->next, f->path, &f->fi);
+	free(f->path);
+	free(f);
+}
+
+static void hc_close_list(struct hcache *h, struct hc_file *list)
+{
+	struct hc_file *f;
+
+	while ((f = list) != NULL) {
+		list = f->hnext;
+		hc_close(h, f);
+	}
+}
+
+/*
+ * Get the caller's credentials.  Returns -1 if they don't fit, in
+ * which case nothing opened for this caller may be shared.
+ */
+static int hc_cred_get(struct hc_cred *c)
+{
+	struct fuse_context *ctx = fuse_get_context();
+	int n;
+
+	memset(c, 0, sizeof(*c));
+	c->uid = ctx->uid;
+	c->gid = ctx->gid;
+	n = fuse_getgroups(HCACHE_NGROUPS, c->groups);
+	if (n == -ENOSYS)
+		return 0;
+	if (n < 0 || n > HCACHE_NGROUPS)
+		return -1;
+	c->ngroups = n;
+	return 0;
+}
+
+static int hc_cred_equal(const struct hc_cred *a, const struct hc_cred *b)
+{
+	return a->uid == b->uid && a->gid == b->gid &&
+		a->ngroups == b->ngroups &&
+		memcmp(a->groups, b->groups,
+		       a->ngroups * sizeof(a->groups[0])) == 0;
+}
+
+/*
+ * Get a cached handle for path, access mode and caller, with a
+ * reference.  If "writable", any handle that can write will do.
+ */
+static struct hc_file *hc_lookup(struct hcache *h, const char *path,
+				 const struct hc_cred *cred, int accmode,
+				 int writable)
+{
+	struct hc_file *f;
+
+	pthread_mutex_lock(&h->lock);
+	for (f = h->hash[hc_hash(path)]; f; f = f->hnext) {
+		if (strcmp(f->path, path) != 0 ||
+		    !hc_cred_equal(&f->cred, cred))
+			continue;
+		if (writable ? f->accmode != O_RDONLY : f->accmode == accmode)
+			break;
+	}
+	if (f && f->refs++ == 0)
+		hc_idle_remove(h, f);
+	pthread_mutex_unlock(&h->lock);
+
+	return f;
+}
+
+/*
+ * Drop a reference.  The last reference puts a cached handle on the
+ * idle list, which may push older idle handles out of the cache.
+ */
+static void hc_put(struct hcache *h, struct hc_file *f)
+{
+	struct hc_file *list = NULL, *old;
+
+	pthread_mutex_lock(&h->lock);
+	if (--f->refs == 0) {
+		if (f->hashed) {
+			hc_idle_add(h, f);
+		} else {
+			f->hnext = list;
+			list = f;
+		}
+	}
+	while (h->nidle > h->max) {
+		old = h->idle.next;
+		hc_idle_remove(h, old);
+		hc_unhash(h, old);
+		old->hnext = list;
+		list = old;
+	}
+	pthread_mutex_unlock(&h->lock);
+
+	hc_close_list(h, list);
+}
+
+/*
+ * Take a path (and with "subtree", everything under it) out of the
+ * cache.  Idle handles are closed; busy ones are closed when their
+ * last user releases them.
+ */
+static void hc_invalidate(struct hcache *h, const char *path, int subtree)
+{
+	struct hc_file *list = NULL, *f, **fp;
+	size_t len = strlen(path);
+	unsigned i, first, last;
+
+	if (subtree) {
+		first = 0;
+		last = HCACHE_HASH_SIZE - 1;
+	} else {
+		first = last = hc_hash(path);
+	}
+
+	pthread_mutex_lock(&h->lock);
+	for (i = first; i <= last; i++) {
+		for (fp = &h->hash[i]; (f = *fp) != NULL;) {
+			if (strncmp(f->path, path, len) != 0 ||
+			    (f->path[len] != '\0' &&
+			     (!subtree || f->path[len] != '/'))) {
+				fp = &f->hnext;
+				continue;
+			}
+			*fp = f->hnext;
+			f->hnext = NULL;
+			f->hashed = 0;
+			if (f->refs == 0) {
+				hc_idle_remove(h, f);
+				f->hnext = list;
+				list = f;
+			}
+		}
+	}
+	pthread_mutex_unlock(&h->lock);
+
+	hc_close_list(h, list);
+}
+
+/* Make a cache entry for a handle the next filesystem just opened */
+static int hc_enter(struct hcache *h, const char *path,
+		    struct fuse_file_info *fi, struct hc_file *f,
+		    const struct hc_cred *cred, int share)
+{
+	unsigned i;
+
+	f->path = strdup(path);
+	if (f->path == NULL)
+		return -ENOMEM;
+	f->accmode = fi->flags & O_ACCMODE;
+	f->cred = *cred;
+	f->fi.flags &= ~O_TRUNC;
+	f->refs = 1;
+
+	if (share) {
+		i = hc_hash(path);
+		pthread_mutex_lock(&h->lock);
+		f->hnext = h->hash[i];
+		h->hash[i] = f;
+		f->hashed = 1;
+		pthread_mutex_unlock(&h->lock);
+	}
+
+	fi->fh = (uintptr_t) f;
+	fi->direct_io = f->fi.direct_io;
+	fi->keep_cache = f->fi.keep_cache;
+	fi->nonseekable = f->fi.nonseekable;
+	return 0;
+}
+
+static int hcache_open(const char *path, struct fuse_file_info *fi)
+{
+	struct hcache *h = hcache_get();
+	struct fuse_file_info tmp;
+	struct hc_file *f;
+	struct hc_cred cred;
+	int share = (fi->flags & ~HCACHE_SHARE_FLAGS) == 0;
+	int err;
+
+	if (hc_cred_get(&cred) != 0)
+		share = 0;
+	if (share) {
+		f = hc_lookup(h, path, &cred, fi->flags & O_ACCMODE, 0);
+		if (f) {
+			err = 0;
+			if (fi->flags & O_TRUNC) {
+				tmp = f->fi;
+				err = fuse_fs_ftruncate(h->next, path, 0, &tmp);
+			}
+			if (err) {
+				hc_put(h, f);
+				return err;
+			}
+			fi->fh = (uintptr_t) f;
+			fi->direct_io = f->fi.direct_io;
+			fi->keep_cache = f->fi.keep_cache;
+			fi->nonseekable = f->fi.nonseekable;
+			return 0;
+		}
+	}
+
+	f = calloc(1, sizeof(struct hc_file));
+	if (f == NULL)
+		return -ENOMEM;
+	f->fi = *fi;
+	err = fuse_fs_open(h->next, path, &f->fi);
+	if (!err) {
+		err = hc_enter(h, path, fi, f, &cred, share);
+		if (err)
+			fuse_fs_release(h->next, path, &f->fi);
+	}
+	if (err)
+		free(f);
+	return err;
+}
+
+static int hcache_create(const char *path, mode_t mode,
+			 struct fuse_file_info *fi)
+{
+	struct hcache *h = hcache_get();
+	struct hc_file *f;
+	struct hc_cred cred;
+	int share;
+	int err;
+
+	/* Anything cached for this name is for some earlier file. */
+	hc_invalidate(h, path, 0);
+
+	share = hc_cred_get(&cred) == 0 &&
+		(fi->flags & ~(HCACHE_SHARE_FLAGS | O_CREAT | O_EXCL)) == 0;
+
+	f = calloc(1, sizeof(struct hc_file));
+	if (f == NULL)
+		return -ENOMEM;
+	f->fi = *fi;
+	err = fuse_fs_create(h->next, path, mode, &f->fi);
+	if (!err) {
+		err = hc_enter(h, path, fi, f, &cred, share);
+		if (err)
+			fuse_fs_release(h->next, path, &f->fi);
+	}
+	if (err)
+		free(f);
+	return err;
+}
+
+static int hcache_release(const char *path, struct fuse_file_info *fi)
+{
+	struct hcache *h = hcache_get();
+	(void) path;
+
+	hc_put(h, hc_file(fi));
+	return 0;
+}
+
+static int hcache_read(const char *path, char *buf, size_t size, off_t offset,
+		       struct fuse_file_info *fi)
+{
+	struct hcache *h = hcache_get();
+	struct fuse_file_info tmp = hc_file(fi)->fi;
+
+	return fuse_fs_read(h->next, path, buf, size, offset, &tmp);
+}
+
+static int hcache_write(const char *path, const char *buf, size_t size,
+			off_t offset, struct fuse_file_info *fi)
+{
+	struct hcache *h = hcache_get();
+	struct fuse_file_info tmp = hc_file(fi)->fi;
+
+	return fuse_fs_write(h->next, path, buf, size, offset, &tmp);
+}
+
+static int hcache_flush(const char *path, struct fuse_file_info *fi)
+{
+	struct hcache *h = hcache_get();
+	struct fuse_file_info tmp = hc_file(fi)->fi;
+
+	tmp.lock_owner = fi->lock_owner;
+	return fuse_fs_flush(h->next, path, &tmp);
+}
+
+static int hcache_fsync(const char *path, int isdatasync,
+			struct fuse_file_info *fi)
+{
+	struct hcache *h = hcache_get();
+	struct fuse_file_info tmp = hc_file(fi)->fi;
+
+	return fuse_fs_fsync(h->next, path, isdatasync, &tmp);
+}
+
+static int hcache_fgetattr(const char *path, struct stat *stbuf,
+			   struct fuse_file_info *fi)
+{
+	struct hcache *h = hcache_get();
+	struct fuse_file_info tmp = hc_file(fi)->fi;
+
+	return fuse_fs_fgetattr(h->next, path, stbuf, &tmp);
+}
+
+static int hcache_ftruncate(const char *path, off_t size,
+			    struct fuse_file_info *fi)
+{
+	struct hcache *h = hcache_get();
+	struct fuse_file_info tmp = hc_file(fi)->fi;
+
+	return fuse_fs_ftruncate(h->next, path, size, &tmp);
+}
+
+static int hcache_fallocate(const char *path, int mode, off_t offset,
+			    off_t length, struct fuse_file_info *fi)
+{
+	struct hcache *h = hcache_get();
+	struct fuse_file_info tmp = hc_file(fi)->fi;
+
+	return fuse_fs_fallocate(h->next, path, mode, offset, length, &tmp);
+}
+
+static int hcache_lock(const char *path, struct fuse_file_info *fi, int cmd,
+		       struct flock *lock)
+{
+	struct hcache *h = hcache_get();
+	struct fuse_file_info tmp = hc_file(fi)->fi;
+
+	tmp.lock_owner = fi->lock_owner;
+	return fuse_fs_lock(h->next, path, &tmp, cmd, lock);
+}
+
+static int hcache_truncate(const char *path, off_t size)
+{
+	struct hcache *h = hcache_get();
+	struct fuse_file_info tmp;
+	struct hc_file *f;
+	struct hc_cred cred;
+	int err;
+
+	f = NULL;
+	if (hc_cred_get(&cred) == 0)
+		f = hc_lookup(h, path, &cred, 0, 1);
+	if (f == NULL)
+		return fuse_fs_truncate(h->next, path, size);
+
+	tmp = f->fi;
+	err = fuse_fs_ftruncate(h->next, path, size, &tmp);
+	hc_put(h, f);
+	return err;
+}
+
+static int hcache_unlink(const char *path)
+{
+	struct hcache *h = hcache_get();
+
+	hc_invalidate(h, path, 0);
+	return fuse_fs_unlink(h->next, path);
+}
+
+static int hcache_rename(const char *from, const char *to)
+{
+	struct hcache *h = hcache_get();
+
+	hc_invalidate(h, from, 1);
+	hc_invalidate(h, to, 1);
+	return fuse_fs_rename(h->next, from, to);
+}
+
+static int hcache_rmtree(const char *path)
+{
+	struct hcache *h = hcache_get();
+
+	hc_invalidate(h, path, 1);
+	return fuse_fs_rmtree(h->next, path);
+}
+
+static int hcache_sumtree(const char *path, struct fuse_treesum *sum)
+{
+	return fuse_fs_sumtree(hcache_get()->next, path, sum);
+}
+
+static int hcache_getattr(const char *path, struct stat *stbuf)
+{
+	return fuse_fs_getattr(hcache_get()->next, path, stbuf);
+}
+
+static int hcache_access(const char *path, int mask)
+{
+	return fuse_fs_access(hcache_get()->next, path, mask);
+}
+
+static int hcache_readlink(const char *path, char *buf, size_t size)
+{
+	return fuse_fs_readlink(hcache_get()->next, path, buf, size);
+}
+
+static int hcache_opendir(const char *path, struct fuse_file_info *fi)
+{
+	return fuse_fs_opendir(hcache_get()->next, path, fi);
+}
+
+static int hcache_readdir(const char *path, void *buf,
+			  fuse_fill_dir_t filler, off_t offset,
+			  struct fuse_file_info *fi)
+{
+	return fuse_fs_readdir(hcache_get()->next, path, buf, filler, offset,
+			       fi);
+}
+
+static int hcache_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	return fuse_fs_releasedir(hcache_get()->next, path, fi);
+}
+
+static int hcache_fsyncdir(const char *path, int isdatasync,
+			   struct fuse_file_info *fi)
+{
+	return fuse_fs_fsyncdir(hcache_get()->next, path, isdatasync, fi);
+}
+
+static int hcache_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+	return fuse_fs_mknod(hcache_get()->next, path, mode, rdev);
+}
+
+static int hcache_mkdir(const char *path, mode_t mode)
+{
+	return fuse_fs_mkdir(hcache_get()->next, path, mode);
+}
+
+static int hcache_rmdir(const char *path)
+{
+	return fuse_fs_rmdir(hcache_get()->next, path);
+}
+
+static int hcache_symlink(const char *from, const char *path)
+{
+	return fuse_fs_symlink(hcache_get()->next, from, path);
+}
+
+static int hcache_link(const char *from, const char *to)
+{
+	return fuse_fs_link(hcache_get()->next, from, to);
+}
+
+static int hcache_chmod(const char *path, mode_t mode)
+{
+	return fuse_fs_chmod(hcache_get()->next, path, mode);
+}
+
+static int hcache_chown(const char *path, uid_t uid, gid_t gid)
+{
+	return fuse_fs_chown(hcache_get()->next, path, uid, gid);
+}
+
+static int hcache_utimens(const char *path, const struct timespec ts[2])
+{
+	return fuse_fs_utimens(hcache_get()->next, path, ts);
+}
+
+static int hcache_statfs(const char *path, struct statvfs *stbuf)
+{
+	return fuse_fs_statfs(hcache_get()->next, path, stbuf);
+}
+
+static int hcache_setxattr(const char *path, const char *name,
+			   const char *value, size_t size, int flags)
+{
+	return fuse_fs_setxattr(hcache_get()->next, path, name, value, size,
+				flags);
+}
+
+static int hcache_getxattr(const char *path, const char *name, char *value,
+			   size_t size)
+{
+	return fuse_fs_getxattr(hcache_get()->next, path, name, value, size);
+}
+
+static int hcache_listxattr(const char *path, char *list, size_t size)
+{
+	return fuse_fs_listxattr(hcache_get()->next, path, list, size);
+}
+
+static int hcache_removexattr(const char *path, const char *name)
+{
+	return fuse_fs_removexattr(hcache_get()->next, path, name);
+}
+
+static int hcache_bmap(const char *path, size_t blocksize, uint64_t *idx)
+{
+	return fuse_fs_bmap(hcache_get()->next, path, blocksize, idx);
+}
+
+static int hcache_ioctl(const char *path, int cmd, void *arg,
+			struct fuse_file_info *fi, unsigned int flags,
+			void *data)
+{
+	struct hcache *h = hcache_get();
+	struct fuse_file_info tmp = hc_file(fi)->fi;
+
+	return fuse_fs_ioctl(h->next, path, cmd, arg, &tmp, flags, data);
+}
+
+static int hcache_poll(const char *path, struct fuse_file_info *fi,
+		       struct fuse_pollhandle *ph, unsigned *reventsp)
+{
+	struct hcache *h = hcache_get();
+	struct fuse_file_info tmp = hc_file(fi)->fi;
+
+	return fuse_fs_poll(h->next, path, &tmp, ph, reventsp);
+}
+
+static void *hcache_init(struct fuse_conn_info *conn)
+{
+	struct hcache *h = hcache_get();
+	fuse_fs_init(h->next, conn);
+	return h;
+}
+
+static void hcache_destroy(void *data)
+{
+	struct hcache *h = data;
+	struct hc_file *list = NULL, *f;
+	unsigned i;
+
+	/* Everything is released by now, so all of it is idle. */
+	for (i = 0; i < HCACHE_HASH_SIZE; i++) {
+		while ((f = h->hash[i]) != NULL) {
+			h->hash[i] = f->hnext;
+			f->hnext = list;
+			list = f;
+		}
+	}
+	hc_close_list(h, list);
+
+	fuse_fs_destroy(h->next);
+	pthread_mutex_destroy(&h->lock);
+	free(h);
+}
+
+static struct fuse_operations hcache_oper = {
+	.destroy	= hcache_destroy,
+	.init		= hcache_init,
+	.getattr	= hcache_getattr,
+	.fgetattr	= hcache_fgetattr,
+	.access		= hcache_access,
+	.readlink	= hcache_readlink,
+	.opendir	= hcache_opendir,
+	.readdir	= hcache_readdir,
+	.releasedir	= hcache_releasedir,
+	.mknod		= hcache_mknod,
+	.mkdir		= hcache_mkdir,
+	.symlink	= hcache_symlink,
+	.unlink		= hcache_unlink,
+	.rmdir		= hcache_rmdir,
+	.rename		= hcache_rename,
+	.link		= hcache_link,
+	.chmod		= hcache_chmod,
+	.chown		= hcache_chown,
+	.truncate	= hcache_truncate,
+	.ftruncate	= hcache_ftruncate,
+	.utimens	= hcache_utimens,
+	.create		= hcache_create,
+	.open		= hcache_open,
+	.read		= hcache_read,
+	.write		= hcache_write,
+	.statfs		= hcache_statfs,
+	.flush		= hcache_flush,
+	.release	= hcache_release,
+	.fsync		= hcache_fsync,
+	.fsyncdir	= hcache_fsyncdir,
+	.setxattr	= hcache_setxattr,
+	.getxattr	= hcache_getxattr,
+	.listxattr	= hcache_listxattr,
+	.removexattr	= hcache_removexattr,
+	.lock		= hcache_lock,
+	.bmap		= hcache_bmap,
+	.ioctl		= hcache_ioctl,
+	.poll		= hcache_poll,
+	.fallocate	= hcache_fallocate,
+	.rmtree		= hcache_rmtree,
+	.sumtree	= hcache_sumtree,
+};
+
+static struct fuse_opt hcache_opts[] = {
+	FUSE_OPT_KEY("-h", 0),
+	FUSE_OPT_KEY("--help", 0),
+	{ "hcache_max=%u", offsetof(struct hcache, max), 0 },
+	FUSE_OPT_END
+};
+
+static void hcache_help(void)
+{
+	fprintf(stderr,
+"    -o hcache_max=N        idle back-end file handles kept open (%u)\n",
+		HCACHE_MAX_DEFAULT);
+}
+
+static int hcache_opt_proc(void *data, const char *arg, int key,
+			   struct fuse_args *outargs)
+{
+	(void) data; (void) arg; (void) outargs;
+
+	if (!key) {
+		hcache_help();
+		return -1;
+	}
+
+	return 1;
+}
+
+static struct fuse_fs *hcache_new(struct fuse_args *args,
+				  struct fuse_fs *next[])
+{
+	struct fuse_fs *fs;
+	struct hcache *h;
+
+	h = calloc(1, sizeof(struct hcache));
+	if (h == NULL) {
+		fprintf(stderr, "fuse-hcache: memory allocation failed\n");
+		return NULL;
+	}
+
+	h->max = HCACHE_MAX_DEFAULT;
+	if (fuse_opt_parse(args, h, hcache_opts, hcache_opt_proc) == -1)
+		goto out_free;
+
+	if (!next[0] || next[1]) {
+		fprintf(stderr, "fuse-hcache: exactly one next filesystem required\n");
+		goto out_free;
+	}
+
+	pthread_mutex_init(&h->lock, NULL);
+	h->idle.prev = h->idle.next = &h->idle;
+	h->next = next[0];
+	fs = fuse_fs_new(&hcache_oper, sizeof(hcache_oper), h);
+	if (!fs)
+		goto out_destroy;
+	return fs;
+
+out_destroy:
+	pthread_mutex_destroy(&h->lock);
+out_free:
+	free(h);
+	return NULL;
+}
+
+FUSE_REGISTER_MODULE(hcache, hcache_new);
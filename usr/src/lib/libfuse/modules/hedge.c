@@ -0,0 +1,869 @@
+/*
+  fuse hedge module: hedged requests for idempotent operations
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+*/
+
+/*
+ * Remote back ends have long latency tails, and the kernel's caller
+ * waits out every slow call.  For getattr, readlink, read and readdir,
+ * which can safely be done twice, this module runs the call on one of
+ * its worker threads and waits.  If no answer has come within the
+ * hedge threshold, it makes the same call again on another worker
+ * and takes whichever answer comes first.  The other one is thrown
+ * away when it finishes.  Calls that could not be hedged anyway (too
+ * few samples, no budget left, or no free worker) are made inline,
+ * with no thread handoff or copy.  The first try can't be inline
+ * when a hedge may follow: the reply has to come from the calling
+ * thread, which would be stuck in the slow call.
+ *
+ * The threshold is a percentile (hedge_pct) of recent latencies for
+ * the operation, kept in a decaying log2 histogram.  Hedged calls are
+ * limited to hedge_budget percent of calls, so the extra load on the
+ * back end stays small.  No hedging is done until an operation has
+ * enough samples, nor when all workers are busy.
+ *
+ * The next filesystem must allow the same call to be in progress
+ * twice at once, including read and readdir on the same handle.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#define HEDGE_THREADS_DEFAULT	16
+#define HEDGE_PCT_DEFAULT	95
+#define HEDGE_BUDGET_DEFAULT	5	/* percent of calls */
+#define HEDGE_MIN_US_DEFAULT	1000
+#define HEDGE_MIN_SAMPLES	64
+#define HEDGE_DECAY_SAMPLES	4096
+#define HEDGE_NBUCKET		32	/* log2 of microseconds */
+#define HEDGE_READDIR_MAX	1024	/* entries buffered per call */
+
+enum hedge_op {
+	HEDGE_GETATTR,
+	HEDGE_READLINK,
+	HEDGE_READ,
+	HEDGE_READDIR,
+	HEDGE_NOPS
+};
+
+/* Latencies seen for one operation */
+struct hedge_stat {
+	unsigned count[HEDGE_NBUCKET];
+	unsigned total;
+};
+
+struct hedge_dirent {
+	struct hedge_dirent *next;
+	struct stat st;
+	int has_st;
+	off_t off;
+	char name[];
+};
+
+struct hedge_req;
+
+/* One attempt at a request */
+struct hedge_try {
+	struct hedge_req *req;
+	struct hedge_try *next;		/* work queue */
+	struct timespec start;
+	int res;
+	char *buf;			/* read, readlink */
+	struct stat st;			/* getattr */
+	struct hedge_dirent *dents;	/* readdir */
+	struct hedge_dirent **dtail;
+	unsigned ndents;
+};
+
+struct hedge_req {
+	enum hedge_op op;
+	struct fuse_context ctx;
+	char *path;
+	size_t size;
+	off_t offset;
+	struct fuse_file_info fi;
+	unsigned refs;			/* caller + tries in progress */
+	struct hedge_try *win;
+	pthread_cond_t cond;
+};
+
+struct hedge {
+	struct fuse_fs *next;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t idle;		/* ntries went to zero */
+	struct hedge_try *head;
+	struct hedge_try **tail;
+	int stop;
+	unsigned nthreads;
+	unsigned nfree;			/* idle workers not yet given work */
+	unsigned ntries;		/* tries queued or running */
+	pthread_t *threads;
+	unsigned pct;
+	unsigned budget;
+	unsigned min_us;
+	unsigned credit;		/* hundredths of a hedged call */
+	struct hedge_stat stat[HEDGE_NOPS];
+};
+
+static struct hedge *hedge_get(void)
+{
+	return fuse_get_context()->private_data;
+}
+
+static unsigned hedge_elapsed_us(const struct timespec *start)
+{
+	struct timespec now;
+	long long us;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (now.tv_sec - start->tv_sec) * 1000000LL +
+		(now.tv_nsec - start->tv_nsec) / 1000;
+	return us < 0 ? 0 : us > 0xffffffffLL ? 0xffffffffU : us;
+}
+
+static void hedge_record(struct hedge *h, enum hedge_op op, unsigned us)
+{
+	struct hedge_stat *s = &h->stat[op];
+	unsigned b, i;
+
+	for (b = 0; b < HEDGE_NBUCKET - 1 && (us >> b) > 1; b++)
+		;
+	s->count[b]++;
+	if (++s->total >= HEDGE_DECAY_SAMPLES) {
+		s->total = 0;
+		for (i = 0; i < HEDGE_NBUCKET; i++) {
+			s->count[i] /= 2;
+			s->total += s->count[i];
+		}
+	}
+}
+
+/*
+ * The delay before hedging an operation, in microseconds,
+ * or zero if it shouldn't be hedged (yet).
+ */
+static unsigned hedge_threshold(struct hedge *h, enum hedge_op op)
+{
+	struct hedge_stat *s = &h->stat[op];
+	unsigned long long want, sum = 0;
+	unsigned b;
+
+	if (s->total < HEDGE_MIN_SAMPLES)
+		return 0;
+	want = (unsigned long long) s->total * h->pct / 100;
+	for (b = 0; b < HEDGE_NBUCKET - 1; b++) {
+		sum += s->count[b];
+		if (sum >= want)
+			break;
+	}
+	/* The top of the bucket */
+	return b >= 31 ? 0 : (2U << b) > h->min_us ? 2U << b : h->min_us;
+}
+
+static int hedge_fill(void *buf, const char *name, const struct stat *stbuf,
+		      off_t off)
+{
+	struct hedge_try *t = buf;
+	struct hedge_dirent *de;
+
+	de = malloc(sizeof(struct hedge_dirent) + strlen(name) + 1);
+	if (de == NULL)
+		return 1;
+	de->next = NULL;
+	de->has_st = stbuf != NULL;
+	if (stbuf)
+		de->st = *stbuf;
+	de->off = off;
+	strcpy(de->name, name);
+	*t->dtail = de;
+	t->dtail = &de->next;
+
+	/*
+	 * With offsets, the caller will come back for the rest.
+	 * Without them, all entries are wanted in one call.
+	 */
+	return off != 0 && ++t->ndents >= HEDGE_READDIR_MAX;
+}
+
+static void hedge_try_free(struct hedge_try *t)
+{
+	struct hedge_dirent *de;
+
+	while ((de = t->dents) != NULL) {
+		t->dents = de->next;
+		free(de);
+	}
+	free(t->buf);
+	free(t);
+}
+
+static void hedge_req_rele(struct hedge_req *r)
+{
+	if (--r->refs != 0)
+		return;
+	pthread_cond_destroy(&r->cond);
+	free(r->path);
+	free(r);
+}
+
+static void hedge_run(struct hedge *h, struct hedge_try *t)
+{
+	struct hedge_req *r = t->req;
+	struct fuse_file_info fi = r->fi;
+
+	switch (r->op) {
+	case HEDGE_GETATTR:
+		t->res = fuse_fs_getattr(h->next, r->path, &t->st);
+		break;
+	case HEDGE_READLINK:
+		t->res = fuse_fs_readlink(h->next, r->path, t->buf, r->size);
+		break;
+	case HEDGE_READ:
+		t->res = fuse_fs_read(h->next, r->path, t->buf, r->size,
+				      r->offset, &fi);
+		break;
+	case HEDGE_READDIR:
+		t->dtail = &t->dents;
+		t->res = fuse_fs_readdir(h->next, r->path, t, hedge_fill,
+					 r->offset, &fi);
+		break;
+	default:
+		t->res = -ENOSYS;
+		break;
+	}
+}
+
+/* Called with the lock held.  The first answer wins. */
+static void hedge_done(struct hedge *h, struct hedge_try *t)
+{
+	struct hedge_req *r = t->req;
+
+	hedge_record(h, r->op, hedge_elapsed_us(&t->start));
+	if (r->win == NULL) {
+		r->win = t;
+		pthread_cond_signal(&r->cond);
+	} else {
+		hedge_try_free(t);
+	}
+	hedge_req_rele(r);
+}
+
+static void *hedge_worker(void *arg)
+{
+	struct hedge *h = arg;
+	struct hedge_try *t;
+
+	pthread_mutex_lock(&h->lock);
+	for (;;) {
+		while (h->head == NULL && !h->stop)
+			pthread_cond_wait(&h->work, &h->lock);
+		/* Run what's queued before stopping. */
+		if (h->head == NULL)
+			break;
+		t = h->head;
+		h->head = t->next;
+		if (h->head == NULL)
+			h->tail = &h->head;
+		pthread_mutex_unlock(&h->lock);
+
+		*fuse_get_context() = t->req->ctx;
+		hedge_run(h, t);
+
+		pthread_mutex_lock(&h->lock);
+		hedge_done(h, t);
+		h->nfree++;
+		if (--h->ntries == 0)
+			pthread_cond_broadcast(&h->idle);
+	}
+	pthread_mutex_unlock(&h->lock);
+	return NULL;
+}
+
+/* Give a try to a worker, if one is free.  Called with the lock held. */
+static struct hedge_try *hedge_submit(struct hedge *h, struct hedge_req *r)
+{
+	struct hedge_try *t;
+
+	if (h->nfree == 0)
+		return NULL;
+	t = calloc(1, sizeof(struct hedge_try));
+	if (t == NULL)
+		return NULL;
+	if (r->op == HEDGE_READ || r->op == HEDGE_READLINK) {
+		t->buf = malloc(r->size);
+		if (t->buf == NULL) {
+			free(t);
+			return NULL;
+		}
+	}
+	t->req = r;
+	clock_gettime(CLOCK_MONOTONIC, &t->start);
+	r->refs++;
+	h->nfree--;
+	h->ntries++;
+	t->next = NULL;
+	*h->tail = t;
+	h->tail = &t->next;
+	pthread_cond_signal(&h->work);
+	return t;
+}
+
+/* Record how long a call made inline took */
+static void hedge_inline_done(struct hedge *h, enum hedge_op op,
+			      const struct timespec *start)
+{
+	unsigned us = hedge_elapsed_us(start);
+
+	pthread_mutex_lock(&h->lock);
+	hedge_record(h, op, us);
+	pthread_mutex_unlock(&h->lock);
+}
+
+/*
+ * Make the call on a worker, hedging it if it's slow.
+ * Returns NULL if it's to be done inline instead, in which
+ * case "start" is set for hedge_inline_done.
+ */
+static struct hedge_try *hedge_call(struct hedge *h, enum hedge_op op,
+				    const char *path, size_t size,
+				    off_t offset, struct fuse_file_info *fi,
+				    struct timespec *start)
+{
+	struct hedge_req *r;
+	struct hedge_try *t;
+	struct timespec ts;
+	unsigned us;
+
+	clock_gettime(CLOCK_MONOTONIC, start);
+	if (h->nthreads == 0)
+		return NULL;
+
+	pthread_mutex_lock(&h->lock);
+	if (h->credit < 100 * 10)
+		h->credit += h->budget;
+	us = hedge_threshold(h, op);
+	if (us == 0 || h->credit < 100 || h->nfree == 0) {
+		pthread_mutex_unlock(&h->lock);
+		return NULL;
+	}
+	pthread_mutex_unlock(&h->lock);
+
+	r = calloc(1, sizeof(struct hedge_req));
+	if (r == NULL)
+		return NULL;
+	if (path && (r->path = strdup(path)) == NULL) {
+		free(r);
+		return NULL;
+	}
+	r->op = op;
+	r->ctx = *fuse_get_context();
+	r->size = size;
+	r->offset = offset;
+	if (fi)
+		r->fi = *fi;
+	r->refs = 1;
+	pthread_cond_init(&r->cond, NULL);
+
+	pthread_mutex_lock(&h->lock);
+	if (hedge_submit(h, r) == NULL) {
+		hedge_req_rele(r);
+		pthread_mutex_unlock(&h->lock);
+		clock_gettime(CLOCK_MONOTONIC, start);
+		return NULL;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += us / 1000000;
+	ts.tv_nsec += (us % 1000000) * 1000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	while (r->win == NULL &&
+	       pthread_cond_timedwait(&r->cond, &h->lock, &ts) == 0)
+		;
+	if (r->win == NULL && h->credit >= 100 &&
+	    hedge_submit(h, r) != NULL)
+		h->credit -= 100;
+	while (r->win == NULL)
+		pthread_cond_wait(&r->cond, &h->lock);
+	t = r->win;
+	hedge_req_rele(r);
+	pthread_mutex_unlock(&h->lock);
+
+	return t;
+}
+
+static int hedge_getattr(const char *path, struct stat *stbuf)
+{
+	struct hedge *h = hedge_get();
+	struct hedge_try *t;
+	struct timespec start;
+	int res;
+
+	t = hedge_call(h, HEDGE_GETATTR, path, 0, 0, NULL, &start);
+	if (t == NULL) {
+		res = fuse_fs_getattr(h->next, path, stbuf);
+		hedge_inline_done(h, HEDGE_GETATTR, &start);
+		return res;
+	}
+	res = t->res;
+	if (res == 0)
+		*stbuf = t->st;
+	hedge_try_free(t);
+	return res;
+}
+
+static int hedge_readlink(const char *path, char *buf, size_t size)
+{
+	struct hedge *h = hedge_get();
+	struct hedge_try *t;
+	struct timespec start;
+	int res;
+
+	t = hedge_call(h, HEDGE_READLINK, path, size, 0, NULL, &start);
+	if (t == NULL) {
+		res = fuse_fs_readlink(h->next, path, buf, size);
+		hedge_inline_done(h, HEDGE_READLINK, &start);
+		return res;
+	}
+	res = t->res;
+	if (res == 0 && size > 0)
+		memcpy(buf, t->buf, size);
+	hedge_try_free(t);
+	return res;
+}
+
+static int hedge_read(const char *path, char *buf, size_t size, off_t offset,
+		      struct fuse_file_info *fi)
+{
+	struct hedge *h = hedge_get();
+	struct hedge_try *t;
+	struct timespec start;
+	int res;
+
+	t = hedge_call(h, HEDGE_READ, path, size, offset, fi, &start);
+	if (t == NULL) {
+		res = fuse_fs_read(h->next, path, buf, size, offset, fi);
+		hedge_inline_done(h, HEDGE_READ, &start);
+		return res;
+	}
+	res = t->res;
+	if (res > 0)
+		memcpy(buf, t->buf, res);
+	hedge_try_free(t);
+	return res;
+}
+
+static int hedge_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	struct hedge *h = hedge_get();
+	struct hedge_dirent *de;
+	struct hedge_try *t;
+	struct timespec start;
+	int res;
+
+	t = hedge_call(h, HEDGE_READDIR, path, 0, offset, fi, &start);
+	if (t == NULL) {
+		res = fuse_fs_readdir(h->next, path, buf, filler, offset, fi);
+		hedge_inline_done(h, HEDGE_READDIR, &start);
+		return res;
+	}
+	res = t->res;
+	for (de = t->dents; res == 0 && de; de = de->next) {
+		if (filler(buf, de->name, de->has_st ? &de->st : NULL,
+			   de->off))
+			break;
+	}
+	hedge_try_free(t);
+	return res;
+}
+
+static int hedge_fgetattr(const char *path, struct stat *stbuf,
+			  struct fuse_file_info *fi)
+{
+	return fuse_fs_fgetattr(hedge_get()->next, path, stbuf, fi);
+}
+
+static int hedge_access(const char *path, int mask)
+{
+	return fuse_fs_access(hedge_get()->next, path, mask);
+}
+
+static int hedge_opendir(const char *path, struct fuse_file_info *fi)
+{
+	return fuse_fs_opendir(hedge_get()->next, path, fi);
+}
+
+static int hedge_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	return fuse_fs_releasedir(hedge_get()->next, path, fi);
+}
+
+static int hedge_fsyncdir(const char *path, int isdatasync,
+			  struct fuse_file_info *fi)
+{
+	return fuse_fs_fsyncdir(hedge_get()->next, path, isdatasync, fi);
+}
+
+static int hedge_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+	return fuse_fs_mknod(hedge_get()->next, path, mode, rdev);
+}
+
+static int hedge_mkdir(const char *path, mode_t mode)
+{
+	return fuse_fs_mkdir(hedge_get()->next, path, mode);
+}
+
+static int hedge_unlink(const char *path)
+{
+	return fuse_fs_unlink(hedge_get()->next, path);
+}
+
+static int hedge_rmdir(const char *path)
+{
+	return fuse_fs_rmdir(hedge_get()->next, path);
+}
+
+static int hedge_rmtree(const char *path)
+{
+	return fuse_fs_rmtree(hedge_get()->next, path);
+}
+
+static int hedge_sumtree(const char *path, struct fuse_treesum *sum)
+{
+	return fuse_fs_sumtree(hedge_get()->next, path, sum);
+}
+
+static int hedge_symlink(const char *from, const char *path)
+{
+	return fuse_fs_symlink(hedge_get()->next, from, path);
+}
+
+static int hedge_rename(const char *from, const char *to)
+{
+	return fuse_fs_rename(hedge_get()->next, from, to);
+}
+
+static int hedge_link(const char *from, const char *to)
+{
+	return fuse_fs_link(hedge_get()->next, from, to);
+}
+
+static int hedge_chmod(const char *path, mode_t mode)
+{
+	return fuse_fs_chmod(hedge_get()->next, path, mode);
+}
+
+static int hedge_chown(const char *path, uid_t uid, gid_t gid)
+{
+	return fuse_fs_chown(hedge_get()->next, path, uid, gid);
+}
+
+static int hedge_truncate(const char *path, off_t size)
+{
+	return fuse_fs_truncate(hedge_get()->next, path, size);
+}
+
+static int hedge_ftruncate(const char *path, off_t size,
+			   struct fuse_file_info *fi)
+{
+	return fuse_fs_ftruncate(hedge_get()->next, path, size, fi);
+}
+
+static int hedge_fallocate(const char *path, int mode, off_t offset,
+			   off_t length, struct fuse_file_info *fi)
+{
+	return fuse_fs_fallocate(hedge_get()->next, path, mode, offset,
+				 length, fi);
+}
+
+static int hedge_utimens(const char *path, const struct timespec ts[2])
+{
+	return fuse_fs_utimens(hedge_get()->next, path, ts);
+}
+
+static int hedge_create(const char *path, mode_t mode,
+			struct fuse_file_info *fi)
+{
+	return fuse_fs_create(hedge_get()->next, path, mode, fi);
+}
+
+static int hedge_open(const char *path, struct fuse_file_info *fi)
+{
+	return fuse_fs_open(hedge_get()->next, path, fi);
+}
+
+static int hedge_write(const char *path, const char *buf, size_t size,
+		       off_t offset, struct fuse_file_info *fi)
+{
+	return fuse_fs_write(hedge_get()->next, path, buf, size, offset, fi);
+}
+
+static int hedge_statfs(const char *path, struct statvfs *stbuf)
+{
+	return fuse_fs_statfs(hedge_get()->next, path, stbuf);
+}
+
+static int hedge_flush(const char *path, struct fuse_file_info *fi)
+{
+	return fuse_fs_flush(hedge_get()->next, path, fi);
+}
+
+static int hedge_release(const char *path, struct fuse_file_info *fi)
+{
+	return fuse_fs_release(hedge_get()->next, path, fi);
+}
+
+static int hedge_fsync(const char *path, int isdatasync,
+		       struct fuse_file_info *fi)
+{
+	return fuse_fs_fsync(hedge_get()->next, path, isdatasync, fi);
+}
+
+static int hedge_setxattr(const char *path, const char *name,
+			  const char *value, size_t size, int flags)
+{
+	return fuse_fs_setxattr(hedge_get()->next, path, name, value, size,
+				flags);
+}
+
+static int hedge_getxattr(const char *path, const char *name, char *value,
+			  size_t size)
+{
+	return fuse_fs_getxattr(hedge_get()->next, path, name, value, size);
+}
+
+static int hedge_listxattr(const char *path, char *list, size_t size)
+{
+	return fuse_fs_listxattr(hedge_get()->next, path, list, size);
+}
+
+static int hedge_removexattr(const char *path, const char *name)
+{
+	return fuse_fs_removexattr(hedge_get()->next, path, name);
+}
+
+static int hedge_lock(const char *path, struct fuse_file_info *fi, int cmd,
+		      struct flock *lock)
+{
+	return fuse_fs_lock(hedge_get()->next, path, fi, cmd, lock);
+}
+
+static int hedge_bmap(const char *path, size_t blocksize, uint64_t *idx)
+{
+	return fuse_fs_bmap(hedge_get()->next, path, blocksize, idx);
+}
+
+static int hedge_ioctl(const char *path, int cmd, void *arg,
+		       struct fuse_file_info *fi, unsigned int flags,
+		       void *data)
+{
+	return fuse_fs_ioctl(hedge_get()->next, path, cmd, arg, fi, flags,
+			     data);
+}
+
+static int hedge_poll(const char *path, struct fuse_file_info *fi,
+		      struct fuse_pollhandle *ph, unsigned *reventsp)
+{
+	return fuse_fs_poll(hedge_get()->next, path, fi, ph, reventsp);
+}
+
+/*
+ * Start the workers here rather than in hedge_new, which runs
+ * before the daemon forks into the background.
+ */
+static void *hedge_init(struct fuse_conn_info *conn)
+{
+	struct hedge *h = hedge_get();
+	unsigned i;
+
+	fuse_fs_init(h->next, conn);
+
+	h->threads = calloc(h->nthreads, sizeof(pthread_t));
+	if (h->threads == NULL) {
+		fprintf(stderr, "fuse-hedge: memory allocation failed\n");
+		h->nthreads = 0;
+		return h;
+	}
+	for (i = 0; i < h->nthreads; i++) {
+		if (pthread_create(&h->threads[i], NULL, hedge_worker, h))
+			break;
+	}
+	if (i < h->nthreads)
+		fprintf(stderr, "fuse-hedge: started only %u threads\n", i);
+	pthread_mutex_lock(&h->lock);
+	h->nthreads = h->nfree = i;
+	pthread_mutex_unlock(&h->lock);
+	return h;
+}
+
+static void hedge_destroy(void *data)
+{
+	struct hedge *h = data;
+	unsigned i;
+
+	/*
+	 * Wait for tries still in progress, including losers nobody
+	 * is waiting for, so they're freed before the next filesystem
+	 * goes away.  Then stop the workers.
+	 */
+	pthread_mutex_lock(&h->lock);
+	while (h->ntries != 0)
+		pthread_cond_wait(&h->idle, &h->lock);
+	h->stop = 1;
+	pthread_cond_broadcast(&h->work);
+	pthread_mutex_unlock(&h->lock);
+	for (i = 0; i < h->nthreads; i++)
+		pthread_join(h->threads[i], NULL);
+	free(h->threads);
+
+	fuse_fs_destroy(h->next);
+	pthread_cond_destroy(&h->idle);
+	pthread_cond_destroy(&h->work);
+	pthread_mutex_destroy(&h->lock);
+	free(h);
+}
+
+static struct fuse_operations hedge_oper = {
+	.destroy	= hedge_destroy,
+	.init		= hedge_init,
+	.getattr	= hedge_getattr,
+	.fgetattr	= hedge_fgetattr,
+	.access		= hedge_access,
+	.readlink	= hedge_readlink,
+	.opendir	= hedge_opendir,
+	.readdir	= hedge_readdir,
+	.releasedir	= hedge_releasedir,
+	.mknod		= hedge_mknod,
+	.mkdir		= hedge_mkdir,
+	.symlink	= hedge_symlink,
+	.unlink		= hedge_unlink,
+	.rmdir		= hedge_rmdir,
+	.rename		= hedge_rename,
+	.link		= hedge_link,
+	.chmod		= hedge_chmod,
+	.chown		= hedge_chown,
+	.truncate	= hedge_truncate,
+	.ftruncate	= hedge_ftruncate,
+	.utimens	= hedge_utimens,
+	.create		= hedge_create,
+	.open		= hedge_open,
+	.read		= hedge_read,
+	.write		= hedge_write,
+	.statfs		= hedge_statfs,
+	.flush		= hedge_flush,
+	.release	= hedge_release,
+	.fsync		= hedge_fsync,
+	.fsyncdir	= hedge_fsyncdir,
+	.setxattr	= hedge_setxattr,
+	.getxattr	= hedge_getxattr,
+	.listxattr	= hedge_listxattr,
+	.removexattr	= hedge_removexattr,
+	.lock		= hedge_lock,
+	.bmap		= hedge_bmap,
+	.ioctl		= hedge_ioctl,
+	.poll		= hedge_poll,
+	.fallocate	= hedge_fallocate,
+	.rmtree		= hedge_rmtree,
+	.sumtree	= hedge_sumtree,
+};
+
+static struct fuse_opt hedge_opts[] = {
+	FUSE_OPT_KEY("-h", 0),
+	FUSE_OPT_KEY("--help", 0),
+	{ "hedge_threads=%u", offsetof(struct hedge, nthreads), 0 },
+	{ "hedge_pct=%u", offsetof(struct hedge, pct), 0 },
+	{ "hedge_budget=%u", offsetof(struct hedge, budget), 0 },
+	{ "hedge_min_us=%u", offsetof(struct hedge, min_us), 0 },
+	FUSE_OPT_END
+};
+
+static void hedge_help(void)
+{
+	fprintf(stderr,
+"    -o hedge_threads=N     worker threads (%u)\n"
+"    -o hedge_pct=N         hedge calls slower than this percentile (%u)\n"
+"    -o hedge_budget=N      max percent of calls hedged (%u)\n"
+"    -o hedge_min_us=N      never hedge sooner than this (%u)\n",
+		HEDGE_THREADS_DEFAULT, HEDGE_PCT_DEFAULT,
+		HEDGE_BUDGET_DEFAULT, HEDGE_MIN_US_DEFAULT);
+}
+
+static int hedge_opt_proc(void *data, const char *arg, int key,
+			  struct fuse_args *outargs)
+{
+	(void) data; (void) arg; (void) outargs;
+
+	if (!key) {
+		hedge_help();
+		return -1;
+	}
+
+	return 1;
+}
+
+static struct fuse_fs *hedge_new(struct fuse_args *args,
+				 struct fuse_fs *next[])
+{
+	struct fuse_fs *fs;
+	struct hedge *h;
+
+	h = calloc(1, sizeof(struct hedge));
+	if (h == NULL) {
+		fprintf(stderr, "fuse-hedge: memory allocation failed\n");
+		return NULL;
+	}
+
+	h->nthreads = HEDGE_THREADS_DEFAULT;
+	h->pct = HEDGE_PCT_DEFAULT;
+	h->budget = HEDGE_BUDGET_DEFAULT;
+	h->min_us = HEDGE_MIN_US_DEFAULT;
+	if (fuse_opt_parse(args, h, hedge_opts, hedge_opt_proc) == -1)
+		goto out_free;
+
+	if (!next[0] || next[1]) {
+		fprintf(stderr, "fuse-hedge: exactly one next filesystem required\n");
+		goto out_free;
+	}
+
+	if (h->pct == 0 || h->pct >= 100) {
+		fprintf(stderr, "fuse-hedge: hedge_pct must be 1..99\n");
+		goto out_free;
+	}
+	if (h->budget > 100)
+		h->budget = 100;
+
+	pthread_mutex_init(&h->lock, NULL);
+	pthread_cond_init(&h->work, NULL);
+	pthread_cond_init(&h->idle, NULL);
+	h->tail = &h->head;
+	h->next = next[0];
+	fs = fuse_fs_new(&hedge_oper, sizeof(hedge_oper), h);
+	if (!fs)
+		goto out_destroy;
+	return fs;
+
+out_destroy:
+	pthread_cond_destroy(&h->idle);
+	pthread_cond_destroy(&h->work);
+	pthread_mutex_destroy(&h->lock);
+out_free:
+	free(h);
+	return NULL;
+}
+
+FUSE_REGISTER_MODULE(hedge, hedge_new);
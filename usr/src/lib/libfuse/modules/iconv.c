@@ -260,6 +260,30 @@ static int iconv_rmdir(const char *path)
 	return err;
 }
 
+static int iconv_rmtree(const char *path)
+{
+	struct iconv *ic = iconv_get();
+	char *newpath;
+	int err = iconv_convpath(ic, path, &newpath, 0);
+	if (!err) {
+		err = fuse_fs_rmtree(ic->next, newpath);
+		free(newpath);
+	}
+	return err;
+}
+
+static int iconv_sumtree(const char *path, struct fuse_treesum *sum)
+{
+	struct iconv *ic = iconv_get();
+	char *newpath;
+	int err = iconv_convpath(ic, path, &newpath, 0);
+	if (!err) {
+		err = fuse_fs_sumtree(ic->next, newpath, sum);
+		free(newpath);
+	}
+	return err;
+}
+
 static int iconv_symlink(const char *from, const char *to)
 {
 	struct iconv *ic = iconv_get();
@@ -360,6 +384,20 @@ static int iconv_ftruncate(const char *path, off_t size,
 	return err;
 }
 
+static int iconv_fallocate(const char *path, int mode, off_t offset,
+			   off_t length, struct fuse_file_info *fi)
+{
+	struct iconv *ic = iconv_get();
+	char *newpath;
+	int err = iconv_convpath(ic, path, &newpath, 0);
+	if (!err) {
+		err = fuse_fs_fallocate(ic->next, newpath, mode, offset,
+					length, fi);
+		free(newpath);
+	}
+	return err;
+}
+
 static int iconv_utimens(const char *path, const struct timespec ts[2])
 {
 	struct iconv *ic = iconv_get();
@@ -561,6 +599,34 @@ static int iconv_bmap(const char *path, size_t blocksize, uint64_t *idx)
 	return err;
 }
 
+static int iconv_ioctl(const char *path, int cmd, void *arg,
+		       struct fuse_file_info *fi, unsigned int flags,
+		       void *data)
+{
+	struct iconv *ic = iconv_get();
+	char *newpath;
+	int err = iconv_convpath(ic, path, &newpath, 0);
+	if (!err) {
+		err = fuse_fs_ioctl(ic->next, newpath, cmd, arg, fi, flags,
+				    data);
+		free(newpath);
+	}
+	return err;
+}
+
+static int iconv_poll(const char *path, struct fuse_file_info *fi,
+		      struct fuse_pollhandle *ph, unsigned *reventsp)
+{
+	struct iconv *ic = iconv_get();
+	char *newpath;
+	int err = iconv_convpath(ic, path, &newpath, 0);
+	if (!err) {
+		err = fuse_fs_poll(ic->next, newpath, fi, ph, reventsp);
+		free(newpath);
+	}
+	return err;
+}
+
 static void *iconv_init(struct fuse_conn_info *conn)
 {
 	struct iconv *ic = iconv_get();
@@ -617,6 +683,11 @@ static struct fuse_operations iconv_oper = {
 	.removexattr	= iconv_removexattr,
 	.lock		= iconv_lock,
 	.bmap		= iconv_bmap,
+	.ioctl		= iconv_ioctl,
+	.poll		= iconv_poll,
+	.fallocate	= iconv_fallocate,
+	.rmtree		= iconv_rmtree,
+	.sumtree	= iconv_sumtree,
 
 	.flag_nullpath_ok = 1,
 };
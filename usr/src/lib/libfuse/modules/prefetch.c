@@ -0,0 +1,1118 @@
+/*
+  fuse prefetch module: learn which file is opened next, and fetch it
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+*/
+
+/*
+ * Builds and program start-up open the same files in the same order
+ * every time, and each getattr, open and first read of those files
+ * is a cold trip to the back end.  This module learns, for each path
+ * opened, which paths the same process opens right after it (a first
+ * order Markov chain: per path, the few successors seen most, with
+ * counts that are halved now and then so the chain follows changes).
+ *
+ * When a path is opened and one of its successors has been next at
+ * least prefetch_conf percent of the time (over at least prefetch_min
+ * opens), a worker thread gets that successor's attributes and its
+ * first prefetch_bytes bytes from the next filesystem.  getattr and
+ * read of the path are then answered from what was fetched, for up
+ * to prefetch_ttl seconds.  Anything changed through this module is
+ * dropped from the cache, both before and after the change.  Stacked above hcache, the handle
+ * opened for the prefetch is also kept for the real open.
+ *
+ * Fetched data not yet used, plus what fetches in progress may bring,
+ * is limited to prefetch_budget bytes; past that, predictions are not
+ * acted on until some of it is used, expires or is pushed out.  The
+ * queue of fetches is short, and fetches that find it full are just
+ * dropped, so wrong guesses cost little.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#define PF_THREADS_DEFAULT	4
+#define PF_CONF_DEFAULT		50	/* percent */
+#define PF_MIN_DEFAULT		3	/* opens seen */
+#define PF_BYTES_DEFAULT	(64 * 1024)
+#define PF_BUDGET_DEFAULT	(8 * 1024 * 1024)
+#define PF_TTL_DEFAULT		5	/* seconds */
+#define PF_PATHS_DEFAULT	4096
+#define PF_HASH_SIZE		1021
+#define PF_NSUCC		4	/* successors kept per path */
+#define PF_DECAY		64	/* halve the counts past this */
+#define PF_NSTREAM		32	/* processes followed */
+#define PF_QUEUE_PER_THREAD	4
+
+/* A successor of a path, and how often it came next */
+struct pf_succ {
+	char *path;
+	unsigned count;
+};
+
+/* What we learned about a path */
+struct pf_node {
+	char *path;
+	struct pf_node *hnext;		/* hash chain */
+	struct pf_node *prev;		/* LRU list */
+	struct pf_node *next;
+	unsigned total;
+	struct pf_succ succ[PF_NSUCC];
+};
+
+/* The last path opened by a process */
+struct pf_stream {
+	pid_t pid;
+	char *last;
+	unsigned long used;
+};
+
+/* A prefetched (or being fetched) path */
+struct pf_ent {
+	char *path;
+	struct pf_ent *hnext;		/* hash chain */
+	struct pf_ent *prev;		/* ready list, oldest first */
+	struct pf_ent *next;
+	struct pf_ent *qnext;		/* work queue */
+	struct fuse_context ctx;	/* of the open that predicted it */
+	int ready;
+	int used;
+	int dead;			/* dropped while being fetched */
+	time_t expires;
+	struct stat st;
+	char *data;
+	size_t len;
+};
+
+struct prefetch {
+	struct fuse_fs *next;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	struct pf_ent *head;		/* work queue */
+	struct pf_ent **tail;
+	unsigned nqueued;
+	int stop;
+	unsigned nthreads;
+	pthread_t *threads;
+
+	unsigned conf;
+	unsigned min;
+	unsigned bytes;
+	unsigned budget;
+	unsigned ttl;
+	unsigned maxpaths;
+
+	/* learned successors */
+	struct pf_node *nodes[PF_HASH_SIZE];
+	struct pf_node lru;		/* list head, oldest first */
+	unsigned npaths;
+	struct pf_stream streams[PF_NSTREAM];
+	unsigned long clock;
+
+	/* prefetched */
+	struct pf_ent *ents[PF_HASH_SIZE];
+	struct pf_ent ready;		/* list head, oldest first */
+	size_t held;			/* bytes in ready entries */
+	size_t unused;			/* not yet used, or reserved */
+};
+
+static struct prefetch *prefetch_get(void)
+{
+	return fuse_get_context()->private_data;
+}
+
+static unsigned pf_hash(const char *path)
+{
+	unsigned h = 0;
+
+	for (; *path; path++)
+		h = h * 31 + (unsigned char) *path;
+	return h % PF_HASH_SIZE;
+}
+
+static time_t pf_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+/* Is "path" p itself, or (with subtree) under it? */
+static int pf_match(const char *path, const char *p, size_t len, int subtree)
+{
+	return strncmp(path, p, len) == 0 &&
+		(path[len] == '\0' || (subtree && path[len] == '/'));
+}
+
+/*
+ * Learning
+ */
+
+static void pf_node_unlink(struct pf_node *n)
+{
+	n->prev->next = n->next;
+	n->next->prev = n->prev;
+}
+
+static void pf_node_append(struct prefetch *h, struct pf_node *n)
+{
+	n->prev = h->lru.prev;
+	n->next = &h->lru;
+	h->lru.prev->next = n;
+	h->lru.prev = n;
+}
+
+static void pf_node_free(struct pf_node *n)
+{
+	unsigned i;
+
+	for (i = 0; i < PF_NSUCC; i++)
+		free(n->succ[i].path);
+	free(n->path);
+	free(n);
+}
+
+/* Drop the least recently opened path.  Called with the lock held. */
+static void pf_node_evict(struct prefetch *h)
+{
+	struct pf_node *n = h->lru.next, **np;
+
+	pf_node_unlink(n);
+	for (np = &h->nodes[pf_hash(n->path)]; *np != n; np = &(*np)->hnext)
+		;
+	*np = n->hnext;
+	h->npaths--;
+	pf_node_free(n);
+}
+
+/* Find what we know about a path, maybe starting on it. */
+static struct pf_node *pf_node_get(struct prefetch *h, const char *path,
+				   int create)
+{
+	unsigned i = pf_hash(path);
+	struct pf_node *n;
+
+	for (n = h->nodes[i]; n; n = n->hnext) {
+		if (strcmp(n->path, path) == 0) {
+			pf_node_unlink(n);
+			pf_node_append(h, n);
+			return n;
+		}
+	}
+	if (!create)
+		return NULL;
+
+	n = calloc(1, sizeof(struct pf_node));
+	if (n == NULL)
+		return NULL;
+	n->path = strdup(path);
+	if (n->path == NULL) {
+		free(n);
+		return NULL;
+	}
+	n->hnext = h->nodes[i];
+	h->nodes[i] = n;
+	pf_node_append(h, n);
+	if (++h->npaths > h->maxpaths)
+		pf_node_evict(h);
+	return n;
+}
+
+/*
+ * "path" was opened right after n->path.  A successor not seen
+ * before replaces the one seen least.
+ */
+static void pf_node_count(struct pf_node *n, const char *path)
+{
+	struct pf_succ *s, *least = &n->succ[0];
+	unsigned i;
+
+	for (i = 0; i < PF_NSUCC; i++) {
+		s = &n->succ[i];
+		if (s->path && strcmp(s->path, path) == 0)
+			break;
+		if (s->count < least->count)
+			least = s;
+	}
+	if (i == PF_NSUCC) {
+		s = least;
+		free(s->path);
+		n->total -= s->count;
+		s->count = 0;
+		s->path = strdup(path);
+		if (s->path == NULL)
+			return;
+	}
+	s->count++;
+	if (++n->total < PF_DECAY)
+		return;
+
+	n->total = 0;
+	for (i = 0; i < PF_NSUCC; i++) {
+		s = &n->succ[i];
+		s->count /= 2;
+		n->total += s->count;
+		if (s->count == 0 && s->path) {
+			free(s->path);
+			s->path = NULL;
+		}
+	}
+}
+
+/*
+ * The caller's process opened path: count it as the successor of
+ * the path that process opened before.  Called with the lock held.
+ */
+static void pf_learn(struct prefetch *h, pid_t pid, const char *path)
+{
+	struct pf_stream *st, *old = &h->streams[0];
+	struct pf_node *n;
+	char *p;
+	unsigned i;
+
+	for (i = 0; i < PF_NSTREAM; i++) {
+		st = &h->streams[i];
+		if (st->last && st->pid == pid)
+			break;
+		if (st->used < old->used)
+			old = st;
+	}
+	if (i == PF_NSTREAM) {
+		st = old;
+		free(st->last);
+		st->last = NULL;
+		st->pid = pid;
+	}
+	st->used = ++h->clock;
+
+	if (st->last && strcmp(st->last, path) != 0) {
+		n = pf_node_get(h, st->last, 1);
+		if (n)
+			pf_node_count(n, path);
+	}
+	p = strdup(path);
+	if (p) {
+		free(st->last);
+		st->last = p;
+	}
+}
+
+/*
+ * Prefetched data
+ */
+
+static void pf_ent_free(struct pf_ent *e)
+{
+	free(e->data);
+	free(e->path);
+	free(e);
+}
+
+static void pf_unhash(struct prefetch *h, struct pf_ent *e)
+{
+	struct pf_ent **ep;
+
+	for (ep = &h->ents[pf_hash(e->path)]; *ep != e; ep = &(*ep)->hnext)
+		;
+	*ep = e->hnext;
+	e->hnext = NULL;
+}
+
+/* Drop a ready entry.  Called with the lock held. */
+static void pf_drop(struct prefetch *h, struct pf_ent *e)
+{
+	pf_unhash(h, e);
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+	h->held -= e->len;
+	if (!e->used)
+		h->unused -= e->len;
+	pf_ent_free(e);
+}
+
+/* Drop expired entries, and old ones past the budget. */
+static void pf_trim(struct prefetch *h, time_t now)
+{
+	struct pf_ent *e;
+
+	while ((e = h->ready.next) != &h->ready &&
+	       (e->expires <= now || h->held > h->budget))
+		pf_drop(h, e);
+}
+
+/* A ready entry for path, or NULL.  Called with the lock held. */
+static struct pf_ent *pf_lookup(struct prefetch *h, const char *path)
+{
+	struct pf_ent *e;
+
+	pf_trim(h, pf_now());
+	for (e = h->ents[pf_hash(path)]; e; e = e->hnext) {
+		if (strcmp(e->path, path) == 0)
+			break;
+	}
+	if (e == NULL || !e->ready)
+		return NULL;
+	if (!e->used) {
+		e->used = 1;
+		h->unused -= e->len;
+	}
+	return e;
+}
+
+/*
+ * Take a path (and with "subtree", everything under it) out of the
+ * cache.  An entry being fetched is marked dead and its worker throws
+ * it away.  Called before a change, so it isn't read from the cache
+ * while the change is made, and again after it: a fetch started in
+ * between may have got what was there before.
+ */
+static void pf_invalidate(struct prefetch *h, const char *path, int subtree)
+{
+	struct pf_ent *e, *next;
+	size_t len = strlen(path);
+	unsigned i, first, last;
+
+	if (subtree) {
+		first = 0;
+		last = PF_HASH_SIZE - 1;
+	} else {
+		first = last = pf_hash(path);
+	}
+
+	pthread_mutex_lock(&h->lock);
+	for (i = first; i <= last; i++) {
+		for (e = h->ents[i]; e; e = next) {
+			next = e->hnext;
+			if (!pf_match(e->path, path, len, subtree))
+				continue;
+			if (e->ready) {
+				pf_drop(h, e);
+			} else {
+				pf_unhash(h, e);
+				e->dead = 1;
+			}
+		}
+	}
+	pthread_mutex_unlock(&h->lock);
+}
+
+/* Queue a fetch of path, if it's worth it.  Called with the lock held. */
+static void pf_schedule(struct prefetch *h, const char *path)
+{
+	unsigned i = pf_hash(path);
+	struct pf_ent *e;
+
+	for (e = h->ents[i]; e; e = e->hnext) {
+		if (strcmp(e->path, path) == 0)
+			return;
+	}
+	if (h->nqueued >= h->nthreads * PF_QUEUE_PER_THREAD ||
+	    h->unused + h->bytes > h->budget)
+		return;
+
+	e = calloc(1, sizeof(struct pf_ent));
+	if (e == NULL)
+		return;
+	e->path = strdup(path);
+	if (e->path == NULL) {
+		free(e);
+		return;
+	}
+	e->ctx = *fuse_get_context();
+	e->hnext = h->ents[i];
+	h->ents[i] = e;
+	h->unused += h->bytes;
+	h->nqueued++;
+	*h->tail = e;
+	h->tail = &e->qnext;
+	pthread_cond_signal(&h->work);
+}
+
+/* path was opened: learn from it, and fetch what's likely next. */
+static void pf_opened(struct prefetch *h, const char *path)
+{
+	struct pf_node *n;
+	struct pf_succ *s;
+	unsigned i;
+
+	pthread_mutex_lock(&h->lock);
+	pf_learn(h, fuse_get_context()->pid, path);
+	n = pf_node_get(h, path, 0);
+	if (n && h->nthreads && n->total >= h->min) {
+		pf_trim(h, pf_now());
+		for (i = 0; i < PF_NSUCC; i++) {
+			s = &n->succ[i];
+			if (s->path && s->count * 100 >= h->conf * n->total)
+				pf_schedule(h, s->path);
+		}
+	}
+	pthread_mutex_unlock(&h->lock);
+}
+
+/* Get the attributes and leading data of e->path */
+static void pf_fetch(struct prefetch *h, struct pf_ent *e)
+{
+	struct fuse_file_info fi;
+	size_t want;
+	int res;
+
+	res = fuse_fs_getattr(h->next, e->path, &e->st);
+	if (res != 0 || !S_ISREG(e->st.st_mode) || h->bytes == 0)
+		goto out;
+
+	want = e->st.st_size < (off_t) h->bytes ? e->st.st_size : h->bytes;
+	if (want == 0)
+		goto out;
+	e->data = malloc(want);
+	if (e->data == NULL)
+		goto out;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDONLY;
+	if (fuse_fs_open(h->next, e->path, &fi) != 0)
+		goto out;
+	while (e->len < want) {
+		res = fuse_fs_read(h->next, e->path, e->data + e->len,
+				   want - e->len, e->len, &fi);
+		if (res <= 0)
+			break;
+		e->len += res;
+	}
+	fuse_fs_release(h->next, e->path, &fi);
+
+out:
+	e->ready = res == 0 || e->len != 0;
+	if (e->ready && e->len == 0) {
+		free(e->data);
+		e->data = NULL;
+	}
+}
+
+static void *pf_worker(void *arg)
+{
+	struct prefetch *h = arg;
+	struct pf_ent *e;
+
+	pthread_mutex_lock(&h->lock);
+	for (;;) {
+		while (h->head == NULL && !h->stop)
+			pthread_cond_wait(&h->work, &h->lock);
+		if (h->stop)
+			break;
+		e = h->head;
+		h->head = e->qnext;
+		if (h->head == NULL)
+			h->tail = &h->head;
+		h->nqueued--;
+		pthread_mutex_unlock(&h->lock);
+
+		*fuse_get_context() = e->ctx;
+		if (!e->dead)
+			pf_fetch(h, e);
+
+		pthread_mutex_lock(&h->lock);
+		h->unused -= h->bytes;
+		if (e->dead || !e->ready) {
+			if (!e->dead)
+				pf_unhash(h, e);
+			pf_ent_free(e);
+			continue;
+		}
+		e->expires = pf_now() + h->ttl;
+		e->prev = h->ready.prev;
+		e->next = &h->ready;
+		h->ready.prev->next = e;
+		h->ready.prev = e;
+		h->held += e->len;
+		h->unused += e->len;
+		pf_trim(h, 0);
+	}
+	pthread_mutex_unlock(&h->lock);
+	return NULL;
+}
+
+static int prefetch_getattr(const char *path, struct stat *stbuf)
+{
+	struct prefetch *h = prefetch_get();
+	struct pf_ent *e;
+
+	pthread_mutex_lock(&h->lock);
+	e = pf_lookup(h, path);
+	if (e)
+		*stbuf = e->st;
+	pthread_mutex_unlock(&h->lock);
+	if (e)
+		return 0;
+
+	return fuse_fs_getattr(h->next, path, stbuf);
+}
+
+/*
+ * Answer a read from the prefetched data if it has all of it, or
+ * all there is up to EOF (a short read means EOF to the kernel).
+ */
+static int prefetch_read(const char *path, char *buf, size_t size,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	struct prefetch *h = prefetch_get();
+	struct pf_ent *e;
+	int res = -1;
+
+	pthread_mutex_lock(&h->lock);
+	e = pf_lookup(h, path);
+	if (e && (offset + (off_t) size <= (off_t) e->len ||
+		  (off_t) e->len == e->st.st_size)) {
+		res = 0;
+		if (offset < (off_t) e->len) {
+			res = e->len - offset;
+			if ((size_t) res > size)
+				res = size;
+			memcpy(buf, e->data + offset, res);
+		}
+	}
+	pthread_mutex_unlock(&h->lock);
+	if (res >= 0)
+		return res;
+
+	return fuse_fs_read(h->next, path, buf, size, offset, fi);
+}
+
+static int prefetch_open(const char *path, struct fuse_file_info *fi)
+{
+	struct prefetch *h = prefetch_get();
+	int err;
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC))
+		pf_invalidate(h, path, 0);
+	err = fuse_fs_open(h->next, path, fi);
+	if (fi->flags & O_TRUNC)
+		pf_invalidate(h, path, 0);
+	if (!err)
+		pf_opened(h, path);
+	return err;
+}
+
+static int prefetch_create(const char *path, mode_t mode,
+			   struct fuse_file_info *fi)
+{
+	struct prefetch *h = prefetch_get();
+	int err;
+
+	pf_invalidate(h, path, 0);
+	err = fuse_fs_create(h->next, path, mode, fi);
+	pf_invalidate(h, path, 0);
+	if (!err)
+		pf_opened(h, path);
+	return err;
+}
+
+static int prefetch_write(const char *path, const char *buf, size_t size,
+			  off_t offset, struct fuse_file_info *fi)
+{
+	struct prefetch *h = prefetch_get();
+	int res;
+
+	pf_invalidate(h, path, 0);
+	res = fuse_fs_write(h->next, path, buf, size, offset, fi);
+	pf_invalidate(h, path, 0);
+	return res;
+}
+
+static int prefetch_truncate(const char *path, off_t size)
+{
+	struct prefetch *h = prefetch_get();
+	int res;
+
+	pf_invalidate(h, path, 0);
+	res = fuse_fs_truncate(h->next, path, size);
+	pf_invalidate(h, path, 0);
+	return res;
+}
+
+static int prefetch_ftruncate(const char *path, off_t size,
+			      struct fuse_file_info *fi)
+{
+	struct prefetch *h = prefetch_get();
+	int res;
+
+	pf_invalidate(h, path, 0);
+	res = fuse_fs_ftruncate(h->next, path, size, fi);
+	pf_invalidate(h, path, 0);
+	return res;
+}
+
+static int prefetch_fallocate(const char *path, int mode, off_t offset,
+			      off_t length, struct fuse_file_info *fi)
+{
+	struct prefetch *h = prefetch_get();
+	int res;
+
+	pf_invalidate(h, path, 0);
+	res = fuse_fs_fallocate(h->next, path, mode, offset, length, fi);
+	pf_invalidate(h, path, 0);
+	return res;
+}
+
+static int prefetch_unlink(const char *path)
+{
+	struct prefetch *h = prefetch_get();
+	int res;
+
+	pf_invalidate(h, path, 0);
+	res = fuse_fs_unlink(h->next, path);
+	pf_invalidate(h, path, 0);
+	return res;
+}
+
+static int prefetch_rmdir(const char *path)
+{
+	struct prefetch *h = prefetch_get();
+	int res;
+
+	pf_invalidate(h, path, 1);
+	res = fuse_fs_rmdir(h->next, path);
+	pf_invalidate(h, path, 1);
+	return res;
+}
+
+static int prefetch_rename(const char *from, const char *to)
+{
+	struct prefetch *h = prefetch_get();
+	int res;
+
+	pf_invalidate(h, from, 1);
+	pf_invalidate(h, to, 1);
+	res = fuse_fs_rename(h->next, from, to);
+	pf_invalidate(h, from, 1);
+	pf_invalidate(h, to, 1);
+	return res;
+}
+
+static int prefetch_rmtree(const char *path)
+{
+	struct prefetch *h = prefetch_get();
+	int res;
+
+	pf_invalidate(h, path, 1);
+	res = fuse_fs_rmtree(h->next, path);
+	pf_invalidate(h, path, 1);
+	return res;
+}
+
+static int prefetch_sumtree(const char *path, struct fuse_treesum *sum)
+{
+	return fuse_fs_sumtree(prefetch_get()->next, path, sum);
+}
+
+static int prefetch_link(const char *from, const char *to)
+{
+	struct prefetch *h = prefetch_get();
+	int res;
+
+	/* The link count changes. */
+	pf_invalidate(h, from, 0);
+	pf_invalidate(h, to, 0);
+	res = fuse_fs_link(h->next, from, to);
+	pf_invalidate(h, from, 0);
+	pf_invalidate(h, to, 0);
+	return res;
+}
+
+static int prefetch_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+	struct prefetch *h = prefetch_get();
+	int res;
+
+	pf_invalidate(h, path, 0);
+	res = fuse_fs_mknod(h->next, path, mode, rdev);
+	pf_invalidate(h, path, 0);
+	return res;
+}
+
+static int prefetch_mkdir(const char *path, mode_t mode)
+{
+	struct prefetch *h = prefetch_get();
+	int res;
+
+	pf_invalidate(h, path, 0);
+	res = fuse_fs_mkdir(h->next, path, mode);
+	pf_invalidate(h, path, 0);
+	return res;
+}
+
+static int prefetch_symlink(const char *from, const char *path)
+{
+	struct prefetch *h = prefetch_get();
+	int res;
+
+	pf_invalidate(h, path, 0);
+	res = fuse_fs_symlink(h->next, from, path);
+	pf_invalidate(h, path, 0);
+	return res;
+}
+
+static int prefetch_chmod(const char *path, mode_t mode)
+{
+	struct prefetch *h = prefetch_get();
+	int res;
+
+	pf_invalidate(h, path, 0);
+	res = fuse_fs_chmod(h->next, path, mode);
+	pf_invalidate(h, path, 0);
+	return res;
+}
+
+static int prefetch_chown(const char *path, uid_t uid, gid_t gid)
+{
+	struct prefetch *h = prefetch_get();
+	int res;
+
+	pf_invalidate(h, path, 0);
+	res = fuse_fs_chown(h->next, path, uid, gid);
+	pf_invalidate(h, path, 0);
+	return res;
+}
+
+static int prefetch_utimens(const char *path, const struct timespec ts[2])
+{
+	struct prefetch *h = prefetch_get();
+	int res;
+
+	pf_invalidate(h, path, 0);
+	res = fuse_fs_utimens(h->next, path, ts);
+	pf_invalidate(h, path, 0);
+	return res;
+}
+
+static int prefetch_fgetattr(const char *path, struct stat *stbuf,
+			     struct fuse_file_info *fi)
+{
+	return fuse_fs_fgetattr(prefetch_get()->next, path, stbuf, fi);
+}
+
+static int prefetch_access(const char *path, int mask)
+{
+	return fuse_fs_access(prefetch_get()->next, path, mask);
+}
+
+static int prefetch_readlink(const char *path, char *buf, size_t size)
+{
+	return fuse_fs_readlink(prefetch_get()->next, path, buf, size);
+}
+
+static int prefetch_opendir(const char *path, struct fuse_file_info *fi)
+{
+	return fuse_fs_opendir(prefetch_get()->next, path, fi);
+}
+
+static int prefetch_readdir(const char *path, void *buf,
+			    fuse_fill_dir_t filler, off_t offset,
+			    struct fuse_file_info *fi)
+{
+	return fuse_fs_readdir(prefetch_get()->next, path, buf, filler,
+			       offset, fi);
+}
+
+static int prefetch_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	return fuse_fs_releasedir(prefetch_get()->next, path, fi);
+}
+
+static int prefetch_fsyncdir(const char *path, int isdatasync,
+			     struct fuse_file_info *fi)
+{
+	return fuse_fs_fsyncdir(prefetch_get()->next, path, isdatasync, fi);
+}
+
+static int prefetch_statfs(const char *path, struct statvfs *stbuf)
+{
+	return fuse_fs_statfs(prefetch_get()->next, path, stbuf);
+}
+
+static int prefetch_flush(const char *path, struct fuse_file_info *fi)
+{
+	return fuse_fs_flush(prefetch_get()->next, path, fi);
+}
+
+static int prefetch_release(const char *path, struct fuse_file_info *fi)
+{
+	return fuse_fs_release(prefetch_get()->next, path, fi);
+}
+
+static int prefetch_fsync(const char *path, int isdatasync,
+			  struct fuse_file_info *fi)
+{
+	return fuse_fs_fsync(prefetch_get()->next, path, isdatasync, fi);
+}
+
+static int prefetch_setxattr(const char *path, const char *name,
+			     const char *value, size_t size, int flags)
+{
+	return fuse_fs_setxattr(prefetch_get()->next, path, name, value, size,
+				flags);
+}
+
+static int prefetch_getxattr(const char *path, const char *name, char *value,
+			     size_t size)
+{
+	return fuse_fs_getxattr(prefetch_get()->next, path, name, value, size);
+}
+
+static int prefetch_listxattr(const char *path, char *list, size_t size)
+{
+	return fuse_fs_listxattr(prefetch_get()->next, path, list, size);
+}
+
+static int prefetch_removexattr(const char *path, const char *name)
+{
+	return fuse_fs_removexattr(prefetch_get()->next, path, name);
+}
+
+static int prefetch_lock(const char *path, struct fuse_file_info *fi, int cmd,
+			 struct flock *lock)
+{
+	return fuse_fs_lock(prefetch_get()->next, path, fi, cmd, lock);
+}
+
+static int prefetch_bmap(const char *path, size_t blocksize, uint64_t *idx)
+{
+	return fuse_fs_bmap(prefetch_get()->next, path, blocksize, idx);
+}
+
+/* The ioctl may change the data. */
+static int prefetch_ioctl(const char *path, int cmd, void *arg,
+			  struct fuse_file_info *fi, unsigned int flags,
+			  void *data)
+{
+	struct prefetch *h = prefetch_get();
+	int res;
+
+	pf_invalidate(h, path, 0);
+	res = fuse_fs_ioctl(h->next, path, cmd, arg, fi, flags, data);
+	pf_invalidate(h, path, 0);
+	return res;
+}
+
+static int prefetch_poll(const char *path, struct fuse_file_info *fi,
+			 struct fuse_pollhandle *ph, unsigned *reventsp)
+{
+	return fuse_fs_poll(prefetch_get()->next, path, fi, ph, reventsp);
+}
+
+/*
+ * Start the workers here rather than in prefetch_new, which runs
+ * before the daemon forks into the background.
+ */
+static void *prefetch_init(struct fuse_conn_info *conn)
+{
+	struct prefetch *h = prefetch_get();
+	unsigned i;
+
+	fuse_fs_init(h->next, conn);
+
+	h->threads = calloc(h->nthreads, sizeof(pthread_t));
+	if (h->threads == NULL) {
+		fprintf(stderr, "fuse-prefetch: memory allocation failed\n");
+		h->nthreads = 0;
+		return h;
+	}
+	for (i = 0; i < h->nthreads; i++) {
+		if (pthread_create(&h->threads[i], NULL, pf_worker, h))
+			break;
+	}
+	if (i < h->nthreads)
+		fprintf(stderr, "fuse-prefetch: started only %u threads\n", i);
+	pthread_mutex_lock(&h->lock);
+	h->nthreads = i;
+	pthread_mutex_unlock(&h->lock);
+	return h;
+}
+
+static void prefetch_destroy(void *data)
+{
+	struct prefetch *h = data;
+	struct pf_ent *e;
+	unsigned i;
+
+	pthread_mutex_lock(&h->lock);
+	h->stop = 1;
+	pthread_cond_broadcast(&h->work);
+	pthread_mutex_unlock(&h->lock);
+	for (i = 0; i < h->nthreads; i++)
+		pthread_join(h->threads[i], NULL);
+	free(h->threads);
+
+	/* Queued entries are hashed too, unless dead. */
+	while ((e = h->head) != NULL) {
+		h->head = e->qnext;
+		if (!e->dead)
+			pf_unhash(h, e);
+		pf_ent_free(e);
+	}
+	for (i = 0; i < PF_HASH_SIZE; i++) {
+		while ((e = h->ents[i]) != NULL)
+			pf_drop(h, e);
+	}
+	while (h->npaths)
+		pf_node_evict(h);
+	for (i = 0; i < PF_NSTREAM; i++)
+		free(h->streams[i].last);
+
+	fuse_fs_destroy(h->next);
+	pthread_cond_destroy(&h->work);
+	pthread_mutex_destroy(&h->lock);
+	free(h);
+}
+
+static struct fuse_operations prefetch_oper = {
+	.destroy	= prefetch_destroy,
+	.init		= prefetch_init,
+	.getattr	= prefetch_getattr,
+	.fgetattr	= prefetch_fgetattr,
+	.access		= prefetch_access,
+	.readlink	= prefetch_readlink,
+	.opendir	= prefetch_opendir,
+	.readdir	= prefetch_readdir,
+	.releasedir	= prefetch_releasedir,
+	.mknod		= prefetch_mknod,
+	.mkdir		= prefetch_mkdir,
+	.symlink	= prefetch_symlink,
+	.unlink		= prefetch_unlink,
+	.rmdir		= prefetch_rmdir,
+	.rename		= prefetch_rename,
+	.link		= prefetch_link,
+	.chmod		= prefetch_chmod,
+	.chown		= prefetch_chown,
+	.truncate	= prefetch_truncate,
+	.ftruncate	= prefetch_ftruncate,
+	.utimens	= prefetch_utimens,
+	.create		= prefetch_create,
+	.open		= prefetch_open,
+	.read		= prefetch_read,
+	.write		= prefetch_write,
+	.statfs		= prefetch_statfs,
+	.flush		= prefetch_flush,
+	.release	= prefetch_release,
+	.fsync		= prefetch_fsync,
+	.fsyncdir	= prefetch_fsyncdir,
+	.setxattr	= prefetch_setxattr,
+	.getxattr	= prefetch_getxattr,
+	.listxattr	= prefetch_listxattr,
+	.removexattr	= prefetch_removexattr,
+	.lock		= prefetch_lock,
+	.bmap		= prefetch_bmap,
+	.ioctl		= prefetch_ioctl,
+	.poll		= prefetch_poll,
+	.fallocate	= prefetch_fallocate,
+	.rmtree		= prefetch_rmtree,
+	.sumtree	= prefetch_sumtree,
+};
+
+static struct fuse_opt prefetch_opts[] = {
+	FUSE_OPT_KEY("-h", 0),
+	FUSE_OPT_KEY("--help", 0),
+	{ "prefetch_threads=%u", offsetof(struct prefetch, nthreads), 0 },
+	{ "prefetch_conf=%u", offsetof(struct prefetch, conf), 0 },
+	{ "prefetch_min=%u", offsetof(struct prefetch, min), 0 },
+	{ "prefetch_bytes=%u", offsetof(struct prefetch, bytes), 0 },
+	{ "prefetch_budget=%u", offsetof(struct prefetch, budget), 0 },
+	{ "prefetch_ttl=%u", offsetof(struct prefetch, ttl), 0 },
+	{ "prefetch_paths=%u", offsetof(struct prefetch, maxpaths), 0 },
+	FUSE_OPT_END
+};
+
+static void prefetch_help(void)
+{
+	fprintf(stderr,
+"    -o prefetch_threads=N  worker threads (%u)\n"
+"    -o prefetch_conf=N     prefetch files next this %% of the time (%u)\n"
+"    -o prefetch_min=N      after a file was opened this many times (%u)\n"
+"    -o prefetch_bytes=N    leading bytes of a file to fetch (%u)\n"
+"    -o prefetch_budget=N   max bytes fetched and not yet used (%u)\n"
+"    -o prefetch_ttl=N      seconds fetched data is good for (%u)\n"
+"    -o prefetch_paths=N    paths to learn successors of (%u)\n",
+		PF_THREADS_DEFAULT, PF_CONF_DEFAULT, PF_MIN_DEFAULT,
+		PF_BYTES_DEFAULT, PF_BUDGET_DEFAULT, PF_TTL_DEFAULT,
+		PF_PATHS_DEFAULT);
+}
+
+static int prefetch_opt_proc(void *data, const char *arg, int key,
+			     struct fuse_args *outargs)
+{
+	(void) data; (void) arg; (void) outargs;
+
+	if (!key) {
+		prefetch_help();
+		return -1;
+	}
+
+	return 1;
+}
+
+static struct fuse_fs *prefetch_new(struct fuse_args *args,
+				    struct fuse_fs *next[])
+{
+	struct fuse_fs *fs;
+	struct prefetch *h;
+
+	h = calloc(1, sizeof(struct prefetch));
+	if (h == NULL) {
+		fprintf(stderr, "fuse-prefetch: memory allocation failed\n");
+		return NULL;
+	}
+
+	h->nthreads = PF_THREADS_DEFAULT;
+	h->conf = PF_CONF_DEFAULT;
+	h->min = PF_MIN_DEFAULT;
+	h->bytes = PF_BYTES_DEFAULT;
+	h->budget = PF_BUDGET_DEFAULT;
+	h->ttl = PF_TTL_DEFAULT;
+	h->maxpaths = PF_PATHS_DEFAULT;
+	if (fuse_opt_parse(args, h, prefetch_opts, prefetch_opt_proc) == -1)
+		goto out_free;
+
+	if (!next[0] || next[1]) {
+		fprintf(stderr, "fuse-prefetch: exactly one next filesystem required\n");
+		goto out_free;
+	}
+
+	if (h->conf == 0 || h->conf > 100) {
+		fprintf(stderr, "fuse-prefetch: prefetch_conf must be 1..100\n");
+		goto out_free;
+	}
+	if (h->min == 0)
+		h->min = 1;
+	if (h->maxpaths == 0)
+		h->maxpaths = 1;
+
+	pthread_mutex_init(&h->lock, NULL);
+	pthread_cond_init(&h->work, NULL);
+	h->tail = &h->head;
+	h->lru.prev = h->lru.next = &h->lru;
+	h->ready.prev = h->ready.next = &h->ready;
+	h->next = next[0];
+	fs = fuse_fs_new(&prefetch_oper, sizeof(prefetch_oper), h);
+	if (!fs)
+		goto out_destroy;
+	return fs;
+
+out_destroy:
+	pthread_cond_destroy(&h->work);
+	pthread_mutex_destroy(&h->lock);
+out_free:
+	free(h);
+	return NULL;
+}
+
+FUSE_REGISTER_MODULE(prefetch, prefetch_new);
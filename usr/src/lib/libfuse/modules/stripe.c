@@ -0,0 +1,1535 @@
+/*
+  fuse stripe module: stripe file data over several back-end files
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+*/
+
+/*
+ * A single big file is read and written through one back-end object,
+ * even when the back end could serve many streams at once.  Files
+ * created through this module have their data cut into stripe_size
+ * chunks, dealt round-robin over stripe_width component files:
+ *
+ *	dir/name			the stripe record
+ *	dir/.name.~stripe~0 ...		the components
+ *
+ * The record is a short line of text ("fuse-stripe 1 width size"),
+ * padded to STRIPE_HDRSIZE bytes.  A file is striped if it's that
+ * size, its first component exists and it holds a record; anything
+ * else is an ordinary file and passed through untouched.
+ * Components do not show up in directory listings, and can't be
+ * looked up or created by name.  The size, blocks, mode and times of
+ * a striped file come from its components; its inode number, link
+ * count and the like from the record.  Hard links to striped files
+ * are refused, as the component names follow the record's name.
+ *
+ * I/O spanning several chunks is split, and the pieces go to the
+ * components at once, on stripe_threads worker threads.  The kernel
+ * sends at most FUSE_MAX_IOSIZE bytes per call, far less than a
+ * stripe row (stripe_width chunks), so with stripe_ahead (the default)
+ * each open file also reads a whole row when it's read sequentially,
+ * and gathers sequential writes into a row before sending them.
+ * Gathered writes are sent before anything that could look at the
+ * file (getattr, read, truncate, rename, unlink, flush, fsync), and a
+ * failure to send them is returned by the next write, flush or fsync.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#define STRIPE_WIDTH_DEFAULT	4
+#define STRIPE_SIZE_DEFAULT	(64 * 1024)
+#define STRIPE_THREADS_DEFAULT	8
+#define STRIPE_MAXWIDTH		64
+#define STRIPE_MAXROW		(64 * 1024 * 1024)
+#define STRIPE_HDRSIZE		64
+#define STRIPE_MAGIC		"fuse-stripe"
+#define STRIPE_VERSION		1
+#define STRIPE_TAG		".~stripe~"
+
+/* An open file; width is zero when it's not striped. */
+struct stripe_file {
+	pthread_mutex_t lock;
+	struct stripe_file *dnext;	/* list of files with gathered writes */
+	int ondirty;
+	unsigned width;
+	unsigned chunk;
+	off_t nextoff;			/* where a sequential read goes next */
+	char *ra;			/* read ahead: one row */
+	off_t raoff;
+	size_t ralen;
+	int raeof;
+	unsigned long ragen;
+	char *wb;			/* gathered writes */
+	char *wpath;
+	off_t wboff;
+	size_t wblen;
+	int werr;			/* from sending gathered writes */
+	struct fuse_file_info fi[1];	/* one per component */
+};
+
+struct stripe_req {
+	struct fuse_context ctx;
+	int write;
+	unsigned pending;		/* pieces on the workers */
+};
+
+/* A piece of a request, within one chunk */
+struct stripe_io {
+	struct stripe_io *next;		/* work queue */
+	struct stripe_req *req;
+	const char *path;
+	struct fuse_file_info *fi;
+	char *buf;
+	size_t size;
+	off_t off;
+	int res;
+};
+
+struct stripe {
+	struct fuse_fs *next;
+	unsigned width;
+	unsigned chunk;
+	unsigned ahead;
+
+	pthread_mutex_t lock;		/* dirty list */
+	struct stripe_file *dirty;
+	pthread_mutex_t glock;		/* gen */
+	unsigned long gen;		/* bumped on any change of data */
+
+	pthread_mutex_t qlock;		/* work queue */
+	pthread_cond_t work;
+	pthread_cond_t done;
+	struct stripe_io *head;
+	struct stripe_io **tail;
+	int stop;
+	unsigned nthreads;
+	pthread_t *threads;
+};
+
+static struct stripe *stripe_get(void)
+{
+	return fuse_get_context()->private_data;
+}
+
+static struct stripe_file *stripe_fh(struct fuse_file_info *fi)
+{
+	return (struct stripe_file *) (uintptr_t) fi->fh;
+}
+
+static unsigned long stripe_gen(struct stripe *h, int bump)
+{
+	unsigned long gen;
+
+	pthread_mutex_lock(&h->glock);
+	if (bump)
+		h->gen++;
+	gen = h->gen;
+	pthread_mutex_unlock(&h->glock);
+	return gen;
+}
+
+/* Is the last component of path the name of a stripe component? */
+static int stripe_hidden(const char *path)
+{
+	const char *base = strrchr(path, '/');
+
+	base = base ? base + 1 : path;
+	return base[0] == '.' && strstr(base, STRIPE_TAG) != NULL;
+}
+
+static void stripe_comps_free(char **comps, unsigned width)
+{
+	unsigned k;
+
+	for (k = 0; k < width; k++)
+		free(comps[k]);
+	free(comps);
+}
+
+/* The paths of the components of the file at path */
+static char **stripe_comps(const char *path, unsigned width)
+{
+	const char *base = strrchr(path, '/') + 1;
+	int dlen = base - path;
+	size_t len = strlen(path) + sizeof(STRIPE_TAG) + 12;
+	char **comps;
+	unsigned k;
+
+	comps = calloc(width, sizeof(char *));
+	if (comps == NULL)
+		return NULL;
+	for (k = 0; k < width; k++) {
+		comps[k] = malloc(len);
+		if (comps[k] == NULL) {
+			stripe_comps_free(comps, k);
+			return NULL;
+		}
+		sprintf(comps[k], "%.*s.%s" STRIPE_TAG "%u", dlen, path, base,
+			k);
+	}
+	return comps;
+}
+
+/*
+ * Read the stripe record of a file.  Returns 1 if it's striped.
+ * A file is only taken for a record if its first component is
+ * there too: components can't be made through this module, so an
+ * ordinary file that happens to look like a record isn't one, and
+ * other files of that size cost a getattr, not an open and a read.
+ */
+static int stripe_meta(struct stripe *h, const char *path,
+		       const struct stat *st, unsigned *width, unsigned *chunk)
+{
+	struct fuse_file_info fi;
+	struct stat cst;
+	char buf[STRIPE_HDRSIZE + 1];
+	char **comps;
+	unsigned ver;
+	int res;
+
+	if (!S_ISREG(st->st_mode) || st->st_size != STRIPE_HDRSIZE)
+		return 0;
+
+	comps = stripe_comps(path, 1);
+	if (comps == NULL)
+		return 0;
+	res = fuse_fs_getattr(h->next, comps[0], &cst);
+	stripe_comps_free(comps, 1);
+	if (res != 0 || !S_ISREG(cst.st_mode))
+		return 0;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDONLY;
+	if (fuse_fs_open(h->next, path, &fi) != 0)
+		return 0;
+	res = fuse_fs_read(h->next, path, buf, STRIPE_HDRSIZE, 0, &fi);
+	fuse_fs_release(h->next, path, &fi);
+	if (res != STRIPE_HDRSIZE)
+		return 0;
+	buf[STRIPE_HDRSIZE] = '\0';
+
+	if (sscanf(buf, STRIPE_MAGIC " %u %u %u", &ver, width, chunk) != 3 ||
+	    ver != STRIPE_VERSION || *width == 0 ||
+	    *width > STRIPE_MAXWIDTH || *chunk == 0)
+		return 0;
+	return 1;
+}
+
+/* Is the file at path striped?  Returns 1, 0 or an error. */
+static int stripe_lookup(struct stripe *h, const char *path,
+			 unsigned *width, unsigned *chunk)
+{
+	struct stat st;
+	int res;
+
+	res = fuse_fs_getattr(h->next, path, &st);
+	if (res)
+		return res;
+	return stripe_meta(h, path, &st, width, chunk);
+}
+
+/*
+ * Fill in what the components say about a striped file.  A component
+ * holding n bytes ends at byte n - 1 of its last chunk, wherever that
+ * chunk is in the file; the file ends where the last one does.
+ */
+static int stripe_attr(struct stripe *h, char **comps, struct stripe_file *sf,
+		       unsigned width, unsigned chunk, struct stat *st)
+{
+	struct stat cst;
+	off_t size = 0, last, end;
+	blkcnt_t blocks = 0;
+	unsigned k;
+	int res;
+
+	for (k = 0; k < width; k++) {
+		if (sf)
+			res = fuse_fs_fgetattr(h->next, comps[k], &cst,
+					       &sf->fi[k]);
+		else
+			res = fuse_fs_getattr(h->next, comps[k], &cst);
+		if (res)
+			return res;
+
+		if (cst.st_size > 0) {
+			last = cst.st_size - 1;
+			end = ((last / chunk) * width + k) * chunk +
+				last % chunk + 1;
+			if (end > size)
+				size = end;
+		}
+		blocks += cst.st_blocks;
+		if (k == 0) {
+			st->st_mode = cst.st_mode;
+			st->st_uid = cst.st_uid;
+			st->st_gid = cst.st_gid;
+		}
+		if (cst.st_atime > st->st_atime)
+			st->st_atim = cst.st_atim;
+		if (cst.st_mtime > st->st_mtime)
+			st->st_mtim = cst.st_mtim;
+		if (cst.st_ctime > st->st_ctime)
+			st->st_ctim = cst.st_ctim;
+	}
+	st->st_size = size;
+	st->st_blocks += blocks;
+	return 0;
+}
+
+/* How much of a file size bytes long is in component k */
+static off_t stripe_comp_size(off_t size, unsigned k, unsigned width,
+			      unsigned chunk)
+{
+	off_t row = (off_t) chunk * width;
+	off_t rem = size % row - (off_t) k * chunk;
+
+	if (rem < 0)
+		rem = 0;
+	else if (rem > chunk)
+		rem = chunk;
+	return size / row * chunk + rem;
+}
+
+static void stripe_io_run(struct stripe *h, struct stripe_io *io)
+{
+	if (io->req->write)
+		io->res = fuse_fs_write(h->next, io->path, io->buf, io->size,
+					io->off, io->fi);
+	else
+		io->res = fuse_fs_read(h->next, io->path, io->buf, io->size,
+				       io->off, io->fi);
+}
+
+static void *stripe_worker(void *arg)
+{
+	struct stripe *h = arg;
+	struct stripe_io *io;
+
+	pthread_mutex_lock(&h->qlock);
+	for (;;) {
+		while (h->head == NULL && !h->stop)
+			pthread_cond_wait(&h->work, &h->qlock);
+		if (h->stop)
+			break;
+		io = h->head;
+		h->head = io->next;
+		if (h->head == NULL)
+			h->tail = &h->head;
+		pthread_mutex_unlock(&h->qlock);
+
+		*fuse_get_context() = io->req->ctx;
+		stripe_io_run(h, io);
+
+		pthread_mutex_lock(&h->qlock);
+		if (--io->req->pending == 0)
+			pthread_cond_broadcast(&h->done);
+	}
+	pthread_mutex_unlock(&h->qlock);
+	return NULL;
+}
+
+/*
+ * Read or write size bytes at off of an open striped file: one piece
+ * per chunk, all but the first on the workers.  Pieces of a read that
+ * come up short are holes, or past the end of the file.
+ */
+static int stripe_rw(struct stripe *h, char **comps, struct stripe_file *sf,
+		     int write, char *buf, size_t size, off_t off)
+{
+	struct stripe_req req;
+	struct stripe_io *io;
+	struct stat st;
+	unsigned n, i, k;
+	size_t done, len;
+	off_t c, pos;
+	int res, holes = 0;
+
+	if (size == 0)
+		return 0;
+	n = (off + size - 1) / sf->chunk - off / sf->chunk + 1;
+	io = calloc(n, sizeof(struct stripe_io));
+	if (io == NULL)
+		return -ENOMEM;
+
+	req.ctx = *fuse_get_context();
+	req.write = write;
+	req.pending = 0;
+	for (i = 0, done = 0; i < n; i++, done += len) {
+		pos = off + done;
+		c = pos / sf->chunk;
+		k = c % sf->width;
+		len = sf->chunk - pos % sf->chunk;
+		if (len > size - done)
+			len = size - done;
+		io[i].req = &req;
+		io[i].path = comps[k];
+		io[i].fi = &sf->fi[k];
+		io[i].buf = buf + done;
+		io[i].size = len;
+		io[i].off = c / sf->width * sf->chunk + pos % sf->chunk;
+	}
+
+	if (n > 1 && h->nthreads) {
+		pthread_mutex_lock(&h->qlock);
+		req.pending = n - 1;
+		for (i = 1; i < n; i++) {
+			*h->tail = &io[i];
+			h->tail = &io[i].next;
+		}
+		pthread_cond_broadcast(&h->work);
+		pthread_mutex_unlock(&h->qlock);
+	} else {
+		for (i = 1; i < n; i++)
+			stripe_io_run(h, &io[i]);
+	}
+	stripe_io_run(h, &io[0]);
+	if (n > 1 && h->nthreads) {
+		pthread_mutex_lock(&h->qlock);
+		while (req.pending)
+			pthread_cond_wait(&h->done, &h->qlock);
+		pthread_mutex_unlock(&h->qlock);
+	}
+
+	for (i = 0, done = 0; i < n; i++) {
+		res = io[i].res;
+		if (res < 0)
+			break;
+		if (!write && (size_t) res < io[i].size) {
+			memset(io[i].buf + res, 0, io[i].size - res);
+			res = io[i].size;
+			holes = 1;
+		}
+		done += res;
+		if ((size_t) res < io[i].size)
+			break;
+	}
+	res = io[0].res;
+	free(io);
+	if (done == 0 && res < 0)
+		return res;
+
+	if (holes) {
+		memset(&st, 0, sizeof(st));
+		res = stripe_attr(h, comps, sf, sf->width, sf->chunk, &st);
+		if (res)
+			return res;
+		if (st.st_size <= off)
+			done = 0;
+		else if ((off_t) done > st.st_size - off)
+			done = st.st_size - off;
+	}
+	return done;
+}
+
+static int stripe_rw_path(struct stripe *h, const char *path,
+			  struct stripe_file *sf, int write, char *buf,
+			  size_t size, off_t off)
+{
+	char **comps;
+	int res;
+
+	comps = stripe_comps(path, sf->width);
+	if (comps == NULL)
+		return -ENOMEM;
+	res = stripe_rw(h, comps, sf, write, buf, size, off);
+	stripe_comps_free(comps, sf->width);
+	if (write)
+		stripe_gen(h, 1);
+	return res;
+}
+
+/* Send gathered writes.  Called with sf->lock held. */
+static int stripe_flush_buf(struct stripe *h, struct stripe_file *sf)
+{
+	int res;
+
+	if (sf->wblen == 0)
+		return 0;
+	res = stripe_rw_path(h, sf->wpath, sf, 1, sf->wb, sf->wblen,
+			     sf->wboff);
+	if (res >= 0 && (size_t) res != sf->wblen)
+		res = -EIO;
+	sf->wblen = 0;
+	if (res < 0) {
+		if (!sf->werr)
+			sf->werr = res;
+		return res;
+	}
+	return 0;
+}
+
+/* Send the gathered writes of every open file. */
+static void stripe_flush_all(struct stripe *h)
+{
+	struct stripe_file *sf;
+
+	pthread_mutex_lock(&h->lock);
+	while ((sf = h->dirty) != NULL) {
+		h->dirty = sf->dnext;
+		sf->ondirty = 0;
+		pthread_mutex_lock(&sf->lock);
+		stripe_flush_buf(h, sf);
+		pthread_mutex_unlock(&sf->lock);
+	}
+	pthread_mutex_unlock(&h->lock);
+}
+
+static int stripe_getattr(const char *path, struct stat *stbuf)
+{
+	struct stripe *h = stripe_get();
+	unsigned width, chunk;
+	char **comps;
+	int res;
+
+	if (stripe_hidden(path))
+		return -ENOENT;
+	stripe_flush_all(h);
+	res = fuse_fs_getattr(h->next, path, stbuf);
+	if (res || !stripe_meta(h, path, stbuf, &width, &chunk))
+		return res;
+
+	comps = stripe_comps(path, width);
+	if (comps == NULL)
+		return -ENOMEM;
+	res = stripe_attr(h, comps, NULL, width, chunk, stbuf);
+	stripe_comps_free(comps, width);
+	return res;
+}
+
+static int stripe_fgetattr(const char *path, struct stat *stbuf,
+			   struct fuse_file_info *fi)
+{
+	struct stripe *h = stripe_get();
+	struct stripe_file *sf = stripe_fh(fi);
+	char **comps;
+	int res;
+
+	if (!sf->width)
+		return fuse_fs_fgetattr(h->next, path, stbuf, &sf->fi[0]);
+
+	stripe_flush_all(h);
+	res = fuse_fs_getattr(h->next, path, stbuf);
+	if (res)
+		return res;
+	comps = stripe_comps(path, sf->width);
+	if (comps == NULL)
+		return -ENOMEM;
+	res = stripe_attr(h, comps, sf, sf->width, sf->chunk, stbuf);
+	stripe_comps_free(comps, sf->width);
+	return res;
+}
+
+static struct stripe_file *stripe_file_new(unsigned width)
+{
+	struct stripe_file *sf;
+
+	sf = calloc(1, offsetof(struct stripe_file, fi) +
+		    (width ? width : 1) * sizeof(struct fuse_file_info));
+	if (sf == NULL)
+		return NULL;
+	pthread_mutex_init(&sf->lock, NULL);
+	sf->width = width;
+	return sf;
+}
+
+static void stripe_file_free(struct stripe_file *sf)
+{
+	pthread_mutex_destroy(&sf->lock);
+	free(sf->ra);
+	free(sf->wb);
+	free(sf->wpath);
+	free(sf);
+}
+
+static void stripe_file_set(struct fuse_file_info *fi, struct stripe_file *sf)
+{
+	fi->fh = (uintptr_t) sf;
+	fi->direct_io = sf->fi[0].direct_io;
+	fi->keep_cache = sf->fi[0].keep_cache;
+}
+
+/*
+ * Open (or with "create", create) the components of a striped file.
+ * A component that's missing is created empty: it reads as a hole.
+ */
+static int stripe_open_comps(struct stripe *h, const char *path,
+			     struct fuse_file_info *fi, mode_t mode,
+			     unsigned width, unsigned chunk, int create)
+{
+	struct stripe_file *sf;
+	char **comps;
+	unsigned k;
+	int res = 0;
+
+	sf = stripe_file_new(width);
+	comps = stripe_comps(path, width);
+	if (sf == NULL || comps == NULL) {
+		if (sf)
+			stripe_file_free(sf);
+		return -ENOMEM;
+	}
+	sf->chunk = chunk;
+
+	for (k = 0; k < width; k++) {
+		sf->fi[k] = *fi;
+		sf->fi[k].fh = 0;
+		sf->fi[k].flags &= ~(O_APPEND | O_EXCL);
+		if (!create)
+			res = fuse_fs_open(h->next, comps[k], &sf->fi[k]);
+		if (create || res == -ENOENT) {
+			sf->fi[k].flags |= O_CREAT | O_TRUNC;
+			res = fuse_fs_create(h->next, comps[k], mode,
+					     &sf->fi[k]);
+		}
+		if (res)
+			break;
+	}
+	if (res) {
+		while (k-- > 0) {
+			fuse_fs_release(h->next, comps[k], &sf->fi[k]);
+			if (create)
+				fuse_fs_unlink(h->next, comps[k]);
+		}
+		stripe_file_free(sf);
+	} else {
+		stripe_file_set(fi, sf);
+	}
+	stripe_comps_free(comps, width);
+	return res;
+}
+
+static int stripe_open(const char *path, struct fuse_file_info *fi)
+{
+	struct stripe *h = stripe_get();
+	struct stripe_file *sf;
+	struct stat st;
+	unsigned width, chunk;
+	int res;
+
+	if (stripe_hidden(path))
+		return -ENOENT;
+	res = fuse_fs_getattr(h->next, path, &st);
+	if (!res && stripe_meta(h, path, &st, &width, &chunk))
+		return stripe_open_comps(h, path, fi, st.st_mode & 07777,
+					 width, chunk, 0);
+
+	sf = stripe_file_new(0);
+	if (sf == NULL)
+		return -ENOMEM;
+	sf->fi[0] = *fi;
+	res = fuse_fs_open(h->next, path, &sf->fi[0]);
+	if (res)
+		stripe_file_free(sf);
+	else
+		stripe_file_set(fi, sf);
+	return res;
+}
+
+/*
+ * Files created here are striped.  The record is left readable, so
+ * it can be read whatever the mode; the mode shown is that of the
+ * components.
+ */
+static int stripe_create(const char *path, mode_t mode,
+			 struct fuse_file_info *fi)
+{
+	struct stripe *h = stripe_get();
+	struct stripe_file *sf;
+	struct fuse_file_info hfi;
+	char hdr[STRIPE_HDRSIZE + 1];
+	struct stat st;
+	int res;
+
+	if (stripe_hidden(path))
+		return -EPERM;
+	if (h->width < 2) {
+		sf = stripe_file_new(0);
+		if (sf == NULL)
+			return -ENOMEM;
+		sf->fi[0] = *fi;
+		res = fuse_fs_create(h->next, path, mode, &sf->fi[0]);
+		if (res)
+			stripe_file_free(sf);
+		else
+			stripe_file_set(fi, sf);
+		return res;
+	}
+
+	if (fuse_fs_getattr(h->next, path, &st) == 0) {
+		if (fi->flags & O_EXCL)
+			return -EEXIST;
+		return stripe_open(path, fi);
+	}
+
+	res = snprintf(hdr, sizeof(hdr), STRIPE_MAGIC " %u %u %u",
+		       STRIPE_VERSION, h->width, h->chunk);
+	memset(hdr + res, ' ', STRIPE_HDRSIZE - 1 - res);
+	hdr[STRIPE_HDRSIZE - 1] = '\n';
+
+	memset(&hfi, 0, sizeof(hfi));
+	hfi.flags = O_WRONLY | O_CREAT | O_EXCL;
+	res = fuse_fs_create(h->next, path, mode | 0444, &hfi);
+	if (res)
+		return res;
+	res = fuse_fs_write(h->next, path, hdr, STRIPE_HDRSIZE, 0, &hfi);
+	fuse_fs_release(h->next, path, &hfi);
+	if (res == STRIPE_HDRSIZE)
+		res = stripe_open_comps(h, path, fi, mode, h->width, h->chunk,
+					1);
+	else if (res >= 0)
+		res = -EIO;
+	if (res)
+		fuse_fs_unlink(h->next, path);
+	return res;
+}
+
+/*
+ * Reads of a striped file that carry on from the last one are served
+ * from a row read at once from all the components.
+ */
+static int stripe_read(const char *path, char *buf, size_t size,
+		       off_t offset, struct fuse_file_info *fi)
+{
+	struct stripe *h = stripe_get();
+	struct stripe_file *sf = stripe_fh(fi);
+	unsigned long gen;
+	size_t row;
+	off_t end;
+	int res;
+
+	if (!sf->width)
+		return fuse_fs_read(h->next, path, buf, size, offset,
+				    &sf->fi[0]);
+
+	row = (size_t) sf->chunk * sf->width;
+	pthread_mutex_lock(&sf->lock);
+	res = stripe_flush_buf(h, sf);
+	if (res)
+		goto out;
+
+	gen = stripe_gen(h, 0);
+	if (h->ahead && size < row && offset == sf->nextoff &&
+	    (sf->ragen != gen || offset < sf->raoff ||
+	     offset >= sf->raoff + (off_t) row)) {
+		if (sf->ra == NULL)
+			sf->ra = malloc(row);
+		sf->ralen = 0;
+		sf->raeof = 0;
+		if (sf->ra) {
+			sf->raoff = offset - offset % row;
+			sf->ragen = gen;
+			res = stripe_rw_path(h, path, sf, 0, sf->ra, row,
+					     sf->raoff);
+			if (res >= 0) {
+				sf->ralen = res;
+				sf->raeof = (size_t) res < row;
+			}
+		}
+	}
+
+	end = sf->raoff + sf->ralen;
+	if ((sf->ralen || sf->raeof) && sf->ragen == gen &&
+	    offset >= sf->raoff &&
+	    (offset + (off_t) size <= end || sf->raeof)) {
+		res = 0;
+		if (offset < end) {
+			res = end - offset;
+			if ((size_t) res > size)
+				res = size;
+			memcpy(buf, sf->ra + (offset - sf->raoff), res);
+		}
+	} else {
+		res = stripe_rw_path(h, path, sf, 0, buf, size, offset);
+	}
+	if (res > 0)
+		sf->nextoff = offset + res;
+out:
+	pthread_mutex_unlock(&sf->lock);
+	return res;
+}
+
+/*
+ * Writes to a striped file that carry on from the last one are
+ * gathered until there's a row of them.
+ */
+static int stripe_write(const char *path, const char *buf, size_t size,
+			off_t offset, struct fuse_file_info *fi)
+{
+	struct stripe *h = stripe_get();
+	struct stripe_file *sf = stripe_fh(fi);
+	size_t row;
+	int res, dirty;
+
+	if (!sf->width)
+		return fuse_fs_write(h->next, path, buf, size, offset,
+				     &sf->fi[0]);
+
+	row = (size_t) sf->chunk * sf->width;
+	pthread_mutex_lock(&sf->lock);
+	sf->ralen = 0;
+	sf->raeof = 0;
+	if (sf->werr) {
+		res = sf->werr;
+		sf->werr = 0;
+		goto out;
+	}
+	if (sf->wblen && (offset != sf->wboff + (off_t) sf->wblen ||
+			  sf->wblen + size > row ||
+			  strcmp(path, sf->wpath) != 0)) {
+		res = stripe_flush_buf(h, sf);
+		if (res) {
+			sf->werr = 0;
+			goto out;
+		}
+	}
+
+	if (sf->wblen == 0) {
+		if (h->ahead && size < row && sf->wb == NULL)
+			sf->wb = malloc(row);
+		if (!h->ahead || size >= row || sf->wb == NULL)
+			goto direct;
+		if (sf->wpath == NULL || strcmp(path, sf->wpath) != 0) {
+			free(sf->wpath);
+			sf->wpath = strdup(path);
+			if (sf->wpath == NULL)
+				goto direct;
+		}
+		sf->wboff = offset;
+	}
+	memcpy(sf->wb + sf->wblen, buf, size);
+	sf->wblen += size;
+	res = size;
+	if (sf->wblen == row && stripe_flush_buf(h, sf)) {
+		res = sf->werr;
+		sf->werr = 0;
+	}
+	goto out;
+
+direct:
+	res = stripe_rw_path(h, path, sf, 1, (char *) buf, size, offset);
+out:
+	dirty = sf->wblen != 0;
+	pthread_mutex_unlock(&sf->lock);
+
+	if (dirty) {
+		pthread_mutex_lock(&h->lock);
+		if (!sf->ondirty) {
+			sf->ondirty = 1;
+			sf->dnext = h->dirty;
+			h->dirty = sf;
+		}
+		pthread_mutex_unlock(&h->lock);
+	}
+	return res;
+}
+
+/* Send gathered writes, and return any error from sending earlier ones. */
+static int stripe_sync_buf(struct stripe *h, struct stripe_file *sf)
+{
+	int res;
+
+	pthread_mutex_lock(&sf->lock);
+	stripe_flush_buf(h, sf);
+	res = sf->werr;
+	sf->werr = 0;
+	pthread_mutex_unlock(&sf->lock);
+	return res;
+}
+
+static int stripe_flush(const char *path, struct fuse_file_info *fi)
+{
+	struct stripe *h = stripe_get();
+	struct stripe_file *sf = stripe_fh(fi);
+	char **comps;
+	unsigned k;
+	int res, err;
+
+	if (!sf->width) {
+		sf->fi[0].lock_owner = fi->lock_owner;
+		return fuse_fs_flush(h->next, path, &sf->fi[0]);
+	}
+
+	res = stripe_sync_buf(h, sf);
+	comps = stripe_comps(path, sf->width);
+	if (comps == NULL)
+		return res ? res : -ENOMEM;
+	for (k = 0; k < sf->width; k++) {
+		sf->fi[k].lock_owner = fi->lock_owner;
+		err = fuse_fs_flush(h->next, comps[k], &sf->fi[k]);
+		if (!res)
+			res = err;
+	}
+	stripe_comps_free(comps, sf->width);
+	return res;
+}
+
+static int stripe_fsync(const char *path, int isdatasync,
+			struct fuse_file_info *fi)
+{
+	struct stripe *h = stripe_get();
+	struct stripe_file *sf = stripe_fh(fi);
+	char **comps;
+	unsigned k;
+	int res, err;
+
+	if (!sf->width)
+		return fuse_fs_fsync(h->next, path, isdatasync, &sf->fi[0]);
+
+	res = stripe_sync_buf(h, sf);
+	comps = stripe_comps(path, sf->width);
+	if (comps == NULL)
+		return res ? res : -ENOMEM;
+	for (k = 0; k < sf->width; k++) {
+		err = fuse_fs_fsync(h->next, comps[k], isdatasync,
+				    &sf->fi[k]);
+		if (!res)
+			res = err;
+	}
+	stripe_comps_free(comps, sf->width);
+	return res;
+}
+
+static int stripe_release(const char *path, struct fuse_file_info *fi)
+{
+	struct stripe *h = stripe_get();
+	struct stripe_file *sf = stripe_fh(fi), **sfp;
+	char **comps;
+	unsigned k;
+
+	if (!sf->width) {
+		sf->fi[0].flush = fi->flush;
+		sf->fi[0].lock_owner = fi->lock_owner;
+		fuse_fs_release(h->next, path, &sf->fi[0]);
+		stripe_file_free(sf);
+		return 0;
+	}
+
+	pthread_mutex_lock(&h->lock);
+	for (sfp = &h->dirty; *sfp; sfp = &(*sfp)->dnext) {
+		if (*sfp == sf) {
+			*sfp = sf->dnext;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&h->lock);
+
+	stripe_sync_buf(h, sf);
+	comps = stripe_comps(path, sf->width);
+	for (k = 0; k < sf->width; k++) {
+		sf->fi[k].flush = fi->flush;
+		sf->fi[k].lock_owner = fi->lock_owner;
+		fuse_fs_release(h->next, comps ? comps[k] : path, &sf->fi[k]);
+	}
+	if (comps)
+		stripe_comps_free(comps, sf->width);
+	stripe_file_free(sf);
+	return 0;
+}
+
+static int stripe_truncate(const char *path, off_t size)
+{
+	struct stripe *h = stripe_get();
+	unsigned width, chunk, k;
+	char **comps;
+	int res;
+
+	stripe_flush_all(h);
+	res = stripe_lookup(h, path, &width, &chunk);
+	if (res <= 0)
+		return res ? res : fuse_fs_truncate(h->next, path, size);
+
+	comps = stripe_comps(path, width);
+	if (comps == NULL)
+		return -ENOMEM;
+	res = 0;
+	for (k = 0; k < width && !res; k++)
+		res = fuse_fs_truncate(h->next, comps[k],
+				       stripe_comp_size(size, k, width, chunk));
+	stripe_comps_free(comps, width);
+	stripe_gen(h, 1);
+	return res;
+}
+
+static int stripe_ftruncate(const char *path, off_t size,
+			    struct fuse_file_info *fi)
+{
+	struct stripe *h = stripe_get();
+	struct stripe_file *sf = stripe_fh(fi);
+	char **comps;
+	unsigned k;
+	int res;
+
+	if (!sf->width)
+		return fuse_fs_ftruncate(h->next, path, size, &sf->fi[0]);
+
+	stripe_flush_all(h);
+	comps = stripe_comps(path, sf->width);
+	if (comps == NULL)
+		return -ENOMEM;
+	res = 0;
+	for (k = 0; k < sf->width && !res; k++)
+		res = fuse_fs_ftruncate(h->next, comps[k],
+					stripe_comp_size(size, k, sf->width,
+							 sf->chunk),
+					&sf->fi[k]);
+	stripe_comps_free(comps, sf->width);
+	stripe_gen(h, 1);
+	return res;
+}
+
+/* Holes could be punched in each component; not done yet. */
+static int stripe_fallocate(const char *path, int mode, off_t offset,
+			    off_t length, struct fuse_file_info *fi)
+{
+	struct stripe *h = stripe_get();
+	struct stripe_file *sf = stripe_fh(fi);
+
+	if (sf->width)
+		return -EOPNOTSUPP;
+	return fuse_fs_fallocate(h->next, path, mode, offset, length,
+				 &sf->fi[0]);
+}
+
+static int stripe_unlink(const char *path)
+{
+	struct stripe *h = stripe_get();
+	unsigned width, chunk, k;
+	char **comps;
+	int res, striped;
+
+	stripe_flush_all(h);
+	striped = stripe_lookup(h, path, &width, &chunk) == 1;
+	res = fuse_fs_unlink(h->next, path);
+	if (res || !striped)
+		return res;
+
+	comps = stripe_comps(path, width);
+	if (comps == NULL)
+		return 0;
+	for (k = 0; k < width; k++)
+		fuse_fs_unlink(h->next, comps[k]);
+	stripe_comps_free(comps, width);
+	stripe_gen(h, 1);
+	return 0;
+}
+
+/*
+ * Move the components first, then the record; components of a
+ * striped file that's replaced, and that weren't moved over, go.
+ */
+static int stripe_rename(const char *from, const char *to)
+{
+	struct stripe *h = stripe_get();
+	unsigned fwidth = 0, twidth = 0, chunk, k;
+	char **fcomps = NULL, **tcomps = NULL;
+	int res;
+
+	if (stripe_hidden(to))
+		return -EPERM;
+	stripe_flush_all(h);
+	if (stripe_lookup(h, from, &fwidth, &chunk) != 1)
+		fwidth = 0;
+	if (stripe_lookup(h, to, &twidth, &chunk) != 1)
+		twidth = 0;
+	if (fwidth == 0 && twidth == 0)
+		return fuse_fs_rename(h->next, from, to);
+
+	res = -ENOMEM;
+	if (fwidth) {
+		fcomps = stripe_comps(from, fwidth);
+		tcomps = stripe_comps(to, fwidth > twidth ? fwidth : twidth);
+		if (fcomps == NULL || tcomps == NULL)
+			goto out;
+	} else {
+		tcomps = stripe_comps(to, twidth);
+		if (tcomps == NULL)
+			goto out;
+	}
+
+	res = 0;
+	for (k = 0; k < fwidth; k++) {
+		res = fuse_fs_rename(h->next, fcomps[k], tcomps[k]);
+		if (res)
+			break;
+	}
+	if (!res)
+		res = fuse_fs_rename(h->next, from, to);
+	if (res) {
+		while (k-- > 0)
+			fuse_fs_rename(h->next, tcomps[k], fcomps[k]);
+		goto out;
+	}
+	for (k = fwidth; k < twidth; k++)
+		fuse_fs_unlink(h->next, tcomps[k]);
+	stripe_gen(h, 1);
+
+out:
+	if (fcomps)
+		stripe_comps_free(fcomps, fwidth);
+	if (tcomps)
+		stripe_comps_free(tcomps, fwidth > twidth ? fwidth : twidth);
+	return res;
+}
+
+static int stripe_link(const char *from, const char *to)
+{
+	struct stripe *h = stripe_get();
+	unsigned width, chunk;
+
+	if (stripe_hidden(to) || stripe_lookup(h, from, &width, &chunk) == 1)
+		return -EPERM;
+	return fuse_fs_link(h->next, from, to);
+}
+
+/* Apply a change of mode, owner or times to the components too. */
+static int stripe_setattr(const char *path, const mode_t *mode,
+			  const uid_t *uid, const gid_t *gid,
+			  const struct timespec *ts)
+{
+	struct stripe *h = stripe_get();
+	unsigned width = 0, chunk, k;
+	char **comps = NULL;
+	const char *p;
+	int res;
+
+	if (stripe_lookup(h, path, &width, &chunk) == 1) {
+		comps = stripe_comps(path, width);
+		if (comps == NULL)
+			return -ENOMEM;
+	} else {
+		width = 0;
+	}
+
+	res = 0;
+	for (k = 0; k <= width && !res; k++) {
+		p = k < width ? comps[k] : path;
+		if (mode)
+			res = fuse_fs_chmod(h->next, p,
+					    k < width || !comps ?
+					    *mode : *mode | 0444);
+		else if (uid)
+			res = fuse_fs_chown(h->next, p, *uid, *gid);
+		else
+			res = fuse_fs_utimens(h->next, p, ts);
+	}
+	if (comps)
+		stripe_comps_free(comps, width);
+	return res;
+}
+
+static int stripe_chmod(const char *path, mode_t mode)
+{
+	return stripe_setattr(path, &mode, NULL, NULL, NULL);
+}
+
+static int stripe_chown(const char *path, uid_t uid, gid_t gid)
+{
+	return stripe_setattr(path, NULL, &uid, &gid, NULL);
+}
+
+static int stripe_utimens(const char *path, const struct timespec ts[2])
+{
+	return stripe_setattr(path, NULL, NULL, NULL, ts);
+}
+
+struct stripe_dirbuf {
+	void *buf;
+	fuse_fill_dir_t filler;
+};
+
+static int stripe_fill(void *buf, const char *name, const struct stat *st,
+		       off_t off)
+{
+	struct stripe_dirbuf *d = buf;
+
+	if (stripe_hidden(name))
+		return 0;
+	return d->filler(d->buf, name, st, off);
+}
+
+static int stripe_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			  off_t offset, struct fuse_file_info *fi)
+{
+	struct stripe_dirbuf d = { buf, filler };
+
+	return fuse_fs_readdir(stripe_get()->next, path, &d, stripe_fill,
+			       offset, fi);
+}
+
+static int stripe_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+	if (stripe_hidden(path))
+		return -EPERM;
+	return fuse_fs_mknod(stripe_get()->next, path, mode, rdev);
+}
+
+static int stripe_mkdir(const char *path, mode_t mode)
+{
+	if (stripe_hidden(path))
+		return -EPERM;
+	return fuse_fs_mkdir(stripe_get()->next, path, mode);
+}
+
+static int stripe_symlink(const char *from, const char *path)
+{
+	if (stripe_hidden(path))
+		return -EPERM;
+	return fuse_fs_symlink(stripe_get()->next, from, path);
+}
+
+static int stripe_lock(const char *path, struct fuse_file_info *fi, int cmd,
+		       struct flock *lock)
+{
+	struct stripe_file *sf = stripe_fh(fi);
+	char **comps;
+	int res;
+
+	sf->fi[0].lock_owner = fi->lock_owner;
+	if (!sf->width)
+		return fuse_fs_lock(stripe_get()->next, path, &sf->fi[0], cmd,
+				    lock);
+
+	/* Locks are kept on the first component. */
+	comps = stripe_comps(path, 1);
+	if (comps == NULL)
+		return -ENOMEM;
+	res = fuse_fs_lock(stripe_get()->next, comps[0], &sf->fi[0], cmd,
+			   lock);
+	stripe_comps_free(comps, 1);
+	return res;
+}
+
+/*
+ * An ioctl has no meaning spread over the components, so only
+ * unstriped files take one.  Poll asks the first component.
+ */
+static int stripe_ioctl(const char *path, int cmd, void *arg,
+			struct fuse_file_info *fi, unsigned int flags,
+			void *data)
+{
+	struct stripe_file *sf = stripe_fh(fi);
+
+	if (sf->width)
+		return -ENOTTY;
+	return fuse_fs_ioctl(stripe_get()->next, path, cmd, arg, &sf->fi[0],
+			     flags, data);
+}
+
+static int stripe_poll(const char *path, struct fuse_file_info *fi,
+		       struct fuse_pollhandle *ph, unsigned *reventsp)
+{
+	struct stripe_file *sf = stripe_fh(fi);
+	char **comps;
+	int res;
+
+	if (!sf->width)
+		return fuse_fs_poll(stripe_get()->next, path, &sf->fi[0], ph,
+				    reventsp);
+
+	comps = stripe_comps(path, 1);
+	if (comps == NULL)
+		return -ENOMEM;
+	res = fuse_fs_poll(stripe_get()->next, comps[0], &sf->fi[0], ph,
+			   reventsp);
+	stripe_comps_free(comps, 1);
+	return res;
+}
+
+static int stripe_access(const char *path, int mask)
+{
+	return fuse_fs_access(stripe_get()->next, path, mask);
+}
+
+static int stripe_readlink(const char *path, char *buf, size_t size)
+{
+	return fuse_fs_readlink(stripe_get()->next, path, buf, size);
+}
+
+static int stripe_opendir(const char *path, struct fuse_file_info *fi)
+{
+	return fuse_fs_opendir(stripe_get()->next, path, fi);
+}
+
+static int stripe_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	return fuse_fs_releasedir(stripe_get()->next, path, fi);
+}
+
+static int stripe_fsyncdir(const char *path, int isdatasync,
+			   struct fuse_file_info *fi)
+{
+	return fuse_fs_fsyncdir(stripe_get()->next, path, isdatasync, fi);
+}
+
+static int stripe_rmdir(const char *path)
+{
+	return fuse_fs_rmdir(stripe_get()->next, path);
+}
+
+/*
+ * The components are in the same directories as their records, so
+ * they go with the tree.  There's no sumtree: the next filesystem
+ * would count the components as entries of their own.
+ */
+static int stripe_rmtree(const char *path)
+{
+	struct stripe *h = stripe_get();
+
+	stripe_flush_all(h);
+	return fuse_fs_rmtree(h->next, path);
+}
+
+static int stripe_statfs(const char *path, struct statvfs *stbuf)
+{
+	return fuse_fs_statfs(stripe_get()->next, path, stbuf);
+}
+
+static int stripe_setxattr(const char *path, const char *name,
+			   const char *value, size_t size, int flags)
+{
+	return fuse_fs_setxattr(stripe_get()->next, path, name, value, size,
+				flags);
+}
+
+/*
+ * A digest from below would be of the record at path, not of the
+ * file's contents, so let a digest module above us compute it.
+ */
+static int stripe_getxattr(const char *path, const char *name, char *value,
+			   size_t size)
+{
+	struct stripe *h = stripe_get();
+	unsigned width, chunk;
+	int res;
+
+	if (strncmp(name, FUSE_DIGEST_XATTR,
+		    sizeof(FUSE_DIGEST_XATTR) - 1) == 0) {
+		res = stripe_lookup(h, path, &width, &chunk);
+		if (res < 0)
+			return res;
+		if (res == 1)
+			return -ENOTSUP;
+	}
+	return fuse_fs_getxattr(h->next, path, name, value, size);
+}
+
+static int stripe_listxattr(const char *path, char *list, size_t size)
+{
+	return fuse_fs_listxattr(stripe_get()->next, path, list, size);
+}
+
+static int stripe_removexattr(const char *path, const char *name)
+{
+	return fuse_fs_removexattr(stripe_get()->next, path, name);
+}
+
+/* The blocks of a striped file are in its components, not at path. */
+static int stripe_bmap(const char *path, size_t blocksize, uint64_t *idx)
+{
+	struct stripe *h = stripe_get();
+	unsigned width, chunk;
+	int res;
+
+	res = stripe_lookup(h, path, &width, &chunk);
+	if (res < 0)
+		return res;
+	if (res == 1)
+		return -EINVAL;
+	return fuse_fs_bmap(h->next, path, blocksize, idx);
+}
+
+/*
+ * Start the workers here rather than in stripe_new, which runs
+ * before the daemon forks into the background.
+ */
+static void *stripe_init(struct fuse_conn_info *conn)
+{
+	struct stripe *h = stripe_get();
+	unsigned i;
+
+	fuse_fs_init(h->next, conn);
+
+	h->threads = calloc(h->nthreads, sizeof(pthread_t));
+	if (h->threads == NULL) {
+		fprintf(stderr, "fuse-stripe: memory allocation failed\n");
+		h->nthreads = 0;
+		return h;
+	}
+	for (i = 0; i < h->nthreads; i++) {
+		if (pthread_create(&h->threads[i], NULL, stripe_worker, h))
+			break;
+	}
+	if (i < h->nthreads)
+		fprintf(stderr, "fuse-stripe: started only %u threads\n", i);
+	pthread_mutex_lock(&h->qlock);
+	h->nthreads = i;
+	pthread_mutex_unlock(&h->qlock);
+	return h;
+}
+
+static void stripe_destroy(void *data)
+{
+	struct stripe *h = data;
+	unsigned i;
+
+	pthread_mutex_lock(&h->qlock);
+	h->stop = 1;
+	pthread_cond_broadcast(&h->work);
+	pthread_mutex_unlock(&h->qlock);
+	for (i = 0; i < h->nthreads; i++)
+		pthread_join(h->threads[i], NULL);
+	free(h->threads);
+
+	fuse_fs_destroy(h->next);
+	pthread_cond_destroy(&h->done);
+	pthread_cond_destroy(&h->work);
+	pthread_mutex_destroy(&h->qlock);
+	pthread_mutex_destroy(&h->glock);
+	pthread_mutex_destroy(&h->lock);
+	free(h);
+}
+
+static struct fuse_operations stripe_oper = {
+	.destroy	= stripe_destroy,
+	.init		= stripe_init,
+	.getattr	= stripe_getattr,
+	.fgetattr	= stripe_fgetattr,
+	.access		= stripe_access,
+	.readlink	= stripe_readlink,
+	.opendir	= stripe_opendir,
+	.readdir	= stripe_readdir,
+	.releasedir	= stripe_releasedir,
+	.mknod		= stripe_mknod,
+	.mkdir		= stripe_mkdir,
+	.symlink	= stripe_symlink,
+	.unlink		= stripe_unlink,
+	.rmdir		= stripe_rmdir,
+	.rename		= stripe_rename,
+	.link		= stripe_link,
+	.chmod		= stripe_chmod,
+	.chown		= stripe_chown,
+	.truncate	= stripe_truncate,
+	.ftruncate	= stripe_ftruncate,
+	.utimens	= stripe_utimens,
+	.create		= stripe_create,
+	.open		= stripe_open,
+	.read		= stripe_read,
+	.write		= stripe_write,
+	.statfs		= stripe_statfs,
+	.flush		= stripe_flush,
+	.release	= stripe_release,
+	.fsync		= stripe_fsync,
+	.fsyncdir	= stripe_fsyncdir,
+	.setxattr	= stripe_setxattr,
+	.getxattr	= stripe_getxattr,
+	.listxattr	= stripe_listxattr,
+	.removexattr	= stripe_removexattr,
+	.lock		= stripe_lock,
+	.bmap		= stripe_bmap,
+	.ioctl		= stripe_ioctl,
+	.poll		= stripe_poll,
+	.fallocate	= stripe_fallocate,
+	.rmtree		= stripe_rmtree,
+};
+
+static struct fuse_opt stripe_opts[] = {
+	FUSE_OPT_KEY("-h", 0),
+	FUSE_OPT_KEY("--help", 0),
+	{ "stripe_width=%u", offsetof(struct stripe, width), 0 },
+	{ "stripe_size=%u", offsetof(struct stripe, chunk), 0 },
+	{ "stripe_threads=%u", offsetof(struct stripe, nthreads), 0 },
+	{ "stripe_ahead=%u", offsetof(struct stripe, ahead), 0 },
+	FUSE_OPT_END
+};
+
+static void stripe_help(void)
+{
+	fprintf(stderr,
+"    -o stripe_width=N      components of new files, 1 for none (%u)\n"
+"    -o stripe_size=N       bytes per chunk (%u)\n"
+"    -o stripe_threads=N    worker threads (%u)\n"
+"    -o stripe_ahead=0|1    read ahead and gather writes a row at a time\n",
+		STRIPE_WIDTH_DEFAULT, STRIPE_SIZE_DEFAULT,
+		STRIPE_THREADS_DEFAULT);
+}
+
+static int stripe_opt_proc(void *data, const char *arg, int key,
+			   struct fuse_args *outargs)
+{
+	(void) data; (void) arg; (void) outargs;
+
+	if (!key) {
+		stripe_help();
+		return -1;
+	}
+
+	return 1;
+}
+
+static struct fuse_fs *stripe_new(struct fuse_args *args,
+				  struct fuse_fs *next[])
+{
+	struct fuse_fs *fs;
+	struct stripe *h;
+
+	h = calloc(1, sizeof(struct stripe));
+	if (h == NULL) {
+		fprintf(stderr, "fuse-stripe: memory allocation failed\n");
+		return NULL;
+	}
+
+	h->width = STRIPE_WIDTH_DEFAULT;
+	h->chunk = STRIPE_SIZE_DEFAULT;
+	h->nthreads = STRIPE_THREADS_DEFAULT;
+	h->ahead = 1;
+	if (fuse_opt_parse(args, h, stripe_opts, stripe_opt_proc) == -1)
+		goto out_free;
+
+	if (!next[0] || next[1]) {
+		fprintf(stderr, "fuse-stripe: exactly one next filesystem required\n");
+		goto out_free;
+	}
+
+	if (h->width == 0)
+		h->width = 1;
+	if (h->width > STRIPE_MAXWIDTH || h->chunk == 0 ||
+	    (unsigned long long) h->chunk * h->width > STRIPE_MAXROW) {
+		fprintf(stderr, "fuse-stripe: bad stripe size\n");
+		goto out_free;
+	}
+
+	pthread_mutex_init(&h->lock, NULL);
+	pthread_mutex_init(&h->glock, NULL);
+	pthread_mutex_init(&h->qlock, NULL);
+	pthread_cond_init(&h->work, NULL);
+	pthread_cond_init(&h->done, NULL);
+	h->tail = &h->head;
+	h->next = next[0];
+	fs = fuse_fs_new(&stripe_oper, sizeof(stripe_oper), h);
+	if (!fs)
+		goto out_destroy;
+	return fs;
+
+out_destroy:
+	pthread_cond_destroy(&h->done);
+	pthread_cond_destroy(&h->work);
+	pthread_mutex_destroy(&h->qlock);
+	pthread_mutex_destroy(&h->glock);
+	pthread_mutex_destroy(&h->lock);
+out_free:
+	free(h);
+	return NULL;
+}
+
+FUSE_REGISTER_MODULE(stripe, stripe_new);
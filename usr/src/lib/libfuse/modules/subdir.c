@@ -252,6 +252,30 @@ static int subdir_rmdir(const char *path)
 	return err;
 }
 
+static int subdir_rmtree(const char *path)
+{
+	struct subdir *d = subdir_get();
+	char *newpath;
+	int err = subdir_addpath(d, path, &newpath);
+	if (!err) {
+		err = fuse_fs_rmtree(d->next, newpath);
+		free(newpath);
+	}
+	return err;
+}
+
+static int subdir_sumtree(const char *path, struct fuse_treesum *sum)
+{
+	struct subdir *d = subdir_get();
+	char *newpath;
+	int err = subdir_addpath(d, path, &newpath);
+	if (!err) {
+		err = fuse_fs_sumtree(d->next, newpath, sum);
+		free(newpath);
+	}
+	return err;
+}
+
 static int subdir_symlink(const char *from, const char *path)
 {
 	struct subdir *d = subdir_get();
@@ -347,6 +371,20 @@ static int subdir_ftruncate(const char *path, off_t size,
 	return err;
 }
 
+static int subdir_fallocate(const char *path, int mode, off_t offset,
+			    off_t length, struct fuse_file_info *fi)
+{
+	struct subdir *d = subdir_get();
+	char *newpath;
+	int err = subdir_addpath(d, path, &newpath);
+	if (!err) {
+		err = fuse_fs_fallocate(d->next, newpath, mode, offset,
+					length, fi);
+		free(newpath);
+	}
+	return err;
+}
+
 static int subdir_utimens(const char *path, const struct timespec ts[2])
 {
 	struct subdir *d = subdir_get();
@@ -548,6 +586,34 @@ static int subdir_bmap(const char *path, size_t blocksize, uint64_t *idx)
 	return err;
 }
 
+static int subdir_ioctl(const char *path, int cmd, void *arg,
+			struct fuse_file_info *fi, unsigned int flags,
+			void *data)
+{
+	struct subdir *d = subdir_get();
+	char *newpath;
+	int err = subdir_addpath(d, path, &newpath);
+	if (!err) {
+		err = fuse_fs_ioctl(d->next, newpath, cmd, arg, fi, flags,
+				    data);
+		free(newpath);
+	}
+	return err;
+}
+
+static int subdir_poll(const char *path, struct fuse_file_info *fi,
+		       struct fuse_pollhandle *ph, unsigned *reventsp)
+{
+	struct subdir *d = subdir_get();
+	char *newpath;
+	int err = subdir_addpath(d, path, &newpath);
+	if (!err) {
+		err = fuse_fs_poll(d->next, newpath, fi, ph, reventsp);
+		free(newpath);
+	}
+	return err;
+}
+
 static void *subdir_init(struct fuse_conn_info *conn)
 {
 	struct subdir *d = subdir_get();
@@ -600,6 +666,11 @@ static struct fuse_operations subdir_oper = {
 	.removexattr	= subdir_removexattr,
 	.lock		= subdir_lock,
 	.bmap		= subdir_bmap,
+	.ioctl		= subdir_ioctl,
+	.poll		= subdir_poll,
+	.fallocate	= subdir_fallocate,
+	.rmtree		= subdir_rmtree,
+	.sumtree	= subdir_sumtree,
 
 	.flag_nullpath_ok = 1,
 };
@@ -38,9 +38,11 @@
 
 #include <sys/param.h>
 #include <sys/fstyp.h>
+#include <sys/atomic.h>
 #include <sys/avl.h>
 #include <sys/list.h>
 #include <sys/t_lock.h>
+#include <sys/taskq.h>
 #include <sys/vfs.h>
 #include <sys/vfs_opreg.h>
 #include <sys/fs/fusefs_mount.h>
@@ -68,12 +70,42 @@
 #define	SM_STATUS_STATFS_WANT 0x00000002 /* statvfs wakeup is wanted */
 #define	SM_STATUS_TIMEO 0x00000004 /* this mount is not responding */
 #define	SM_STATUS_DEAD	0x00000010 /* connection gone - unmount this */
+#define	SM_STATUS_MEMRECLAIM 0x00000020 /* fusefs_mem_reclaim running */
+#define	SM_STATUS_NOPOLL 0x00000040 /* daemon does not implement poll */
+#define	SM_STATUS_NOIOCTL 0x00000080 /* daemon does not implement ioctl */
+#define	SM_STATUS_NOFALLOC 0x00000100 /* file system can't punch holes */
+#define	SM_STATUS_NOBMAP 0x00000200 /* daemon does not implement bmap */
+#define	SM_STATUS_NOACL 0x00000400 /* file system has no ACLs */
 
 extern const struct fs_operation_def	fusefs_vnodeops_template[];
 extern struct vnodeops			*fusefs_vnodeops;
 
 struct fusenode; /* fusefs_node.h */
 
+/*
+ * I/O limits (token buckets), per mount and per zone.
+ * See fusefs_qos.c
+ */
+#define	FUSEFS_QOS_READ		0	/* bytes read */
+#define	FUSEFS_QOS_WRITE	1	/* bytes written */
+#define	FUSEFS_QOS_OPS		2	/* upcalls */
+#define	FUSEFS_QOS_NB		3
+
+typedef struct fusefs_tbucket {
+	uint64_t	tb_rate;	/* per second, zero: no limit */
+	int64_t		tb_tokens;	/* negative: debt being waited out */
+	hrtime_t	tb_last;	/* last refill */
+	uint64_t	tb_ndelay;	/* callers delayed */
+	uint64_t	tb_delay_ns;	/* total delay */
+} fusefs_tbucket_t;
+
+typedef struct fusefs_qos {
+	kmutex_t		q_lock;
+	boolean_t		q_intr;		/* delays interruptible */
+	fusefs_tbucket_t	q_tb[FUSEFS_QOS_NB];
+	struct kstat		*q_kstats;
+} fusefs_qos_t;
+
 /*
  * Options we get from the libfuse init call.
  * Just flags for now...
@@ -84,6 +116,8 @@ struct fusefs_ssn {
 	int		ss_genid;	/* generation ID */
 	uint_t		ss_max_iosize;
 	uint32_t	ss_opts;
+	fusefs_qos_t	*ss_qos;	/* mount I/O limits */
+	fusefs_qos_t	*ss_zqos;	/* zone I/O limits, if charged */
 };
 typedef struct fusefs_ssn fusefs_ssn_t;
 
@@ -94,6 +128,7 @@ typedef struct fusefs_ssn fusefs_ssn_t;
 #define	FMI_NOAC	0x10		/* don't cache attributes */
 #define	FMI_LLOCK	0x80		/* local locking only */
 #define	FMI_LARGEF	0x100		/* has large files */
+#define	FMI_ACL		0x400		/* per-file access checks (-o acl) */
 #define	FMI_DEAD	0x200000	/* mount has been terminated */
 
 /*
@@ -113,6 +148,7 @@ typedef struct fusemntinfo {
 	uint32_t		fmi_status;	/* status bits for this mount */
 	hrtime_t		fmi_statfstime;	/* sm_statvfsbuf cache time */
 	statvfs64_t		fmi_statvfsbuf;	/* cached statvfs data */
+	cred_t			*fmi_statfscr;	/* for fusefs_statvfs_refresh */
 	kcondvar_t		fmi_statvfs_cv;
 
 	/*
@@ -128,6 +164,90 @@ typedef struct fusemntinfo {
 	 */
 	struct kstat    *fmi_io_kstats;
 	struct kstat    *fmi_ro_kstats;
+	struct kstat    *fmi_mem_kstats;
+
+	/*
+	 * Cache memory budget for this mount.
+	 * See fusefs_mem_reclaim() in fusefs_node.c
+	 * Updated with atomics, limit under fmi_lock.
+	 */
+	uint64_t		fmi_memlimit;	/* bytes, zero: no limit */
+	uint64_t		fmi_memused;	/* bytes charged */
+	uint32_t		fmi_mem_nodes;	/* nodes charged */
+	uint32_t		fmi_mem_dents;	/* dir index names charged */
+	uint64_t		fmi_mem_nevict;	/* nodes evicted */
+	uint64_t		fmi_mem_devict;	/* dir indices evicted */
+
+	/*
+	 * I/O limits for this mount.  See fusefs_qos.c
+	 */
+	fusefs_qos_t		fmi_qos;
+
+	/*
+	 * Files unlinked while open, to be deleted at last
+	 * close (NUNLINKED).  See fusefs_node_unlink.
+	 * Lock is fmi_lock.
+	 */
+	list_t			fmi_unlinked;	/* fusenode_t, n_unl_node */
+
+	/*
+	 * Held as reader by fusefs_open, and as writer by
+	 * fusefs_rmtree while it checks that nothing under the
+	 * directory is open and adds it to fmi_rmtrees.  Opens
+	 * at or under those wait on fmi_rmtree_cv until the
+	 * daemon is done.  List and cv under fmi_lock.
+	 */
+	krwlock_t		fmi_rmtree_lk;
+	list_t			fmi_rmtrees;	/* fusenode_t, n_rmt_node */
+	kcondvar_t		fmi_rmtree_cv;
+
+	/*
+	 * Stale-while-revalidate (-o swr=N): attributes and
+	 * statvfs data up to fmi_swrmax past expiry are used
+	 * while a thread from fmi_swr_tq gets new ones.
+	 * See fusefs_getattr_stale.  fmi_swr_tq under fmi_lock.
+	 */
+	hrtime_t		fmi_swrmax;
+	taskq_t			*fmi_swr_tq;
+
+	/*
+	 * Notifications from the daemon, and the nodes
+	 * that may have pollers waiting for one.
+	 * See fusefs_notify.c  Lock is fmi_lock.
+	 */
+	kthread_t		*fmi_notify_thread;
+	kcondvar_t		fmi_notify_cv;
+	list_t			fmi_pollers;	/* fusenode_t, n_poll_node */
+	uint64_t		fmi_pollkh;	/* last poll handle given out */
+
+	/*
+	 * Provisional creates and mkdirs (-o asyncns): ops
+	 * not sent yet, and the threads that send them.
+	 * See fusefs_asyncns.c  Lock is fmi_ans_lock.
+	 */
+	taskq_t			*fmi_ans_tq;
+	kmutex_t		fmi_ans_lock;
+	kcondvar_t		fmi_ans_cv;
+	list_t			fmi_ans_list;	/* fusefs_ans_t, not sent */
+	uint_t			fmi_ans_pending; /* ops not done */
+	size_t			fmi_ans_bytes;	/* data kept for them */
+
+	/*
+	 * The device or image the file system is on, for
+	 * block-mapped direct I/O (-o blkdev), our open of
+	 * it, and the credentials we do that I/O with.
+	 * Set at mount.  See fusefs_bmap.c
+	 */
+	vnode_t			*fmi_bvp;	/* NULL: not in use */
+	int			fmi_bflag;	/* FREAD, maybe FWRITE */
+	cred_t			*fmi_bcred;
+
+	/*
+	 * Nodes by inode number, for NFS file handles.
+	 * See fusefs_fh.c  Lock is fmi_fh_lock.
+	 */
+	kmutex_t		fmi_fh_lock;
+	avl_tree_t		fmi_fh_avl;	/* fusefs_fhnode_t, n_fh */
 
 	/*
 	 * Zones support.
@@ -173,4 +293,13 @@ typedef struct fusemntinfo {
 #define	VFTOFMI(vfsp)	((fusemntinfo_t *)((vfsp)->vfs_data))
 #define	FUSEINTR(vp)	(VTOFMI(vp)->fmi_flags & FMI_INT)
 
+/*
+ * Charge (or credit, when negative) cache memory to a mount,
+ * and check whether it's time to give some back.
+ */
+#define	FUSEFS_MEM_CHARGE(fmi, n) \
+	atomic_add_64(&(fmi)->fmi_memused, (int64_t)(n))
+#define	FUSEFS_MEM_OVER(fmi) \
+	((fmi)->fmi_memlimit != 0 && (fmi)->fmi_memused > (fmi)->fmi_memlimit)
+
 #endif	/* _FUSEFS_FUSEFS_H */
@@ -0,0 +1,441 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * ACLs, and access checks with them (-o acl).
+ *
+ * When the daemon sets FUSE_INIT_ACL, file systems may have POSIX
+ * draft ACLs (the kind UFS has, kept as Linux ACL xattrs by the
+ * file system), which VOP_GETSECATTR and VOP_SETSECATTR get and
+ * set with FUSE_OP_GETACL and FUSE_OP_SETACL.
+ *
+ * By default access is checked against the mount's uid, gid and
+ * modes (see fusefs_access_rwx).  With -o acl, fusefs_access uses
+ * the file's own owner, group, mode and ACL instead, so a file
+ * system with real permissions gets the same answers here that it
+ * would give, without the round trips for ops it would refuse.
+ *
+ * Each fusenode keeps the ACL it last got (n_acl), and the ctime
+ * the file had then.  GETACL returns the attributes as well, which
+ * go in the attribute cache, so getting the ACL costs no more than
+ * the getattr it replaces.  The ACL is good for as long as the
+ * attributes are and after they are refreshed if the ctime hasn't
+ * changed (any change to an ACL changes the ctime), so access
+ * checks almost never need a call of their own.
+ *
+ * Locks: the ACL cache is under r_statelock.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/cred.h>
+#include <sys/vnode.h>
+#include <sys/vfs.h>
+#include <sys/kmem.h>
+#include <sys/acl.h>
+#include <sys/policy.h>
+#include <sys/fs_subr.h>
+#include <sys/sunddi.h>
+
+#include <sys/fs/fuse_door.h>
+
+#include "fusefs.h"
+#include "fusefs_calls.h"
+#include "fusefs_node.h"
+#include "fusefs_subr.h"
+
+#define	ACL_SIZE(n)	((n) * sizeof (aclent_t))
+
+static boolean_t
+acl_supported(fusemntinfo_t *fmi)
+{
+	return ((fmi->fmi_ssn->ss_opts & FUSE_INIT_ACL) != 0 &&
+	    (fmi->fmi_status & SM_STATUS_NOACL) == 0);
+}
+
+/*
+ * Is the cached ACL still good?  See above.
+ */
+static boolean_t
+acl_valid(fusenode_t *np)
+{
+	ASSERT(MUTEX_HELD(&np->r_statelock));
+
+	return ((np->n_flag & NACLVALID) != 0 &&
+	    gethrtime() < np->r_attrtime &&
+	    np->n_aclctime_sec == np->r_attr.st_ctime_sec &&
+	    np->n_aclctime_ns == np->r_attr.st_ctime_ns);
+}
+
+/*
+ * Make sure n_acl is valid, getting the ACL (and the
+ * attributes) from the daemon if need be.  ENOTSUP if
+ * the file system has no ACLs.
+ */
+static int
+acl_load(vnode_t *vp)
+{
+	fusenode_t	*np = VTOFUSE(vp);
+	fusemntinfo_t	*fmi = np->n_mount;
+	fusefattr_t	fa;
+	aclent_t	*aclp, *nacl, *oacl;
+	int		cnt, ocnt, error;
+
+	if (!acl_supported(fmi))
+		return (ENOTSUP);
+
+	mutex_enter(&np->r_statelock);
+	if (acl_valid(np)) {
+		mutex_exit(&np->r_statelock);
+		return (0);
+	}
+	mutex_exit(&np->r_statelock);
+
+	/* A provisional node must be created first. */
+	if ((error = fusefs_ans_wait(np)) != 0)
+		return (error);
+
+	aclp = kmem_alloc(ACL_SIZE(FUSE_ACL_MAX), KM_SLEEP);
+	error = fusefs_call_getacl(fmi->fmi_ssn, np->n_rplen, np->n_rpath,
+	    aclp, &cnt, &fa);
+	if (error == ENOSYS || error == ENOTSUP || error == EOPNOTSUPP) {
+		mutex_enter(&fmi->fmi_lock);
+		fmi->fmi_status |= SM_STATUS_NOACL;
+		mutex_exit(&fmi->fmi_lock);
+		error = ENOTSUP;
+	}
+	if (error) {
+		kmem_free(aclp, ACL_SIZE(FUSE_ACL_MAX));
+		return (error);
+	}
+
+	fusefs_cache_check(vp, &fa);
+	fusefs_attrcache_fa(vp, &fa);
+
+	nacl = NULL;
+	if (cnt != 0) {
+		nacl = kmem_alloc(ACL_SIZE(cnt), KM_SLEEP);
+		bcopy(aclp, nacl, ACL_SIZE(cnt));
+		FUSEFS_MEM_CHARGE(fmi, ACL_SIZE(cnt));
+	}
+	kmem_free(aclp, ACL_SIZE(FUSE_ACL_MAX));
+
+	mutex_enter(&np->r_statelock);
+	oacl = np->n_acl;
+	ocnt = np->n_aclcnt;
+	np->n_acl = nacl;
+	np->n_aclcnt = cnt;
+	np->n_aclctime_sec = fa.st_ctime_sec;
+	np->n_aclctime_ns = fa.st_ctime_ns;
+	np->n_flag |= NACLVALID;
+	mutex_exit(&np->r_statelock);
+
+	if (oacl != NULL) {
+		kmem_free(oacl, ACL_SIZE(ocnt));
+		FUSEFS_MEM_CHARGE(fmi, -(int64_t)ACL_SIZE(ocnt));
+	}
+	return (0);
+}
+
+/*
+ * Forget the cached ACL, as we just changed it.
+ */
+void
+fusefs_acl_inval(fusenode_t *np)
+{
+	mutex_enter(&np->r_statelock);
+	np->n_flag &= ~NACLVALID;
+	mutex_exit(&np->r_statelock);
+}
+
+/*
+ * From sn_inactive: free it.
+ */
+void
+fusefs_acl_inactive(fusenode_t *np)
+{
+	aclent_t	*oacl;
+	int		ocnt;
+
+	mutex_enter(&np->r_statelock);
+	oacl = np->n_acl;
+	ocnt = np->n_aclcnt;
+	np->n_acl = NULL;
+	np->n_aclcnt = 0;
+	np->n_flag &= ~NACLVALID;
+	mutex_exit(&np->r_statelock);
+
+	if (oacl != NULL) {
+		kmem_free(oacl, ACL_SIZE(ocnt));
+		FUSEFS_MEM_CHARGE(np->n_mount, -(int64_t)ACL_SIZE(ocnt));
+	}
+}
+
+/*
+ * The permissions (rwx, as 4, 2, 1) the ACL or the mode grants
+ * cr, as POSIX 1003.1e says: the owner entry, else a named user
+ * entry, else the group entries (one that grants all of want if
+ * any does), else other.  All but the owner and other entries
+ * are limited by the mask entry.
+ */
+static int
+acl_perm(fusenode_t *np, cred_t *cr, int want)
+{
+	aclent_t	*ap;
+	uid_t		uid = np->r_attr.st_uid;
+	gid_t		gid = np->r_attr.st_gid;
+	int		mode = np->r_attr.st_mode;
+	int		i, mask = 07, perm, gperm = -1;
+
+	ASSERT(MUTEX_HELD(&np->r_statelock));
+
+	if ((np->n_flag & NACLVALID) == 0 || np->n_aclcnt == 0) {
+		if (crgetuid(cr) == uid)
+			return ((mode >> 6) & 07);
+		if (groupmember(gid, cr))
+			return ((mode >> 3) & 07);
+		return (mode & 07);
+	}
+
+	if (crgetuid(cr) == uid)
+		return ((mode >> 6) & 07);	/* USER_OBJ is the mode's */
+
+	for (i = 0, ap = np->n_acl; i < np->n_aclcnt; i++, ap++) {
+		if (ap->a_type == CLASS_OBJ)
+			mask = ap->a_perm & 07;
+	}
+	for (i = 0, ap = np->n_acl; i < np->n_aclcnt; i++, ap++) {
+		if (ap->a_type == USER && ap->a_id == crgetuid(cr))
+			return (ap->a_perm & mask);
+	}
+	for (i = 0, ap = np->n_acl; i < np->n_aclcnt; i++, ap++) {
+		if (ap->a_type == GROUP_OBJ ? !groupmember(gid, cr) :
+		    ap->a_type != GROUP || !groupmember(ap->a_id, cr))
+			continue;
+		perm = ap->a_perm & mask;
+		if ((perm & want) == want)
+			return (perm);
+		if (gperm == -1)
+			gperm = perm;
+	}
+	if (gperm != -1)
+		return (gperm);
+
+	return (mode & 07);	/* OTHER_OBJ is the mode's */
+}
+
+/*
+ * fusefs_access with -o acl: check against the file's own
+ * attributes and ACL.
+ */
+int
+fusefs_acl_access(vnode_t *vp, int mode, cred_t *cr)
+{
+	fusenode_t	*np = VTOFUSE(vp);
+	vattr_t		va;
+	uid_t		owner;
+	int		perm, error;
+
+	if ((mode & VWRITE) && vn_is_readonly(vp) && !IS_DEVVP(vp))
+		return (EROFS);
+
+	error = acl_load(vp);
+	if (error == ENOTSUP) {
+		/* Just the mode, then. */
+		va.va_mask = AT_MODE | AT_UID | AT_GID;
+		error = fusefsgetattr(vp, &va, cr);
+	}
+	if (error)
+		return (error);
+
+	mutex_enter(&np->r_statelock);
+	if (vp->v_type == VREG && MANDMODE(np->r_attr.st_mode) &&
+	    (mode & (VWRITE | VREAD | VEXEC))) {
+		mutex_exit(&np->r_statelock);
+		return (EACCES);
+	}
+	owner = np->r_attr.st_uid;
+	perm = acl_perm(np, cr, (mode >> 6) & 07);
+	mutex_exit(&np->r_statelock);
+
+	return (secpolicy_vnode_access2(cr, vp, owner, perm << 6, mode));
+}
+
+/*
+ * VOP_GETSECATTR.  Files with no ACL (or file systems without
+ * them) get one made from the mode, as before.
+ */
+int
+fusefs_acl_getsecattr(vnode_t *vp, vsecattr_t *vsa, int flag, cred_t *cr,
+	caller_context_t *ct)
+{
+	fusenode_t	*np = VTOFUSE(vp);
+	aclent_t	*aclp;
+	int		cnt, acnt, dcnt, error;
+
+	error = acl_load(vp);
+	if (error == ENOTSUP)
+		return (fs_fab_acl(vp, vsa, flag, cr, ct));
+	if (error)
+		return (error);
+
+	aclp = kmem_alloc(ACL_SIZE(FUSE_ACL_MAX), KM_SLEEP);
+	mutex_enter(&np->r_statelock);
+	cnt = np->n_aclcnt;
+	if (cnt != 0)
+		bcopy(np->n_acl, aclp, ACL_SIZE(cnt));
+	mutex_exit(&np->r_statelock);
+
+	if (cnt == 0) {
+		kmem_free(aclp, ACL_SIZE(FUSE_ACL_MAX));
+		return (fs_fab_acl(vp, vsa, flag, cr, ct));
+	}
+	if (vsa->vsa_mask & (VSA_ACE | VSA_ACECNT |
+	    VSA_ACE_ACLFLAGS | VSA_ACE_ALLTYPES)) {
+		/* We have POSIX draft ACLs only. */
+		kmem_free(aclp, ACL_SIZE(FUSE_ACL_MAX));
+		return (ENOTSUP);
+	}
+
+	/* Access entries come first, then the default ones. */
+	for (acnt = 0; acnt < cnt; acnt++) {
+		if (aclp[acnt].a_type & ACL_DEFAULT)
+			break;
+	}
+	dcnt = cnt - acnt;
+
+	if (vsa->vsa_mask & VSA_ACL) {
+		vsa->vsa_aclentp = NULL;
+		if (acnt != 0) {
+			vsa->vsa_aclentp = kmem_alloc(ACL_SIZE(acnt),
+			    KM_SLEEP);
+			bcopy(aclp, vsa->vsa_aclentp, ACL_SIZE(acnt));
+		}
+	}
+	if (vsa->vsa_mask & (VSA_ACL | VSA_ACLCNT))
+		vsa->vsa_aclcnt = acnt;
+	if (vsa->vsa_mask & VSA_DFACL) {
+		vsa->vsa_dfaclentp = NULL;
+		if (dcnt != 0) {
+			vsa->vsa_dfaclentp = kmem_alloc(ACL_SIZE(dcnt),
+			    KM_SLEEP);
+			bcopy(aclp + acnt, vsa->vsa_dfaclentp,
+			    ACL_SIZE(dcnt));
+		}
+	}
+	if (vsa->vsa_mask & (VSA_DFACL | VSA_DFACLCNT))
+		vsa->vsa_dfaclcnt = dcnt;
+
+	kmem_free(aclp, ACL_SIZE(FUSE_ACL_MAX));
+	return (0);
+}
+
+/*
+ * Enough of aclcheck(3SEC) that the file system gets
+ * what it expects: one of each object entry, a mask if
+ * there are named entries, and known types.
+ */
+static int
+acl_check(aclent_t *aclp, int cnt, int dflt)
+{
+	int	i, type, uobj = 0, gobj = 0, oobj = 0, cobj = 0, named = 0;
+
+	for (i = 0; i < cnt; i++) {
+		type = aclp[i].a_type;
+		if ((type & ACL_DEFAULT) != dflt)
+			return (EINVAL);
+		switch (type & ~ACL_DEFAULT) {
+		case USER_OBJ:
+			uobj++;
+			break;
+		case GROUP_OBJ:
+			gobj++;
+			break;
+		case OTHER_OBJ:
+			oobj++;
+			break;
+		case CLASS_OBJ:
+			cobj++;
+			break;
+		case USER:
+		case GROUP:
+			named++;
+			break;
+		default:
+			return (EINVAL);
+		}
+	}
+	if (cnt == 0 && dflt)
+		return (0);
+	if (uobj != 1 || gobj != 1 || oobj != 1 || cobj > 1 ||
+	    (named != 0 && cobj == 0))
+		return (EINVAL);
+	return (0);
+}
+
+/*
+ * VOP_SETSECATTR: the owner (or privilege) may set the
+ * access ACL and, for directories, the default one.
+ */
+/* ARGSUSED */
+int
+fusefs_acl_setsecattr(vnode_t *vp, vsecattr_t *vsa, int flag, cred_t *cr)
+{
+	fusenode_t	*np = VTOFUSE(vp);
+	fusemntinfo_t	*fmi = np->n_mount;
+	aclent_t	*aclp;
+	vattr_t		va;
+	int		acnt, dcnt, error;
+
+	if (!acl_supported(fmi))
+		return (ENOTSUP);
+	if ((vsa->vsa_mask & VSA_ACL) == 0 || (vsa->vsa_mask &
+	    (VSA_ACE | VSA_ACECNT | VSA_ACE_ACLFLAGS | VSA_ACE_ALLTYPES)))
+		return (ENOTSUP);
+	if (vn_is_readonly(vp))
+		return (EROFS);
+
+	acnt = vsa->vsa_aclcnt;
+	dcnt = (vsa->vsa_mask & VSA_DFACL) ? vsa->vsa_dfaclcnt : 0;
+	if (acnt < 0 || dcnt < 0)
+		return (EINVAL);
+	if (acnt + dcnt > FUSE_ACL_MAX)
+		return (ENOSPC);
+	if (dcnt != 0 && vp->v_type != VDIR)
+		return (EINVAL);
+	if ((error = acl_check(vsa->vsa_aclentp, acnt, 0)) != 0 ||
+	    (error = acl_check(vsa->vsa_dfaclentp, dcnt, ACL_DEFAULT)) != 0)
+		return (error);
+
+	va.va_mask = AT_UID;
+	if ((error = fusefsgetattr(vp, &va, cr)) != 0)
+		return (error);
+	if ((error = secpolicy_vnode_setdac(cr, va.va_uid)) != 0)
+		return (error);
+
+	if ((error = fusefs_ans_wait(np)) != 0)
+		return (error);
+
+	aclp = kmem_alloc(ACL_SIZE(FUSE_ACL_MAX), KM_SLEEP);
+	if (acnt != 0)
+		bcopy(vsa->vsa_aclentp, aclp, ACL_SIZE(acnt));
+	if (dcnt != 0)
+		bcopy(vsa->vsa_dfaclentp, aclp + acnt, ACL_SIZE(dcnt));
+	error = fusefs_call_setacl(fmi->fmi_ssn, np->n_rplen, np->n_rpath,
+	    aclp, acnt + dcnt);
+	kmem_free(aclp, ACL_SIZE(FUSE_ACL_MAX));
+
+	/* The mode may have changed too. */
+	fusefs_acl_inval(np);
+	fusefs_attrcache_remove(np);
+
+	return (error);
+}
@@ -0,0 +1,925 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Provisional creates and mkdirs (-o asyncns).
+ *
+ * Extracting an archive makes every create and mkdir a round trip
+ * to the daemon, so with a slow back end it goes at one file per
+ * round trip.  With this option, when the directory name index
+ * (fusefs_dircache.c) tells us a name is not there, fusefs_create
+ * and fusefs_mkdir make the node right away, with attributes made
+ * up from the request, and queue the real work (an "op") for the
+ * threads of a per-mount taskq.  A new directory starts with an
+ * empty, complete index, so the names made in it go the same way.
+ *
+ * Data written to a provisional file (sequentially, up to some
+ * limit) and attribute changes (mode, owner and times) are kept
+ * with its op, so the create, the writes and the setattr reach
+ * the daemon together when the file is closed.  An op is sent
+ * ("dispatched") when: the last close of the file happens (mkdir
+ * ops are sent at once), something needs the file to exist on
+ * the back end (read, truncate, a lookup we can't answer, etc.),
+ * too many ops are queued, or at fsync, sync and unmount.
+ *
+ * Order: ops are dispatched in the order they are queued.  An op
+ * waits for the ops queued before it on the same node (n_ans_done
+ * counts up to its a_seq) and for its directory to be created
+ * (n_ans_prov).  Those were dispatched earlier, and taskq threads
+ * take tasks in order, so they are already running or done.
+ * Operations that work on names we may not know about yet (remove,
+ * rename, rmdir, readdir, lookups that go to the daemon) first wait
+ * for everything queued on the mount (fusefs_ans_sync).
+ *
+ * Errors: when an op fails, the error is kept on the node and on
+ * its directory (n_ans_error).  fsync on either waits for the ops
+ * and returns it (and clears it); close of the file returns it if
+ * we know it by then, but leaves it for fsync.  The directory index
+ * and cached attributes are dropped, so the file system is asked
+ * about the name again.
+ *
+ * Credentials: an op holds those of the caller who queued it
+ * (a_cr), and the taskq sends its calls with them.
+ *
+ * A provisional file can be opened: the open is counted (n_fidrefs)
+ * without a handle, and if the file is still open when its create
+ * is done, the create's handle becomes n_fid.
+ *
+ * Everything here is protected by fmi_ans_lock.  Lock order is:
+ * r_lkserlock > fmi_ans_lock.  The taskq threads take no vnode
+ * locks other than r_lkserlock (to hand over the handle) so it is
+ * safe to wait for them holding r_rwlock, but not r_lkserlock.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/vnode.h>
+#include <sys/vfs.h>
+#include <sys/file.h>
+#include <sys/kmem.h>
+#include <sys/uio.h>
+#include <sys/mode.h>
+#include <sys/taskq.h>
+#include <sys/cred.h>
+#include <sys/sunddi.h>
+#include <sys/sysmacros.h>
+#include <sys/int_limits.h>
+
+#include <sys/fs/fuse_door.h>
+
+#include "fusefs.h"
+#include "fusefs_calls.h"
+#include "fusefs_node.h"
+#include "fusefs_subr.h"
+
+/*
+ * Threads (per mount) sending ops: how many calls may be
+ * outstanding at once.  The most ops queued on a mount
+ * before callers wait, the most data kept for one file,
+ * and for all the files on a mount.
+ */
+int	fusefs_ans_threads = 8;
+int	fusefs_ans_maxops = 1024;
+size_t	fusefs_ans_maxdata = 64 * 1024;
+size_t	fusefs_ans_maxbytes = 16 * 1024 * 1024;
+
+#define	FUSEFS_ANS_CREATE	1
+#define	FUSEFS_ANS_MKDIR	2
+#define	FUSEFS_ANS_SETATTR	3
+
+/* Attributes kept with an op */
+#define	FUSEFS_ANS_AT	(AT_MODE | AT_UID | AT_GID | AT_ATIME | AT_MTIME)
+
+/* Data written to a provisional file */
+typedef struct fusefs_ans_data {
+	list_node_t	ad_node;
+	size_t		ad_len;
+	/* data follows */
+} fusefs_ans_data_t;
+
+typedef struct fusefs_ans {
+	list_node_t	a_node;		/* linkage in fmi_ans_list */
+	int		a_op;		/* FUSEFS_ANS_... */
+	uint_t		a_seq;		/* order among a_np's ops */
+	vnode_t		*a_vp;		/* held */
+	vnode_t		*a_dvp;		/* held, unless SETATTR */
+	char		*a_name;	/* name in a_dvp */
+	int		a_nmlen;
+	mode_t		a_mode;		/* for create */
+	vattr_t		a_va;		/* attributes to set */
+	list_t		a_data;		/* fusefs_ans_data_t */
+	size_t		a_len;		/* bytes in a_data */
+	cred_t		*a_cr;		/* held, the caller's */
+} fusefs_ans_t;
+
+static void fusefs_ans_task(void *);
+
+/*
+ * Setup and teardown, from fusefs_mount, fusefs_unmount
+ * and fusefs_free_fmi.  The taskq only when the option
+ * is on, and that's how the rest of the code knows.
+ */
+void
+fusefs_ans_init(fusemntinfo_t *fmi, boolean_t on)
+{
+	mutex_init(&fmi->fmi_ans_lock, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&fmi->fmi_ans_cv, NULL, CV_DEFAULT, NULL);
+	list_create(&fmi->fmi_ans_list, sizeof (fusefs_ans_t),
+	    offsetof(fusefs_ans_t, a_node));
+	if (on) {
+		fmi->fmi_ans_tq = taskq_create("fusefs_ans",
+		    fusefs_ans_threads, minclsyspri, 1, INT_MAX,
+		    TASKQ_PREPOPULATE);
+	}
+}
+
+/*
+ * Send whatever is left and wait for it.  Called at unmount
+ * (also forced, in which case the calls just fail) once the
+ * session is dead or no longer busy.  Not from freevfs: the
+ * last VN_RELE can be in one of the taskq threads.
+ */
+void
+fusefs_ans_stop(fusemntinfo_t *fmi)
+{
+	taskq_t *tq;
+
+	if (fmi->fmi_ans_tq == NULL)
+		return;
+
+	(void) fusefs_ans_sync(fmi, B_FALSE);
+
+	mutex_enter(&fmi->fmi_ans_lock);
+	tq = fmi->fmi_ans_tq;
+	fmi->fmi_ans_tq = NULL;
+	mutex_exit(&fmi->fmi_ans_lock);
+	taskq_destroy(tq);
+}
+
+void
+fusefs_ans_fini(fusemntinfo_t *fmi)
+{
+	ASSERT(fmi->fmi_ans_tq == NULL);
+	ASSERT(list_is_empty(&fmi->fmi_ans_list));
+	list_destroy(&fmi->fmi_ans_list);
+	cv_destroy(&fmi->fmi_ans_cv);
+	mutex_destroy(&fmi->fmi_ans_lock);
+}
+
+static void
+ans_free(fusemntinfo_t *fmi, fusefs_ans_t *ap)
+{
+	fusefs_ans_data_t *ad;
+
+	while ((ad = list_remove_head(&ap->a_data)) != NULL) {
+		FUSEFS_MEM_CHARGE(fmi, -(int64_t)ad->ad_len);
+		kmem_free(ad, sizeof (*ad) + ad->ad_len);
+	}
+	list_destroy(&ap->a_data);
+	if (ap->a_name != NULL)
+		kmem_free(ap->a_name, ap->a_nmlen + 1);
+	if (ap->a_cr != NULL)
+		crfree(ap->a_cr);
+	kmem_free(ap, sizeof (*ap));
+}
+
+/*
+ * Send an op not yet sent (fmi_ans_list).  Dispatching under
+ * fmi_ans_lock keeps the taskq order the same as a_seq order.
+ * The taskq has no limit, so TQ_SLEEP only waits for memory.
+ */
+static void
+ans_dispatch_locked(fusemntinfo_t *fmi, fusefs_ans_t *ap)
+{
+	fusenode_t *np = VTOFUSE(ap->a_vp);
+
+	ASSERT(MUTEX_HELD(&fmi->fmi_ans_lock));
+
+	if (np->n_ans == ap) {
+		list_remove(&fmi->fmi_ans_list, ap);
+		np->n_ans = NULL;
+	}
+	(void) taskq_dispatch(fmi->fmi_ans_tq, fusefs_ans_task,
+	    ap, TQ_SLEEP);
+}
+
+static void
+ans_flush_locked(fusemntinfo_t *fmi)
+{
+	fusefs_ans_t *ap;
+
+	while ((ap = list_head(&fmi->fmi_ans_list)) != NULL)
+		ans_dispatch_locked(fmi, ap);
+}
+
+static int
+ans_cv_wait(fusemntinfo_t *fmi)
+{
+	if ((fmi->fmi_flags & FMI_INT) == 0) {
+		cv_wait(&fmi->fmi_ans_cv, &fmi->fmi_ans_lock);
+		return (0);
+	}
+	return (cv_wait_sig(&fmi->fmi_ans_cv, &fmi->fmi_ans_lock) ?
+	    0 : EINTR);
+}
+
+/*
+ * Queue an op.  Creates of files wait on fmi_ans_list for the
+ * last close (or someone who needs them), everything else is
+ * sent now.  Takes holds on the vnodes, released by the task.
+ */
+static void
+ans_enqueue_locked(fusemntinfo_t *fmi, fusefs_ans_t *ap)
+{
+	fusenode_t *np = VTOFUSE(ap->a_vp);
+
+	ASSERT(MUTEX_HELD(&fmi->fmi_ans_lock));
+
+	VN_HOLD(ap->a_vp);
+	if (ap->a_dvp != NULL)
+		VN_HOLD(ap->a_dvp);
+	ap->a_seq = np->n_ans_next++;
+	fmi->fmi_ans_pending++;
+
+	if (ap->a_op == FUSEFS_ANS_CREATE) {
+		ASSERT(np->n_ans == NULL);
+		np->n_ans = ap;
+		list_insert_tail(&fmi->fmi_ans_list, ap);
+	} else {
+		ans_dispatch_locked(fmi, ap);
+	}
+}
+
+/*
+ * Make a provisional node for fusefs_create or fusefs_mkdir,
+ * which hold the directory r_rwlock (writer), and have found
+ * that the name is not in the (complete) directory index and
+ * that the caller may create it.  Returns ENOTSUP when the
+ * caller should do it the usual way.
+ */
+int
+fusefs_ans_create(vnode_t *dvp, const char *name, int nmlen,
+	vattr_t *vap, vnode_t **vpp, cred_t *cr)
+{
+	fusemntinfo_t	*fmi = VTOFMI(dvp);
+	fusenode_t	*dnp = VTOFUSE(dvp);
+	fusenode_t	*np;
+	fusefs_ans_t	*ap;
+	fusefattr_t	fa;
+	timestruc_t	now;
+	vnode_t		*vp;
+	int		error;
+
+	ASSERT(vap->va_type == VREG || vap->va_type == VDIR);
+
+	if (fmi->fmi_ans_tq == NULL)
+		return (ENOTSUP);
+
+	/*
+	 * Too many queued?  Send them all, and wait
+	 * until enough are done.
+	 */
+	mutex_enter(&fmi->fmi_ans_lock);
+	while (fmi->fmi_ans_pending >= fusefs_ans_maxops) {
+		ans_flush_locked(fmi);
+		if ((error = ans_cv_wait(fmi)) != 0) {
+			mutex_exit(&fmi->fmi_ans_lock);
+			return (error);
+		}
+	}
+	mutex_exit(&fmi->fmi_ans_lock);
+
+	/*
+	 * Attributes as the daemon would (probably) have them.
+	 * Replaced with the real ones when the op is done.
+	 */
+	gethrestime(&now);
+	bzero(&fa, sizeof (fa));
+	fa.st_mode = VTTOIF(vap->va_type) | (vap->va_mode & MODEMASK);
+	fa.st_nlink = (vap->va_type == VDIR) ? 2 : 1;
+	fa.st_uid = fmi->fmi_uid;
+	fa.st_gid = fmi->fmi_gid;
+	fa.st_atime_sec = fa.st_mtime_sec = fa.st_ctime_sec = now.tv_sec;
+	fa.st_atime_ns = fa.st_mtime_ns = fa.st_ctime_ns = now.tv_nsec;
+
+	error = fusefs_nget(dvp, name, nmlen, &fa, &vp);
+	if (error)
+		return (error);
+	np = VTOFUSE(vp);
+
+	/*
+	 * An old node for this name may still be around.
+	 * If it has ops of its own queued, give up.
+	 */
+	ap = kmem_zalloc(sizeof (*ap), KM_SLEEP);
+	list_create(&ap->a_data, sizeof (fusefs_ans_data_t),
+	    offsetof(fusefs_ans_data_t, ad_node));
+	ap->a_op = (vap->va_type == VDIR) ?
+	    FUSEFS_ANS_MKDIR : FUSEFS_ANS_CREATE;
+	ap->a_vp = vp;
+	ap->a_dvp = dvp;
+	ap->a_name = kmem_alloc(nmlen + 1, KM_SLEEP);
+	bcopy(name, ap->a_name, nmlen);
+	ap->a_name[nmlen] = '\0';
+	ap->a_nmlen = nmlen;
+	ap->a_mode = vap->va_mode & MODEMASK;
+	crhold(cr);
+	ap->a_cr = cr;
+
+	mutex_enter(&fmi->fmi_ans_lock);
+	if (np->n_ans_next != np->n_ans_done || np->n_fidrefs != 0) {
+		mutex_exit(&fmi->fmi_ans_lock);
+		ans_free(fmi, ap);
+		VN_RELE(vp);
+		return (ENOTSUP);
+	}
+	np->n_ans_prov = B_TRUE;
+	np->n_ans_error = 0;
+	ans_enqueue_locked(fmi, ap);
+	mutex_exit(&fmi->fmi_ans_lock);
+
+	/*
+	 * Use the made-up attributes until the op is done
+	 * (when fusefs_ans_task replaces them), even if
+	 * that's later than they would normally expire.
+	 */
+	fusefs_attrcache_fa(vp, &fa);
+	mutex_enter(&np->r_statelock);
+	np->r_attrtime = INT64_MAX;
+	np->r_swrtime = 0;
+	mutex_exit(&np->r_statelock);
+
+	/*
+	 * Record the name in the directory index (which also
+	 * marks the coming mtime change as ours).  Unlike the
+	 * usual create, leave the directory attributes alone,
+	 * so the index can answer the next lookup too.
+	 */
+	fusefs_dircache_enter(dnp, name, nmlen, vap->va_type);
+	if (vap->va_type == VDIR)
+		fusefs_dircache_empty(np);
+
+	*vpp = vp;
+	return (0);
+}
+
+/*
+ * Keep data written to a provisional file for its op.
+ * Only what follows on from what we have (so from zero)
+ * and within the limits.  Returns ENOTSUP (once any ops
+ * on the file are done) when the caller should write it
+ * the usual way.  Caller holds r_rwlock (writer).
+ */
+int
+fusefs_ans_write(fusenode_t *np, uio_t *uiop)
+{
+	fusemntinfo_t	*fmi = np->n_mount;
+	fusefs_ans_data_t *ad;
+	fusefs_ans_t	*ap;
+	size_t		len, cbytes;
+	int		error;
+
+	if (fmi->fmi_ans_tq == NULL)
+		return (ENOTSUP);
+
+	len = (size_t)uiop->uio_resid;
+	mutex_enter(&fmi->fmi_ans_lock);
+	if (np->n_ans_next == np->n_ans_done) {
+		mutex_exit(&fmi->fmi_ans_lock);
+		return (ENOTSUP);
+	}
+	ap = np->n_ans;
+	if (ap == NULL || uiop->uio_loffset != ap->a_len ||
+	    ap->a_len + len > fusefs_ans_maxdata ||
+	    fmi->fmi_ans_bytes + len > fusefs_ans_maxbytes) {
+		mutex_exit(&fmi->fmi_ans_lock);
+		goto wait;
+	}
+	mutex_exit(&fmi->fmi_ans_lock);
+
+	/* Copy it in without the lock (may fault). */
+	ad = kmem_alloc(sizeof (*ad) + len, KM_SLEEP);
+	ad->ad_len = len;
+	error = uiocopy((caddr_t)(ad + 1), len, UIO_WRITE, uiop, &cbytes);
+	if (error != 0 || cbytes != len) {
+		kmem_free(ad, sizeof (*ad) + len);
+		return (error ? error : EFAULT);
+	}
+
+	/* Sent meanwhile? */
+	mutex_enter(&fmi->fmi_ans_lock);
+	if (np->n_ans != ap) {
+		mutex_exit(&fmi->fmi_ans_lock);
+		kmem_free(ad, sizeof (*ad) + len);
+		goto wait;
+	}
+	list_insert_tail(&ap->a_data, ad);
+	ap->a_len += len;
+	fmi->fmi_ans_bytes += len;
+	mutex_exit(&fmi->fmi_ans_lock);
+	FUSEFS_MEM_CHARGE(fmi, len);
+
+	uioskip(uiop, len);
+
+	mutex_enter(&np->r_statelock);
+	if (uiop->uio_loffset > (offset_t)np->r_size)
+		np->r_size = (len_t)uiop->uio_loffset;
+	np->r_attr.st_size = np->r_size;
+	np->r_attr.st_blocks = howmany(np->r_size, DEV_BSIZE);
+	np->r_mtime = gethrtime();
+	mutex_exit(&np->r_statelock);
+
+	if (FUSEFS_MEM_OVER(fmi))
+		fusefs_mem_reclaim(fmi);
+	return (0);
+
+wait:
+	error = fusefs_ans_wait(np);
+	return (error ? error : ENOTSUP);
+}
+
+/*
+ * Keep attribute changes to a node with ops queued: in its
+ * create op if not sent yet, or as an op of their own.  The
+ * cached attributes are updated to match.  Returns ENOTSUP
+ * (once any ops on the node are done) when the caller should
+ * set them the usual way.
+ */
+int
+fusefs_ans_setattr(fusenode_t *np, vattr_t *vap, cred_t *cr)
+{
+	fusemntinfo_t	*fmi = np->n_mount;
+	fusefs_ans_t	*ap, *nap = NULL;
+	vattr_t		*dst;
+	uint_t		mask = vap->va_mask;
+	int		error;
+
+	if (fmi->fmi_ans_tq == NULL)
+		return (ENOTSUP);
+
+	if ((mask & ~FUSEFS_ANS_AT) != 0) {
+		error = fusefs_ans_wait(np);
+		return (error ? error : ENOTSUP);
+	}
+
+again:
+	mutex_enter(&fmi->fmi_ans_lock);
+	if (np->n_ans_next == np->n_ans_done) {
+		mutex_exit(&fmi->fmi_ans_lock);
+		if (nap != NULL)
+			ans_free(fmi, nap);
+		return (ENOTSUP);
+	}
+	if ((ap = np->n_ans) != NULL) {
+		dst = &ap->a_va;
+	} else if (nap != NULL) {
+		dst = &nap->a_va;
+	} else {
+		mutex_exit(&fmi->fmi_ans_lock);
+		nap = kmem_zalloc(sizeof (*nap), KM_SLEEP);
+		list_create(&nap->a_data, sizeof (fusefs_ans_data_t),
+		    offsetof(fusefs_ans_data_t, ad_node));
+		nap->a_op = FUSEFS_ANS_SETATTR;
+		nap->a_vp = FUSETOV(np);
+		crhold(cr);
+		nap->a_cr = cr;
+		goto again;
+	}
+
+	dst->va_mask |= mask;
+	if (mask & AT_MODE)
+		dst->va_mode = vap->va_mode;
+	if (mask & AT_UID)
+		dst->va_uid = vap->va_uid;
+	if (mask & AT_GID)
+		dst->va_gid = vap->va_gid;
+	if (mask & AT_ATIME)
+		dst->va_atime = vap->va_atime;
+	if (mask & AT_MTIME)
+		dst->va_mtime = vap->va_mtime;
+
+	if (ap == NULL) {
+		ans_enqueue_locked(fmi, nap);
+		nap = NULL;
+	}
+	mutex_exit(&fmi->fmi_ans_lock);
+	if (nap != NULL)
+		ans_free(fmi, nap);
+
+	mutex_enter(&np->r_statelock);
+	if (mask & AT_MODE) {
+		np->r_attr.st_mode = (np->r_attr.st_mode & S_IFMT) |
+		    (vap->va_mode & MODEMASK);
+	}
+	if (mask & AT_UID)
+		np->r_attr.st_uid = vap->va_uid;
+	if (mask & AT_GID)
+		np->r_attr.st_gid = vap->va_gid;
+	if (mask & AT_ATIME) {
+		np->r_attr.st_atime_sec = vap->va_atime.tv_sec;
+		np->r_attr.st_atime_ns = vap->va_atime.tv_nsec;
+	}
+	if (mask & AT_MTIME) {
+		np->r_attr.st_mtime_sec = vap->va_mtime.tv_sec;
+		np->r_attr.st_mtime_ns = vap->va_mtime.tv_nsec;
+	}
+	mutex_exit(&np->r_statelock);
+
+	return (0);
+}
+
+/*
+ * fusefs_open: is this a file not created yet?  If so, the
+ * caller counts the open without a handle (see above).
+ * Caller holds r_lkserlock (writer).
+ */
+boolean_t
+fusefs_ans_open(fusenode_t *np)
+{
+	fusemntinfo_t	*fmi = np->n_mount;
+	boolean_t	prov;
+
+	if (fmi->fmi_ans_tq == NULL)
+		return (B_FALSE);
+
+	ASSERT(fusefs_rw_lock_held(&np->r_lkserlock, RW_WRITER));
+
+	mutex_enter(&fmi->fmi_ans_lock);
+	prov = np->n_ans_prov;
+	mutex_exit(&fmi->fmi_ans_lock);
+
+	return (prov);
+}
+
+/*
+ * Last close of a file (fusefs_rele_fid): send its create.
+ */
+void
+fusefs_ans_close(fusenode_t *np)
+{
+	fusemntinfo_t	*fmi = np->n_mount;
+
+	if (fmi->fmi_ans_tq == NULL)
+		return;
+
+	mutex_enter(&fmi->fmi_ans_lock);
+	if (np->n_ans != NULL)
+		ans_dispatch_locked(fmi, np->n_ans);
+	mutex_exit(&fmi->fmi_ans_lock);
+}
+
+/*
+ * Send any ops queued on this node and wait for them.
+ * Caller must not hold r_lkserlock.
+ */
+int
+fusefs_ans_wait(fusenode_t *np)
+{
+	fusemntinfo_t	*fmi = np->n_mount;
+	int		error = 0;
+
+	if (fmi->fmi_ans_tq == NULL)
+		return (0);
+
+	mutex_enter(&fmi->fmi_ans_lock);
+	if (np->n_ans != NULL)
+		ans_dispatch_locked(fmi, np->n_ans);
+	while (np->n_ans_done != np->n_ans_next) {
+		if ((error = ans_cv_wait(fmi)) != 0)
+			break;
+	}
+	mutex_exit(&fmi->fmi_ans_lock);
+
+	return (error);
+}
+
+/*
+ * Send all the ops queued on the mount, and optionally
+ * wait for them.  Caller must not hold any r_lkserlock.
+ */
+int
+fusefs_ans_sync(fusemntinfo_t *fmi, boolean_t intr)
+{
+	int		error = 0;
+
+	if (fmi->fmi_ans_tq == NULL)
+		return (0);
+
+	mutex_enter(&fmi->fmi_ans_lock);
+	ans_flush_locked(fmi);
+	while (fmi->fmi_ans_pending != 0) {
+		if (!intr) {
+			cv_wait(&fmi->fmi_ans_cv, &fmi->fmi_ans_lock);
+		} else if ((error = ans_cv_wait(fmi)) != 0) {
+			break;
+		}
+	}
+	mutex_exit(&fmi->fmi_ans_lock);
+
+	return (error);
+}
+
+/*
+ * VFS_SYNC: send what's queued, without waiting.
+ */
+void
+fusefs_ans_flush(fusemntinfo_t *fmi)
+{
+	if (fmi->fmi_ans_tq == NULL)
+		return;
+
+	mutex_enter(&fmi->fmi_ans_lock);
+	ans_flush_locked(fmi);
+	mutex_exit(&fmi->fmi_ans_lock);
+}
+
+/*
+ * Get the error from a failed op on this node or, for a
+ * directory, under it.  Only fsync clears it, so a close
+ * (which may not be the caller who cares) doesn't lose it.
+ */
+int
+fusefs_ans_error(fusenode_t *np, boolean_t clear)
+{
+	fusemntinfo_t	*fmi = np->n_mount;
+	int		error;
+
+	if (fmi->fmi_ans_tq == NULL)
+		return (0);
+
+	mutex_enter(&fmi->fmi_ans_lock);
+	error = np->n_ans_error;
+	if (clear)
+		np->n_ans_error = 0;
+	mutex_exit(&fmi->fmi_ans_lock);
+
+	return (error);
+}
+
+/*
+ * Set attributes kept with an op.  As in fusefssetattr.
+ */
+static int
+ans_setattr_otw(fusefs_ssn_t *ssp, fusenode_t *np, vattr_t *vap,
+	cred_t *cr)
+{
+	timespec_t	*atime = NULL;
+	timespec_t	*mtime = NULL;
+	uid_t		uid = (uid_t)-1;
+	gid_t		gid = (gid_t)-1;
+	uint_t		mask = vap->va_mask;
+	int		error;
+
+	if (mask & AT_ATIME)
+		atime = &vap->va_atime;
+	if (mask & AT_MTIME)
+		mtime = &vap->va_mtime;
+	if (mask & (AT_ATIME | AT_MTIME)) {
+		error = fusefs_call_utimes(ssp,
+		    np->n_rplen, np->n_rpath, atime, mtime, cr);
+		if (error)
+			return (error);
+	}
+
+	if (mask & AT_MODE) {
+		error = fusefs_call_chmod(ssp,
+		    np->n_rplen, np->n_rpath, vap->va_mode, cr);
+		if (error)
+			return (error);
+	}
+
+	if (mask & AT_UID)
+		uid = vap->va_uid;
+	if (mask & AT_GID)
+		gid = vap->va_gid;
+	if (mask & (AT_UID | AT_GID)) {
+		error = fusefs_call_chown(ssp,
+		    np->n_rplen, np->n_rpath, uid, gid, cr);
+		if (error)
+			return (error);
+	}
+
+	return (0);
+}
+
+/*
+ * Write the data kept with a create op, all of it in
+ * one uio (one iovec per write(2) we absorbed).
+ */
+static int
+ans_write_otw(fusefs_ssn_t *ssp, fusenode_t *np, uint64_t fid,
+	fusefs_ans_t *ap)
+{
+	fusefs_ans_data_t *ad;
+	iovec_t		*iov;
+	uio_t		uio;
+	uint32_t	len, rlen;
+	int		i, n, error = 0;
+
+	n = 0;
+	for (ad = list_head(&ap->a_data); ad != NULL;
+	    ad = list_next(&ap->a_data, ad))
+		n++;
+
+	iov = kmem_alloc(n * sizeof (*iov), KM_SLEEP);
+	i = 0;
+	for (ad = list_head(&ap->a_data); ad != NULL;
+	    ad = list_next(&ap->a_data, ad)) {
+		iov[i].iov_base = (caddr_t)(ad + 1);
+		iov[i].iov_len = ad->ad_len;
+		i++;
+	}
+
+	bzero(&uio, sizeof (uio));
+	uio.uio_iov = iov;
+	uio.uio_iovcnt = n;
+	uio.uio_loffset = 0;
+	uio.uio_segflg = UIO_SYSSPACE;
+	uio.uio_fmode = FWRITE;
+	uio.uio_llimit = MAXOFFSET_T;
+	uio.uio_resid = ap->a_len;
+
+	while (uio.uio_resid > 0) {
+		rlen = len = (uint32_t)MIN(ssp->ss_max_iosize, uio.uio_resid);
+		error = fusefs_call_write(ssp, fid, &rlen, &uio,
+		    np->n_rplen, np->n_rpath, ap->a_cr);
+		if (error)
+			break;
+		if (rlen < len) {
+			/* Out of space, probably. */
+			error = ENOSPC;
+			break;
+		}
+	}
+
+	kmem_free(iov, n * sizeof (*iov));
+	return (error);
+}
+
+/*
+ * Create the file (or directory) for a create op,
+ * then write the data and set the attributes kept
+ * with it.  Returns the handle from the create.
+ */
+static int
+ans_create_otw(fusefs_ssn_t *ssp, fusefs_ans_t *ap, uint64_t *fidp)
+{
+	fusenode_t	*dnp = VTOFUSE(ap->a_dvp);
+	fusenode_t	*np = VTOFUSE(ap->a_vp);
+	fusefattr_t	fa;
+	uint32_t	rflags;
+	uint64_t	fid = FUSE_FID_UNUSED;
+	int		error;
+
+	if (ap->a_op == FUSEFS_ANS_MKDIR) {
+		error = fusefs_call_mkdir(ssp,
+		    dnp->n_rplen, dnp->n_rpath,
+		    ap->a_nmlen, ap->a_name, ap->a_cr);
+	} else if (ssp->ss_opts & FUSE_INIT_CREATE2) {
+		rflags = 0;
+		error = fusefs_call_create2(ssp,
+		    dnp->n_rplen, dnp->n_rpath,
+		    ap->a_nmlen, ap->a_name,
+		    FUSE_CREATE_CREAT | FUSE_CREATE_EXCL,
+		    ap->a_mode, FREAD | FWRITE,
+		    &fid, &fa, &rflags, ap->a_cr);
+		if (error == 0 && (rflags & FUSE_CREATE_OPENED) == 0)
+			fid = FUSE_FID_UNUSED;
+	} else {
+		error = fusefs_call_create(ssp,
+		    dnp->n_rplen, dnp->n_rpath,
+		    ap->a_nmlen, ap->a_name,
+		    ap->a_mode, &fid, NULL, ap->a_cr);
+	}
+	if (error)
+		return (error);
+
+	if (ap->a_len != 0) {
+		if (fid == FUSE_FID_UNUSED)
+			error = fusefs_call_open(ssp,
+			    np->n_rplen, np->n_rpath, FREAD | FWRITE, &fid,
+			    ap->a_cr);
+		if (error == 0)
+			error = ans_write_otw(ssp, np, fid, ap);
+	}
+	if (error == 0 && ap->a_va.va_mask != 0)
+		error = ans_setattr_otw(ssp, np, &ap->a_va, ap->a_cr);
+
+	*fidp = fid;
+	return (error);
+}
+
+/*
+ * Taskq thread: do one op.
+ */
+static void
+fusefs_ans_task(void *arg)
+{
+	fusefs_ans_t	*ap = arg;
+	vnode_t		*vp = ap->a_vp;
+	vnode_t		*dvp = ap->a_dvp;
+	fusenode_t	*np = VTOFUSE(vp);
+	fusenode_t	*dnp = (dvp != NULL) ? VTOFUSE(dvp) : NULL;
+	fusemntinfo_t	*fmi = np->n_mount;
+	fusefs_ssn_t	*ssp = fmi->fmi_ssn;
+	fusefattr_t	fa;
+	uint64_t	fid = FUSE_FID_UNUSED;
+	int		error, cerror;
+
+	/*
+	 * Wait for the ops before this one on the node,
+	 * and for the directory to be created.
+	 */
+	mutex_enter(&fmi->fmi_ans_lock);
+	while (np->n_ans_done != ap->a_seq ||
+	    (dnp != NULL && dnp->n_ans_prov))
+		cv_wait(&fmi->fmi_ans_cv, &fmi->fmi_ans_lock);
+	mutex_exit(&fmi->fmi_ans_lock);
+
+	if (ap->a_op == FUSEFS_ANS_SETATTR)
+		error = ans_setattr_otw(ssp, np, &ap->a_va, ap->a_cr);
+	else
+		error = ans_create_otw(ssp, ap, &fid);
+
+	if (error) {
+		FUSEFS_DEBUG("error %d in provisional op on %s\n",
+		    error, np->n_rpath);
+		fusefs_attrcache_remove(np);
+		if (dnp != NULL) {
+			/* Don't know what's there now. */
+			fusefs_dircache_purge(dnp);
+			fusefs_attrcache_remove(dnp);
+		}
+	} else if (ap->a_op == FUSEFS_ANS_SETATTR) {
+		fusefs_attrcache_remove(np);
+	} else {
+		/*
+		 * The real attributes.  No fusefs_cache_check: that
+		 * would drop the index of a new directory, which we
+		 * keep up to date ourselves.  The directory mtime
+		 * changes once more because of us.
+		 */
+		if (fusefs_call_getattr(ssp, np->n_rplen, np->n_rpath,
+		    &fa, ap->a_cr) == 0)
+			fusefs_attrcache_fa(vp, &fa);
+		else
+			fusefs_attrcache_remove(np);
+		mutex_enter(&dnp->r_statelock);
+		if (dnp->n_flag & NDCCOMPLETE)
+			dnp->n_flag |= NDCLOCAL;
+		mutex_exit(&dnp->r_statelock);
+	}
+
+	/*
+	 * Give the handle to the file if it's open (and has
+	 * none), otherwise close it.  Either way, the node is
+	 * now what the file system has.
+	 */
+	if (ap->a_op != FUSEFS_ANS_SETATTR) {
+		(void) fusefs_rw_enter_sig(&np->r_lkserlock, RW_WRITER, 0);
+		mutex_enter(&fmi->fmi_ans_lock);
+		np->n_ans_prov = B_FALSE;
+		if (fid != FUSE_FID_UNUSED && error == 0 &&
+		    np->n_fidrefs > 0 && np->n_fid == FUSE_FID_UNUSED) {
+			np->n_fid = fid;
+			np->n_rights = FREAD | FWRITE;
+			np->n_ssgenid = ssp->ss_genid;
+			fid = FUSE_FID_UNUSED;
+		}
+		mutex_exit(&fmi->fmi_ans_lock);
+		fusefs_rw_exit(&np->r_lkserlock);
+
+		if (fid != FUSE_FID_UNUSED) {
+			cerror = fusefs_call_close(ssp, fid);
+			if (cerror)
+				FUSEFS_DEBUG("error %d closing %s\n",
+				    cerror, np->n_rpath);
+		}
+	}
+
+	mutex_enter(&fmi->fmi_ans_lock);
+	if (error) {
+		if (np->n_ans_error == 0)
+			np->n_ans_error = error;
+		if (dnp != NULL && dnp->n_ans_error == 0)
+			dnp->n_ans_error = error;
+	}
+	fmi->fmi_ans_bytes -= ap->a_len;
+	np->n_ans_done++;
+	fmi->fmi_ans_pending--;
+	cv_broadcast(&fmi->fmi_ans_cv);
+	mutex_exit(&fmi->fmi_ans_lock);
+
+	ans_free(fmi, ap);
+	VN_RELE(vp);
+	if (dvp != NULL)
+		VN_RELE(dvp);
+}
@@ -0,0 +1,393 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Block-mapped direct I/O (-o blkdev=PATH).
+ *
+ * A file system that lives on a block device or an image file
+ * (ext2, fat, ntfs...) can tell where each block of a file is
+ * (the bmap op).  With this option, the mount program opens the
+ * device with the user's own access and passes it to us; file
+ * data is then read and written on the device directly, which
+ * saves the trip through the daemon and its 8K door transfers.
+ * Everything else (names, attributes, allocation, holes, making
+ * files longer) still goes through the daemon.
+ *
+ * Each fusenode keeps a few runs of blocks (fusefs_bext_t) the
+ * daemon told us about, replaced round robin.  One FUSE_OP_BMAP
+ * call maps up to fusefs_bmap_nblks blocks that are contiguous
+ * on the device, or a hole that long.  fusefs_read and
+ * fusefs_write call fusefs_bmap_rw for each chunk: it does what
+ * it can directly, stopping at a hole, at our idea of the end of
+ * the file, or if the file can't be mapped, and the rest of the
+ * chunk goes to the daemon as usual.  A write the daemon did, a
+ * hole punched, or a change of size may move blocks, so runs
+ * that overlap it are dropped (fusefs_bmap_inval).  n_bgen
+ * counts those, so a map that was being looked up while one
+ * happened is not kept.
+ *
+ * The daemon does not see the data we write, so it doesn't
+ * update the file's mtime: writes on the device set NBMAPWRITE,
+ * and fsync and the last close (fusefs_bmap_flush) send a
+ * utimes for them.
+ *
+ * This is only right when the file system doesn't keep file data
+ * of its own in memory, doesn't move the blocks of a file while
+ * it's being used (copy-on-write file systems can't use this),
+ * and uses the block device (not the raw one) or the same image
+ * file, so its I/O and ours see the same cache.  Hence opt-in.
+ *
+ * Locks: the block map is under r_statelock.  fusefs_read and
+ * fusefs_write hold r_lkserlock (reader) around our calls, and
+ * r_rwlock, which a change of size takes as writer: blocks a
+ * truncate frees can't be in use by I/O from a stale map.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/cred.h>
+#include <sys/vnode.h>
+#include <sys/vfs.h>
+#include <sys/file.h>
+#include <sys/kmem.h>
+#include <sys/uio.h>
+#include <sys/sunddi.h>
+#include <sys/sysmacros.h>
+
+#include <sys/fs/fuse_door.h>
+
+#include "fusefs.h"
+#include "fusefs_calls.h"
+#include "fusefs_node.h"
+#include "fusefs_subr.h"
+
+/*
+ * Unit of the block map, in bytes: the block size we ask the
+ * file system to map in.  The file system block size is best.
+ * Most blocks one FUSE_OP_BMAP call may map (1MB by default),
+ * and the runs kept per fusenode.
+ */
+int	fusefs_bmap_bsize = 4096;
+uint_t	fusefs_bmap_nblks = 256;
+
+#define	FUSEFS_BMAP_NEXT	8
+#define	FUSEFS_BMAP_SIZE	(FUSEFS_BMAP_NEXT * sizeof (fusefs_bext_t))
+
+/*
+ * Get the backing device for the mount from the file descriptor
+ * the mount program opened, and open it ourselves, for reading
+ * and, if the descriptor allows and the mount isn't read-only,
+ * writing.  Undo with fusefs_bmap_putdev.
+ */
+int
+fusefs_bmap_getdev(int fd, boolean_t rdonly, cred_t *cr,
+	vnode_t **vpp, int *flagp)
+{
+	file_t		*fp;
+	vnode_t		*vp;
+	int		flag, error;
+
+	if ((fp = getf(fd)) == NULL)
+		return (EBADF);
+	vp = fp->f_vnode;
+	flag = fp->f_flag & (FREAD | FWRITE);
+	if (rdonly)
+		flag &= ~FWRITE;
+	if ((flag & FREAD) == 0) {
+		releasef(fd);
+		return (EBADF);
+	}
+	/* Block device or image file, not on a fusefs mount. */
+	if ((vp->v_type != VBLK && vp->v_type != VREG) ||
+	    vn_matchops(vp, fusefs_vnodeops)) {
+		releasef(fd);
+		return (ENOTBLK);
+	}
+	VN_HOLD(vp);
+	releasef(fd);
+
+	error = VOP_OPEN(&vp, flag, cr, NULL);
+	if (error) {
+		VN_RELE(vp);
+		return (error);
+	}
+
+	*vpp = vp;
+	*flagp = flag;
+	return (0);
+}
+
+void
+fusefs_bmap_putdev(vnode_t *vp, int flag, cred_t *cr)
+{
+	(void) VOP_CLOSE(vp, flag, 1, (offset_t)0, cr, NULL);
+	VN_RELE(vp);
+}
+
+/*
+ * Tear-down, from fusefs_free_fmi
+ */
+void
+fusefs_bmap_fini(fusemntinfo_t *fmi)
+{
+	if (fmi->fmi_bvp == NULL)
+		return;
+
+	fusefs_bmap_putdev(fmi->fmi_bvp, fmi->fmi_bflag, fmi->fmi_bcred);
+	crfree(fmi->fmi_bcred);
+	fmi->fmi_bvp = NULL;
+	fmi->fmi_bcred = NULL;
+}
+
+/*
+ * Find the run of blocks with blk in it, asking the daemon
+ * if we don't have it.  Returns ENOTSUP if this file can't be
+ * mapped (callers then leave the I/O to the daemon).
+ */
+static int
+bmap_lookup(fusenode_t *np, uint64_t blk, fusefs_bext_t *bep)
+{
+	fusemntinfo_t	*fmi = np->n_mount;
+	fusefs_ssn_t	*ssp = fmi->fmi_ssn;
+	fusefs_bext_t	*be, *nbe;
+	uint64_t	pblk;
+	uint32_t	nblks;
+	uint_t		gen;
+	int		i, error;
+
+	mutex_enter(&np->r_statelock);
+	if (np->n_flag & NBMAPNONE) {
+		mutex_exit(&np->r_statelock);
+		return (ENOTSUP);
+	}
+	if ((be = np->n_bext) != NULL) {
+		for (i = 0; i < FUSEFS_BMAP_NEXT; i++, be++) {
+			if (be->be_nblks != 0 && blk >= be->be_lblk &&
+			    blk - be->be_lblk < be->be_nblks) {
+				*bep = *be;
+				mutex_exit(&np->r_statelock);
+				return (0);
+			}
+		}
+	}
+	gen = np->n_bgen;
+	mutex_exit(&np->r_statelock);
+
+	if ((ssp->ss_opts & FUSE_INIT_BMAP) == 0 ||
+	    (fmi->fmi_status & SM_STATUS_NOBMAP) != 0)
+		return (ENOTSUP);
+
+	error = fusefs_call_bmap(ssp, blk, fusefs_bmap_bsize,
+	    fusefs_bmap_nblks, np->n_rplen, np->n_rpath, &pblk, &nblks);
+	if (error == ENOSYS) {
+		mutex_enter(&fmi->fmi_lock);
+		fmi->fmi_status |= SM_STATUS_NOBMAP;
+		mutex_exit(&fmi->fmi_lock);
+		return (ENOTSUP);
+	}
+	if (error != 0) {
+		if (error != EINTR) {
+			mutex_enter(&np->r_statelock);
+			np->n_flag |= NBMAPNONE;
+			mutex_exit(&np->r_statelock);
+		}
+		return (ENOTSUP);
+	}
+
+	bep->be_lblk = blk;
+	bep->be_pblk = pblk;
+	bep->be_nblks = nblks;
+
+	/*
+	 * Keep it, unless something changed the file meanwhile.
+	 */
+	nbe = NULL;
+	if (np->n_bext == NULL)
+		nbe = kmem_zalloc(FUSEFS_BMAP_SIZE, KM_SLEEP);
+	mutex_enter(&np->r_statelock);
+	if (np->n_bext == NULL && nbe != NULL) {
+		np->n_bext = nbe;
+		nbe = NULL;
+		FUSEFS_MEM_CHARGE(fmi, FUSEFS_BMAP_SIZE);
+	}
+	if (np->n_bext != NULL && np->n_bgen == gen) {
+		np->n_bext[np->n_bnext] = *bep;
+		np->n_bnext = (np->n_bnext + 1) % FUSEFS_BMAP_NEXT;
+	}
+	mutex_exit(&np->r_statelock);
+	if (nbe != NULL)
+		kmem_free(nbe, FUSEFS_BMAP_SIZE);
+
+	return (0);
+}
+
+/*
+ * Do as much of the I/O in uiop as we can on the device: from
+ * uio_loffset, through mapped blocks, up to our idea of the end
+ * of the file.  Returns with the uio updated for what was done,
+ * which may be nothing.  Errors are from the device.
+ */
+int
+fusefs_bmap_rw(fusenode_t *np, uio_t *uiop, enum uio_rw rw, int ioflag)
+{
+	fusemntinfo_t	*fmi = np->n_mount;
+	vnode_t		*bvp = fmi->fmi_bvp;
+	fusefs_bext_t	be;
+	offset_t	off, eof, bsize, devoff;
+	ssize_t		len, done, save_resid;
+	rlim64_t	save_limit;
+	int		rwl, error = 0;
+
+	if (bvp == NULL)
+		return (0);
+	if (rw == UIO_WRITE && (fmi->fmi_bflag & FWRITE) == 0)
+		return (0);
+
+	bsize = fusefs_bmap_bsize;
+	rwl = (rw == UIO_WRITE) ? V_WRITELOCK_TRUE : V_WRITELOCK_FALSE;
+	while (uiop->uio_resid > 0) {
+		off = uiop->uio_loffset;
+		mutex_enter(&np->r_statelock);
+		eof = (offset_t)np->r_size;
+		mutex_exit(&np->r_statelock);
+		if (off >= eof)
+			break;
+		if (bmap_lookup(np, off / bsize, &be) != 0)
+			break;
+		if (be.be_pblk == 0)
+			break;	/* hole */
+
+		len = (ssize_t)(MIN((offset_t)(be.be_lblk + be.be_nblks) *
+		    bsize, eof) - off);
+		len = MIN(len, uiop->uio_resid);
+		devoff = (offset_t)be.be_pblk * bsize +
+		    (off - (offset_t)be.be_lblk * bsize);
+
+		/*
+		 * Point the uio at the device, for len bytes.
+		 */
+		save_resid = uiop->uio_resid;
+		save_limit = uiop->uio_llimit;
+		uiop->uio_loffset = devoff;
+		uiop->uio_resid = len;
+		uiop->uio_llimit = MAXOFFSET_T;
+
+		(void) VOP_RWLOCK(bvp, rwl, NULL);
+		if (rw == UIO_READ) {
+			error = VOP_READ(bvp, uiop, 0, fmi->fmi_bcred, NULL);
+		} else {
+			error = VOP_WRITE(bvp, uiop, ioflag & (FSYNC | FDSYNC),
+			    fmi->fmi_bcred, NULL);
+		}
+		VOP_RWUNLOCK(bvp, rwl, NULL);
+
+		done = len - uiop->uio_resid;
+		uiop->uio_loffset = off + done;
+		uiop->uio_resid = save_resid - done;
+		uiop->uio_llimit = save_limit;
+
+		if (rw == UIO_WRITE && done != 0) {
+			mutex_enter(&np->r_statelock);
+			np->n_flag |= NBMAPWRITE;
+			mutex_exit(&np->r_statelock);
+		}
+		if (error != 0 || done < len)
+			break;
+	}
+
+	return (error);
+}
+
+/*
+ * Blocks from off for len bytes (len zero: the whole file) may
+ * have moved.  Drop the runs that overlap them.
+ */
+void
+fusefs_bmap_inval(fusenode_t *np, offset_t off, offset_t len)
+{
+	fusefs_bext_t	*be;
+	uint64_t	first, last;
+	int		i;
+
+	if (np->n_mount->fmi_bvp == NULL)
+		return;
+
+	first = off / fusefs_bmap_bsize;
+	last = (len == 0) ? UINT64_MAX : (off + len - 1) / fusefs_bmap_bsize;
+
+	mutex_enter(&np->r_statelock);
+	np->n_bgen++;
+	if ((be = np->n_bext) != NULL) {
+		for (i = 0; i < FUSEFS_BMAP_NEXT; i++, be++) {
+			if (be->be_nblks != 0 && be->be_lblk <= last &&
+			    be->be_lblk + be->be_nblks > first)
+				be->be_nblks = 0;
+		}
+	}
+	mutex_exit(&np->r_statelock);
+}
+
+/*
+ * For fsync and last close: tell the daemon the file was
+ * modified, if we wrote it on the device, and if sync, make
+ * what we wrote there stable.
+ */
+int
+fusefs_bmap_flush(fusenode_t *np, boolean_t sync)
+{
+	fusemntinfo_t	*fmi = np->n_mount;
+	timespec_t	atime, mtime;
+	boolean_t	written;
+	int		error = 0;
+
+	if (fmi->fmi_bvp == NULL)
+		return (0);
+
+	mutex_enter(&np->r_statelock);
+	written = (np->n_flag & NBMAPWRITE) != 0;
+	np->n_flag &= ~NBMAPWRITE;
+	atime.tv_sec = np->r_attr.st_atime_sec;
+	atime.tv_nsec = np->r_attr.st_atime_ns;
+	mutex_exit(&np->r_statelock);
+
+	if (sync && (fmi->fmi_bflag & FWRITE) != 0)
+		error = VOP_FSYNC(fmi->fmi_bvp, FSYNC, fmi->fmi_bcred, NULL);
+
+	if (written) {
+		gethrestime(&mtime);
+		(void) fusefs_call_utimes(fmi->fmi_ssn,
+		    np->n_rplen, np->n_rpath, &atime, &mtime, NULL);
+		fusefs_attrcache_remove(np);
+	}
+
+	return (error);
+}
+
+/*
+ * From sn_inactive: free the block map.
+ */
+void
+fusefs_bmap_inactive(fusenode_t *np)
+{
+	fusefs_bext_t	*obext;
+
+	mutex_enter(&np->r_statelock);
+	obext = np->n_bext;
+	np->n_bext = NULL;
+	np->n_bnext = 0;
+	np->n_flag &= ~(NBMAPWRITE | NBMAPNONE);
+	mutex_exit(&np->r_statelock);
+
+	if (obext != NULL) {
+		kmem_free(obext, FUSEFS_BMAP_SIZE);
+		FUSEFS_MEM_CHARGE(np->n_mount, -(int64_t)FUSEFS_BMAP_SIZE);
+	}
+}
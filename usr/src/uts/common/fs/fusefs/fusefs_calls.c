@@ -24,10 +24,15 @@
 #include <sys/vnode.h>
 #include <sys/dirent.h>
 #include <sys/uio.h>
+#include <sys/ioccom.h>
+#include <sys/model.h>
 #include <sys/sunddi.h>
 #include <sys/sysmacros.h>
 #include <sys/cmn_err.h>
 #include <sys/sdt.h>
+#include <sys/class.h>
+#include <sys/proc.h>
+#include <sys/cred.h>
 
 #include <sys/fs/fuse_door.h>
 
@@ -38,6 +43,28 @@
 
 uint_t fusefs_genid = 0;
 
+/*
+ * Tell the daemon the priority class of the caller (FUSE_OP_PRIO),
+ * so it can serve interactive callers ahead of batch work.
+ */
+int fusefs_prio_enable = 1;
+
+/*
+ * The scheduling classes that count as "high", looked up once when
+ * the module is loaded.  A class that isn't loaded by then is -1
+ * here, and its threads are treated like any other.
+ */
+static id_t fusefs_rt_cid = -1;
+static id_t fusefs_fx_cid = -1;
+static id_t fusefs_ia_cid = -1;
+
+/*
+ * Every upcall gets a request ID, which fusefs:::upcall-start and
+ * upcall-done report, and which the daemon gets (with our times)
+ * in a FUSE_OP_TRACE header if it asked for one.
+ */
+static uint64_t fusefs_reqid;
+
 int
 fusefs_ssn_create(int doorfd, fusefs_ssn_t **ret_ssn)
 {
@@ -107,6 +134,129 @@ fusefs_ssn_rele(fusefs_ssn_t *ssn)
  * Up-calls to the FUSE daemon.
  */
 
+void
+fusefs_prio_init(void)
+{
+
+	(void) getcidbyname("RT", &fusefs_rt_cid);
+	(void) getcidbyname("FX", &fusefs_fx_cid);
+	(void) getcidbyname("IA", &fusefs_ia_cid);
+}
+
+/*
+ * The priority class of the calling thread.  Threads in the
+ * real-time, fixed and interactive classes, and those with a
+ * negative nice value, are "high".  A positive nice is "low".
+ * The class and nice value are read under p_lock, as priocntl
+ * and nice(2) do, since either may be changing.
+ */
+static uint32_t
+fusefs_prio(void)
+{
+	kthread_t *t = curthread;
+	proc_t *p = ttoproc(t);
+	uint32_t prio;
+	id_t cid;
+	int nice;
+
+	mutex_enter(&p->p_lock);
+	cid = t->t_cid;
+	if (cid == syscid) {
+		prio = FUSE_PRIO_NORMAL;
+	} else if (cid == fusefs_rt_cid || cid == fusefs_fx_cid ||
+	    cid == fusefs_ia_cid) {
+		prio = FUSE_PRIO_HIGH;
+	} else if (CL_DONICE(t, CRED(), 0, &nice) != 0 || nice == 0) {
+		prio = FUSE_PRIO_NORMAL;
+	} else {
+		prio = (nice < 0) ? FUSE_PRIO_HIGH : FUSE_PRIO_LOW;
+	}
+	mutex_exit(&p->p_lock);
+
+	return (prio);
+}
+
+/*
+ * Make a door call to the daemon, once the I/O limits allow.
+ * All args start with the op code, in which we put the caller's
+ * priority if the daemon wants it.  If the daemon is tracing,
+ * the args go behind a FUSE_OP_TRACE header (a copy, so we
+ * only pay for that while tracing).
+ *
+ * The door call carries credentials "cr", or those of the
+ * calling thread if that's NULL.  Work done on behalf of a
+ * caller by some other thread (a taskq) passes the caller's.
+ */
+static int
+fusefs_upcall_cr(fusefs_ssn_t *ssn, door_arg_t *da, cred_t *cr)
+{
+	uint32_t *opp = (uint32_t *)(void *)da->data_ptr;
+	struct fuse_trace_arg *targ;
+	door_arg_t tda;
+	hrtime_t t_enter;
+	uint64_t reqid;
+	size_t tsize;
+	int rc;
+
+	reqid = atomic_inc_64_nv(&fusefs_reqid);
+	t_enter = gethrtime();
+
+	/* The notify thread's call waits for the daemon; not I/O. */
+	if (*opp == FUSE_OP_NOTIFY)
+		return (door_ki_upcall(ssn->ss_door_handle, da));
+
+	rc = fusefs_qos_charge(ssn, FUSEFS_QOS_OPS, 1);
+	if (rc != 0)
+		return (rc);
+
+	if ((ssn->ss_opts & FUSE_INIT_PRIO) != 0 && fusefs_prio_enable)
+		*opp |= fusefs_prio() << FUSE_OP_PRIO_SHIFT;
+
+	DTRACE_PROBE4(fusefs__upcall__start, fusefs_ssn_t *, ssn,
+	    uint64_t, reqid, uint32_t, *opp, hrtime_t, t_enter);
+
+	if ((ssn->ss_opts & FUSE_INIT_TRACE) == 0) {
+		rc = door_ki_upcall_limited(ssn->ss_door_handle, da, cr,
+		    SIZE_MAX, UINT_MAX);
+		DTRACE_PROBE3(fusefs__upcall__done, fusefs_ssn_t *, ssn,
+		    uint64_t, reqid, int, rc);
+		return (rc);
+	}
+
+	tsize = sizeof (*targ) + da->data_size;
+	targ = kmem_alloc(tsize, KM_SLEEP);
+	targ->arg_opcode = FUSE_OP_TRACE;
+	targ->arg_flags = 0;
+	targ->arg_reqid = reqid;
+	targ->arg_t_enter = t_enter;
+	bcopy(da->data_ptr, targ + 1, da->data_size);
+
+	tda = *da;
+	tda.data_ptr = (char *)targ;
+	tda.data_size = tsize;
+	targ->arg_t_call = gethrtime();
+	rc = door_ki_upcall_limited(ssn->ss_door_handle, &tda, cr,
+	    SIZE_MAX, UINT_MAX);
+	DTRACE_PROBE3(fusefs__upcall__done, fusefs_ssn_t *, ssn,
+	    uint64_t, reqid, int, rc);
+
+	/* Results are where the caller expects them. */
+	da->rbuf = tda.rbuf;
+	da->rsize = tda.rsize;
+	da->data_ptr = tda.data_ptr;
+	da->data_size = tda.data_size;
+	kmem_free(targ, tsize);
+
+	return (rc);
+}
+
+static int
+fusefs_upcall(fusefs_ssn_t *ssn, door_arg_t *da)
+{
+
+	return (fusefs_upcall_cr(ssn, da, NULL));
+}
+
 int
 fusefs_call_init(fusefs_ssn_t *ssn, int want)
 {
@@ -126,7 +276,7 @@ fusefs_call_init(fusefs_ssn_t *ssn, int want)
 	da.rbuf = (void *) &ret;
 	da.rsize = sizeof (ret);
 
-	rc = door_ki_upcall(ssn->ss_door_handle, &da);
+	rc = fusefs_upcall(ssn, &da);
 	if (rc != 0)
 		return (rc);
 	if (ret.ret_err != 0)
@@ -140,7 +290,7 @@ fusefs_call_init(fusefs_ssn_t *ssn, int want)
 
 
 int
-fusefs_call_statvfs(fusefs_ssn_t *ssn, statvfs64_t *stv)
+fusefs_call_statvfs(fusefs_ssn_t *ssn, statvfs64_t *stv, cred_t *cr)
 {
 	door_arg_t da;
 	struct fuse_generic_arg arg;
@@ -157,7 +307,7 @@ fusefs_call_statvfs(fusefs_ssn_t *ssn, statvfs64_t *stv)
 	da.rbuf = (void *) &ret;
 	da.rsize = sizeof (ret);
 
-	rc = door_ki_upcall(ssn->ss_door_handle, &da);
+	rc = fusefs_upcall_cr(ssn, &da, cr);
 	if (rc != 0)
 		return (rc);
 	if (ret.ret_err != 0)
@@ -181,7 +331,7 @@ fusefs_call_statvfs(fusefs_ssn_t *ssn, statvfs64_t *stv)
 
 int
 fusefs_call_fgetattr(fusefs_ssn_t *ssn,
-	uint64_t fid, fusefattr_t *fap)
+	uint64_t fid, fusefattr_t *fap, cred_t *cr)
 {
 	door_arg_t da;
 	struct fuse_fid_arg arg;
@@ -199,7 +349,7 @@ fusefs_call_fgetattr(fusefs_ssn_t *ssn,
 	da.rbuf = (void *) &ret;
 	da.rsize = sizeof (ret);
 
-	rc = door_ki_upcall(ssn->ss_door_handle, &da);
+	rc = fusefs_upcall_cr(ssn, &da, cr);
 	if (rc != 0)
 		return (rc);
 	if (ret.ret_err != 0)
@@ -213,7 +363,7 @@ fusefs_call_fgetattr(fusefs_ssn_t *ssn,
 int
 fusefs_call_getattr(fusefs_ssn_t *ssn,
 	int rplen, const char *rpath,
-	fusefattr_t *fap)
+	fusefattr_t *fap, cred_t *cr)
 {
 	door_arg_t da;
 	struct fuse_path_arg *argp;
@@ -236,7 +386,7 @@ fusefs_call_getattr(fusefs_ssn_t *ssn,
 	da.rbuf = (void *) &ret;
 	da.rsize = sizeof (ret);
 
-	rc = door_ki_upcall(ssn->ss_door_handle, &da);
+	rc = fusefs_upcall_cr(ssn, &da, cr);
 
 	kmem_free(argp, sizeof (*argp));
 	if (rc != 0)
@@ -290,7 +440,7 @@ fusefs_call_getattr2(fusefs_ssn_t *ssn,
 	da.rbuf = (void *) &ret;
 	da.rsize = sizeof (ret);
 
-	rc = door_ki_upcall(ssn->ss_door_handle, &da);
+	rc = fusefs_upcall(ssn, &da);
 
 	kmem_free(argp, sizeof (*argp));
 	if (rc != 0)
@@ -327,7 +477,7 @@ fusefs_call_opendir(fusefs_ssn_t *ssn,
 	da.rbuf = (void *) &ret;
 	da.rsize = sizeof (ret);
 
-	rc = door_ki_upcall(ssn->ss_door_handle, &da);
+	rc = fusefs_upcall(ssn, &da);
 
 	kmem_free(argp, sizeof (*argp));
 	if (rc != 0)
@@ -358,7 +508,7 @@ fusefs_call_closedir(fusefs_ssn_t *ssn, uint64_t fid)
 	da.rbuf = (void *) &ret;
 	da.rsize = sizeof (ret);
 
-	rc = door_ki_upcall(ssn->ss_door_handle, &da);
+	rc = fusefs_upcall(ssn, &da);
 	if (rc != 0)
 		return (rc);
 	if (ret.ret_err != 0)
@@ -390,7 +540,7 @@ fusefs_call_readdir(fusefs_ssn_t *ssn, uint64_t fid, int offset,
 	da.rbuf = (void *) retp;
 	da.rsize = sizeof (*retp);
 
-	rc = door_ki_upcall(ssn->ss_door_handle, &da);
+	rc = fusefs_upcall(ssn, &da);
 	if (rc == 0)
 		rc = retp->ret_err;
 	if (rc != 0)
@@ -430,7 +580,7 @@ out:
 
 int
 fusefs_call_open(fusefs_ssn_t *ssn,
-	int rplen, const char *rpath, int oflags, uint64_t *ret_fid)
+	int rplen, const char *rpath, int oflags, uint64_t *ret_fid, cred_t *cr)
 {
 	door_arg_t da;
 	struct fuse_path_arg *argp;
@@ -454,7 +604,7 @@ fusefs_call_open(fusefs_ssn_t *ssn,
 	da.rbuf = (void *) &ret;
 	da.rsize = sizeof (ret);
 
-	rc = door_ki_upcall(ssn->ss_door_handle, &da);
+	rc = fusefs_upcall_cr(ssn, &da, cr);
 
 	kmem_free(argp, sizeof (*argp));
 	if (rc != 0)
@@ -485,7 +635,7 @@ fusefs_call_close(fusefs_ssn_t *ssn, uint64_t fid)
 	da.rbuf = (void *) &ret;
 	da.rsize = sizeof (ret);
 
-	rc = door_ki_upcall(ssn->ss_door_handle, &da);
+	rc = fusefs_upcall(ssn, &da);
 	if (rc != 0)
 		return (rc);
 	if (ret.ret_err != 0)
@@ -530,7 +680,10 @@ fusefs_call_read(fusefs_ssn_t *ssn,
 	da.rbuf = (void *) retp;
 	da.rsize = allocsize;
 
-	rc = door_ki_upcall(ssn->ss_door_handle, &da);
+	rc = fusefs_qos_charge(ssn, FUSEFS_QOS_READ, *rlen);
+	if (rc != 0)
+		goto out;
+	rc = fusefs_upcall(ssn, &da);
 	if (rc == 0)
 		rc = retp->ret_err;
 	if (rc != 0)
@@ -549,7 +702,7 @@ out:
 int
 fusefs_call_write(fusefs_ssn_t *ssn,
 	uint64_t fid, uint32_t *rlen, uio_t *uiop,
-	int rplen, const char *rpath)
+	int rplen, const char *rpath, cred_t *cr)
 {
 	door_arg_t da;
 	struct fuse_write_arg *argp;
@@ -586,7 +739,10 @@ fusefs_call_write(fusefs_ssn_t *ssn,
 	da.rbuf = (void *) &ret;
 	da.rsize = sizeof (ret);
 
-	rc = door_ki_upcall(ssn->ss_door_handle, &da);
+	rc = fusefs_qos_charge(ssn, FUSEFS_QOS_WRITE, *rlen);
+	if (rc != 0)
+		goto out;
+	rc = fusefs_upcall_cr(ssn, &da, cr);
 	if (rc == 0)
 		rc = ret.ret_err;
 	if (rc != 0)
@@ -600,6 +756,125 @@ out:
 	return (rc);
 }
 
+/*
+ * Read and write on an open CUSE device.  Unlike the file calls
+ * above, the data rides right behind the fixed part of the call,
+ * so one call can move up to FUSE_DEVIO_MAX.  *lenp is how much
+ * the caller wants moved, and then how much was.
+ */
+int
+fusefs_call_devread(fusefs_ssn_t *ssn, uint64_t fid, int flags,
+	uint32_t *lenp, uio_t *uiop)
+{
+	door_arg_t da;
+	struct fuse_devio_arg arg;
+	struct fuse_devio_ret *retp;
+	size_t allocsize;
+	int rc;
+
+	if (*lenp > FUSE_DEVIO_MAX)
+		return (EINVAL);
+
+	memset(&arg, 0, sizeof (arg));
+	arg.arg_opcode = FUSE_OP_DEVREAD;
+	arg.arg_flags = flags;
+	arg.arg_fid = fid;
+	arg.arg_offset = uiop->uio_loffset;
+	arg.arg_length = *lenp;
+
+	allocsize = sizeof (*retp) + *lenp;
+	retp = kmem_alloc(allocsize, KM_SLEEP);
+
+	memset(&da, 0, sizeof (da));
+	da.data_ptr = (void *)&arg;
+	da.data_size = sizeof (arg);
+	da.rbuf = (void *)retp;
+	da.rsize = allocsize;
+
+	rc = fusefs_qos_charge(ssn, FUSEFS_QOS_READ, *lenp);
+	if (rc != 0)
+		goto out;
+	rc = fusefs_upcall(ssn, &da);
+	if (rc != 0)
+		goto out;
+	if (da.rbuf != (void *)retp) {
+		/* Daemon sent more than we asked for. */
+		kmem_free(da.rbuf, da.rsize);
+		rc = EIO;
+		goto out;
+	}
+	rc = retp->ret_err;
+	if (rc != 0)
+		goto out;
+	if (retp->ret_length > *lenp ||
+	    da.data_size < sizeof (*retp) + retp->ret_length) {
+		rc = EIO;
+		goto out;
+	}
+
+	*lenp = retp->ret_length;
+	rc = uiomove(retp + 1, *lenp, UIO_READ, uiop);
+
+out:
+	kmem_free(retp, allocsize);
+	return (rc);
+}
+
+int
+fusefs_call_devwrite(fusefs_ssn_t *ssn, uint64_t fid, int flags,
+	uint32_t *lenp, uio_t *uiop)
+{
+	door_arg_t da;
+	struct fuse_devio_arg *argp;
+	struct fuse_devio_ret ret;
+	size_t allocsize, cbytes;
+	int rc;
+
+	if (*lenp > FUSE_DEVIO_MAX)
+		return (EINVAL);
+
+	allocsize = sizeof (*argp) + *lenp;
+	argp = kmem_alloc(allocsize, KM_SLEEP);
+	memset(argp, 0, sizeof (*argp));
+	argp->arg_opcode = FUSE_OP_DEVWRITE;
+	argp->arg_flags = flags;
+	argp->arg_fid = fid;
+	argp->arg_offset = uiop->uio_loffset;
+	argp->arg_length = *lenp;
+
+	/* Copy, but don't advance the uio until we know how much went. */
+	rc = uiocopy((caddr_t)(argp + 1), *lenp, UIO_WRITE, uiop, &cbytes);
+	if (rc != 0)
+		goto out;
+	memset(&ret, 0, sizeof (ret));
+
+	memset(&da, 0, sizeof (da));
+	da.data_ptr = (void *)argp;
+	da.data_size = allocsize;
+	da.rbuf = (void *) &ret;
+	da.rsize = sizeof (ret);
+
+	rc = fusefs_qos_charge(ssn, FUSEFS_QOS_WRITE, *lenp);
+	if (rc != 0)
+		goto out;
+	rc = fusefs_upcall(ssn, &da);
+	if (rc == 0)
+		rc = ret.ret_err;
+	if (rc != 0)
+		goto out;
+	if (ret.ret_length > *lenp) {
+		rc = EIO;
+		goto out;
+	}
+
+	*lenp = ret.ret_length;
+	uioskip(uiop, *lenp);
+
+out:
+	kmem_free(argp, allocsize);
+	return (rc);
+}
+
 int
 fusefs_call_flush(fusefs_ssn_t *ssn, uint64_t fid)
 {
@@ -619,7 +894,7 @@ fusefs_call_flush(fusefs_ssn_t *ssn, uint64_t fid)
 	da.rbuf = (void *) &ret;
 	da.rsize = sizeof (ret);
 
-	rc = door_ki_upcall(ssn->ss_door_handle, &da);
+	rc = fusefs_upcall(ssn, &da);
 	if (rc != 0)
 		return (rc);
 	if (ret.ret_err != 0)
@@ -632,7 +907,7 @@ int
 fusefs_call_create(fusefs_ssn_t *ssn,
 	int dnlen, const char *dname,
 	int cnlen, const char *cname,
-	int mode, uint64_t *ret_fid)
+	int mode, uint64_t *ret_fid, uint32_t *ret_flags, cred_t *cr)
 {
 	door_arg_t da;
 	struct fuse_path_arg *argp;
@@ -671,7 +946,7 @@ fusefs_call_create(fusefs_ssn_t *ssn,
 	da.rbuf = (void *) &ret;
 	da.rsize = sizeof (ret);
 
-	rc = door_ki_upcall(ssn->ss_door_handle, &da);
+	rc = fusefs_upcall_cr(ssn, &da, cr);
 
 	kmem_free(argp, sizeof (*argp));
 	if (rc != 0)
@@ -680,9 +955,76 @@ fusefs_call_create(fusefs_ssn_t *ssn,
 		return (ret.ret_err);
 
 	*ret_fid = ret.ret_fid;
+	if (ret_flags != NULL)
+		*ret_flags = ret.ret_flags;
 	return (0);
 }
 
+/*
+ * Create and/or open a file in one call (FUSE_OP_CREATE2).
+ * Returns the handle (if FUSE_CREATE_OPENED is set in the
+ * returned flags) and the attributes.
+ */
+int
+fusefs_call_create2(fusefs_ssn_t *ssn,
+	int dnlen, const char *dname,
+	int cnlen, const char *cname,
+	uint32_t flags, uint32_t mode, int rights,
+	uint64_t *ret_fid, fusefattr_t *fap, uint32_t *ret_flags, cred_t *cr)
+{
+	door_arg_t da;
+	struct fuse_create_arg *argp;
+	struct fuse_create_ret *retp;
+	char *p;
+	int plen, rc;
+
+	/*
+	 * Add one '/' and a null, except when we're
+	 * starting at the root dir, then just a null.
+	 */
+	plen = dnlen + cnlen + 2;
+	if (dnlen == 1)
+		--plen;
+	if (plen >= MAXPATHLEN)
+		return (ENAMETOOLONG);
+
+	argp = kmem_zalloc(sizeof (*argp), KM_SLEEP);
+	retp = kmem_zalloc(sizeof (*retp), KM_SLEEP);
+
+	argp->arg_opcode = FUSE_OP_CREATE2;
+	argp->arg_flags = flags;
+	argp->arg_mode = mode;
+	argp->arg_rights = rights;
+	argp->arg_pathlen = plen;
+
+	/* Fill in path from two parts. */
+	p = argp->arg_path;
+	memcpy(p, dname, dnlen);
+	p += dnlen;
+	if (dnlen > 1)
+		*p++ = '/';
+	memcpy(p, cname, cnlen);
+
+	memset(&da, 0, sizeof (da));
+	da.data_ptr = (void *)argp;
+	da.data_size = sizeof (*argp);
+	da.rbuf = (void *) retp;
+	da.rsize = sizeof (*retp);
+
+	rc = fusefs_upcall_cr(ssn, &da, cr);
+	if (rc == 0)
+		rc = retp->ret_err;
+	if (rc == 0) {
+		*ret_fid = retp->ret_fid;
+		*fap = retp->ret_st;	/* XXX (stat64) */
+		*ret_flags = retp->ret_flags;
+	}
+
+	kmem_free(retp, sizeof (*retp));
+	kmem_free(argp, sizeof (*argp));
+	return (rc);
+}
+
 int
 fusefs_call_ftruncate(fusefs_ssn_t *ssn, uint64_t fid, u_offset_t off,
 	int rplen, const char *rpath)
@@ -709,7 +1051,7 @@ fusefs_call_ftruncate(fusefs_ssn_t *ssn, uint64_t fid, u_offset_t off,
 	da.rbuf = (void *) &ret;
 	da.rsize = sizeof (ret);
 
-	rc = door_ki_upcall(ssn->ss_door_handle, &da);
+	rc = fusefs_upcall(ssn, &da);
 
 	kmem_free(argp, sizeof (*argp));
 	if (rc != 0)
@@ -720,10 +1062,286 @@ fusefs_call_ftruncate(fusefs_ssn_t *ssn, uint64_t fid, u_offset_t off,
 	return (0);
 }
 
+int
+fusefs_call_fallocate(fusefs_ssn_t *ssn, uint64_t fid, int mode,
+	offset_t off, offset_t len, int rplen, const char *rpath)
+{
+	door_arg_t da;
+	struct fuse_fallocate_arg *argp;
+	struct fuse_generic_ret ret;
+	int rc;
+
+	argp = kmem_zalloc(sizeof (*argp), KM_SLEEP);
+
+	argp->arg_opcode = FUSE_OP_FALLOCATE;
+	argp->arg_fid = fid;
+	argp->arg_offset = off;
+	argp->arg_length = len;
+	argp->arg_mode = mode;
+
+	if (rplen > (MAXPATHLEN - 1))
+		rplen = MAXPATHLEN - 1;
+	argp->arg_pathlen = rplen;
+	memcpy(argp->arg_path, rpath, rplen+1);
+
+	memset(&da, 0, sizeof (da));
+	da.data_ptr = (void *)argp;
+	da.data_size = sizeof (*argp);
+	da.rbuf = (void *) &ret;
+	da.rsize = sizeof (ret);
+
+	rc = fusefs_upcall(ssn, &da);
+
+	kmem_free(argp, sizeof (*argp));
+	if (rc != 0)
+		return (rc);
+	if (ret.ret_err != 0)
+		return (ret.ret_err);
+
+	return (0);
+}
+
+int
+fusefs_call_bmap(fusefs_ssn_t *ssn, uint64_t blk, uint32_t bsize,
+	uint32_t nblks, int rplen, const char *rpath,
+	uint64_t *devblkp, uint32_t *nblksp)
+{
+	door_arg_t da;
+	struct fuse_bmap_arg *argp;
+	struct fuse_bmap_ret ret;
+	int rc;
+
+	argp = kmem_zalloc(sizeof (*argp), KM_SLEEP);
+
+	argp->arg_opcode = FUSE_OP_BMAP;
+	argp->arg_block = blk;
+	argp->arg_blocksize = bsize;
+	argp->arg_nblocks = nblks;
+
+	if (rplen > (MAXPATHLEN - 1))
+		rplen = MAXPATHLEN - 1;
+	argp->arg_pathlen = rplen;
+	memcpy(argp->arg_path, rpath, rplen+1);
+
+	memset(&da, 0, sizeof (da));
+	da.data_ptr = (void *)argp;
+	da.data_size = sizeof (*argp);
+	da.rbuf = (void *) &ret;
+	da.rsize = sizeof (ret);
+
+	rc = fusefs_upcall(ssn, &da);
+
+	kmem_free(argp, sizeof (*argp));
+	if (rc != 0)
+		return (rc);
+	if (ret.ret_err != 0)
+		return (ret.ret_err);
+	if (ret.ret_nblocks == 0 || ret.ret_nblocks > nblks)
+		return (EIO);
+
+	*devblkp = ret.ret_devblock;
+	*nblksp = ret.ret_nblocks;
+
+	return (0);
+}
+
+/*
+ * Find a file by the inode number and generation in its handle.
+ * Returns its path (in rpath, MAXPATHLEN bytes) and attributes.
+ */
+int
+fusefs_call_fhlookup(fusefs_ssn_t *ssn, uint64_t ino, uint32_t gen,
+	char *rpath, int *rplenp, fusefattr_t *fap)
+{
+	door_arg_t da;
+	struct fuse_fhlookup_arg arg;
+	struct fuse_fhlookup_ret *retp;
+	int rc;
+
+	memset(&arg, 0, sizeof (arg));
+	arg.arg_opcode = FUSE_OP_FHLOOKUP;
+	arg.arg_ino = ino;
+	arg.arg_gen = gen;
+
+	retp = kmem_zalloc(sizeof (*retp), KM_SLEEP);
+
+	memset(&da, 0, sizeof (da));
+	da.data_ptr = (void *)&arg;
+	da.data_size = sizeof (arg);
+	da.rbuf = (void *)retp;
+	da.rsize = sizeof (*retp);
+
+	rc = fusefs_upcall(ssn, &da);
+	if (rc != 0)
+		goto out;
+	if (retp->ret_err != 0) {
+		rc = retp->ret_err;
+		goto out;
+	}
+	if (retp->ret_pathlen == 0 || retp->ret_pathlen >= MAXPATHLEN ||
+	    retp->ret_path[0] != '/') {
+		rc = EIO;
+		goto out;
+	}
+
+	memcpy(rpath, retp->ret_path, retp->ret_pathlen);
+	rpath[retp->ret_pathlen] = '\0';
+	*rplenp = retp->ret_pathlen;
+	*fap = retp->ret_st;
+
+out:
+	kmem_free(retp, sizeof (*retp));
+	return (rc);
+}
+
+/*
+ * Get a file's ACL (up to FUSE_ACL_MAX entries, into aclp)
+ * and its attributes.  A count of zero means no ACL.
+ */
+int
+fusefs_call_getacl(fusefs_ssn_t *ssn,
+	int rplen, const char *rpath,
+	aclent_t *aclp, int *cntp, fusefattr_t *fap)
+{
+	door_arg_t da;
+	struct fuse_path_arg *argp;
+	struct fuse_getacl_ret *retp;
+	int i, rc;
+
+	if (rplen >= MAXPATHLEN)
+		return (ENAMETOOLONG);
+
+	argp = kmem_zalloc(sizeof (*argp), KM_SLEEP);
+	retp = kmem_zalloc(sizeof (*retp), KM_SLEEP);
+
+	argp->arg_opcode = FUSE_OP_GETACL;
+	argp->arg_pathlen = rplen;
+	memcpy(argp->arg_path, rpath, rplen);
+
+	memset(&da, 0, sizeof (da));
+	da.data_ptr = (void *)argp;
+	da.data_size = sizeof (*argp);
+	da.rbuf = (void *)retp;
+	da.rsize = sizeof (*retp);
+
+	rc = fusefs_upcall(ssn, &da);
+	if (rc != 0)
+		goto out;
+	if (retp->ret_err != 0) {
+		rc = retp->ret_err;
+		goto out;
+	}
+	if (retp->ret_count > FUSE_ACL_MAX) {
+		rc = EIO;
+		goto out;
+	}
+
+	for (i = 0; i < retp->ret_count; i++) {
+		aclp[i].a_type = retp->ret_ent[i].a_type;
+		aclp[i].a_id = retp->ret_ent[i].a_id;
+		aclp[i].a_perm = retp->ret_ent[i].a_perm & 07;
+	}
+	*cntp = retp->ret_count;
+	*fap = retp->ret_st;
+
+out:
+	kmem_free(retp, sizeof (*retp));
+	kmem_free(argp, sizeof (*argp));
+	return (rc);
+}
+
+int
+fusefs_call_setacl(fusefs_ssn_t *ssn,
+	int rplen, const char *rpath,
+	aclent_t *aclp, int cnt)
+{
+	door_arg_t da;
+	struct fuse_setacl_arg *argp;
+	struct fuse_generic_ret ret;
+	int i, rc;
+
+	if (rplen >= MAXPATHLEN)
+		return (ENAMETOOLONG);
+	if (cnt < 0 || cnt > FUSE_ACL_MAX)
+		return (ENOSPC);
+
+	argp = kmem_zalloc(sizeof (*argp), KM_SLEEP);
+
+	argp->arg_opcode = FUSE_OP_SETACL;
+	argp->arg_count = cnt;
+	for (i = 0; i < cnt; i++) {
+		argp->arg_ent[i].a_type = aclp[i].a_type;
+		argp->arg_ent[i].a_id = aclp[i].a_id;
+		argp->arg_ent[i].a_perm = aclp[i].a_perm & 07;
+	}
+	argp->arg_pathlen = rplen;
+	memcpy(argp->arg_path, rpath, rplen);
+	memset(&ret, 0, sizeof (ret));
+
+	memset(&da, 0, sizeof (da));
+	da.data_ptr = (void *)argp;
+	da.data_size = sizeof (*argp);
+	da.rbuf = (void *) &ret;
+	da.rsize = sizeof (ret);
+
+	rc = fusefs_upcall(ssn, &da);
+
+	kmem_free(argp, sizeof (*argp));
+	if (rc != 0)
+		return (rc);
+	return (ret.ret_err);
+}
+
+/*
+ * Get a digest of a file from the daemon, as a NUL terminated
+ * hex string (digest has FUSE_DIGEST_MAX + 1 bytes).
+ */
+int
+fusefs_call_digest(fusefs_ssn_t *ssn,
+	int rplen, const char *rpath,
+	const char *alg, char *digest)
+{
+	door_arg_t da;
+	struct fuse_digest_arg *argp;
+	struct fuse_digest_ret ret;
+	int rc;
+
+	if (rplen >= MAXPATHLEN)
+		return (ENAMETOOLONG);
+
+	argp = kmem_zalloc(sizeof (*argp), KM_SLEEP);
+
+	argp->arg_opcode = FUSE_OP_DIGEST;
+	(void) strlcpy(argp->arg_alg, alg, sizeof (argp->arg_alg));
+	argp->arg_pathlen = rplen;
+	memcpy(argp->arg_path, rpath, rplen);
+	memset(&ret, 0, sizeof (ret));
+
+	memset(&da, 0, sizeof (da));
+	da.data_ptr = (void *)argp;
+	da.data_size = sizeof (*argp);
+	da.rbuf = (void *) &ret;
+	da.rsize = sizeof (ret);
+
+	rc = fusefs_upcall(ssn, &da);
+
+	kmem_free(argp, sizeof (*argp));
+	if (rc != 0)
+		return (rc);
+	if (ret.ret_err != 0)
+		return (ret.ret_err);
+	if (ret.ret_len == 0 || ret.ret_len > FUSE_DIGEST_MAX)
+		return (EIO);
+
+	memcpy(digest, ret.ret_digest, ret.ret_len);
+	digest[ret.ret_len] = '\0';
+	return (0);
+}
+
 int
 fusefs_call_utimes(fusefs_ssn_t *ssn,
 	int rplen, const char *rpath,
-	timespec_t *atime, timespec_t *mtime)
+	timespec_t *atime, timespec_t *mtime, cred_t *cr)
 {
 	door_arg_t da;
 	struct fuse_utimes_arg *argp;
@@ -749,7 +1367,7 @@ fusefs_call_utimes(fusefs_ssn_t *ssn,
 	da.rbuf = (void *) &ret;
 	da.rsize = sizeof (ret);
 
-	rc = door_ki_upcall(ssn->ss_door_handle, &da);
+	rc = fusefs_upcall_cr(ssn, &da, cr);
 
 	kmem_free(argp, sizeof (*argp));
 	if (rc != 0)
@@ -762,7 +1380,7 @@ fusefs_call_utimes(fusefs_ssn_t *ssn,
 
 int
 fusefs_call_chmod(fusefs_ssn_t *ssn,
-	int rplen, const char *rpath, mode_t mode)
+	int rplen, const char *rpath, mode_t mode, cred_t *cr)
 {
 	door_arg_t da;
 	struct fuse_path_arg *argp;
@@ -785,7 +1403,7 @@ fusefs_call_chmod(fusefs_ssn_t *ssn,
 	da.rbuf = (void *) &ret;
 	da.rsize = sizeof (ret);
 
-	rc = door_ki_upcall(ssn->ss_door_handle, &da);
+	rc = fusefs_upcall_cr(ssn, &da, cr);
 
 	kmem_free(argp, sizeof (*argp));
 	if (rc != 0)
@@ -798,7 +1416,7 @@ fusefs_call_chmod(fusefs_ssn_t *ssn,
 
 int
 fusefs_call_chown(fusefs_ssn_t *ssn,
-	int rplen, const char *rpath, uid_t uid, gid_t gid)
+	int rplen, const char *rpath, uid_t uid, gid_t gid, cred_t *cr)
 {
 	door_arg_t da;
 	struct fuse_path_arg *argp;
@@ -822,7 +1440,7 @@ fusefs_call_chown(fusefs_ssn_t *ssn,
 	da.rbuf = (void *) &ret;
 	da.rsize = sizeof (ret);
 
-	rc = door_ki_upcall(ssn->ss_door_handle, &da);
+	rc = fusefs_upcall_cr(ssn, &da, cr);
 
 	kmem_free(argp, sizeof (*argp));
 	if (rc != 0)
@@ -857,7 +1475,7 @@ fusefs_call_delete(fusefs_ssn_t *ssn,
 	da.rbuf = (void *) &ret;
 	da.rsize = sizeof (ret);
 
-	rc = door_ki_upcall(ssn->ss_door_handle, &da);
+	rc = fusefs_upcall(ssn, &da);
 
 	kmem_free(argp, sizeof (*argp));
 	if (rc != 0)
@@ -914,7 +1532,7 @@ fusefs_call_rename(fusefs_ssn_t *ssn,
 	da.rbuf = (void *) &ret;
 	da.rsize = sizeof (ret);
 
-	rc = door_ki_upcall(ssn->ss_door_handle, &da);
+	rc = fusefs_upcall(ssn, &da);
 
 	kmem_free(argp, sizeof (*argp));
 	if (rc != 0)
@@ -928,7 +1546,7 @@ fusefs_call_rename(fusefs_ssn_t *ssn,
 int
 fusefs_call_mkdir(fusefs_ssn_t *ssn,
 	int dnlen, const char *dname,
-	int cnlen, const char *cname)
+	int cnlen, const char *cname, cred_t *cr)
 {
 	door_arg_t da;
 	struct fuse_path_arg *argp;
@@ -966,7 +1584,7 @@ fusefs_call_mkdir(fusefs_ssn_t *ssn,
 	da.rbuf = (void *) &ret;
 	da.rsize = sizeof (ret);
 
-	rc = door_ki_upcall(ssn->ss_door_handle, &da);
+	rc = fusefs_upcall_cr(ssn, &da, cr);
 
 	kmem_free(argp, sizeof (*argp));
 	if (rc != 0)
@@ -1001,7 +1619,78 @@ fusefs_call_rmdir(fusefs_ssn_t *ssn,
 	da.rbuf = (void *) &ret;
 	da.rsize = sizeof (ret);
 
-	rc = door_ki_upcall(ssn->ss_door_handle, &da);
+	rc = fusefs_upcall(ssn, &da);
+
+	kmem_free(argp, sizeof (*argp));
+	if (rc != 0)
+		return (rc);
+	if (ret.ret_err != 0)
+		return (ret.ret_err);
+
+	return (0);
+}
+
+int
+fusefs_call_rmtree(fusefs_ssn_t *ssn,
+	int rplen, const char *rpath)
+{
+	door_arg_t da;
+	struct fuse_path_arg *argp;
+	struct fuse_generic_ret ret;
+	int rc;
+
+	if (rplen >= MAXPATHLEN)
+		return (ENAMETOOLONG);
+
+	argp = kmem_zalloc(sizeof (*argp), KM_SLEEP);
+
+	argp->arg_opcode = FUSE_OP_RMTREE;
+	argp->arg_pathlen = rplen;
+	memcpy(argp->arg_path, rpath, rplen);
+
+	memset(&da, 0, sizeof (da));
+	da.data_ptr = (void *)argp;
+	da.data_size = sizeof (*argp);
+	da.rbuf = (void *) &ret;
+	da.rsize = sizeof (ret);
+
+	rc = fusefs_upcall(ssn, &da);
+
+	kmem_free(argp, sizeof (*argp));
+	if (rc != 0)
+		return (rc);
+	if (ret.ret_err != 0)
+		return (ret.ret_err);
+
+	return (0);
+}
+
+int
+fusefs_call_sumtree(fusefs_ssn_t *ssn,
+	int rplen, const char *rpath, struct fuse_treesum *tsp)
+{
+	door_arg_t da;
+	struct fuse_path_arg *argp;
+	struct fuse_sumtree_ret ret;
+	int rc;
+
+	if (rplen >= MAXPATHLEN)
+		return (ENAMETOOLONG);
+
+	argp = kmem_zalloc(sizeof (*argp), KM_SLEEP);
+
+	argp->arg_opcode = FUSE_OP_SUMTREE;
+	argp->arg_pathlen = rplen;
+	memcpy(argp->arg_path, rpath, rplen);
+	memset(&ret, 0, sizeof (ret));
+
+	memset(&da, 0, sizeof (da));
+	da.data_ptr = (void *)argp;
+	da.data_size = sizeof (*argp);
+	da.rbuf = (void *) &ret;
+	da.rsize = sizeof (ret);
+
+	rc = fusefs_upcall(ssn, &da);
 
 	kmem_free(argp, sizeof (*argp));
 	if (rc != 0)
@@ -1009,5 +1698,236 @@ fusefs_call_rmdir(fusefs_ssn_t *ssn,
 	if (ret.ret_err != 0)
 		return (ret.ret_err);
 
+	*tsp = ret.ret_sum;
+	return (0);
+}
+
+int
+fusefs_call_poll(fusefs_ssn_t *ssn, uint64_t fid,
+	int rplen, const char *rpath,
+	uint64_t kh, int events, int flags, int *reventsp)
+{
+	door_arg_t da;
+	struct fuse_poll_arg *argp;
+	struct fuse_poll_ret ret;
+	int rc;
+
+	if (rplen >= MAXPATHLEN)
+		return (ENAMETOOLONG);
+
+	argp = kmem_zalloc(sizeof (*argp), KM_SLEEP);
+
+	argp->arg_opcode = FUSE_OP_POLL;
+	argp->arg_flags = flags;
+	argp->arg_fid = fid;
+	argp->arg_kh = kh;
+	argp->arg_events = events;
+	argp->arg_pathlen = rplen;
+	memcpy(argp->arg_path, rpath, rplen);
+	memset(&ret, 0, sizeof (ret));
+
+	memset(&da, 0, sizeof (da));
+	da.data_ptr = (void *)argp;
+	da.data_size = sizeof (*argp);
+	da.rbuf = (void *) &ret;
+	da.rsize = sizeof (ret);
+
+	rc = fusefs_upcall(ssn, &da);
+
+	kmem_free(argp, sizeof (*argp));
+	if (rc != 0)
+		return (rc);
+	if (ret.ret_err != 0)
+		return (ret.ret_err);
+
+	*reventsp = ret.ret_revents;
+	return (0);
+}
+
+/*
+ * Forward an ioctl.  See FUSE_OP_IOCTL in fuse_door.h
+ *
+ * The data that goes up is copied in from the caller's buffers:
+ * at first, the one the command's encoding describes, and after
+ * a FUSE_IOCTLF_RETRY answer, the ones the daemon listed.  What
+ * comes back is copied out to the out buffers, in order.  mode
+ * is the ioctl(9E) mode (data model, FKIOCTL).
+ */
+int
+fusefs_call_ioctl(fusefs_ssn_t *ssn, uint64_t fid,
+	int rplen, const char *rpath, int cmd, intptr_t arg,
+	int mode, uint32_t flags, int *rvalp)
+{
+	door_arg_t da;
+	struct fuse_ioctl_arg *argp = NULL;
+	struct fuse_ioctl_ret *retp = NULL;
+	struct fuse_ioctl_iovec *iov;
+	size_t argsize = 0, retsize = 0, iovsize;
+	uint64_t insize, outsize, n;
+	uint_t in_iovs = 0, out_iovs = 0, i, try;
+	char *p;
+	int rc = 0;
+
+	if (rplen >= MAXPATHLEN)
+		return (ENAMETOOLONG);
+
+	iovsize = FUSE_IOCTL_MAXIOV * sizeof (*iov);
+	iov = kmem_zalloc(iovsize, KM_SLEEP);
+
+	/* Well-formed commands say what they move (sys/ioccom.h). */
+	if ((cmd & IOC_IN) != 0 && IOCPARM_LEN(cmd) != 0) {
+		iov[0].iov_base = (uint64_t)arg;
+		iov[0].iov_len = IOCPARM_LEN(cmd);
+		in_iovs = 1;
+	}
+	if ((cmd & IOC_OUT) != 0 && IOCPARM_LEN(cmd) != 0) {
+		iov[in_iovs].iov_base = (uint64_t)arg;
+		iov[in_iovs].iov_len = IOCPARM_LEN(cmd);
+		out_iovs = 1;
+	}
+	if (ddi_model_convert_from(mode & FMODELS) == DDI_MODEL_ILP32)
+		flags |= FUSE_IOCTLF_32BIT;
+
+	for (try = 0; ; try++) {
+		insize = outsize = 0;
+		for (i = 0; i < in_iovs + out_iovs; i++) {
+			if (iov[i].iov_len > FUSE_IOCTL_MAXDATA) {
+				rc = EINVAL;
+				goto out;
+			}
+			if (i < in_iovs)
+				insize += iov[i].iov_len;
+			else
+				outsize += iov[i].iov_len;
+		}
+		if (insize > FUSE_IOCTL_MAXDATA ||
+		    outsize > FUSE_IOCTL_MAXDATA) {
+			rc = EINVAL;
+			goto out;
+		}
+
+		argsize = sizeof (*argp) + insize;
+		argp = kmem_zalloc(argsize, KM_SLEEP);
+		argp->arg_opcode = FUSE_OP_IOCTL;
+		argp->arg_flags = flags;
+		argp->arg_fid = fid;
+		argp->arg_arg = (uint64_t)arg;
+		argp->arg_cmd = cmd;
+		argp->arg_insize = insize;
+		argp->arg_outsize = outsize;
+		argp->arg_pathlen = rplen;
+		memcpy(argp->arg_path, rpath, rplen);
+
+		p = (char *)(argp + 1);
+		for (i = 0; i < in_iovs; i++) {
+			if (ddi_copyin((void *)(uintptr_t)iov[i].iov_base, p,
+			    iov[i].iov_len, mode) != 0) {
+				rc = EFAULT;
+				goto out;
+			}
+			p += iov[i].iov_len;
+		}
+
+		retsize = sizeof (*retp) + MAX(outsize, iovsize);
+		retp = kmem_zalloc(retsize, KM_SLEEP);
+
+		memset(&da, 0, sizeof (da));
+		da.data_ptr = (void *)argp;
+		da.data_size = argsize;
+		da.rbuf = (void *)retp;
+		da.rsize = retsize;
+
+		rc = fusefs_upcall(ssn, &da);
+		if (rc == 0 && da.rbuf != (void *)retp) {
+			kmem_free(da.rbuf, da.rsize);
+			rc = EIO;
+		}
+		if (rc == 0)
+			rc = retp->ret_err;
+		if (rc != 0)
+			goto out;
+		if ((retp->ret_flags & FUSE_IOCTLF_RETRY) == 0)
+			break;
+
+		/* The daemon wants (other) buffers moved. */
+		in_iovs = retp->ret_in_iovs;
+		out_iovs = retp->ret_out_iovs;
+		if ((flags & FUSE_IOCTLF_UNRESTRICTED) == 0 ||
+		    try + 1 >= FUSE_IOCTL_MAXTRY ||
+		    in_iovs > FUSE_IOCTL_MAXIOV ||
+		    out_iovs > FUSE_IOCTL_MAXIOV ||
+		    in_iovs + out_iovs > FUSE_IOCTL_MAXIOV ||
+		    da.data_size < sizeof (*retp) +
+		    (in_iovs + out_iovs) * sizeof (*iov)) {
+			rc = EIO;
+			goto out;
+		}
+		bcopy(retp + 1, iov, (in_iovs + out_iovs) * sizeof (*iov));
+
+		kmem_free(argp, argsize);
+		kmem_free(retp, retsize);
+		argp = NULL;
+		retp = NULL;
+	}
+
+	if (retp->ret_outsize > outsize ||
+	    da.data_size < sizeof (*retp) + retp->ret_outsize) {
+		rc = EIO;
+		goto out;
+	}
+	p = (char *)(retp + 1);
+	outsize = retp->ret_outsize;
+	for (i = in_iovs; i < in_iovs + out_iovs && outsize != 0; i++) {
+		n = MIN(outsize, iov[i].iov_len);
+		if (ddi_copyout(p, (void *)(uintptr_t)iov[i].iov_base,
+		    n, mode) != 0) {
+			rc = EFAULT;
+			goto out;
+		}
+		p += n;
+		outsize -= n;
+	}
+	*rvalp = retp->ret_result;
+
+out:
+	if (argp != NULL)
+		kmem_free(argp, argsize);
+	if (retp != NULL)
+		kmem_free(retp, retsize);
+	kmem_free(iov, iovsize);
+	return (rc);
+}
+
+/*
+ * Wait for notifications from the daemon.  This call does not
+ * return until the daemon has something to say, so it's only
+ * made by the per-mount notify thread (fusefs_notify.c).
+ * Caller supplies the (large) return struct.
+ */
+int
+fusefs_call_notify(fusefs_ssn_t *ssn, struct fuse_notify_ret *retp)
+{
+	door_arg_t da;
+	struct fuse_generic_arg arg;
+	int rc;
+
+	memset(&arg, 0, sizeof (arg));
+	arg.arg_opcode = FUSE_OP_NOTIFY;
+	memset(retp, 0, sizeof (*retp));
+
+	memset(&da, 0, sizeof (da));
+	da.data_ptr = (void *)&arg;
+	da.data_size = sizeof (arg);
+	da.rbuf = (void *) retp;
+	da.rsize = sizeof (*retp);
+
+	rc = fusefs_upcall(ssn, &da);
+	if (rc != 0)
+		return (rc);
+	if (retp->ret_err != 0)
+		return (retp->ret_err);
+	if (retp->ret_count > FUSE_NOTIFY_MAX)
+		return (EIO);
+
 	return (0);
 }
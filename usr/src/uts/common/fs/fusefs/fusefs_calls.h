@@ -24,17 +24,18 @@
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/dirent.h>
+#include <sys/acl.h>
 #include <sys/fs/fuse_ktypes.h>
 
 int fusefs_call_init(fusefs_ssn_t *, int);
 
-int fusefs_call_statvfs(fusefs_ssn_t *, statvfs64_t *);
+int fusefs_call_statvfs(fusefs_ssn_t *, statvfs64_t *, cred_t *);
 
 int fusefs_call_fgetattr(fusefs_ssn_t *,
-	uint64_t fid, fusefattr_t *);
+	uint64_t fid, fusefattr_t *, cred_t *);
 int fusefs_call_getattr(fusefs_ssn_t *,
 	int rplen, const char *rpath,
-	fusefattr_t *);
+	fusefattr_t *, cred_t *);
 int fusefs_call_getattr2(fusefs_ssn_t *,
 	int dnlen, const char *dname,
 	int cnlen, const char *cname,
@@ -47,7 +48,7 @@ int fusefs_call_readdir(fusefs_ssn_t *, uint64_t fid, int offset,
 	fusefattr_t *fa, dirent64_t *de, int *eofp);
 
 int fusefs_call_open(fusefs_ssn_t *,
-	int rplen, const char *rpath, int oflags, uint64_t *ret_fid);
+	int rplen, const char *rpath, int oflags, uint64_t *ret_fid, cred_t *);
 int fusefs_call_close(fusefs_ssn_t *, uint64_t fid);
 
 int  fusefs_call_read(fusefs_ssn_t *,
@@ -55,30 +56,67 @@ int  fusefs_call_read(fusefs_ssn_t *,
 	int rplen, const char *rpath);
 int  fusefs_call_write(fusefs_ssn_t *,
 	uint64_t fid, uint32_t *wlen, uio_t *uiop,
-	int rplen, const char *rpath);
+	int rplen, const char *rpath, cred_t *);
 
 int fusefs_call_flush(fusefs_ssn_t *, uint64_t fid);
 
+/* CUSE device I/O */
+
+int fusefs_call_devread(fusefs_ssn_t *,
+	uint64_t fid, int flags, uint32_t *lenp, uio_t *uiop);
+int fusefs_call_devwrite(fusefs_ssn_t *,
+	uint64_t fid, int flags, uint32_t *lenp, uio_t *uiop);
+
 /* Modify operations */
 
 int fusefs_call_create(fusefs_ssn_t *,
 	int dnlen, const char *dname,
 	int cnlen, const char *cname,
-	int mode, uint64_t *ret_fid);
+	int mode, uint64_t *ret_fid, uint32_t *ret_flags, cred_t *);
+int fusefs_call_create2(fusefs_ssn_t *,
+	int dnlen, const char *dname,
+	int cnlen, const char *cname,
+	uint32_t flags, uint32_t mode, int rights,
+	uint64_t *ret_fid, fusefattr_t *fap, uint32_t *ret_flags, cred_t *);
 
 int fusefs_call_ftruncate(fusefs_ssn_t *,
 	uint64_t fid, u_offset_t off,
 	int rplen, const char *rpath);
 
+int fusefs_call_fallocate(fusefs_ssn_t *,
+	uint64_t fid, int mode, offset_t off, offset_t len,
+	int rplen, const char *rpath);
+
+int fusefs_call_bmap(fusefs_ssn_t *,
+	uint64_t blk, uint32_t bsize, uint32_t nblks,
+	int rplen, const char *rpath,
+	uint64_t *devblkp, uint32_t *nblksp);
+
+int fusefs_call_fhlookup(fusefs_ssn_t *,
+	uint64_t ino, uint32_t gen,
+	char *rpath, int *rplenp, fusefattr_t *);
+
+int fusefs_call_getacl(fusefs_ssn_t *,
+	int rplen, const char *rpath,
+	aclent_t *aclp, int *cntp, fusefattr_t *);
+
+int fusefs_call_setacl(fusefs_ssn_t *,
+	int rplen, const char *rpath,
+	aclent_t *aclp, int cnt);
+
+int fusefs_call_digest(fusefs_ssn_t *,
+	int rplen, const char *rpath,
+	const char *alg, char *digest);
+
 int fusefs_call_utimes(fusefs_ssn_t *,
 	int rplen, const char *rpath,
-	timespec_t *atime, timespec_t *mtime);
+	timespec_t *atime, timespec_t *mtime, cred_t *);
 
 int fusefs_call_chmod(fusefs_ssn_t *,
-	int rplen, const char *rpath, mode_t mode);
+	int rplen, const char *rpath, mode_t mode, cred_t *);
 
 int fusefs_call_chown(fusefs_ssn_t *,
-	int rplen, const char *rpath, uid_t, gid_t);
+	int rplen, const char *rpath, uid_t, gid_t, cred_t *);
 
 int fusefs_call_delete(fusefs_ssn_t *,
 	int rplen, const char *rpath);
@@ -90,11 +128,31 @@ int fusefs_call_rename(fusefs_ssn_t *,
 
 int fusefs_call_mkdir(fusefs_ssn_t *,
 	int ndirlen, const char *ndirpath,
-	int nnmlen, const char *newname);
+	int nnmlen, const char *newname, cred_t *);
 
 int fusefs_call_rmdir(fusefs_ssn_t *,
 	int rplen, const char *rpath);
 
+int fusefs_call_rmtree(fusefs_ssn_t *,
+	int rplen, const char *rpath);
+
+struct fuse_treesum;
+int fusefs_call_sumtree(fusefs_ssn_t *,
+	int rplen, const char *rpath, struct fuse_treesum *);
+
+/* Poll and notifications */
+
+int fusefs_call_poll(fusefs_ssn_t *, uint64_t fid,
+	int rplen, const char *rpath,
+	uint64_t kh, int events, int flags, int *reventsp);
+
+int fusefs_call_ioctl(fusefs_ssn_t *, uint64_t fid,
+	int rplen, const char *rpath, int cmd, intptr_t arg,
+	int mode, uint32_t flags, int *rvalp);
+
+struct fuse_notify_ret;
+int fusefs_call_notify(fusefs_ssn_t *, struct fuse_notify_ret *);
+
 /*
  * FUSE session management
  */
@@ -104,4 +162,6 @@ void fusefs_ssn_kill(fusefs_ssn_t *);
 void fusefs_ssn_hold(fusefs_ssn_t *);
 void fusefs_ssn_rele(fusefs_ssn_t *);
 
+void fusefs_prio_init(void);
+
 #endif /* !_FS_FUSEFS_FUSEFS_CALLS_H_ */
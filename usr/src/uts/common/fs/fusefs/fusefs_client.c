@@ -54,6 +54,8 @@
 #include <sys/mode.h>
 #include <sys/zone.h>
 
+#include <sys/fs/fuse_door.h>
+
 #include "fusefs.h"
 #include "fusefs_calls.h"
 #include "fusefs_node.h"
@@ -68,6 +70,7 @@
 #include <vm/seg_vn.h>
 
 static int fusefs_getattr_cache(vnode_t *, fusefattr_t *);
+static int fusefs_getattr_stale(vnode_t *, fusefattr_t *, cred_t *);
 static void fattr_to_vattr(vnode_t *, fusefattr_t *, vattr_t *);
 
 /*
@@ -81,6 +84,7 @@ struct fmi_globals {
 	kmutex_t	smg_lock;  /* lock protecting smg_list */
 	list_t		smg_list;  /* list of FUSEFS mounts in zone */
 	boolean_t	smg_destructor_called;
+	fusefs_qos_t	smg_qos;   /* I/O limits for "qoszone" mounts */
 };
 typedef struct fmi_globals fmi_globals_t;
 
@@ -118,18 +122,22 @@ fusefs_validate_caches(
 /*
  * Purge all of the various data caches.
  */
-/*ARGSUSED*/
 void
 fusefs_purge_caches(struct vnode *vp)
 {
-#if 0	/* not yet: mmap support */
+	fusenode_t *np = VTOFUSE(vp);
+
 	/*
 	 * NFS: Purge the DNLC for this vp,
 	 * Clear any readdir state bits,
 	 * the readlink response cache, ...
+	 *
+	 * We have the directory name index.
 	 */
-	fusenode_t *np = VTOFUSE(vp);
+	if (vp->v_type == VDIR)
+		fusefs_dircache_inval(np);
 
+#if 0	/* not yet: mmap support */
 	/*
 	 * Flush the page cache.
 	 */
@@ -247,7 +255,20 @@ fusefs_attrcache_fa(vnode_t *vp, fusefattr_t *fap)
 	}
 
 	np->r_attrtime = now + delta;
+	np->r_swrtime = (delta != 0 && fmi->fmi_swrmax != 0) ?
+	    np->r_attrtime + fmi->fmi_swrmax : 0;
 	np->r_attr = *fap;
+
+	/*
+	 * If the daemon supplies inode numbers (FUSE_INIT_INO),
+	 * use them.  Zero means it doesn't know this one, so we
+	 * keep the hash of the path.
+	 */
+	if ((fmi->fmi_ssn->ss_opts & FUSE_INIT_INO) != 0 &&
+	    fap->st_ino != 0)
+		np->n_ino = fap->st_ino;
+	/* and keep the node findable from NFS file handles. */
+	fusefs_fh_update(np, fap);
 	oldvt = vp->v_type;
 	vp->v_type = vtype;
 
@@ -270,7 +291,7 @@ fusefs_attrcache_fa(vnode_t *vp, fusefattr_t *fap)
 	}
 
 	/* NFS: np->r_flags &= ~RWRITEATTR; */
-	np->n_flag &= ~NATTRCHANGED;
+	np->n_flag &= ~(NATTRCHANGED | NDCLOCAL);
 
 	mutex_exit(&np->r_statelock);
 
@@ -309,6 +330,100 @@ fusefs_getattr_cache(vnode_t *vp, fusefattr_t *fap)
 	return (error);
 }
 
+/*
+ * Stale-while-revalidate (-o swr=N): if the cached attributes
+ * expired less than N seconds ago (r_swrtime), return them
+ * anyway and have a taskq thread get new ones, so callers
+ * don't all wait on the daemon when the cache times out.
+ * One refresh per node at a time (NREFRESH).
+ *
+ * Attributes we invalidated (fusefs_attrcache_remove)
+ * are never used this way.  The refresh is made with the
+ * credentials of the caller that found them stale.
+ */
+typedef struct fusefs_refresh {
+	vnode_t		*rf_vp;
+	cred_t		*rf_cr;
+} fusefs_refresh_t;
+
+static void
+fusefs_attr_refresh(void *arg)
+{
+	fusefs_refresh_t *rf = arg;
+	vnode_t *vp = rf->rf_vp;
+	fusenode_t *np = VTOFUSE(vp);
+	fusefattr_t fa;
+
+	(void) fusefs_getattr_otw(vp, &fa, rf->rf_cr);
+
+	mutex_enter(&np->r_statelock);
+	np->n_flag &= ~NREFRESH;
+	mutex_exit(&np->r_statelock);
+	crfree(rf->rf_cr);
+	VN_RELE(vp);
+	kmem_free(rf, sizeof (*rf));
+}
+
+static int
+fusefs_getattr_stale(vnode_t *vp, fusefattr_t *fap, cred_t *cr)
+{
+	fusemntinfo_t *fmi;
+	fusenode_t *np;
+	fusefs_refresh_t *rf;
+	boolean_t refresh = B_FALSE;
+	int error;
+
+	np = VTOFUSE(vp);
+	fmi = VTOFMI(vp);
+
+	mutex_enter(&np->r_statelock);
+	if (gethrtime() >= np->r_swrtime) {
+		/* too old, or invalidated */
+		error = ENOENT;
+	} else {
+		*fap = np->r_attr;
+		error = 0;
+		if ((np->n_flag & NREFRESH) == 0) {
+			np->n_flag |= NREFRESH;
+			refresh = B_TRUE;
+		}
+	}
+	mutex_exit(&np->r_statelock);
+
+	if (!refresh)
+		return (error);
+
+	rf = kmem_alloc(sizeof (*rf), KM_NOSLEEP);
+	if (rf != NULL) {
+		VN_HOLD(vp);
+		crhold(cr);
+		rf->rf_vp = vp;
+		rf->rf_cr = cr;
+		mutex_enter(&fmi->fmi_lock);
+		if (fmi->fmi_swr_tq == NULL ||
+		    taskq_dispatch(fmi->fmi_swr_tq, fusefs_attr_refresh,
+		    rf, TQ_NOSLEEP) == 0)
+			refresh = B_FALSE;
+		mutex_exit(&fmi->fmi_lock);
+		if (!refresh) {
+			crfree(cr);
+			VN_RELE(vp);
+			kmem_free(rf, sizeof (*rf));
+		}
+	} else {
+		refresh = B_FALSE;
+	}
+
+	if (!refresh) {
+		/* Unmounting, or no memory.  Do it now. */
+		mutex_enter(&np->r_statelock);
+		np->n_flag &= ~NREFRESH;
+		mutex_exit(&np->r_statelock);
+		error = ENOENT;
+	}
+	return (error);
+}
+
 /*
  * Get attributes over-the-wire and update attributes cache
  * if no error occurred in the over-the-wire operation.
@@ -318,7 +433,6 @@ fusefs_getattr_cache(vnode_t *vp, fusefattr_t *fap)
 int
 fusefs_getattr_otw(vnode_t *vp, fusefattr_t *fap, cred_t *cr)
 {
-	_NOTE(ARGUNUSED(cr));
 	fusemntinfo_t	*fmi;
 	fusefs_ssn_t	*ssp;
 	struct fusenode	*np;
@@ -330,6 +444,10 @@ fusefs_getattr_otw(vnode_t *vp, fusefattr_t *fap, cred_t *cr)
 
 	bzero(fap, sizeof (fap));
 
+	/* A provisional node must be created first. */
+	if ((error = fusefs_ans_wait(np)) != 0)
+		return (error);
+
 	/* Shared lock for (possible) n_fid use. */
 	if (fusefs_rw_enter_sig(&np->r_lkserlock, RW_READER, FUSEINTR(vp)))
 		return (EINTR);
@@ -339,12 +457,12 @@ fusefs_getattr_otw(vnode_t *vp, fusefattr_t *fap, cred_t *cr)
 	    (np->n_fid != FUSE_FID_UNUSED) &&
 	    (np->n_ssgenid == ssp->ss_genid))
 		error = fusefs_call_fgetattr(
-		    ssp, np->n_fid, fap);
+		    ssp, np->n_fid, fap, cr);
 	else
 		error = ENOSYS;
 	if (error == ENOSYS)
 		error = fusefs_call_getattr(
-		    ssp, np->n_rplen, np->n_rpath, fap);
+		    ssp, np->n_rplen, np->n_rpath, fap, cr);
 
 	fusefs_rw_exit(&np->r_lkserlock);
 
@@ -397,6 +515,8 @@ fusefsgetattr(vnode_t *vp, struct vattr *vap, cred_t *cr)
 	 * which will update the cache in the process.
 	 */
 	error = fusefs_getattr_cache(vp, &fa);
+	if (error && fmi->fmi_swrmax != 0)
+		error = fusefs_getattr_stale(vp, &fa, cr);
 	if (error)
 		error = fusefs_getattr_otw(vp, &fa, cr);
 	if (error)
@@ -429,7 +549,7 @@ fattr_to_vattr(vnode_t *vp, fusefattr_t *fa, vattr_t *vap)
 	vap->va_uid = fa->st_uid;
 	vap->va_gid = fa->st_gid;
 	vap->va_fsid = vp->v_vfsp->vfs_dev;
-	vap->va_nodeid = np->n_ino; /* don't trust: fa->st_ino; */
+	vap->va_nodeid = np->n_ino; /* see fusefs_attrcache_fa */
 	vap->va_nlink = fa->st_nlink;
 
 	/* Careful: see ... */
@@ -489,6 +609,7 @@ fusefs_attrcache_remove(struct fusenode *np)
 	mutex_enter(&np->r_statelock);
 	/* fusefs_attrcache_rm_locked(np); */
 	np->r_attrtime = gethrtime();
+	np->r_swrtime = 0;
 	mutex_exit(&np->r_statelock);
 }
 
@@ -499,6 +620,7 @@ fusefs_attrcache_rm_locked(struct fusenode *np)
 {
 	ASSERT(MUTEX_HELD(&np->r_statelock));
 	np->r_attrtime = gethrtime();
+	np->r_swrtime = 0;
 }
 
 
@@ -508,7 +630,6 @@ fusefs_attrcache_rm_locked(struct fusenode *np)
  */
 
 
-/* ARGSUSED */
 static void *
 fusefs_zone_init(zoneid_t zoneid)
 {
@@ -519,6 +640,9 @@ fusefs_zone_init(zoneid_t zoneid)
 	list_create(&smg->smg_list, sizeof (fusemntinfo_t),
 	    offsetof(fusemntinfo_t, fmi_zone_node));
 	smg->smg_destructor_called = B_FALSE;
+	bzero(&smg->smg_qos, sizeof (smg->smg_qos));
+	fusefs_qos_init(&smg->smg_qos);
+	fusefs_qos_kstat_init(&smg->smg_qos, zoneid, "zone_qos", zoneid);
 	return (smg);
 }
 
@@ -570,6 +694,7 @@ static void
 fusefs_zone_free_globals(fmi_globals_t *smg)
 {
 	list_destroy(&smg->smg_list);	/* makes sure the list is empty */
+	fusefs_qos_fini(&smg->smg_qos);
 	mutex_destroy(&smg->smg_lock);
 	kmem_free(smg, sizeof (*smg));
 
@@ -606,6 +731,19 @@ fusefs_zonelist_add(fusemntinfo_t *fmi)
 	mutex_exit(&smg->smg_lock);
 }
 
+/*
+ * The I/O limits shared by "qoszone" mounts in a zone.
+ * These last as long as the zone has fusefs mounts.
+ */
+fusefs_qos_t *
+fusefs_zone_qos(zone_t *zone)
+{
+	fmi_globals_t *smg;
+
+	smg = zone_getspecific(fmi_list_key, zone);
+	return (&smg->smg_qos);
+}
+
 /*
  * Remove an FUSEFS mount from the per-zone list of FUSEFS mounts.
  */
@@ -643,6 +781,7 @@ fusefs_clntinit(void)
 
 	zone_key_create(&fmi_list_key, fusefs_zone_init, fusefs_zone_shutdown,
 	    fusefs_zone_destroy);
+	fusefs_prio_init();
 	return (0);
 }
 
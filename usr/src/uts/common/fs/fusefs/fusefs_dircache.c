@@ -0,0 +1,451 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Directory name index for fusefs.
+ *
+ * When a directory has been read from start to end (offset zero
+ * through EOF) and its mtime did not change while we did so, we
+ * know every name in it.  We keep those names in a small AVL tree
+ * on the directory fusenode (n_dents) and mark the directory
+ * "complete" (NDCCOMPLETE).  While the directory attributes are
+ * valid, fusefslookup can then answer a lookup without going to
+ * the daemon: names not in the index get ENOENT, and names in the
+ * index get a node (possibly with stale attributes, which will be
+ * fetched when somebody asks for them).
+ *
+ * The index is discarded whenever the directory mtime (or size)
+ * is seen to change (fusefs_purge_caches), except for the one
+ * change that we made ourselves: local create, mkdir, remove,
+ * rmdir and rename update the index directly and set NDCLOCAL,
+ * so the next attribute update of the directory is absorbed
+ * instead of throwing the index away.  NDCLOCAL is cleared by
+ * the next fusefs_attrcache_fa on the directory either way.
+ *
+ * All the n_dents state is protected by r_statelock.
+ * Memory used by the index is charged to the mount
+ * (see fusefs_mem_reclaim).
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/time.h>
+#include <sys/vnode.h>
+#include <sys/kmem.h>
+#include <sys/mode.h>
+#include <sys/sunddi.h>
+#include <sys/sysmacros.h>
+
+#include "fusefs.h"
+#include "fusefs_node.h"
+#include "fusefs_subr.h"
+
+/*
+ * Turning this off disables the directory name index.
+ * fusefs_dircache_max limits the number of names kept
+ * for any one directory.  Larger directories are just
+ * never marked complete (NDCBIG), and not tried again
+ * until they're seen to change.
+ */
+int fusefs_dircache = 1;
+int fusefs_dircache_max = 4096;
+
+#ifdef DEBUG
+int fusefs_dircache_hits = 0;
+int fusefs_dircache_neg = 0;
+int fusefs_dircache_fills = 0;
+int fusefs_dircache_purges = 0;
+#endif /* DEBUG */
+
+#define	FUSEFS_DENT_SIZE(nmlen) \
+	(sizeof (fusefs_dent_t) + (nmlen) + 1)
+
+static int
+fusefs_dent_cmp(const void *va, const void *vb)
+{
+	const fusefs_dent_t *a = va;
+	const fusefs_dent_t *b = vb;
+	int clen, diff;
+
+	/* Same as fusefs_node_cmp */
+	clen = (a->de_nmlen < b->de_nmlen) ?
+	    a->de_nmlen : b->de_nmlen;
+	diff = strncmp(a->de_name, b->de_name, clen);
+	if (diff < 0)
+		return (-1);
+	if (diff > 0)
+		return (1);
+	if (b->de_nmlen > clen)
+		return (-1);
+	if (a->de_nmlen > clen)
+		return (1);
+	return (0);
+}
+
+/*
+ * Setup and teardown, called from make_fusenode
+ * and sn_destroy_node respectively.
+ */
+void
+fusefs_dircache_init(fusenode_t *np)
+{
+	avl_create(&np->n_dents, fusefs_dent_cmp, sizeof (fusefs_dent_t),
+	    offsetof(fusefs_dent_t, de_avl_node));
+}
+
+void
+fusefs_dircache_fini(fusenode_t *np)
+{
+	fusefs_dircache_purge(np);
+	avl_destroy(&np->n_dents);
+}
+
+static void
+dc_purge_locked(fusenode_t *np)
+{
+	fusemntinfo_t *mi = np->n_mount;
+	fusefs_dent_t *de;
+	void *cookie = NULL;
+
+	ASSERT(MUTEX_HELD(&np->r_statelock));
+
+	while ((de = avl_destroy_nodes(&np->n_dents, &cookie)) != NULL)
+		kmem_free(de, FUSEFS_DENT_SIZE(de->de_nmlen));
+	if (np->n_dcount != 0) {
+		FUSEFS_MEM_CHARGE(mi, -(int64_t)np->n_dsize);
+		atomic_add_32(&mi->fmi_mem_dents, -np->n_dcount);
+	}
+	np->n_dcount = 0;
+	np->n_dsize = 0;
+	np->n_flag &= ~(NDCFILL | NDCCOMPLETE | NDCLOCAL);
+}
+
+/*
+ * Forget everything we know about this directory.
+ */
+void
+fusefs_dircache_purge(fusenode_t *np)
+{
+	mutex_enter(&np->r_statelock);
+	if (np->n_dcount != 0 || (np->n_flag & (NDCFILL | NDCCOMPLETE))) {
+#ifdef DEBUG
+		fusefs_dircache_purges++;
+#endif
+		dc_purge_locked(np);
+	}
+	mutex_exit(&np->r_statelock);
+}
+
+/*
+ * The directory was seen to change.  Purge the index,
+ * unless the change was one we made (and recorded).
+ * Called from fusefs_purge_caches.
+ */
+void
+fusefs_dircache_inval(fusenode_t *np)
+{
+	mutex_enter(&np->r_statelock);
+	if (np->n_flag & NDCLOCAL) {
+		np->n_flag &= ~NDCLOCAL;
+		mutex_exit(&np->r_statelock);
+		return;
+	}
+	np->n_flag &= ~NDCBIG;
+	mutex_exit(&np->r_statelock);
+
+	fusefs_dircache_purge(np);
+}
+
+/*
+ * Add one name to the index.  Duplicates are ignored.
+ */
+static void
+dc_add_locked(fusenode_t *np, const char *name, int nmlen, vtype_t vtype)
+{
+	fusefs_dent_t key, *de;
+	avl_index_t where;
+
+	ASSERT(MUTEX_HELD(&np->r_statelock));
+
+	key.de_name = (char *)name;
+	key.de_nmlen = nmlen;
+	de = avl_find(&np->n_dents, &key, &where);
+	if (de != NULL) {
+		de->de_type = vtype;
+		return;
+	}
+
+	de = kmem_alloc(FUSEFS_DENT_SIZE(nmlen), KM_SLEEP);
+	de->de_name = (char *)(de + 1);
+	bcopy(name, de->de_name, nmlen);
+	de->de_name[nmlen] = '\0';
+	de->de_nmlen = nmlen;
+	de->de_type = vtype;
+	avl_insert(&np->n_dents, de, where);
+	np->n_dcount++;
+	np->n_dsize += FUSEFS_DENT_SIZE(nmlen);
+	FUSEFS_MEM_CHARGE(np->n_mount, FUSEFS_DENT_SIZE(nmlen));
+	atomic_inc_32(&np->n_mount->fmi_mem_dents);
+}
+
+/*
+ * Called by fusefs_readvdir before it starts reading at offset.
+ * A listing that starts at offset zero (re)starts the fill.
+ * Any other offset must continue where the last call left off,
+ * otherwise we've missed some names and must give up.
+ *
+ * The fill is checked against the directory mtime, here and in
+ * fusefs_dircache_done.  That comes from the attribute cache when
+ * it's valid; a change we miss that way is caught when the cached
+ * attributes are next refreshed (fusefs_dircache_inval).
+ */
+void
+fusefs_dircache_begin(fusenode_t *np, int offset, cred_t *cr)
+{
+	struct vattr va;
+	boolean_t fill;
+	int error;
+
+	if (!fusefs_dircache)
+		return;
+
+	if (offset == 0) {
+		mutex_enter(&np->r_statelock);
+		fill = (np->n_flag & (NDCCOMPLETE | NDCBIG)) == 0;
+		mutex_exit(&np->r_statelock);
+		if (!fill)
+			return;
+		error = fusefsgetattr(FUSETOV(np), &va, cr);
+
+		mutex_enter(&np->r_statelock);
+		if ((np->n_flag & (NDCCOMPLETE | NDCBIG)) == 0) {
+			dc_purge_locked(np);
+			if (error == 0) {
+				np->n_flag |= NDCFILL;
+				np->n_doffset = 0;
+				np->n_dmtime_sec = va.va_mtime.tv_sec;
+				np->n_dmtime_ns = va.va_mtime.tv_nsec;
+			}
+		}
+		mutex_exit(&np->r_statelock);
+		return;
+	}
+
+	mutex_enter(&np->r_statelock);
+	if ((np->n_flag & NDCFILL) && offset != np->n_doffset)
+		dc_purge_locked(np);
+	mutex_exit(&np->r_statelock);
+}
+
+/*
+ * Called by fusefs_readvdir for each entry it returns.
+ * nextoff is the offset of the entry after this one.
+ */
+void
+fusefs_dircache_fill(fusenode_t *np, const char *name, int nmlen,
+	fusefattr_t *fap, int nextoff)
+{
+	mutex_enter(&np->r_statelock);
+	if (np->n_flag & NDCFILL) {
+		if (np->n_dcount >= fusefs_dircache_max) {
+			dc_purge_locked(np);
+			np->n_flag |= NDCBIG;
+		} else {
+			if (!(nmlen == 1 && name[0] == '.') &&
+			    !(nmlen == 2 && name[0] == '.' && name[1] == '.'))
+				dc_add_locked(np, name, nmlen,
+				    IFTOVT(fap->st_mode));
+			np->n_doffset = nextoff;
+		}
+	}
+	mutex_exit(&np->r_statelock);
+
+	if (FUSEFS_MEM_OVER(np->n_mount))
+		fusefs_mem_reclaim(np->n_mount);
+}
+
+/*
+ * Called by fusefs_readvdir when it reaches EOF.  If the
+ * directory mtime is still what it was when we started,
+ * we have seen every name and the index is complete.
+ */
+void
+fusefs_dircache_done(fusenode_t *np, cred_t *cr)
+{
+	struct vattr va;
+	boolean_t fill;
+	int error;
+
+	mutex_enter(&np->r_statelock);
+	fill = (np->n_flag & NDCFILL) != 0;
+	mutex_exit(&np->r_statelock);
+	if (!fill)
+		return;
+	error = fusefsgetattr(FUSETOV(np), &va, cr);
+
+	mutex_enter(&np->r_statelock);
+	if (np->n_flag & NDCFILL) {
+		np->n_flag &= ~NDCFILL;
+		if (error == 0 &&
+		    np->n_dmtime_sec == va.va_mtime.tv_sec &&
+		    np->n_dmtime_ns == va.va_mtime.tv_nsec &&
+		    (np->n_flag & NDCLOCAL) == 0) {
+			np->n_flag |= NDCCOMPLETE;
+#ifdef DEBUG
+			fusefs_dircache_fills++;
+#endif
+		} else {
+			dc_purge_locked(np);
+		}
+	}
+	mutex_exit(&np->r_statelock);
+}
+
+/*
+ * Local modifications.  Callers hold the directory r_rwlock
+ * as writer and call these after the daemon said OK.
+ * A fill in progress can't be trusted after this.
+ */
+void
+fusefs_dircache_enter(fusenode_t *dnp, const char *name, int nmlen,
+	vtype_t vtype)
+{
+	mutex_enter(&dnp->r_statelock);
+	if (dnp->n_flag & NDCFILL)
+		dc_purge_locked(dnp);
+	if (dnp->n_flag & NDCCOMPLETE) {
+		dc_add_locked(dnp, name, nmlen, vtype);
+		dnp->n_flag |= NDCLOCAL;
+	}
+	mutex_exit(&dnp->r_statelock);
+}
+
+void
+fusefs_dircache_remove(fusenode_t *dnp, const char *name, int nmlen)
+{
+	fusefs_dent_t key, *de;
+
+	mutex_enter(&dnp->r_statelock);
+	if (dnp->n_flag & NDCFILL)
+		dc_purge_locked(dnp);
+	if (dnp->n_flag & NDCCOMPLETE) {
+		key.de_name = (char *)name;
+		key.de_nmlen = nmlen;
+		de = avl_find(&dnp->n_dents, &key, NULL);
+		if (de != NULL) {
+			avl_remove(&dnp->n_dents, de);
+			dnp->n_dcount--;
+			dnp->n_dsize -= FUSEFS_DENT_SIZE(de->de_nmlen);
+			FUSEFS_MEM_CHARGE(dnp->n_mount,
+			    -(int64_t)FUSEFS_DENT_SIZE(de->de_nmlen));
+			atomic_dec_32(&dnp->n_mount->fmi_mem_dents);
+			kmem_free(de, FUSEFS_DENT_SIZE(de->de_nmlen));
+		}
+		dnp->n_flag |= NDCLOCAL;
+	}
+	mutex_exit(&dnp->r_statelock);
+}
+
+/*
+ * A directory we are making (see fusefs_asyncns.c) is empty,
+ * so its index is complete from the start.
+ */
+void
+fusefs_dircache_empty(fusenode_t *np)
+{
+	if (!fusefs_dircache)
+		return;
+
+	mutex_enter(&np->r_statelock);
+	dc_purge_locked(np);
+	np->n_flag |= NDCCOMPLETE;
+	mutex_exit(&np->r_statelock);
+}
+
+/*
+ * Try to answer a lookup from the directory name index.
+ * Same conventions as fusefslookup_cache: returns zero
+ * with *vpp == NULL when the index can't say.  Returns
+ * ENOENT when the directory is complete and the name is
+ * not in it, or zero with a held vnode when it is.
+ *
+ * The caller has made sure the directory attributes are
+ * valid (fusefslookup_cache does a fusefsgetattr).
+ */
+int
+fusefs_dircache_lookup(vnode_t *dvp, const char *nm, int nmlen,
+	vnode_t **vpp)
+{
+	fusefs_dent_t key, *de;
+	fusenode_t *dnp;
+	fusenode_t *np;
+	vnode_t *vp;
+	vtype_t vtype;
+
+	dnp = VTOFUSE(dvp);
+	*vpp = NULL;
+
+	if (!fusefs_dircache)
+		return (0);
+
+	mutex_enter(&dnp->r_statelock);
+	if ((dnp->n_flag & NDCCOMPLETE) == 0 ||
+	    dnp->r_attrtime <= gethrtime()) {
+		mutex_exit(&dnp->r_statelock);
+		return (0);
+	}
+	key.de_name = (char *)nm;
+	key.de_nmlen = nmlen;
+	de = avl_find(&dnp->n_dents, &key, NULL);
+	if (de == NULL) {
+		mutex_exit(&dnp->r_statelock);
+#ifdef DEBUG
+		fusefs_dircache_neg++;
+#endif
+		return (ENOENT);
+	}
+	vtype = de->de_type;
+	mutex_exit(&dnp->r_statelock);
+
+	/* No type (readdir had no attributes)?  Ask the daemon. */
+	if (vtype == VNON)
+		return (0);
+
+	/*
+	 * The name exists.  Find or create the node without
+	 * attributes (they will be fetched when needed), but
+	 * we do know the type, which lookup callers need.
+	 */
+	np = fusefs_node_findcreate(dnp->n_mount,
+	    dnp->n_rpath, dnp->n_rplen,
+	    nm, nmlen, FUSEFS_DNP_SEP(dnp),
+	    &fusefs_fattr0); /* force create */
+	ASSERT(np != NULL);
+	vp = FUSETOV(np);
+	if (vp->v_type == VNON)
+		vp->v_type = vtype;
+
+#ifdef DEBUG
+	fusefs_dircache_hits++;
+#endif
+	*vpp = vp;
+	return (0);
+}
@@ -0,0 +1,304 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * File handles (VOP_FID, VFS_VGET), so a fusefs mount can be
+ * shared by the NFS server in the kernel.
+ *
+ * Our nodes are named by path, which a rename or a node cache
+ * eviction doesn't keep, so handles are made from what the daemon
+ * says identifies the file: the inode number (st_ino, from the
+ * file system) and a generation (st_gen, from the daemon, which
+ * changes when an inode number is given to a new file).  The
+ * daemon sets FUSE_INIT_FHANDLE when it can do that and can find
+ * a file again from them (FUSE_OP_FHLOOKUP).
+ *
+ * To find nodes we have without asking, the nodes with an inode
+ * number from the daemon are in a per-mount AVL tree (fmi_fh_avl)
+ * by inode number.  VFS_VGET looks there, and then up the node's
+ * path in the node cache, and checks the node it gets is still
+ * that file (it may have been renamed, and something else put
+ * there).  If not, the daemon is asked for a path.
+ *
+ * Handles hold 12 bytes: the inode number and the generation,
+ * least significant byte first.  That's too long for NFSv2.
+ *
+ * Locks: fmi_fh_lock protects the tree and n_fh.  n_fh changes
+ * with r_statelock held too.  Lock order: r_statelock > fmi_fh_lock.
+ * A node leaves the tree in sn_inactive, before its path is freed,
+ * so a path can be copied from a node found in the tree.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/vnode.h>
+#include <sys/vfs.h>
+#include <sys/kmem.h>
+#include <sys/avl.h>
+#include <sys/sunddi.h>
+#include <sys/sysmacros.h>
+
+#include <sys/fs/fuse_door.h>
+
+#include "fusefs.h"
+#include "fusefs_calls.h"
+#include "fusefs_node.h"
+#include "fusefs_subr.h"
+
+#define	FUSEFS_FID_INO		8	/* bytes of inode number */
+#define	FUSEFS_FID_GEN		4	/* bytes of generation */
+#define	FUSEFS_FID_LEN		(FUSEFS_FID_INO + FUSEFS_FID_GEN)
+
+#define	FHTOFUSE(fhp) \
+	((fusenode_t *)((char *)(fhp) - offsetof(fusenode_t, n_fh)))
+
+static int
+fusefs_fh_cmp(const void *va, const void *vb)
+{
+	const fusefs_fhnode_t *a = va;
+	const fusefs_fhnode_t *b = vb;
+
+	if (a->fh_ino < b->fh_ino)
+		return (-1);
+	if (a->fh_ino > b->fh_ino)
+		return (1);
+	if (a->fh_gen < b->fh_gen)
+		return (-1);
+	if (a->fh_gen > b->fh_gen)
+		return (1);
+	/* Hard links: same file, several nodes. */
+	if ((uintptr_t)a < (uintptr_t)b)
+		return (-1);
+	if ((uintptr_t)a > (uintptr_t)b)
+		return (1);
+	return (0);
+}
+
+void
+fusefs_fh_init(fusemntinfo_t *fmi)
+{
+	mutex_init(&fmi->fmi_fh_lock, NULL, MUTEX_DEFAULT, NULL);
+	avl_create(&fmi->fmi_fh_avl, fusefs_fh_cmp,
+	    sizeof (fusefs_fhnode_t), offsetof(fusefs_fhnode_t, fh_avl));
+}
+
+void
+fusefs_fh_fini(fusemntinfo_t *fmi)
+{
+	avl_destroy(&fmi->fmi_fh_avl);
+	mutex_destroy(&fmi->fmi_fh_lock);
+}
+
+/*
+ * New attributes for a node (from fusefs_attrcache_fa).
+ * Keep its place in the index up to date.
+ */
+void
+fusefs_fh_update(fusenode_t *np, fusefattr_t *fap)
+{
+	fusemntinfo_t	*fmi = np->n_mount;
+
+	ASSERT(MUTEX_HELD(&np->r_statelock));
+
+	if ((fmi->fmi_ssn->ss_opts & FUSE_INIT_FHANDLE) == 0 ||
+	    fap->st_ino == 0)
+		return;
+	if (np->n_fh.fh_ino == fap->st_ino &&
+	    np->n_fh.fh_gen == fap->st_gen)
+		return;
+
+	mutex_enter(&fmi->fmi_fh_lock);
+	if (np->n_fh.fh_ino != 0)
+		avl_remove(&fmi->fmi_fh_avl, &np->n_fh);
+	np->n_fh.fh_ino = fap->st_ino;
+	np->n_fh.fh_gen = fap->st_gen;
+	avl_add(&fmi->fmi_fh_avl, &np->n_fh);
+	mutex_exit(&fmi->fmi_fh_lock);
+}
+
+/*
+ * From sn_inactive: take the node out of the index.
+ */
+void
+fusefs_fh_inactive(fusenode_t *np)
+{
+	fusemntinfo_t	*fmi = np->n_mount;
+
+	mutex_enter(&np->r_statelock);
+	mutex_enter(&fmi->fmi_fh_lock);
+	if (np->n_fh.fh_ino != 0) {
+		avl_remove(&fmi->fmi_fh_avl, &np->n_fh);
+		np->n_fh.fh_ino = 0;
+		np->n_fh.fh_gen = 0;
+	}
+	mutex_exit(&fmi->fmi_fh_lock);
+	mutex_exit(&np->r_statelock);
+}
+
+/*
+ * Make the handle for a node.  The caller (fusefs_fid) has
+ * made sure we have its attributes.
+ */
+int
+fusefs_fh_fid(fusenode_t *np, fid_t *fidp)
+{
+	fusemntinfo_t	*fmi = np->n_mount;
+	uint64_t	ino;
+	uint32_t	gen;
+	int		i;
+
+	if ((fmi->fmi_ssn->ss_opts & FUSE_INIT_FHANDLE) == 0)
+		return (ENOTSUP);
+
+	if (fidp->fid_len < FUSEFS_FID_LEN) {
+		fidp->fid_len = FUSEFS_FID_LEN;
+		return (ENOSPC);
+	}
+
+	mutex_enter(&np->r_statelock);
+	ino = np->n_fh.fh_ino;
+	gen = np->n_fh.fh_gen;
+	mutex_exit(&np->r_statelock);
+	if (ino == 0)
+		return (ESTALE);
+
+	bzero(fidp->fid_data, FUSEFS_FID_LEN);
+	fidp->fid_len = FUSEFS_FID_LEN;
+	for (i = 0; i < FUSEFS_FID_INO; i++)
+		fidp->fid_data[i] = (char)(ino >> (8 * i));
+	for (i = 0; i < FUSEFS_FID_GEN; i++)
+		fidp->fid_data[FUSEFS_FID_INO + i] = (char)(gen >> (8 * i));
+
+	return (0);
+}
+
+/*
+ * Is np still the file with this inode number and generation?
+ */
+static boolean_t
+fh_match(fusenode_t *np, uint64_t ino, uint32_t gen)
+{
+	boolean_t	match;
+
+	mutex_enter(&np->r_statelock);
+	match = (np->n_fh.fh_ino == ino && np->n_fh.fh_gen == gen &&
+	    (np->n_flag & NUNLINKED) == 0);
+	mutex_exit(&np->r_statelock);
+
+	return (match);
+}
+
+/*
+ * A node we have for this file, returned held, or NULL.
+ */
+static fusenode_t *
+fh_find(fusemntinfo_t *fmi, uint64_t ino, uint32_t gen)
+{
+	fusefs_fhnode_t	key, *fhp;
+	fusenode_t	*np;
+	avl_index_t	where;
+	char		*rpath = NULL;
+	int		rplen = 0;
+
+	/*
+	 * The key's address puts it somewhere among the nodes
+	 * for this file (if any), so one is next to it.
+	 */
+	bzero(&key, sizeof (key));
+	key.fh_ino = ino;
+	key.fh_gen = gen;
+
+	mutex_enter(&fmi->fmi_fh_lock);
+	(void) avl_find(&fmi->fmi_fh_avl, &key, &where);
+	fhp = avl_nearest(&fmi->fmi_fh_avl, where, AVL_BEFORE);
+	if (fhp == NULL || fhp->fh_ino != ino || fhp->fh_gen != gen)
+		fhp = avl_nearest(&fmi->fmi_fh_avl, where, AVL_AFTER);
+	if (fhp != NULL && fhp->fh_ino == ino && fhp->fh_gen == gen) {
+		np = FHTOFUSE(fhp);
+		if (np->n_rpath != NULL) {
+			rplen = np->n_rplen;
+			rpath = kmem_alloc(rplen + 1, KM_NOSLEEP);
+			if (rpath != NULL)
+				bcopy(np->n_rpath, rpath, rplen + 1);
+		}
+	}
+	mutex_exit(&fmi->fmi_fh_lock);
+
+	if (rpath == NULL)
+		return (NULL);
+
+	/* Just looking: no attributes, so no create. */
+	np = fusefs_node_findcreate(fmi, rpath, rplen, NULL, 0, '\0', NULL);
+	kmem_free(rpath, rplen + 1);
+	if (np != NULL && !fh_match(np, ino, gen)) {
+		VN_RELE(FUSETOV(np));
+		np = NULL;
+	}
+
+	return (np);
+}
+
+/*
+ * Find the node for a handle (VFS_VGET), asking the
+ * daemon if we don't have it.  Returned held.
+ */
+int
+fusefs_fh_vget(fusemntinfo_t *fmi, fid_t *fidp, fusenode_t **npp)
+{
+	fusefs_ssn_t	*ssp = fmi->fmi_ssn;
+	fusefattr_t	fa;
+	fusenode_t	*np;
+	uint64_t	ino = 0;
+	uint32_t	gen = 0;
+	char		*rpath;
+	int		i, rplen, error;
+
+	if ((ssp->ss_opts & FUSE_INIT_FHANDLE) == 0)
+		return (ENOTSUP);
+	if (fidp->fid_len != FUSEFS_FID_LEN)
+		return (EINVAL);
+
+	for (i = 0; i < FUSEFS_FID_INO; i++)
+		ino |= (uint64_t)(uchar_t)fidp->fid_data[i] << (8 * i);
+	for (i = 0; i < FUSEFS_FID_GEN; i++)
+		gen |= (uint32_t)(uchar_t)fidp->fid_data[
+		    FUSEFS_FID_INO + i] << (8 * i);
+	if (ino == 0)
+		return (ESTALE);
+
+	if ((np = fh_find(fmi, ino, gen)) != NULL) {
+		*npp = np;
+		return (0);
+	}
+
+	rpath = kmem_alloc(MAXPATHLEN, KM_SLEEP);
+	error = fusefs_call_fhlookup(ssp, ino, gen, rpath, &rplen, &fa);
+	if (error == 0) {
+		if (fa.st_ino != ino || fa.st_gen != gen) {
+			error = ESTALE;
+		} else {
+			np = fusefs_node_findcreate(fmi, rpath, rplen,
+			    NULL, 0, '\0', &fa);
+			if (!fh_match(np, ino, gen)) {
+				VN_RELE(FUSETOV(np));
+				error = ESTALE;
+			}
+		}
+	}
+	kmem_free(rpath, MAXPATHLEN);
+	if (error == ENOSYS)
+		error = ENOTSUP;
+	if (error)
+		return (error);
+
+	*npp = np;
+	return (0);
+}
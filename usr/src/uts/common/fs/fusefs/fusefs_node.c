@@ -144,8 +144,14 @@ static void
 sn_inactive(fusenode_t *np)
 {
 	cred_t		*oldcr;
-	char 		*orpath;
-	int		orplen;
+	char 		*orpath, *upath;
+	int		orplen, uplen;
+
+	/*
+	 * Out of the file handle index first, as that
+	 * lets others copy n_rpath.  See fusefs_fh.c
+	 */
+	fusefs_fh_inactive(np);
 
 	/*
 	 * Flush and invalidate all pages (todo)
@@ -164,11 +170,32 @@ sn_inactive(fusenode_t *np)
 
 	mutex_exit(&np->r_statelock);
 
+	/* Directory name index */
+	fusefs_dircache_purge(np);
+
+	/* Poll handle and pollhead */
+	fusefs_poll_inactive(np);
+
+	/* Deferred delete, normally done at the last close */
+	if ((upath = fusefs_node_unlinked_take(np, &uplen)) != NULL)
+		kmem_free(upath, uplen + 1);
+
+	/* Block map */
+	fusefs_bmap_inactive(np);
+
+	/* ACL cache */
+	fusefs_acl_inactive(np);
+
 	if (oldcr != NULL)
 		crfree(oldcr);
 
-	if (orpath != NULL)
+	if (orpath != NULL) {
 		kmem_free(orpath, orplen + 1);
+		/* Charged in make_fusenode */
+		FUSEFS_MEM_CHARGE(np->n_mount,
+		    -(int64_t)FUSEFS_NODE_MEMSIZE(orplen));
+		atomic_dec_32(&np->n_mount->fmi_mem_nodes);
+	}
 }
 
 /*
@@ -243,6 +270,10 @@ fusefs_node_findcreate(
 	if (rpalloc)
 		kmem_free(rpath, rpalloc);
 
+	/* New nodes may put us over the memory budget. */
+	if (np != NULL && FUSEFS_MEM_OVER(mi))
+		fusefs_mem_reclaim(mi);
+
 	if (fap == NULL) {
 		/*
 		 * Caller is "just looking" (no create)
@@ -283,6 +314,192 @@ fusefs_node_findcreate(
 	return (np);
 }
 
+/*
+ * Is path at or under the directory top (a separator follows)?
+ */
+static boolean_t
+sn_path_under(const char *path, int plen, const char *top, int toplen)
+{
+	if (plen < toplen || strncmp(path, top, toplen) != 0)
+		return (B_FALSE);
+	return (plen == toplen || path[toplen] == '/' || path[toplen] == ':');
+}
+
+/*
+ * Is the unlinked path of np the name dnp/name?
+ * Caller holds fmi_lock.
+ */
+static boolean_t
+sn_unl_match(fusenode_t *np, fusenode_t *dnp, const char *name, int nmlen)
+{
+	char sep = FUSEFS_DNP_SEP(dnp);
+	int dlen = dnp->n_rplen + (sep ? 1 : 0);
+
+	if (np->n_unllen != dlen + nmlen)
+		return (B_FALSE);
+	if (bcmp(np->n_unlpath, dnp->n_rpath, dnp->n_rplen) != 0)
+		return (B_FALSE);
+	if (sep && np->n_unlpath[dnp->n_rplen] != sep)
+		return (B_FALSE);
+	return (bcmp(np->n_unlpath + dlen, name, nmlen) == 0);
+}
+
+/*
+ * The file np was unlinked (or renamed over) while open.
+ * Take it out of the AVL tree, so its name gets a new node.
+ * If deferred, the daemon still has it under n_rpath, and
+ * the last close deletes it (fusefs_rele_fid); until then
+ * lookup and readdir don't show it (fusefs_node_unlinked).
+ */
+void
+fusefs_node_unlink(fusenode_t *np, boolean_t deferred)
+{
+	fusemntinfo_t *mi = np->n_mount;
+	char *upath;
+
+	rw_enter(&mi->fmi_hash_lk, RW_WRITER);
+	if (np->r_flags & RHASHED)
+		sn_rmhash_locked(np);
+	rw_exit(&mi->fmi_hash_lk);
+
+	mutex_enter(&np->r_statelock);
+	np->n_flag |= NUNLINKED;
+	fusefs_attrcache_rm_locked(np);
+	mutex_exit(&np->r_statelock);
+
+	if (!deferred)
+		return;
+
+	upath = kmem_alloc(np->n_rplen + 1, KM_SLEEP);
+	bcopy(np->n_rpath, upath, np->n_rplen + 1);
+
+	mutex_enter(&mi->fmi_lock);
+	ASSERT(np->n_unlpath == NULL);
+	np->n_unlpath = upath;
+	np->n_unllen = np->n_rplen;
+	list_insert_tail(&mi->fmi_unlinked, np);
+	mutex_exit(&mi->fmi_lock);
+}
+
+/*
+ * Is dnp/name a file we unlinked while it was open?
+ * The daemon still has it until the last close, but
+ * to everyone else it's gone.
+ */
+boolean_t
+fusefs_node_unlinked(fusenode_t *dnp, const char *name, int nmlen)
+{
+	fusemntinfo_t *mi = dnp->n_mount;
+	fusenode_t *np;
+	boolean_t found = B_FALSE;
+
+	mutex_enter(&mi->fmi_lock);
+	for (np = list_head(&mi->fmi_unlinked); np != NULL;
+	    np = list_next(&mi->fmi_unlinked, np)) {
+		if (sn_unl_match(np, dnp, name, nmlen)) {
+			found = B_TRUE;
+			break;
+		}
+	}
+	mutex_exit(&mi->fmi_lock);
+
+	return (found);
+}
+
+/*
+ * Take the deferred delete for np off the list: return
+ * the path to delete, which the caller frees, or NULL
+ * if there's none.
+ */
+char *
+fusefs_node_unlinked_take(fusenode_t *np, int *lenp)
+{
+	fusemntinfo_t *mi = np->n_mount;
+	char *upath;
+
+	mutex_enter(&mi->fmi_lock);
+	upath = np->n_unlpath;
+	*lenp = np->n_unllen;
+	if (upath != NULL) {
+		list_remove(&mi->fmi_unlinked, np);
+		np->n_unlpath = NULL;
+		np->n_unllen = 0;
+	}
+	mutex_exit(&mi->fmi_lock);
+
+	return (upath);
+}
+
+/*
+ * A new file is taking the name dnp/name.  If a file we
+ * unlinked while open still has it, take its deferred delete
+ * (as above), so the last close can't delete the new file.
+ */
+char *
+fusefs_node_unlinked_claim(fusenode_t *dnp, const char *name, int nmlen,
+	int *lenp)
+{
+	fusemntinfo_t *mi = dnp->n_mount;
+	fusenode_t *np;
+	char *upath = NULL;
+
+	mutex_enter(&mi->fmi_lock);
+	for (np = list_head(&mi->fmi_unlinked); np != NULL;
+	    np = list_next(&mi->fmi_unlinked, np)) {
+		if (sn_unl_match(np, dnp, name, nmlen)) {
+			list_remove(&mi->fmi_unlinked, np);
+			upath = np->n_unlpath;
+			*lenp = np->n_unllen;
+			np->n_unlpath = NULL;
+			np->n_unllen = 0;
+			break;
+		}
+	}
+	mutex_exit(&mi->fmi_lock);
+
+	return (upath);
+}
+
+/*
+ * The daemon renamed opath to dnp/name.  Unlinked files at
+ * or under opath have moved with it, so fix their paths.
+ */
+void
+fusefs_node_unlinked_rename(fusemntinfo_t *mi, const char *opath, int oplen,
+	fusenode_t *dnp, const char *name, int nmlen)
+{
+	fusenode_t *np;
+	char *p;
+	char sep;
+	int dlen, len;
+
+	sep = FUSEFS_DNP_SEP(dnp);
+	dlen = dnp->n_rplen + (sep ? 1 : 0);
+
+	mutex_enter(&mi->fmi_lock);
+	for (np = list_head(&mi->fmi_unlinked); np != NULL;
+	    np = list_next(&mi->fmi_unlinked, np)) {
+		if (np->n_unllen <= oplen ||
+		    strncmp(np->n_unlpath, opath, oplen) != 0)
+			continue;
+		if (np->n_unlpath[oplen] != '/' &&
+		    np->n_unlpath[oplen] != ':')
+			continue;
+		len = dlen + nmlen + (np->n_unllen - oplen);
+		p = kmem_alloc(len + 1, KM_SLEEP);
+		bcopy(dnp->n_rpath, p, dnp->n_rplen);
+		if (sep)
+			p[dnp->n_rplen] = sep;
+		bcopy(name, p + dlen, nmlen);
+		bcopy(np->n_unlpath + oplen, p + dlen + nmlen,
+		    np->n_unllen - oplen + 1);
+		kmem_free(np->n_unlpath, np->n_unllen + 1);
+		np->n_unlpath = p;
+		np->n_unllen = len;
+	}
+	mutex_exit(&mi->fmi_lock);
+}
+
 /*
  * NFS: nfs_subr.c:rtablehash
  * We use fusefs_hash().
@@ -363,6 +580,7 @@ start:
 		 * destroy old locks before bzero'ing and
 		 * recreating the locks below.
 		 */
+		fusefs_dircache_fini(np);
 		fusefs_rw_destroy(&np->r_rwlock);
 		fusefs_rw_destroy(&np->r_lkserlock);
 		mutex_destroy(&np->r_statelock);
@@ -404,6 +622,7 @@ start:
 	mutex_init(&np->r_statelock, NULL, MUTEX_DEFAULT, NULL);
 	cv_init(&np->r_cv, NULL, CV_DEFAULT, NULL);
 	/* cv_init(&np->r_commit.c_cv, NULL, CV_DEFAULT, NULL); */
+	fusefs_dircache_init(np);
 
 	np->r_vnode = vp;
 	np->n_mount = mi;
@@ -451,8 +670,13 @@ start:
 	 */
 	np->n_rpath = new_rpath;
 	np->n_rplen = rplen;
+	FUSEFS_MEM_CHARGE(mi, FUSEFS_NODE_MEMSIZE(rplen));
+	atomic_inc_32(&mi->fmi_mem_nodes);
 
-	/* fake inode number: hash of the full path name */
+	/*
+	 * Fake inode number: hash of the full path name,
+	 * until the daemon gives us a real one.
+	 */
 	np->n_ino = fusefs_gethash(new_rpath, rplen);
 
 	sn_addhash_locked(np, where);
@@ -821,6 +1045,132 @@ fusefs_attrcache_prune(fusenode_t *top_np)
 	rw_exit(&mi->fmi_hash_lk);
 }
 
+/*
+ * Would removing everything under top_np behind the vnode layer's
+ * back (FUSE_OP_RMTREE) break something here?  That's an open file
+ * under it (or one created with a handle kept for its open), or a
+ * mount on anything under it (the caller checks the node itself,
+ * as for rmdir), or a file unlinked while open that the daemon
+ * still has under it.  Walks the node cache like
+ * fusefs_attrcache_prune.  Caller holds fmi_rmtree_lk (writer),
+ * so no more files get opened.
+ */
+boolean_t
+fusefs_subtree_busy(fusenode_t *top_np)
+{
+	fusemntinfo_t *mi;
+	fusenode_t *np;
+	boolean_t busy = B_FALSE;
+	char *rpath;
+	int rplen;
+
+	mi = top_np->n_mount;
+	rw_enter(&mi->fmi_hash_lk, RW_READER);
+
+	np = top_np;
+	rpath = top_np->n_rpath;
+	rplen = top_np->n_rplen;
+	while (!busy) {
+		np = avl_walk(&mi->fmi_hash_avl, np, AVL_AFTER);
+		if (np == NULL)
+			break;
+		if (np->n_rplen < rplen)
+			break;
+		if (0 != strncmp(np->n_rpath, rpath, rplen))
+			break;
+		if (np->n_rplen == rplen || (
+		    np->n_rpath[rplen] != ':' &&
+		    np->n_rpath[rplen] != '/'))
+			continue;
+		mutex_enter(&np->r_statelock);
+		if ((np->n_fidrefs > 0 || (np->n_flag & NCREATEFID)) &&
+		    FUSETOV(np)->v_type != VDIR)
+			busy = B_TRUE;
+		mutex_exit(&np->r_statelock);
+		if (vn_mountedvfs(FUSETOV(np)) != NULL)
+			busy = B_TRUE;
+	}
+
+	rw_exit(&mi->fmi_hash_lk);
+	if (busy)
+		return (busy);
+
+	/* These are out of the AVL tree.  See fusefs_node_unlink */
+	mutex_enter(&mi->fmi_lock);
+	for (np = list_head(&mi->fmi_unlinked); np != NULL;
+	    np = list_next(&mi->fmi_unlinked, np)) {
+		if (sn_path_under(np->n_unlpath, np->n_unllen,
+		    rpath, rplen)) {
+			busy = B_TRUE;
+			break;
+		}
+	}
+	mutex_exit(&mi->fmi_lock);
+
+	return (busy);
+}
+
+/*
+ * Is np at or under a directory fusefs_rmtree is removing?
+ * Caller holds fmi_lock.
+ */
+boolean_t
+fusefs_in_rmtree(fusenode_t *np)
+{
+	fusemntinfo_t *mi = np->n_mount;
+	fusenode_t *top_np;
+
+	ASSERT(MUTEX_HELD(&mi->fmi_lock));
+
+	for (top_np = list_head(&mi->fmi_rmtrees); top_np != NULL;
+	    top_np = list_next(&mi->fmi_rmtrees, top_np)) {
+		if (sn_path_under(np->n_rpath, np->n_rplen,
+		    top_np->n_rpath, top_np->n_rplen))
+			return (B_TRUE);
+	}
+	return (B_FALSE);
+}
+
+/*
+ * Everything under top_np is gone (FUSE_OP_RMTREE).  In one walk,
+ * invalidate the attributes of the nodes we have under it, and
+ * what we know of the directories among them.  The caller takes
+ * care of top_np itself.
+ */
+void
+fusefs_subtree_gone(fusenode_t *top_np)
+{
+	fusemntinfo_t *mi;
+	fusenode_t *np;
+	char *rpath;
+	int rplen;
+
+	mi = top_np->n_mount;
+	rw_enter(&mi->fmi_hash_lk, RW_READER);
+
+	np = top_np;
+	rpath = top_np->n_rpath;
+	rplen = top_np->n_rplen;
+	for (;;) {
+		np = avl_walk(&mi->fmi_hash_avl, np, AVL_AFTER);
+		if (np == NULL)
+			break;
+		if (np->n_rplen < rplen)
+			break;
+		if (0 != strncmp(np->n_rpath, rpath, rplen))
+			break;
+		if (np->n_rplen == rplen || (
+		    np->n_rpath[rplen] != ':' &&
+		    np->n_rpath[rplen] != '/'))
+			continue;
+		fusefs_attrcache_remove(np);
+		if (FUSETOV(np)->v_type == VDIR)
+			fusefs_dircache_purge(np);
+	}
+
+	rw_exit(&mi->fmi_hash_lk);
+}
+
 #ifdef FUSE_VNODE_DEBUG
 int fusefs_check_table_debug = 1;
 #else /* FUSE_VNODE_DEBUG */
@@ -1000,6 +1350,7 @@ sn_destroy_node(fusenode_t *np)
 	ASSERT(!(np->r_flags & RHASHED));
 	ASSERT(np->r_freef == NULL && np->r_freeb == NULL);
 	atomic_add_long((ulong_t *)&fusenodenew, -1);
+	fusefs_dircache_fini(np);
 	vn_invalid(vp);
 	vn_free(vp);
 	kmem_cache_free(fusenode_cache, np);
@@ -1181,6 +1532,135 @@ fusefs_node_reclaim(void)
 	mutex_exit(&fusefreelist_lock);
 }
 
+/*
+ * Per-mount cache memory budget.
+ *
+ * Everything we cache for a mount (nodes, with their attributes
+ * and paths, and directory name indices) is charged to the mount
+ * in fmi_memused.  When that goes over fmi_memlimit, we give back
+ * memory until we're down to fusefs_mem_lowat percent of the limit.
+ * What we give back first is whatever is cheapest to get again:
+ *
+ *	1: inactive nodes without a name index (a getattr each)
+ *	2: inactive directories with a name index (a full listing)
+ *	3: name indices of directories that are still in use
+ *
+ * Only one thread per mount does this at a time; others just
+ * continue, slightly over budget.  fusefs_kmem_reclaim is still
+ * the global safety valve.
+ */
+int fusefs_mem_lowat = 90;	/* percent of fmi_memlimit */
+
+/*
+ * Passes 1 and 2 above.  Much like fusefs_destroy_table,
+ * but only for nodes on the free list, and only until
+ * we have freed "want" bytes.
+ */
+static void
+sn_mem_reclaim_free(fusemntinfo_t *mi, uint64_t want, int dirs)
+{
+	fusenode_t *np, *next;
+	fusenode_t *rlist;
+	uint64_t freed;
+	vnode_t *vp;
+
+	rlist = NULL;
+	freed = 0;
+
+	rw_enter(&mi->fmi_hash_lk, RW_WRITER);
+	for (np = avl_first(&mi->fmi_hash_avl);
+	    np != NULL && freed < want; np = next) {
+		next = AVL_NEXT(&mi->fmi_hash_avl, np);
+
+		/* Pass 1 skips name indices, pass 2 wants them. */
+		if ((np->n_dcount != 0) != dirs)
+			continue;
+
+		mutex_enter(&fusefreelist_lock);
+		if (np->r_freef == NULL) {
+			/* Busy node (not on the free list). */
+			mutex_exit(&fusefreelist_lock);
+			continue;
+		}
+		sn_rmfree(np);
+		mutex_exit(&fusefreelist_lock);
+
+		vp = FUSETOV(np);
+		mutex_enter(&vp->v_lock);
+		if (vp->v_count > 1) {
+			vp->v_count--;
+			mutex_exit(&vp->v_lock);
+			continue;
+		}
+		mutex_exit(&vp->v_lock);
+		sn_rmhash_locked(np);
+
+		freed += FUSEFS_NODE_MEMSIZE(np->n_rplen) + np->n_dsize;
+
+		/* Borrowing avl_child[0], as in fusefs_destroy_table */
+		np->r_avl_node.avl_child[0] = (struct avl_node *)rlist;
+		rlist = np;
+	}
+	rw_exit(&mi->fmi_hash_lk);
+
+	/*
+	 * These are no longer in the AVL tree, so
+	 * fusefs_addfree will destroy them.
+	 */
+	while ((np = rlist) != NULL) {
+		rlist = (fusenode_t *)np->r_avl_node.avl_child[0];
+		fusefs_addfree(np);
+		atomic_inc_64(&mi->fmi_mem_nevict);
+	}
+}
+
+/*
+ * Pass 3 above: drop the name index of active directories.
+ */
+static void
+sn_mem_reclaim_dirs(fusemntinfo_t *mi, uint64_t target)
+{
+	fusenode_t *np;
+
+	rw_enter(&mi->fmi_hash_lk, RW_READER);
+	for (np = avl_first(&mi->fmi_hash_avl);
+	    np != NULL && mi->fmi_memused > target;
+	    np = AVL_NEXT(&mi->fmi_hash_avl, np)) {
+		if (np->n_dcount == 0)
+			continue;
+		fusefs_dircache_purge(np);
+		atomic_inc_64(&mi->fmi_mem_devict);
+	}
+	rw_exit(&mi->fmi_hash_lk);
+}
+
+void
+fusefs_mem_reclaim(fusemntinfo_t *mi)
+{
+	uint64_t target;
+
+	mutex_enter(&mi->fmi_lock);
+	if (mi->fmi_memlimit == 0 ||
+	    (mi->fmi_status & SM_STATUS_MEMRECLAIM) != 0) {
+		mutex_exit(&mi->fmi_lock);
+		return;
+	}
+	mi->fmi_status |= SM_STATUS_MEMRECLAIM;
+	target = (mi->fmi_memlimit / 100) * fusefs_mem_lowat;
+	mutex_exit(&mi->fmi_lock);
+
+	if (mi->fmi_memused > target)
+		sn_mem_reclaim_free(mi, mi->fmi_memused - target, 0);
+	if (mi->fmi_memused > target)
+		sn_mem_reclaim_free(mi, mi->fmi_memused - target, 1);
+	if (mi->fmi_memused > target)
+		sn_mem_reclaim_dirs(mi, target);
+
+	mutex_enter(&mi->fmi_lock);
+	mi->fmi_status &= ~SM_STATUS_MEMRECLAIM;
+	mutex_exit(&mi->fmi_lock);
+}
+
 /*
  * Called by kmem_cache_alloc ask us if we could
  * "Please give back some memory!"
@@ -38,6 +38,8 @@
 
 #include <sys/avl.h>
 #include <sys/list.h>
+#include <sys/poll.h>
+#include <sys/acl.h>
 #include <sys/fs/fuse_ktypes.h>
 
 #ifdef __cplusplus
@@ -82,6 +84,42 @@ typedef struct fusefs_node_hdr {
 	int		hdr_n_rplen;
 } fusefs_node_hdr_t;
 
+/*
+ * An entry in the directory name index of a fusenode.
+ * These are built from a complete directory listing
+ * and let lookups be answered without an up-call.
+ * See fusefs_dircache.c for details.
+ */
+typedef struct fusefs_dent {
+	avl_node_t	de_avl_node;	/* linkage in n_dents */
+	char		*de_name;	/* name (follows this struct) */
+	int		de_nmlen;	/* length of de_name */
+	vtype_t		de_type;	/* type, from st_mode */
+} fusefs_dent_t;
+
+/*
+ * A run of blocks of a file and where they are on the backing
+ * device (-o blkdev), in fusefs_bmap_bsize units.  be_pblk zero
+ * means a hole.  See fusefs_bmap.c for details.
+ */
+typedef struct fusefs_bext {
+	uint64_t	be_lblk;	/* first block in the file */
+	uint64_t	be_pblk;	/* first block on the device */
+	uint32_t	be_nblks;	/* length of the run, zero: unused */
+} fusefs_bext_t;
+
+/*
+ * Linkage of a fusenode in the mount's index by inode number
+ * (fmi_fh_avl), for finding nodes from NFS file handles.  Like
+ * fusefs_node_hdr_t, it's a separate struct so a search key can
+ * be a stack local.  See fusefs_fh.c for details.
+ */
+typedef struct fusefs_fhnode {
+	avl_node_t	fh_avl;		/* linkage in fmi_fh_avl */
+	uint64_t	fh_ino;		/* st_ino, zero: not in the index */
+	uint32_t	fh_gen;		/* st_gen */
+} fusefs_fhnode_t;
+
 /*
  * Below is the FUSEFS-specific representation of a "node".
  * Fields starting with "r_" came from NFS struct "rnode"
@@ -205,10 +243,81 @@ typedef struct fusenode {
 	hrtime_t	r_attrtime;	/* time attributes become invalid */
 	hrtime_t	r_mtime;	/* client time file last modified */
 	len_t		r_size;		/* client's view of file size */
+	hrtime_t	r_swrtime;	/* may use r_attr stale until */
 	/*
 	 * Other attributes, not carried in smbfattr_t
 	 */
-	u_longlong_t	n_ino;
+	u_longlong_t	n_ino;		/* see fusefs_attrcache_fa */
+
+	/*
+	 * Directory name index (see fusefs_dircache.c)
+	 * Lock for these is: r_statelock
+	 */
+	avl_tree_t	n_dents;	/* fusefs_dent_t, by name */
+	int		n_dcount;	/* entries in n_dents */
+	int		n_doffset;	/* next readdir offset (NDCFILL) */
+	size_t		n_dsize;	/* bytes in n_dents */
+	uint64_t	n_dmtime_sec;	/* dir mtime when listing began */
+	uint32_t	n_dmtime_ns;
+
+	/*
+	 * Poll support (see fusefs_notify.c)
+	 * Lock for these is: fmi_lock
+	 */
+	pollhead_t	n_pollhead;	/* pollers of this node */
+	list_node_t	n_poll_node;	/* linkage in fmi_pollers */
+	uint64_t	n_pollkh;	/* handle the daemon knows, or zero */
+	uint_t		n_pollgen;	/* count of poll notifications */
+	uint_t		n_pollbusy;	/* pollwakeup calls in progress */
+
+	/*
+	 * Unlinked while open (NUNLINKED, see fusefs_node_unlink):
+	 * the path to delete at the last close.
+	 * Lock for these is: fmi_lock
+	 */
+	list_node_t	n_unl_node;	/* linkage in fmi_unlinked */
+	char		*n_unlpath;
+	int		n_unllen;
+
+	/*
+	 * Directory fusefs_rmtree is removing.
+	 * Lock for this is: fmi_lock
+	 */
+	list_node_t	n_rmt_node;	/* linkage in fmi_rmtrees */
+
+	/*
+	 * Provisional create or mkdir (see fusefs_asyncns.c)
+	 * Lock for these is: fmi_ans_lock
+	 */
+	struct fusefs_ans *n_ans;	/* create not sent yet, or NULL */
+	uint_t		n_ans_next;	/* ops queued on this node */
+	uint_t		n_ans_done;	/* ops finished */
+	boolean_t	n_ans_prov;	/* not created yet */
+	int		n_ans_error;	/* from a failed op, for fsync */
+
+	/*
+	 * Block map for direct I/O (see fusefs_bmap.c)
+	 * Lock for these is: r_statelock
+	 */
+	fusefs_bext_t	*n_bext;	/* FUSEFS_BMAP_NEXT runs, or NULL */
+	uint_t		n_bnext;	/* slot to replace next */
+	uint_t		n_bgen;		/* count of invalidations */
+
+	/*
+	 * NFS file handle index (see fusefs_fh.c)
+	 * Lock for this is: fmi_fh_lock, and to change it
+	 * also r_statelock (so either one is enough to read it)
+	 */
+	fusefs_fhnode_t	n_fh;
+
+	/*
+	 * ACL cache (see fusefs_acl.c)
+	 * Lock for these is: r_statelock
+	 */
+	aclent_t	*n_acl;		/* entries, or NULL (none) */
+	int		n_aclcnt;	/* entries in n_acl */
+	uint64_t	n_aclctime_sec;	/* st_ctime when we got them */
+	uint32_t	n_aclctime_ns;
 } fusenode_t;
 
 /* Invalid n_fid value. */
@@ -222,6 +331,16 @@ typedef struct fusenode {
 #define	NFLUSHWIRE	0x01000
 #define	NATTRCHANGED	0x02000 /* kill cached attributes at close */
 #define	N_XATTR 	0x10000 /* extended attribute (dir or file) */
+#define	NDCFILL		0x20000 /* filling n_dents from a listing */
+#define	NDCCOMPLETE	0x40000 /* n_dents holds the whole directory */
+#define	NDCLOCAL	0x80000 /* next mtime change was made by us */
+#define	NUNLINKED	0x100000 /* unlinked while open, delete later */
+#define	NCREATEFID	0x200000 /* n_fid is from create, for next open */
+#define	NREFRESH	0x400000 /* getting new attributes (swr) */
+#define	NBMAPWRITE	0x800000 /* written on the device, mtime not set */
+#define	NBMAPNONE	0x1000000 /* file system won't map this file */
+#define	NACLVALID	0x2000000 /* n_acl goes with n_aclctime */
+#define	NDCBIG		0x4000000 /* too many names for n_dents */
 
 /*
  * Flag bits in: fusenode_t .r_flags
@@ -242,6 +361,13 @@ typedef struct fusenode {
 #define	RINDNLCPURGE	0x2000	/* in the process of purging DNLC references */
 #define	RDELMAPLIST	0x4000	/* delmap callers tracking for as callback */
 
+/*
+ * Cache memory charged to the mount for a node.
+ * See fusefs_mem_reclaim()
+ */
+#define	FUSEFS_NODE_MEMSIZE(rplen) \
+	(sizeof (fusenode_t) + sizeof (vnode_t) + (rplen) + 1)
+
 /*
  * Convert between vnode and fusenode
  */
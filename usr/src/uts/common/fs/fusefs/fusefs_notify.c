@@ -0,0 +1,451 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Notifications from the FUSE daemon, and poll support.
+ *
+ * Doors only carry calls from fusefs up to the daemon, so to let
+ * the daemon tell us things at times of its choosing, each mount
+ * (whose daemon sets FUSE_INIT_NOTIFY) has a thread that keeps one
+ * FUSE_OP_NOTIFY call outstanding.  The daemon answers that call
+ * with a batch of notifications whenever it has some, and we call
+ * again.  At unmount, the FUSE_OP_DESTROY call makes the daemon
+ * answer ESRCH (or the door goes away) and the thread exits.
+ *
+ * Poll: fusefs_poll forwards VOP_POLL to the daemon.  When nothing
+ * is ready, it passes a handle (n_pollkh) for the node and asks the
+ * daemon to send FUSE_NOTIFY_POLL with that handle when readiness
+ * may have changed.  We then pollwakeup the node's pollhead, and
+ * the pollers come back through fusefs_poll to ask again.
+ *
+ * Changes: the daemon may report changes made to the back end by
+ * someone other than us (fuse_notify_change).  For those, we drop
+ * what we have cached about the paths involved (attributes and the
+ * directory name index) and post the vnode events that event port
+ * watchers (PORT_SOURCE_FILE) see for the same change made locally.
+ * Only nodes we already have are touched; nothing here calls up to
+ * the daemon.  The events are the ones the same change would post
+ * here: VE_REMOVE/VE_RMDIR, VE_RENAME_SRC/VE_RENAME_DEST, and
+ * VE_RENAME_DEST_DIR on the directory a rename moved into.  There
+ * is no vnode event for "contents changed" (locally, port_fop sees
+ * the write or create itself), so modifications and directory
+ * changes post VE_RENAME_DEST_DIR, unless fusefs_notify_modevents
+ * is cleared.
+ *
+ * Nodes that have been given a poll handle are kept on the mount
+ * list fmi_pollers until they are destroyed (sn_inactive), so the
+ * notify thread can find them.  Everything here is protected by
+ * fmi_lock, which is never held across the call to pollwakeup.
+ * Instead, n_pollbusy keeps the node (and its pollhead) around
+ * while we're in pollwakeup.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/thread.h>
+#include <sys/disp.h>
+#include <sys/vnode.h>
+#include <sys/kmem.h>
+#include <sys/poll.h>
+#include <sys/zone.h>
+#include <sys/sunddi.h>
+#include <sys/cmn_err.h>
+
+#include <sys/fs/fuse_door.h>
+
+#include "fusefs.h"
+#include "fusefs_calls.h"
+#include "fusefs_node.h"
+#include "fusefs_subr.h"
+
+/*
+ * Post VE_RENAME_DEST_DIR, which port_fop reports as FILE_MODIFIED,
+ * for changes that have no vnode event of their own (a file that
+ * was written, a directory that gained or lost an entry).  It's
+ * not what the event means, but it's the only way watchers hear
+ * of these, so it's done unless this is cleared.
+ */
+int fusefs_notify_modevents = 1;
+
+/*
+ * Events reported to pollwakeup for FUSE_NOTIFY_POLL.  The daemon
+ * does not say which events changed, so wake any interested poller
+ * and let VOP_POLL sort it out.
+ */
+#define	FUSEFS_POLL_ANY	\
+	(POLLIN | POLLRDNORM | POLLRDBAND | POLLPRI | POLLOUT | POLLWRBAND)
+
+static void
+fusefs_notify_poll(fusemntinfo_t *fmi, uint64_t kh)
+{
+	fusenode_t *np;
+
+	mutex_enter(&fmi->fmi_lock);
+	for (np = list_head(&fmi->fmi_pollers); np != NULL;
+	    np = list_next(&fmi->fmi_pollers, np)) {
+		if (np->n_pollkh == kh)
+			break;
+	}
+	if (np == NULL) {
+		/* Already gone.  No pollers to wake. */
+		mutex_exit(&fmi->fmi_lock);
+		return;
+	}
+	np->n_pollgen++;
+	np->n_pollbusy++;
+	mutex_exit(&fmi->fmi_lock);
+
+	pollwakeup(&np->n_pollhead, FUSEFS_POLL_ANY);
+
+	mutex_enter(&fmi->fmi_lock);
+	if (--np->n_pollbusy == 0)
+		cv_broadcast(&fmi->fmi_notify_cv);
+	mutex_exit(&fmi->fmi_lock);
+}
+
+/*
+ * Find the node for a path (from the daemon) and, if wanted,
+ * the node for its parent directory.  Either may be NULL if
+ * we don't have it.  Returned nodes are held.
+ */
+static fusenode_t *
+fusefs_notify_node(fusemntinfo_t *fmi, const char *path,
+    fusenode_t **dnpp, const char **namep, int *nmlenp)
+{
+	const char *nm;
+	int len, dlen;
+
+	len = strlen(path);
+	if (dnpp != NULL) {
+		*dnpp = NULL;
+		*namep = NULL;
+		*nmlenp = 0;
+		nm = strrchr(path, '/');
+		if (nm != NULL && len > 1) {
+			dlen = nm - path;
+			nm++;
+			/* The root is "/", others have no trailing slash. */
+			*dnpp = fusefs_node_findcreate(fmi, path,
+			    dlen ? dlen : 1, NULL, 0, 0, NULL);
+			*namep = nm;
+			*nmlenp = len - (nm - path);
+		}
+	}
+
+	return (fusefs_node_findcreate(fmi, path, len, NULL, 0, 0, NULL));
+}
+
+/*
+ * Contents of vp changed, with no more specific event to post.
+ */
+static void
+fusefs_notify_modified(vnode_t *vp)
+{
+
+	if (fusefs_notify_modevents)
+		vnevent_rename_dest_dir(vp, NULL);
+}
+
+/*
+ * Something in directory dnp changed.
+ */
+static void
+fusefs_notify_dirmod(fusenode_t *dnp)
+{
+
+	fusefs_attrcache_remove(dnp);
+	fusefs_notify_modified(FUSETOV(dnp));
+}
+
+/*
+ * Forget what we know about a node that was removed or replaced.
+ */
+static void
+fusefs_notify_gone(fusenode_t *np)
+{
+
+	fusefs_attrcache_remove(np);
+	if (FUSETOV(np)->v_type == VDIR) {
+		fusefs_attrcache_prune(np);
+		fusefs_dircache_purge(np);
+	}
+}
+
+static void
+fusefs_notify_change(fusemntinfo_t *fmi, int code,
+    const char *path1, const char *path2)
+{
+	fusenode_t *np, *dnp, *tnp, *tdnp;
+	const char *nm, *tnm;
+	int nmlen, tnmlen;
+	vnode_t *vp;
+	vtype_t vtype;
+
+	np = fusefs_notify_node(fmi, path1, &dnp, &nm, &nmlen);
+	vp = (np != NULL) ? FUSETOV(np) : NULL;
+
+	switch (code) {
+	case FUSE_NOTIFY_MODIFIED:
+		if (np == NULL)
+			break;
+		fusefs_attrcache_remove(np);
+		if (vp->v_type == VDIR)
+			fusefs_dircache_purge(np);
+		fusefs_notify_modified(vp);
+		break;
+
+	case FUSE_NOTIFY_CREATED:
+		/*
+		 * A node we still have for this path was created
+		 * over, as with creat(2) on an existing file.
+		 */
+		if (np != NULL) {
+			fusefs_attrcache_remove(np);
+			vnevent_create(vp, NULL);
+		}
+		if (dnp == NULL)
+			break;
+		fusefs_dircache_enter(dnp, nm, nmlen, VNON);
+		fusefs_notify_dirmod(dnp);
+		break;
+
+	case FUSE_NOTIFY_REMOVED:
+		if (np != NULL) {
+			fusefs_notify_gone(np);
+			/*
+			 * Out of the AVL tree, so a new file of
+			 * that name gets a new node.
+			 */
+			if (np->r_flags & RHASHED)
+				fusefs_rmhash(np);
+			/*
+			 * The remove/rmdir events want the parent.
+			 * We'd normally have it; if not, the event
+			 * goes unposted rather than making one.
+			 */
+			if (dnp != NULL) {
+				if (vp->v_type == VDIR)
+					vnevent_rmdir(vp, FUSETOV(dnp),
+					    (char *)nm, NULL);
+				else
+					vnevent_remove(vp, FUSETOV(dnp),
+					    (char *)nm, NULL);
+			}
+		}
+		if (dnp == NULL)
+			break;
+		fusefs_dircache_remove(dnp, nm, nmlen);
+		fusefs_notify_dirmod(dnp);
+		break;
+
+	case FUSE_NOTIFY_RENAMED:
+		tnp = fusefs_notify_node(fmi, path2, &tdnp, &tnm, &tnmlen);
+		if (tnp != NULL) {
+			fusefs_notify_gone(tnp);
+			if (tdnp != NULL)
+				vnevent_rename_dest(FUSETOV(tnp),
+				    FUSETOV(tdnp), (char *)tnm, NULL);
+			VN_RELE(FUSETOV(tnp));
+		}
+		vtype = VNON;
+		if (np != NULL) {
+			vtype = vp->v_type;
+			fusefs_notify_gone(np);
+			if (dnp != NULL)
+				vnevent_rename_src(vp, FUSETOV(dnp),
+				    (char *)nm, NULL);
+		}
+		if (dnp != NULL)
+			fusefs_dircache_remove(dnp, nm, nmlen);
+		if (tdnp != NULL)
+			fusefs_dircache_enter(tdnp, tnm, tnmlen, vtype);
+		if (dnp != NULL)
+			fusefs_notify_dirmod(dnp);
+		if (tdnp != NULL) {
+			fusefs_attrcache_remove(tdnp);
+			vnevent_rename_dest_dir(FUSETOV(tdnp), NULL);
+			VN_RELE(FUSETOV(tdnp));
+		}
+		break;
+	}
+
+	if (np != NULL)
+		VN_RELE(vp);
+	if (dnp != NULL)
+		VN_RELE(FUSETOV(dnp));
+}
+
+/*
+ * Get path name "off" from the daemon's reply, or NULL if there
+ * is none (FUSE_NOTIFY_NOPATH) or it's not a valid offset.
+ * The paths area was terminated by our caller, so the string
+ * ends within it.
+ */
+static const char *
+fusefs_notify_path(struct fuse_notify_ret *retp, uint32_t off)
+{
+
+	if (off == FUSE_NOTIFY_NOPATH)
+		return (NULL);
+	if (off >= FUSE_NOTIFY_PATHSZ || retp->ret_paths[off] != '/') {
+		FUSEFS_DEBUG("bad notify path offset %u\n", off);
+		return (NULL);
+	}
+	return (&retp->ret_paths[off]);
+}
+
+static void
+fusefs_notify_thread(void *arg)
+{
+	fusemntinfo_t *fmi = arg;
+	struct fuse_notify_ret *retp;
+	struct fuse_notify_ent *ne;
+	const char *path1, *path2;
+	int error, i;
+
+	retp = kmem_alloc(sizeof (*retp), KM_SLEEP);
+
+	for (;;) {
+		error = fusefs_call_notify(fmi->fmi_ssn, retp);
+		if (error != 0)
+			break;
+
+		retp->ret_paths[FUSE_NOTIFY_PATHSZ - 1] = '\0';
+		for (i = 0; i < retp->ret_count; i++) {
+			ne = &retp->ret_ents[i];
+			switch (ne->ne_code) {
+			case FUSE_NOTIFY_POLL:
+				fusefs_notify_poll(fmi, ne->ne_kh);
+				break;
+			case FUSE_NOTIFY_RENAMED:
+			case FUSE_NOTIFY_MODIFIED:
+			case FUSE_NOTIFY_CREATED:
+			case FUSE_NOTIFY_REMOVED:
+				path1 = fusefs_notify_path(retp, ne->ne_path1);
+				path2 = fusefs_notify_path(retp, ne->ne_path2);
+				if (path1 == NULL || (path2 == NULL &&
+				    ne->ne_code == FUSE_NOTIFY_RENAMED)) {
+					FUSEFS_DEBUG("bad notify path\n");
+					break;
+				}
+				fusefs_notify_change(fmi, ne->ne_code,
+				    path1, path2);
+				break;
+			default:
+				FUSEFS_DEBUG("unknown notify code %d\n",
+				    ne->ne_code);
+				break;
+			}
+		}
+	}
+
+	kmem_free(retp, sizeof (*retp));
+	FUSEFS_DEBUG("notify thread exit, error %d\n", error);
+
+	mutex_enter(&fmi->fmi_lock);
+	fmi->fmi_notify_thread = NULL;
+	cv_broadcast(&fmi->fmi_notify_cv);
+	mutex_exit(&fmi->fmi_lock);
+
+	zthread_exit();
+}
+
+/*
+ * Start the notify thread, if the daemon wants one.
+ * Called at the end of fusefs_mount.
+ */
+void
+fusefs_notify_start(fusemntinfo_t *fmi)
+{
+
+	if ((fmi->fmi_ssn->ss_opts & FUSE_INIT_NOTIFY) == 0)
+		return;
+
+	mutex_enter(&fmi->fmi_lock);
+	fmi->fmi_notify_thread = zthread_create(NULL, 0,
+	    fusefs_notify_thread, fmi, 0, minclsyspri);
+	mutex_exit(&fmi->fmi_lock);
+}
+
+/*
+ * Wait for the notify thread to go away.  Called in unmount
+ * after fusefs_ssn_kill, which makes the daemon answer the
+ * outstanding FUSE_OP_NOTIFY call.
+ */
+void
+fusefs_notify_stop(fusemntinfo_t *fmi)
+{
+
+	mutex_enter(&fmi->fmi_lock);
+	while (fmi->fmi_notify_thread != NULL)
+		cv_wait(&fmi->fmi_notify_cv, &fmi->fmi_lock);
+	mutex_exit(&fmi->fmi_lock);
+}
+
+/*
+ * Get the poll handle for a node, giving it one if needed.
+ * Returns zero if there's no notify thread to deliver the
+ * daemon's notifications, in which case the caller should
+ * not ask for them.  Also returns (in *genp) the count of
+ * notifications seen so far, so fusefs_poll can tell if one
+ * came in while it was asking the daemon.
+ */
+uint64_t
+fusefs_poll_register(fusenode_t *np, uint_t *genp)
+{
+	fusemntinfo_t *fmi = np->n_mount;
+	uint64_t kh = 0;
+
+	mutex_enter(&fmi->fmi_lock);
+	if (fmi->fmi_notify_thread != NULL) {
+		if (np->n_pollkh == 0) {
+			np->n_pollkh = ++fmi->fmi_pollkh;
+			list_insert_tail(&fmi->fmi_pollers, np);
+		}
+		kh = np->n_pollkh;
+	}
+	*genp = np->n_pollgen;
+	mutex_exit(&fmi->fmi_lock);
+
+	return (kh);
+}
+
+/*
+ * The node is going away (called from sn_inactive).
+ * Take it off the pollers list, wait out any wakeup
+ * in progress, and clean up the pollhead.
+ */
+void
+fusefs_poll_inactive(fusenode_t *np)
+{
+	fusemntinfo_t *fmi = np->n_mount;
+
+	mutex_enter(&fmi->fmi_lock);
+	if (np->n_pollkh != 0) {
+		list_remove(&fmi->fmi_pollers, np);
+		np->n_pollkh = 0;
+	}
+	while (np->n_pollbusy != 0)
+		cv_wait(&fmi->fmi_notify_cv, &fmi->fmi_lock);
+	mutex_exit(&fmi->fmi_lock);
+
+	pollhead_clean(&np->n_pollhead);
+}
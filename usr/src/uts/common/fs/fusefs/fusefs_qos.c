@@ -0,0 +1,244 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * I/O limits for fusefs mounts.
+ *
+ * A mount may limit its read bandwidth, write bandwidth and rate of
+ * upcalls (-o rbw=, wbw=, iops=).  With -o qoszone, it's also charged
+ * against limits shared by all such mounts in its zone.  The limits
+ * are token buckets, checked before each upcall is made, so they
+ * hold whatever the daemon does.
+ *
+ * A bucket holds at most one second's worth of tokens, and it may
+ * go into debt: a caller takes what it needs and, if that leaves the
+ * bucket negative, sleeps until the debt would be repaid.  So a large
+ * request never needs a burst larger than itself, and later callers
+ * wait their turn behind it.
+ *
+ * The limits can be changed at runtime by writing the kstats
+ * fusefs:<minor>:qos (per mount) and fusefs:<zoneid>:zone_qos.
+ * Those also count the delays callers have seen.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/time.h>
+#include <sys/kmem.h>
+#include <sys/kstat.h>
+#include <sys/zone.h>
+#include <sys/sunddi.h>
+#include <sys/cmn_err.h>
+#include <sys/sdt.h>
+
+#include "fusefs.h"
+#include "fusefs_subr.h"
+
+typedef struct fusefs_qosstats {
+	kstat_named_t	qs_rate[FUSEFS_QOS_NB];
+	kstat_named_t	qs_ndelay[FUSEFS_QOS_NB];
+	kstat_named_t	qs_delay_ns[FUSEFS_QOS_NB];
+} fusefs_qosstats_t;
+
+static const fusefs_qosstats_t fusefs_qosstats_tmpl = {
+	{
+		{ "read_bps",		KSTAT_DATA_UINT64 },
+		{ "write_bps",		KSTAT_DATA_UINT64 },
+		{ "ops_per_sec",	KSTAT_DATA_UINT64 },
+	},
+	{
+		{ "read_delays",	KSTAT_DATA_UINT64 },
+		{ "write_delays",	KSTAT_DATA_UINT64 },
+		{ "ops_delays",		KSTAT_DATA_UINT64 },
+	},
+	{
+		{ "read_delay_ns",	KSTAT_DATA_UINT64 },
+		{ "write_delay_ns",	KSTAT_DATA_UINT64 },
+		{ "ops_delay_ns",	KSTAT_DATA_UINT64 },
+	},
+};
+
+void
+fusefs_qos_init(fusefs_qos_t *q)
+{
+
+	mutex_init(&q->q_lock, NULL, MUTEX_DEFAULT, NULL);
+}
+
+void
+fusefs_qos_fini(fusefs_qos_t *q)
+{
+
+	fusefs_qos_kstat_fini(q);
+	mutex_destroy(&q->q_lock);
+}
+
+/*
+ * Set a limit (bytes or calls per second, zero for none).
+ */
+void
+fusefs_qos_set(fusefs_qos_t *q, int which, uint64_t rate)
+{
+	fusefs_tbucket_t *tb = &q->q_tb[which];
+
+	mutex_enter(&q->q_lock);
+	if (tb->tb_rate != rate) {
+		tb->tb_rate = rate;
+		tb->tb_tokens = 0;
+		tb->tb_last = gethrtime();
+	}
+	mutex_exit(&q->q_lock);
+}
+
+/*
+ * Take "amount" tokens from a bucket, and return how long
+ * (in ns) the caller has to wait for them.
+ */
+static hrtime_t
+fusefs_tb_take(fusefs_tbucket_t *tb, uint64_t amount, hrtime_t now)
+{
+	hrtime_t elapsed;
+	uint64_t debt;
+
+	if (tb->tb_rate == 0)
+		return (0);
+
+	/* Refill, up to one second's worth. */
+	elapsed = now - tb->tb_last;
+	if (elapsed > NANOSEC)
+		elapsed = NANOSEC;
+	tb->tb_last = now;
+	if (elapsed > 0) {
+		tb->tb_tokens += (int64_t)(tb->tb_rate *
+		    (uint64_t)(elapsed / (NANOSEC / MICROSEC)) / MICROSEC);
+		if (tb->tb_tokens > (int64_t)tb->tb_rate)
+			tb->tb_tokens = (int64_t)tb->tb_rate;
+	}
+
+	tb->tb_tokens -= (int64_t)amount;
+	if (tb->tb_tokens >= 0)
+		return (0);
+
+	/* Avoid overflow: rates go up to 4 TB/sec. */
+	debt = (uint64_t)-tb->tb_tokens;
+	return ((hrtime_t)(debt / tb->tb_rate) * NANOSEC +
+	    (hrtime_t)((debt % tb->tb_rate) * MICROSEC / tb->tb_rate) *
+	    (NANOSEC / MICROSEC));
+}
+
+static hrtime_t
+fusefs_qos_take(fusefs_qos_t *q, int which, uint64_t amount, hrtime_t now)
+{
+	fusefs_tbucket_t *tb = &q->q_tb[which];
+	hrtime_t wait;
+
+	mutex_enter(&q->q_lock);
+	wait = fusefs_tb_take(tb, amount, now);
+	if (wait != 0) {
+		tb->tb_ndelay++;
+		tb->tb_delay_ns += wait;
+	}
+	mutex_exit(&q->q_lock);
+
+	return (wait);
+}
+
+/*
+ * Charge an upcall (or the bytes it moves) to the limits of the
+ * mount and, if it has them, its zone.  Sleeps as needed, before
+ * the upcall is made.  Returns EINTR if interrupted ("intr" mounts).
+ */
+int
+fusefs_qos_charge(fusefs_ssn_t *ssn, int which, uint64_t amount)
+{
+	hrtime_t now, wait, zwait;
+	clock_t ticks;
+	boolean_t intr;
+
+	if (ssn->ss_qos == NULL)
+		return (0);
+
+	now = gethrtime();
+	wait = fusefs_qos_take(ssn->ss_qos, which, amount, now);
+	intr = ssn->ss_qos->q_intr;
+	if (ssn->ss_zqos != NULL) {
+		zwait = fusefs_qos_take(ssn->ss_zqos, which, amount, now);
+		if (zwait > wait)
+			wait = zwait;
+	}
+	if (wait == 0)
+		return (0);
+
+	DTRACE_PROBE3(fusefs__qos__delay, fusefs_ssn_t *, ssn,
+	    int, which, hrtime_t, wait);
+
+	ticks = drv_usectohz(wait / (NANOSEC / MICROSEC));
+	if (ticks == 0)
+		ticks = 1;
+	if (intr)
+		return (delay_sig(ticks));
+	delay(ticks);
+	return (0);
+}
+
+static int
+fusefs_qos_kstat_update(kstat_t *ksp, int rw)
+{
+	fusefs_qos_t *q = ksp->ks_private;
+	fusefs_qosstats_t *qs = ksp->ks_data;
+	int i;
+
+	if (rw == KSTAT_WRITE) {
+		for (i = 0; i < FUSEFS_QOS_NB; i++)
+			fusefs_qos_set(q, i, qs->qs_rate[i].value.ui64);
+		return (0);
+	}
+
+	mutex_enter(&q->q_lock);
+	for (i = 0; i < FUSEFS_QOS_NB; i++) {
+		qs->qs_rate[i].value.ui64 = q->q_tb[i].tb_rate;
+		qs->qs_ndelay[i].value.ui64 = q->q_tb[i].tb_ndelay;
+		qs->qs_delay_ns[i].value.ui64 = q->q_tb[i].tb_delay_ns;
+	}
+	mutex_exit(&q->q_lock);
+	return (0);
+}
+
+void
+fusefs_qos_kstat_init(fusefs_qos_t *q, int instance, const char *name,
+    zoneid_t zoneid)
+{
+	kstat_t *ksp;
+
+	ksp = kstat_create_zone("fusefs", instance, (char *)name, "misc",
+	    KSTAT_TYPE_NAMED,
+	    sizeof (fusefs_qosstats_t) / sizeof (kstat_named_t),
+	    KSTAT_FLAG_WRITABLE, zoneid);
+	if (ksp == NULL)
+		return;
+
+	bcopy(&fusefs_qosstats_tmpl, ksp->ks_data,
+	    sizeof (fusefs_qosstats_t));
+	ksp->ks_update = fusefs_qos_kstat_update;
+	ksp->ks_private = q;
+	kstat_install(ksp);
+	q->q_kstats = ksp;
+}
+
+void
+fusefs_qos_kstat_fini(fusefs_qos_t *q)
+{
+
+	if (q->q_kstats != NULL) {
+		kstat_delete(q->q_kstats);
+		q->q_kstats = NULL;
+	}
+}
@@ -107,8 +107,9 @@ fusefs_gethash(const char *rpath, int rplen)
 }
 
 /*
- * Like fusefs_gethash, but optimized a little by
- * starting with the directory hash.
+ * Like fusefs_gethash, but with the directory and name
+ * supplied separately.  (Can't start with dnp->n_ino,
+ * which may be an inode number from the daemon.)
  */
 uint32_t
 fusefs_getino(struct fusenode *dnp, const char *name, int nmlen)
@@ -117,7 +118,7 @@ fusefs_getino(struct fusenode *dnp, const char *name, int nmlen)
 	char sep;
 
 	/* Start with directory hash */
-	ino = (uint32_t)dnp->n_ino;
+	ino = fusefs_gethash(dnp->n_rpath, dnp->n_rplen);
 
 	/* separator (maybe) */
 	sep = FUSEFS_DNP_SEP(dnp);
@@ -65,6 +65,7 @@ void fusefs_clntfini(void);
 
 void fusefs_zonelist_add(fusemntinfo_t *);
 void fusefs_zonelist_remove(fusemntinfo_t *);
+fusefs_qos_t *fusefs_zone_qos(struct zone *);
 
 int fusefs_check_table(struct vfs *vfsp, struct fusenode *srp);
 void fusefs_destroy_table(struct vfs *vfsp);
@@ -76,10 +77,14 @@ void fusefs_rflush(struct vfs *vfsp, cred_t *cr);
  */
 
 void fusefs_attrcache_prune(struct fusenode *np);
+boolean_t fusefs_subtree_busy(struct fusenode *np);
+boolean_t fusefs_in_rmtree(struct fusenode *np);
+void fusefs_subtree_gone(struct fusenode *np);
 void fusefs_attrcache_remove(struct fusenode *np);
 void fusefs_attrcache_rm_locked(struct fusenode *np);
 #ifndef	DEBUG
-#define	fusefs_attrcache_rm_locked(np)	(np)->r_attrtime = gethrtime()
+#define	fusefs_attrcache_rm_locked(np)	\
+	((np)->r_attrtime = gethrtime(), (np)->r_swrtime = 0)
 #endif
 void fusefs_attr_touchdir(struct fusenode *);
 void fusefs_attrcache_fa(vnode_t *, fusefattr_t *);
@@ -88,6 +93,7 @@ void fusefs_cache_check(struct vnode *, fusefattr_t *);
 
 void fusefs_addfree(struct fusenode *sp);
 void fusefs_rmhash(struct fusenode *);
+void fusefs_mem_reclaim(fusemntinfo_t *);
 
 /* See avl_create in fusefs_vfsops.c */
 void fusefs_init_hash_avl(avl_tree_t *);
@@ -103,8 +109,88 @@ fusenode_t *fusefs_node_findcreate(fusemntinfo_t *mi,
 
 int fusefs_nget(vnode_t *dvp, const char *name, int nmlen,
 	fusefattr_t *fap, vnode_t **vpp);
+void fusefs_node_unlink(fusenode_t *np, boolean_t deferred);
+boolean_t fusefs_node_unlinked(fusenode_t *dnp, const char *name, int nmlen);
+char *fusefs_node_unlinked_take(fusenode_t *np, int *lenp);
+char *fusefs_node_unlinked_claim(fusenode_t *dnp, const char *name,
+	int nmlen, int *lenp);
+void fusefs_node_unlinked_rename(fusemntinfo_t *mi, const char *opath,
+	int oplen, fusenode_t *dnp, const char *name, int nmlen);
 
 int fusefsgetattr(vnode_t *vp, struct vattr *vap, cred_t *cr);
+int fusefs_getattr_otw(vnode_t *vp, fusefattr_t *fap, cred_t *cr);
+
+/* Directory name index, see fusefs_dircache.c */
+void fusefs_dircache_init(struct fusenode *);
+void fusefs_dircache_fini(struct fusenode *);
+void fusefs_dircache_purge(struct fusenode *);
+void fusefs_dircache_inval(struct fusenode *);
+void fusefs_dircache_begin(struct fusenode *, int offset, cred_t *);
+void fusefs_dircache_fill(struct fusenode *, const char *name, int nmlen,
+	fusefattr_t *fap, int nextoff);
+void fusefs_dircache_done(struct fusenode *, cred_t *);
+void fusefs_dircache_enter(struct fusenode *dnp, const char *name, int nmlen,
+	vtype_t vtype);
+void fusefs_dircache_remove(struct fusenode *dnp, const char *name, int nmlen);
+int fusefs_dircache_lookup(vnode_t *dvp, const char *nm, int nmlen,
+	vnode_t **vpp);
+void fusefs_dircache_empty(struct fusenode *);
+
+/* Daemon notifications and poll, see fusefs_notify.c */
+void fusefs_notify_start(fusemntinfo_t *);
+void fusefs_notify_stop(fusemntinfo_t *);
+uint64_t fusefs_poll_register(struct fusenode *, uint_t *genp);
+void fusefs_poll_inactive(struct fusenode *);
+
+/* Provisional create and mkdir, see fusefs_asyncns.c */
+void fusefs_ans_init(fusemntinfo_t *, boolean_t on);
+void fusefs_ans_stop(fusemntinfo_t *);
+void fusefs_ans_fini(fusemntinfo_t *);
+int fusefs_ans_create(vnode_t *dvp, const char *name, int nmlen,
+	vattr_t *vap, vnode_t **vpp, cred_t *cr);
+int fusefs_ans_write(struct fusenode *, uio_t *);
+int fusefs_ans_setattr(struct fusenode *, vattr_t *, cred_t *);
+boolean_t fusefs_ans_open(struct fusenode *);
+void fusefs_ans_close(struct fusenode *);
+int fusefs_ans_wait(struct fusenode *);
+int fusefs_ans_sync(fusemntinfo_t *, boolean_t intr);
+void fusefs_ans_flush(fusemntinfo_t *);
+int fusefs_ans_error(struct fusenode *, boolean_t clear);
+
+/* Block-mapped direct I/O (-o blkdev), see fusefs_bmap.c */
+int fusefs_bmap_getdev(int fd, boolean_t rdonly, cred_t *cr,
+	vnode_t **vpp, int *flagp);
+void fusefs_bmap_putdev(vnode_t *vp, int flag, cred_t *cr);
+void fusefs_bmap_fini(fusemntinfo_t *);
+int fusefs_bmap_rw(struct fusenode *, uio_t *, enum uio_rw, int ioflag);
+void fusefs_bmap_inval(struct fusenode *, offset_t off, offset_t len);
+int fusefs_bmap_flush(struct fusenode *, boolean_t sync);
+void fusefs_bmap_inactive(struct fusenode *);
+
+/* NFS file handles, see fusefs_fh.c */
+void fusefs_fh_init(fusemntinfo_t *);
+void fusefs_fh_fini(fusemntinfo_t *);
+void fusefs_fh_update(struct fusenode *, fusefattr_t *);
+void fusefs_fh_inactive(struct fusenode *);
+int fusefs_fh_fid(struct fusenode *, fid_t *);
+int fusefs_fh_vget(fusemntinfo_t *, fid_t *, struct fusenode **);
+
+/* ACLs, see fusefs_acl.c */
+int fusefs_acl_access(vnode_t *, int mode, cred_t *);
+int fusefs_acl_getsecattr(vnode_t *, vsecattr_t *, int flag, cred_t *,
+	caller_context_t *);
+int fusefs_acl_setsecattr(vnode_t *, vsecattr_t *, int flag, cred_t *);
+void fusefs_acl_inval(struct fusenode *);
+void fusefs_acl_inactive(struct fusenode *);
+
+/* I/O limits, see fusefs_qos.c */
+void fusefs_qos_init(fusefs_qos_t *);
+void fusefs_qos_fini(fusefs_qos_t *);
+void fusefs_qos_set(fusefs_qos_t *, int which, uint64_t rate);
+void fusefs_qos_kstat_init(fusefs_qos_t *, int instance, const char *name,
+	zoneid_t);
+void fusefs_qos_kstat_fini(fusefs_qos_t *);
+int fusefs_qos_charge(fusefs_ssn_t *, int which, uint64_t amount);
 
 /* For Solaris, interruptible rwlock */
 int fusefs_rw_enter_sig(fusefs_rwlock_t *l, krw_t rw, int intr);
@@ -52,6 +52,7 @@
 #include <sys/atomic.h>
 #include <sys/zone.h>
 #include <sys/vfs_opreg.h>
+#include <sys/kstat.h>
 #include <sys/mntent.h>
 #include <sys/priv.h>
 #include <sys/tsol/label.h>
@@ -126,6 +127,13 @@ extern	int		fusefs_minor;
  */
 uint32_t	fusefs_mountcount;
 
+/*
+ * Threads (per mount) for stale-while-revalidate refreshes,
+ * and the most we queue before callers just wait instead.
+ */
+int		fusefs_swr_threads = 2;
+int		fusefs_swr_maxtasks = 256;
+
 /*
  * fusefs vfs operations.
  */
@@ -134,8 +142,13 @@ static int	fusefs_unmount(vfs_t *, int, cred_t *);
 static int	fusefs_root(vfs_t *, vnode_t **);
 static int	fusefs_statvfs(vfs_t *, statvfs64_t *);
 static int	fusefs_sync(vfs_t *, short, cred_t *);
+static int	fusefs_vget(vfs_t *, vnode_t **, fid_t *);
 static void	fusefs_freevfs(vfs_t *);
 
+static void	fusefs_mem_kstat_init(fusemntinfo_t *);
+static int	fusefs_statvfs_otw(fusemntinfo_t *, cred_t *);
+static void	fusefs_statvfs_refresh(void *);
+
 /*
  * Module loading
  */
@@ -238,7 +251,7 @@ static const fs_operation_def_t fusefs_vfsops_template[] = {
 	{ VFSNAME_ROOT,	{ .vfs_root = fusefs_root } },
 	{ VFSNAME_STATVFS, { .vfs_statvfs = fusefs_statvfs } },
 	{ VFSNAME_SYNC,	{ .vfs_sync = fusefs_sync } },
-	{ VFSNAME_VGET,	{ .error = fs_nosys } },
+	{ VFSNAME_VGET,	{ .vfs_vget = fusefs_vget } },
 	{ VFSNAME_MOUNTROOT, { .error = fs_nosys } },
 	{ VFSNAME_FREEVFS, { .vfs_freevfs = fusefs_freevfs } },
 	{ NULL, NULL }
@@ -291,11 +304,28 @@ fusefs_free_fmi(fusemntinfo_t *fmi)
 	if (fmi->fmi_zone != NULL)
 		zone_rele(fmi->fmi_zone);
 
-	if (fmi->fmi_ssn != NULL)
+	if (fmi->fmi_ssn != NULL) {
+		fmi->fmi_ssn->ss_qos = NULL;
+		fmi->fmi_ssn->ss_zqos = NULL;
 		fusefs_ssn_rele(fmi->fmi_ssn);
+	}
+
+	/* Normally gone already (fusefs_unmount) */
+	if (fmi->fmi_swr_tq != NULL)
+		taskq_destroy(fmi->fmi_swr_tq);
+	fusefs_ans_fini(fmi);
+	fusefs_bmap_fini(fmi);
+	fusefs_fh_fini(fmi);
 
 	avl_destroy(&fmi->fmi_hash_avl);
 	rw_destroy(&fmi->fmi_hash_lk);
+	rw_destroy(&fmi->fmi_rmtree_lk);
+	list_destroy(&fmi->fmi_pollers);
+	list_destroy(&fmi->fmi_unlinked);
+	list_destroy(&fmi->fmi_rmtrees);
+	cv_destroy(&fmi->fmi_rmtree_cv);
+	fusefs_qos_fini(&fmi->fmi_qos);
+	cv_destroy(&fmi->fmi_notify_cv);
 	cv_destroy(&fmi->fmi_statvfs_cv);
 	mutex_destroy(&fmi->fmi_lock);
 
@@ -319,6 +349,8 @@ fusefs_mount(vfs_t *vfsp, vnode_t *mvp, struct mounta *uap, cred_t *cr)
 	zone_t		*zone = curproc->p_zone;
 	zone_t		*mntzone = NULL;
 	fusefs_ssn_t	*ssp = NULL;
+	vnode_t		*bvp = NULL;
+	int		bflag = 0;
 	int		flags, sec;
 
 	STRUCT_DECL(fusefs_args, args);		/* fusefs mount arguments */
@@ -387,7 +419,7 @@ fusefs_mount(vfs_t *vfsp, vnode_t *mvp, struct mounta *uap, cred_t *cr)
 
 	/*
 	 * Use "goto errout" from here on.
-	 * See: ssp, fmi, rtnp, mntzone
+	 * See: ssp, fmi, rtnp, mntzone, bvp
 	 */
 
 	/*
@@ -416,6 +448,21 @@ fusefs_mount(vfs_t *vfsp, vnode_t *mvp, struct mounta *uap, cred_t *cr)
 	 * XXX: Trusted Extensions stuff?
 	 */
 
+	/*
+	 * The device the file system is on, for block-mapped
+	 * direct I/O.  See fusefs_bmap.c
+	 */
+	if (STRUCT_FGET(args, flags) & FUSEFS_MF_BLKDEV) {
+		error = fusefs_bmap_getdev(STRUCT_FGET(args, blkfd),
+		    vfs_optionisset(vfsp, MNTOPT_RO, NULL), cr,
+		    &bvp, &bflag);
+		if (error) {
+			cmn_err(CE_WARN, "fusefs: can't use blkdev (%d)\n",
+			    error);
+			goto errout;
+		}
+	}
+
 	/* Prevent unload. */
 	atomic_inc_32(&fusefs_mountcount);
 
@@ -430,9 +477,20 @@ fusefs_mount(vfs_t *vfsp, vnode_t *mvp, struct mounta *uap, cred_t *cr)
 
 	mutex_init(&fmi->fmi_lock, NULL, MUTEX_DEFAULT, NULL);
 	cv_init(&fmi->fmi_statvfs_cv, NULL, CV_DEFAULT, NULL);
+	cv_init(&fmi->fmi_notify_cv, NULL, CV_DEFAULT, NULL);
+	list_create(&fmi->fmi_pollers, sizeof (fusenode_t),
+	    offsetof(fusenode_t, n_poll_node));
+	list_create(&fmi->fmi_unlinked, sizeof (fusenode_t),
+	    offsetof(fusenode_t, n_unl_node));
+	list_create(&fmi->fmi_rmtrees, sizeof (fusenode_t),
+	    offsetof(fusenode_t, n_rmt_node));
+	cv_init(&fmi->fmi_rmtree_cv, NULL, CV_DEFAULT, NULL);
+	fusefs_qos_init(&fmi->fmi_qos);
 
 	rw_init(&fmi->fmi_hash_lk, NULL, RW_DEFAULT, NULL);
+	rw_init(&fmi->fmi_rmtree_lk, NULL, RW_DEFAULT, NULL);
 	fusefs_init_hash_avl(&fmi->fmi_hash_avl);
+	fusefs_fh_init(fmi);
 
 	fmi->fmi_ssn = ssp;
 	ssp = NULL;
@@ -471,6 +529,8 @@ fusefs_mount(vfs_t *vfsp, vnode_t *mvp, struct mounta *uap, cred_t *cr)
 	 */
 	if (flags & FUSEFS_MF_NOAC)
 		fmi->fmi_flags |= FMI_NOAC;
+	if (flags & FUSEFS_MF_ACL)
+		fmi->fmi_flags |= FMI_ACL;
 	if (flags & FUSEFS_MF_ACREGMIN) {
 		sec = STRUCT_FGET(args, acregmin);
 		if (sec < 0 || sec > FUSEFS_ACMINMAX)
@@ -495,6 +555,60 @@ fusefs_mount(vfs_t *vfsp, vnode_t *mvp, struct mounta *uap, cred_t *cr)
 			sec = FUSEFS_ACMAXMAX;
 		fmi->fmi_acdirmax = SEC2HR(sec);
 	}
+	if (flags & FUSEFS_MF_MEMLIMIT) {
+		/* KB, zero means no limit */
+		fmi->fmi_memlimit =
+		    (uint64_t)STRUCT_FGET(args, memlimit) * 1024;
+	}
+
+	/*
+	 * I/O limits, checked before each upcall.
+	 * Bandwidth is in KB/sec, zero means no limit.
+	 */
+	fmi->fmi_qos.q_intr = (fmi->fmi_flags & FMI_INT) != 0;
+	if (flags & FUSEFS_MF_QOS) {
+		fusefs_qos_set(&fmi->fmi_qos, FUSEFS_QOS_READ,
+		    (uint64_t)STRUCT_FGET(args, rbw) * 1024);
+		fusefs_qos_set(&fmi->fmi_qos, FUSEFS_QOS_WRITE,
+		    (uint64_t)STRUCT_FGET(args, wbw) * 1024);
+		fusefs_qos_set(&fmi->fmi_qos, FUSEFS_QOS_OPS,
+		    STRUCT_FGET(args, iops));
+	}
+	fmi->fmi_ssn->ss_qos = &fmi->fmi_qos;
+	if (flags & FUSEFS_MF_QOSZONE)
+		fmi->fmi_ssn->ss_zqos = fusefs_zone_qos(fmi->fmi_zone);
+
+	/*
+	 * Stale-while-revalidate, and the threads
+	 * that do the refreshing.
+	 */
+	if (flags & FUSEFS_MF_SWR) {
+		sec = STRUCT_FGET(args, swr);
+		if (sec < 0 || sec > FUSEFS_ACMAXMAX)
+			sec = FUSEFS_ACMAXMAX;
+		fmi->fmi_swrmax = SEC2HR(sec);
+	}
+	if (fmi->fmi_swrmax != 0) {
+		fmi->fmi_swr_tq = taskq_create("fusefs_swr",
+		    fusefs_swr_threads, minclsyspri, 1,
+		    fusefs_swr_maxtasks, TASKQ_PREPOPULATE);
+	}
+
+	/*
+	 * Provisional creates and mkdirs, sent to the
+	 * daemon by taskq threads.  See fusefs_asyncns.c
+	 */
+	fusefs_ans_init(fmi, (flags & FUSEFS_MF_ASYNCNS) != 0);
+
+	/*
+	 * Block-mapped direct I/O.  Closed in fusefs_free_fmi.
+	 */
+	if (bvp != NULL) {
+		fmi->fmi_bvp = bvp;
+		fmi->fmi_bflag = bflag;
+		fmi->fmi_bcred = crdup(cr);
+		bvp = NULL;
+	}
 
 #if 0
 	/*
@@ -544,6 +658,19 @@ fusefs_mount(vfs_t *vfsp, vnode_t *mvp, struct mounta *uap, cred_t *cr)
 	rtnp->r_vnode->v_flag |= VROOT;
 	fmi->fmi_root = rtnp;
 
+	/*
+	 * Cache memory budget stats (and runtime limit)
+	 */
+	fusefs_mem_kstat_init(fmi);
+	fusefs_qos_kstat_init(&fmi->fmi_qos,
+	    getminor(fmi->fmi_vfsp->vfs_dev), "qos", fmi->fmi_zone->zone_id);
+
+	/*
+	 * Notifications from the daemon (poll wakeups, etc.)
+	 * Stopped in fusefs_unmount.
+	 */
+	fusefs_notify_start(fmi);
+
 	/*
 	 * NFS does other stuff here too:
 	 *   async worker threads
@@ -564,6 +691,9 @@ errout:
 	if (ssp != NULL)
 		fusefs_ssn_rele(ssp);
 
+	if (bvp != NULL)
+		fusefs_bmap_putdev(bvp, bflag, cr);
+
 	return (error);
 }
 
@@ -575,6 +705,7 @@ fusefs_unmount(vfs_t *vfsp, int flag, cred_t *cr)
 {
 	fusemntinfo_t	*fmi;
 	fusenode_t	*rtnp;
+	taskq_t		*tq;
 
 	fmi = VFTOFMI(vfsp);
 
@@ -584,6 +715,14 @@ fusefs_unmount(vfs_t *vfsp, int flag, cred_t *cr)
 	if ((flag & MS_FORCE) == 0) {
 		fusefs_rflush(vfsp, cr);
 
+		/* Background refreshes hold vnodes. */
+		if (fmi->fmi_swr_tq != NULL)
+			taskq_wait(fmi->fmi_swr_tq);
+
+		/* So do provisional creates. */
+		if (fusefs_ans_sync(fmi, B_TRUE) != 0)
+			return (EINTR);
+
 		/*
 		 * If there are any active vnodes on this file system,
 		 * (other than the root vnode) then the file system is
@@ -618,6 +757,27 @@ fusefs_unmount(vfs_t *vfsp, int flag, cred_t *cr)
 	 */
 	fusefs_ssn_kill(fmi->fmi_ssn);
 
+	/*
+	 * The daemon has now answered (or lost) our
+	 * outstanding notify call.  Wait for that thread.
+	 */
+	fusefs_notify_stop(fmi);
+
+	/*
+	 * No more background refreshes.  (Destroy the taskq
+	 * here, not in fusefs_freevfs, which could be called
+	 * from one of its threads by the last VN_RELE.)
+	 */
+	mutex_enter(&fmi->fmi_lock);
+	tq = fmi->fmi_swr_tq;
+	fmi->fmi_swr_tq = NULL;
+	mutex_exit(&fmi->fmi_lock);
+	if (tq != NULL)
+		taskq_destroy(tq);
+
+	/* Likewise, send (or fail) what's left of these. */
+	fusefs_ans_stop(fmi);
+
 	/*
 	 * If we hold the root VP (and we normally do)
 	 * then it's safe to release it now.
@@ -655,6 +815,11 @@ fusefs_unmount(vfs_t *vfsp, int flag, cred_t *cr)
 		kstat_delete(fmi->fmi_ro_kstats);
 		fmi->fmi_ro_kstats = NULL;
 	}
+	if (fmi->fmi_mem_kstats) {
+		kstat_delete(fmi->fmi_mem_kstats);
+		fmi->fmi_mem_kstats = NULL;
+	}
+	fusefs_qos_kstat_fini(&fmi->fmi_qos);
 
 	/*
 	 * The rest happens in fusefs_freevfs()
@@ -695,6 +860,31 @@ fusefs_root(vfs_t *vfsp, vnode_t **vpp)
 	return (0);
 }
 
+/*
+ * Get the vnode for a file handle (from fusefs_fid).
+ * See fusefs_fh.c
+ */
+static int
+fusefs_vget(vfs_t *vfsp, vnode_t **vpp, fid_t *fidp)
+{
+	fusemntinfo_t	*fmi = VFTOFMI(vfsp);
+	fusenode_t	*np;
+	int		error;
+
+	if (curproc->p_zone != fmi->fmi_zone)
+		return (EPERM);
+
+	if (fmi->fmi_flags & FMI_DEAD || vfsp->vfs_flag & VFS_UNMOUNTED)
+		return (EIO);
+
+	error = fusefs_fh_vget(fmi, fidp, &np);
+	if (error)
+		return (error);
+
+	*vpp = FUSETOV(np);
+	return (0);
+}
+
 /*
  * Get file system statistics.
  */
@@ -703,8 +893,6 @@ fusefs_statvfs(vfs_t *vfsp, statvfs64_t *sbp)
 {
 	int		error;
 	fusemntinfo_t	*fmi = VFTOFMI(vfsp);
-	fusefs_ssn_t	*ssp = fmi->fmi_ssn;
-	statvfs64_t	stvfs;
 	hrtime_t now;
 
 	if (curproc->p_zone != fmi->fmi_zone)
@@ -725,6 +913,30 @@ recheck:
 		goto cache_hit;
 	}
 
+	/*
+	 * Stale-while-revalidate: data that expired recently
+	 * will do, while a taskq thread gets new data (with
+	 * our credentials, as we'd have done it ourselves).
+	 */
+	if (fmi->fmi_statfstime != 0 &&
+	    now < fmi->fmi_statfstime + fmi->fmi_swrmax) {
+		if ((fmi->fmi_status & SM_STATUS_STATFS_BUSY) == 0 &&
+		    fmi->fmi_swr_tq != NULL) {
+			ASSERT(fmi->fmi_statfscr == NULL);
+			fmi->fmi_statfscr = CRED();
+			crhold(fmi->fmi_statfscr);
+			if (taskq_dispatch(fmi->fmi_swr_tq,
+			    fusefs_statvfs_refresh, fmi, TQ_NOSLEEP) != 0) {
+				fmi->fmi_status |= SM_STATUS_STATFS_BUSY;
+			} else {
+				crfree(fmi->fmi_statfscr);
+				fmi->fmi_statfscr = NULL;
+			}
+		}
+		error = 0;
+		goto cache_hit;
+	}
+
 	/*
 	 * FS attributes are stale, so someone
 	 * needs to do an UP call to get them.
@@ -743,11 +955,37 @@ recheck:
 	fmi->fmi_status |= SM_STATUS_STATFS_BUSY;
 	mutex_exit(&fmi->fmi_lock);
 
+	error = fusefs_statvfs_otw(fmi, CRED());
+
+	mutex_enter(&fmi->fmi_lock);
+
+	/*
+	 * Copy the statvfs data to caller's buf.
+	 * Note: struct assignment
+	 */
+cache_hit:
+	if (error == 0)
+		*sbp = fmi->fmi_statvfsbuf;
+	mutex_exit(&fmi->fmi_lock);
+	return (error);
+}
+
+/*
+ * Get new statvfs data for fusefs_statvfs, which has set
+ * SM_STATUS_STATFS_BUSY.  Clears that and wakes waiters.
+ */
+static int
+fusefs_statvfs_otw(fusemntinfo_t *fmi, cred_t *cr)
+{
+	vfs_t		*vfsp = fmi->fmi_vfsp;
+	statvfs64_t	stvfs;
+	int		error;
+
 	/*
 	 * Do the OTW call.  Note: lock NOT held.
 	 */
 	bzero(&stvfs, sizeof (stvfs));
-	error = fusefs_call_statvfs(ssp, &stvfs);
+	error = fusefs_call_statvfs(fmi->fmi_ssn, &stvfs, cr);
 	if (error) {
 		FUSEFS_DEBUG("statfs error=%d\n", error);
 	} else {
@@ -759,32 +997,110 @@ recheck:
 		bcopy(fs_type_name, stvfs.f_basetype, FSTYPSZ);
 		stvfs.f_flag	= vf_to_stf(vfsp->vfs_flag);
 		stvfs.f_namemax	= FUSE_MAXFNAMELEN;
+	}
 
+	mutex_enter(&fmi->fmi_lock);
+	if (error == 0) {
 		/*
 		 * Save the result, update lifetime
 		 */
-		now = gethrtime();
-		fmi->fmi_statfstime = now +
+		fmi->fmi_statfstime = gethrtime() +
 		    (SM_MAX_STATFSTIME * (hrtime_t)NANOSEC);
 		fmi->fmi_statvfsbuf = stvfs; /* struct assign! */
 	}
-
-	mutex_enter(&fmi->fmi_lock);
 	if (fmi->fmi_status & SM_STATUS_STATFS_WANT)
 		cv_broadcast(&fmi->fmi_statvfs_cv);
 	fmi->fmi_status &= ~(SM_STATUS_STATFS_BUSY | SM_STATUS_STATFS_WANT);
-
-	/*
-	 * Copy the statvfs data to caller's buf.
-	 * Note: struct assignment
-	 */
-cache_hit:
-	if (error == 0)
-		*sbp = fmi->fmi_statvfsbuf;
 	mutex_exit(&fmi->fmi_lock);
+
 	return (error);
 }
 
+/* Stale-while-revalidate, for fusefs_statvfs */
+static void
+fusefs_statvfs_refresh(void *arg)
+{
+	fusemntinfo_t *fmi = arg;
+	cred_t *cr;
+
+	mutex_enter(&fmi->fmi_lock);
+	cr = fmi->fmi_statfscr;
+	fmi->fmi_statfscr = NULL;
+	mutex_exit(&fmi->fmi_lock);
+
+	(void) fusefs_statvfs_otw(fmi, cr);
+	crfree(cr);
+}
+
+/*
+ * Per-mount cache memory kstats: fusefs:<minor>:memory
+ * The "limit" (bytes) may be written to change the budget
+ * of a mounted file system.  See fusefs_mem_reclaim.
+ */
+typedef struct fusefs_memstats {
+	kstat_named_t	ms_limit;
+	kstat_named_t	ms_used;
+	kstat_named_t	ms_nodes;
+	kstat_named_t	ms_dents;
+	kstat_named_t	ms_nevict;
+	kstat_named_t	ms_devict;
+} fusefs_memstats_t;
+
+static const fusefs_memstats_t fusefs_memstats_tmpl = {
+	{ "limit",		KSTAT_DATA_UINT64 },
+	{ "used",		KSTAT_DATA_UINT64 },
+	{ "nodes",		KSTAT_DATA_UINT32 },
+	{ "dir_names",		KSTAT_DATA_UINT32 },
+	{ "node_evictions",	KSTAT_DATA_UINT64 },
+	{ "dir_evictions",	KSTAT_DATA_UINT64 },
+};
+
+static int
+fusefs_mem_kstat_update(kstat_t *ksp, int rw)
+{
+	fusemntinfo_t *fmi = ksp->ks_private;
+	fusefs_memstats_t *ms = ksp->ks_data;
+
+	if (rw == KSTAT_WRITE) {
+		mutex_enter(&fmi->fmi_lock);
+		fmi->fmi_memlimit = ms->ms_limit.value.ui64;
+		mutex_exit(&fmi->fmi_lock);
+		/* A lower limit takes effect now, not at the next charge. */
+		if (FUSEFS_MEM_OVER(fmi))
+			fusefs_mem_reclaim(fmi);
+		return (0);
+	}
+
+	ms->ms_limit.value.ui64 = fmi->fmi_memlimit;
+	ms->ms_used.value.ui64 = fmi->fmi_memused;
+	ms->ms_nodes.value.ui32 = fmi->fmi_mem_nodes;
+	ms->ms_dents.value.ui32 = fmi->fmi_mem_dents;
+	ms->ms_nevict.value.ui64 = fmi->fmi_mem_nevict;
+	ms->ms_devict.value.ui64 = fmi->fmi_mem_devict;
+	return (0);
+}
+
+static void
+fusefs_mem_kstat_init(fusemntinfo_t *fmi)
+{
+	kstat_t *ksp;
+
+	ksp = kstat_create_zone("fusefs",
+	    getminor(fmi->fmi_vfsp->vfs_dev), "memory", "misc",
+	    KSTAT_TYPE_NAMED,
+	    sizeof (fusefs_memstats_t) / sizeof (kstat_named_t),
+	    KSTAT_FLAG_WRITABLE, fmi->fmi_zone->zone_id);
+	if (ksp == NULL)
+		return;
+
+	bcopy(&fusefs_memstats_tmpl, ksp->ks_data,
+	    sizeof (fusefs_memstats_t));
+	ksp->ks_update = fusefs_mem_kstat_update;
+	ksp->ks_private = fmi;
+	kstat_install(ksp);
+	fmi->fmi_mem_kstats = ksp;
+}
+
 static kmutex_t fusefs_syncbusy;
 
 /*
@@ -804,6 +1120,10 @@ fusefs_sync(vfs_t *vfsp, short flag, cred_t *cr)
 		mutex_exit(&fusefs_syncbusy);
 	}
 
+	/* Send any provisional creates along. */
+	if (vfsp != NULL && !(flag & SYNC_ATTR))
+		fusefs_ans_flush(VFTOFMI(vfsp));
+
 	return (0);
 }
 
@@ -840,6 +1160,7 @@ fusefs_freevfs(vfs_t *vfsp)
 	 * something is wrong
 	 */
 	ASSERT(fmi->fmi_io_kstats == NULL);
+	ASSERT(fmi->fmi_mem_kstats == NULL);
 
 	fusefs_zonelist_remove(fmi);
 
@@ -35,6 +35,7 @@
 
 #include <sys/systm.h>
 #include <sys/cred.h>
+#include <sys/user.h>
 #include <sys/vnode.h>
 #include <sys/vfs.h>
 #include <sys/filio.h>
@@ -49,6 +50,8 @@
 #include <sys/vfs_opreg.h>
 #include <sys/policy.h>
 
+#include <sys/fs/fuse_door.h>
+
 #include "fusefs.h"
 #include "fusefs_calls.h"
 #include "fusefs_node.h"
@@ -61,6 +64,13 @@
  */
 int fusefs_fastlookup = 1;
 
+/*
+ * Turning this on makes writes of whole chunks of zeros
+ * into holes, when the file system can punch them.
+ * See fusefs_write_hole.
+ */
+int fusefs_write_holes = 1;
+
 /* local static function defines */
 
 static int	fusefslookup_cache(vnode_t *, char *, int, vnode_t **,
@@ -71,9 +81,19 @@ static int	fusefsrename(vnode_t *odvp, char *onm, vnode_t *ndvp, char *nnm,
 			cred_t *cr, caller_context_t *);
 static int	fusefssetattr(vnode_t *, struct vattr *, int, cred_t *);
 static int	fusefs_accessx(void *, int, cred_t *);
+static boolean_t fusefs_iszero(const void *, size_t);
+static int	fusefs_write_kbuf(fusenode_t *, caddr_t, offset_t, uint32_t *);
+static int	fusefs_write_hole(fusenode_t *, uio_t *, size_t, uint32_t);
 static int	fusefs_readvdir(vnode_t *vp, uio_t *uio, cred_t *cr, int *eofp,
 			caller_context_t *);
 static void	fusefs_rele_fid(fusenode_t *);
+static void	fusefs_keep_createfid(fusenode_t *, uint64_t, int);
+static void	fusefs_drop_createfid(fusenode_t *);
+static int	fusefs_create_prov(vnode_t *, char *, int, struct vattr *,
+	int, vnode_t **, cred_t *, caller_context_t *);
+static int	fusefs_create2(vnode_t *, char *, int, struct vattr *,
+			enum vcexcl, int, vnode_t **, cred_t *,
+			caller_context_t *);
 
 /*
  * These are the vnode ops routines which implement the vnode interface to
@@ -118,6 +138,7 @@ static int	fusefs_rmdir(vnode_t *, char *, vnode_t *, cred_t *,
 			caller_context_t *, int);
 static int	fusefs_readdir(vnode_t *, struct uio *, cred_t *, int *,
 			caller_context_t *, int);
+static int	fusefs_fid(vnode_t *, fid_t *, caller_context_t *);
 static int	fusefs_rwlock(vnode_t *, int, caller_context_t *);
 static void	fusefs_rwunlock(vnode_t *, int, caller_context_t *);
 static int	fusefs_seek(vnode_t *, offset_t, offset_t *,
@@ -130,11 +151,14 @@ static int	fusefs_pathconf(vnode_t *, int, ulong_t *, cred_t *,
 			caller_context_t *);
 static int	fusefs_shrlock(vnode_t *, int, struct shrlock *, int, cred_t *,
 			caller_context_t *);
-
-/* Dummy function to use until correct function is ported in */
-int noop_vnodeop() {
-	return (0);
-}
+static int	fusefs_poll(vnode_t *, short, int, short *, struct pollhead **,
+			caller_context_t *);
+static int	fusefs_ioctl(vnode_t *, int, intptr_t, int, cred_t *, int *,
+			caller_context_t *);
+static int	fusefs_setsecattr(vnode_t *, vsecattr_t *, int, cred_t *,
+			caller_context_t *);
+static int	fusefs_getsecattr(vnode_t *, vsecattr_t *, int, cred_t *,
+			caller_context_t *);
 
 struct vnodeops *fusefs_vnodeops = NULL;
 
@@ -148,7 +172,7 @@ const fs_operation_def_t fusefs_vnodeops_template[] = {
 	{ VOPNAME_CLOSE,	{ .vop_close = fusefs_close } },
 	{ VOPNAME_READ,		{ .vop_read = fusefs_read } },
 	{ VOPNAME_WRITE,	{ .vop_write = fusefs_write } },
-	{ VOPNAME_IOCTL,	{ .error = fs_nosys } }, /* fusefs_ioctl, */
+	{ VOPNAME_IOCTL,	{ .vop_ioctl = fusefs_ioctl } },
 	{ VOPNAME_GETATTR,	{ .vop_getattr = fusefs_getattr } },
 	{ VOPNAME_SETATTR,	{ .vop_setattr = fusefs_setattr } },
 	{ VOPNAME_ACCESS,	{ .vop_access = fusefs_access } },
@@ -164,7 +188,7 @@ const fs_operation_def_t fusefs_vnodeops_template[] = {
 	{ VOPNAME_READLINK,	{ .error = fs_nosys } }, /* fusefs_readlink, */
 	{ VOPNAME_FSYNC,	{ .vop_fsync = fusefs_fsync } },
 	{ VOPNAME_INACTIVE,	{ .vop_inactive = fusefs_inactive } },
-	{ VOPNAME_FID,		{ .error = fs_nosys } }, /* fusefs_fid, */
+	{ VOPNAME_FID,		{ .vop_fid = fusefs_fid } },
 	{ VOPNAME_RWLOCK,	{ .vop_rwlock = fusefs_rwlock } },
 	{ VOPNAME_RWUNLOCK,	{ .vop_rwunlock = fusefs_rwunlock } },
 	{ VOPNAME_SEEK,		{ .vop_seek = fusefs_seek } },
@@ -177,10 +201,11 @@ const fs_operation_def_t fusefs_vnodeops_template[] = {
 	{ VOPNAME_ADDMAP,	{ .error = fs_nosys } }, /* fusefs_addmap, */
 	{ VOPNAME_DELMAP,	{ .error = fs_nosys } }, /* fusefs_delmap, */
 	{ VOPNAME_DUMP,		{ .error = fs_nosys } }, /* fusefs_dump, */
+	{ VOPNAME_POLL,		{ .vop_poll = fusefs_poll } },
 	{ VOPNAME_PATHCONF,	{ .vop_pathconf = fusefs_pathconf } },
 	{ VOPNAME_PAGEIO,	{ .error = fs_nosys } }, /* fusefs_pageio, */
-	{ VOPNAME_SETSECATTR,	{ .error = fs_nosys } },
-	{ VOPNAME_GETSECATTR,	{ .error = noop_vnodeop } },
+	{ VOPNAME_SETSECATTR,	{ .vop_setsecattr = fusefs_setsecattr } },
+	{ VOPNAME_GETSECATTR,	{ .vop_getsecattr = fusefs_getsecattr } },
 	{ VOPNAME_SHRLOCK,	{ .vop_shrlock = fusefs_shrlock } },
 	{ NULL, NULL }
 };
@@ -216,12 +241,38 @@ fusefs_open(vnode_t **vpp, int flag, cred_t *cr, caller_context_t *ct)
 		return (EACCES);
 	}
 
+	/* A provisional directory must be created first. */
+	if (vp->v_type == VDIR && (error = fusefs_ans_wait(np)) != 0)
+		return (error);
+
+	/*
+	 * Not while fusefs_rmtree is removing a tree this is in.
+	 * Opens elsewhere only wait for its check that nothing
+	 * under the directory is open.
+	 */
+	for (;;) {
+		rw_enter(&fmi->fmi_rmtree_lk, RW_READER);
+		mutex_enter(&fmi->fmi_lock);
+		if (!fusefs_in_rmtree(np)) {
+			mutex_exit(&fmi->fmi_lock);
+			break;
+		}
+		rw_exit(&fmi->fmi_rmtree_lk);
+		if (!cv_wait_sig(&fmi->fmi_rmtree_cv, &fmi->fmi_lock)) {
+			mutex_exit(&fmi->fmi_lock);
+			return (EINTR);
+		}
+		mutex_exit(&fmi->fmi_lock);
+	}
+
 	/*
 	 * Get exclusive access to n_fid and related stuff.
 	 * No returns after this until out.
 	 */
-	if (fusefs_rw_enter_sig(&np->r_lkserlock, RW_WRITER, FUSEINTR(vp)))
+	if (fusefs_rw_enter_sig(&np->r_lkserlock, RW_WRITER, FUSEINTR(vp))) {
+		rw_exit(&fmi->fmi_rmtree_lk);
 		return (EINTR);
+	}
 
 	/*
 	 * Keep track of the vnode type at first open.
@@ -245,6 +296,39 @@ fusefs_open(vnode_t **vpp, int flag, cred_t *cr, caller_context_t *ct)
 	if (flag & FTRUNC)
 		flag |= FWRITE;
 
+	/*
+	 * A provisional file gets its handle when it's
+	 * created (see fusefs_asyncns.c).  Just count it.
+	 */
+	if (vp->v_type == VREG && fusefs_ans_open(np)) {
+		if (np->n_fidrefs == 0)
+			np->n_rights = 0;
+		np->n_rights |= FREAD;
+		if (flag & FWRITE)
+			np->n_rights |= FWRITE;
+		np->n_ssgenid = ssp->ss_genid;
+		np->n_fidrefs++;
+		goto have_fid;
+	}
+
+	/*
+	 * Did fusefs_create leave us the handle it got?
+	 * Use it if the rights are sufficient.
+	 */
+	if (np->n_flag & NCREATEFID) {
+		ASSERT(np->n_fidrefs == 0);
+		if (np->n_ssgenid == ssp->ss_genid &&
+		    ((flag & FWRITE) == 0 || (np->n_rights & FWRITE) != 0)) {
+			mutex_enter(&np->r_statelock);
+			np->n_flag &= ~NCREATEFID;
+			mutex_exit(&np->r_statelock);
+			fid = np->n_fid;
+			rights = np->n_rights;
+			goto new_fid;
+		}
+		fusefs_drop_createfid(np);
+	}
+
 	/*
 	 * If we already have it open, and the FID is still valid,
 	 * check whether the rights are sufficient for FID reuse.
@@ -282,11 +366,12 @@ fusefs_open(vnode_t **vpp, int flag, cred_t *cr, caller_context_t *ct)
 		    np->n_rplen, np->n_rpath, &fid);
 	} else {
 		error = fusefs_call_open(ssp,
-		    np->n_rplen, np->n_rpath, rights, &fid);
+		    np->n_rplen, np->n_rpath, rights, &fid, NULL);
 	}
 	if (error)
 		goto out;
 
+new_fid:
 	/*
 	 * We have a new FID and access rights.
 	 */
@@ -334,6 +419,7 @@ have_fid:
 
 out:
 	fusefs_rw_exit(&np->r_lkserlock);
+	rw_exit(&fmi->fmi_rmtree_lk);
 	return (error);
 }
 
@@ -400,6 +486,10 @@ fusefs_close(vnode_t *vp, int flag, int count, offset_t offset, cred_t *cr,
 	if (count > 1)
 		return (0);
 
+	/* The mtime of data we wrote on the device (-o blkdev) */
+	if (vp->v_type == VREG)
+		(void) fusefs_bmap_flush(np, B_FALSE);
+
 	/*
 	 * Decrement the reference count for the FID
 	 * and possibly do the OtW close.
@@ -413,7 +503,13 @@ fusefs_close(vnode_t *vp, int flag, int count, offset_t offset, cred_t *cr,
 
 	fusefs_rw_exit(&np->r_lkserlock);
 
-	return (0);
+	/*
+	 * A provisional create that failed, if we know yet.
+	 * Left for fsync, which is where it's reported for sure.
+	 */
+	if (vp->v_type == VDIR)
+		return (0);
+	return (fusefs_ans_error(np, B_FALSE));
 }
 
 /*
@@ -428,6 +524,9 @@ fusefs_rele_fid(fusenode_t *np)
 	fusefs_ssn_t	*ssp;
 	cred_t		*oldcr;
 	uint64_t	ofid;
+	boolean_t	unlinked;
+	char		*upath;
+	int		uplen;
 	int		error;
 
 	ssp = np->n_mount->fmi_ssn;
@@ -464,6 +563,9 @@ fusefs_rele_fid(fusenode_t *np)
 	/* Allow next open to use any v_type. */
 	np->n_ovtype = VNON;
 
+	/* Not created yet?  It's time.  See fusefs_asyncns.c */
+	fusefs_ans_close(np);
+
 	/*
 	 * Other "last close" stuff.
 	 */
@@ -472,9 +574,84 @@ fusefs_rele_fid(fusenode_t *np)
 		fusefs_attrcache_rm_locked(np);
 	oldcr = np->r_cred;
 	np->r_cred = NULL;
+	unlinked = (np->n_flag & NUNLINKED) != 0;
+	np->n_flag &= ~NUNLINKED;
 	mutex_exit(&np->r_statelock);
 	if (oldcr != NULL)
 		crfree(oldcr);
+
+	/*
+	 * Unlinked while open (see fusefs_remove).
+	 * Now the daemon can delete it.
+	 */
+	if (unlinked &&
+	    (upath = fusefs_node_unlinked_take(np, &uplen)) != NULL) {
+		error = fusefs_call_delete(ssp, uplen, upath);
+		if (error != 0 && error != ENOENT) {
+			FUSEFS_DEBUG("error %d deleting %s\n",
+			    error, upath);
+		}
+		kmem_free(upath, uplen + 1);
+	}
+}
+
+/*
+ * Keep the handle fusefs_create got for the VOP_OPEN that
+ * normally follows (see fusefs_open).  If the file is open
+ * already, or a handle is waiting, just close this one.
+ */
+static void
+fusefs_keep_createfid(fusenode_t *np, uint64_t fid, int rights)
+{
+	fusefs_ssn_t	*ssp;
+	int		error;
+
+	ssp = np->n_mount->fmi_ssn;
+
+	(void) fusefs_rw_enter_sig(&np->r_lkserlock, RW_WRITER, 0);
+	if (np->n_fidrefs == 0 && (np->n_flag & NCREATEFID) == 0) {
+		np->n_fid = fid;
+		np->n_rights = rights;
+		np->n_ssgenid = ssp->ss_genid;
+		mutex_enter(&np->r_statelock);
+		np->n_flag |= NCREATEFID;
+		mutex_exit(&np->r_statelock);
+		fid = FUSE_FID_UNUSED;
+	}
+	fusefs_rw_exit(&np->r_lkserlock);
+
+	if (fid != FUSE_FID_UNUSED) {
+		error = fusefs_call_close(ssp, fid);
+		if (error)
+			FUSEFS_DEBUG("error %d closing %s\n",
+			    error, np->n_rpath);
+	}
+}
+
+/*
+ * Close a handle left by fusefs_create that no open took.
+ * Caller holds r_lkserlock (writer).
+ */
+static void
+fusefs_drop_createfid(fusenode_t *np)
+{
+	fusefs_ssn_t	*ssp;
+	int		error;
+
+	ssp = np->n_mount->fmi_ssn;
+
+	mutex_enter(&np->r_statelock);
+	np->n_flag &= ~NCREATEFID;
+	mutex_exit(&np->r_statelock);
+
+	/* Gone with the old session? */
+	if (np->n_ssgenid != ssp->ss_genid)
+		return;
+
+	error = fusefs_call_close(ssp, np->n_fid);
+	if (error)
+		FUSEFS_DEBUG("error %d closing %s\n",
+		    error, np->n_rpath);
 }
 
 /* ARGSUSED */
@@ -520,6 +697,10 @@ fusefs_read(vnode_t *vp, struct uio *uiop, int ioflag, cred_t *cr,
 	if (uiop->uio_loffset < 0 || endoff < 0)
 		return (EINVAL);
 
+	/* A provisional file must be created first. */
+	if ((error = fusefs_ans_wait(np)) != 0)
+		return (error);
+
 	/* get vnode attributes from server */
 	va.va_mask = AT_SIZE | AT_MTIME;
 	if (error = fusefsgetattr(vp, &va, cr))
@@ -560,6 +741,12 @@ fusefs_read(vnode_t *vp, struct uio *uiop, int ioflag, cred_t *cr,
 	maxlen = ssp->ss_max_iosize;
 	save_resid = uiop->uio_resid;
 	while (uiop->uio_resid > 0) {
+		/* What's mapped, from the device (-o blkdev) */
+		if (fmi->fmi_bvp != NULL) {
+			error = fusefs_bmap_rw(np, uiop, UIO_READ, ioflag);
+			if (error || uiop->uio_resid == 0)
+				break;
+		}
 		/* Lint: uio_resid may be 64-bits */
 		rlen = len = (uint32_t)MIN(maxlen, uiop->uio_resid);
 		error = fusefs_call_read(ssp,
@@ -610,6 +797,9 @@ fusefs_write(vnode_t *vp, struct uio *uiop, int ioflag, cred_t *cr,
 	ssize_t		save_resid;
 	uint32_t	len, rlen;
 	uint32_t	maxlen;
+	caddr_t		zbuf = NULL;
+	size_t		hlen, cbytes;
+	boolean_t	copied;
 	int		error = 0;
 
 	np = VTOFUSE(vp);
@@ -676,9 +866,27 @@ fusefs_write(vnode_t *vp, struct uio *uiop, int ioflag, cred_t *cr,
 	} else
 		past_limit = 0;
 
+	/*
+	 * A provisional file keeps what is written until
+	 * it's created (see fusefs_asyncns.c), unless the
+	 * caller wants it written out now.
+	 */
+	if (ioflag & (FSYNC | FDSYNC)) {
+		error = fusefs_ans_wait(np);
+		if (error)
+			goto out;
+	} else {
+		error = fusefs_ans_write(np, uiop);
+		if (error != ENOTSUP)
+			goto out;
+		error = 0;
+	}
+
 	/* Shared lock for n_fid use in fusefs_call_write */
-	if (fusefs_rw_enter_sig(&np->r_lkserlock, RW_READER, FUSEINTR(vp)))
-		return (EINTR);
+	if (fusefs_rw_enter_sig(&np->r_lkserlock, RW_READER, FUSEINTR(vp))) {
+		error = EINTR;
+		goto out;
+	}
 
 	/* Make sure fid is valid. */
 	if (np->n_fidrefs == 0 ||
@@ -690,15 +898,65 @@ fusefs_write(vnode_t *vp, struct uio *uiop, int ioflag, cred_t *cr,
 
 	/*
 	 * Do the I/O in maxlen chunks.
+	 *
+	 * If the file system can punch holes, whole chunks at
+	 * chunk-aligned offsets are first copied into zbuf to
+	 * see if they're all zeros.  Runs of those are skipped
+	 * (hlen bytes, just before uio_loffset) and made into
+	 * a hole when the run ends.  Other chunks we copied are
+	 * written from zbuf.
 	 */
 	maxlen = ssp->ss_max_iosize;
+	if (fusefs_write_holes != 0 &&
+	    (ssp->ss_opts & FUSE_INIT_FALLOCATE) != 0 &&
+	    (fmi->fmi_status & SM_STATUS_NOFALLOC) == 0 &&
+	    (maxlen % 64) == 0 && uiop->uio_resid >= maxlen)
+		zbuf = kmem_alloc(maxlen, KM_SLEEP);
+	hlen = 0;
 	save_resid = uiop->uio_resid;
 	while (uiop->uio_resid > 0) {
 		/* Lint: uio_resid may be 64-bits */
+		/*
+		 * What's mapped, on the device (-o blkdev).  Not
+		 * while skipping zeros: hlen must end at loffset.
+		 */
+		if (fmi->fmi_bvp != NULL && hlen == 0) {
+			error = fusefs_bmap_rw(np, uiop, UIO_WRITE, ioflag);
+			if (error || uiop->uio_resid == 0)
+				break;
+		}
 		rlen = len = (uint32_t)MIN(maxlen, uiop->uio_resid);
-		error = fusefs_call_write(ssp,
-		    np->n_fid, &rlen, uiop,
-		    np->n_rplen, np->n_rpath);
+		copied = B_FALSE;
+		if (zbuf != NULL && len == maxlen &&
+		    (uiop->uio_loffset % maxlen) == 0) {
+			error = uiocopy(zbuf, len, UIO_WRITE, uiop, &cbytes);
+			if (error)
+				break;
+			if (fusefs_iszero(zbuf, len)) {
+				uioskip(uiop, len);
+				hlen += len;
+				continue;
+			}
+			copied = B_TRUE;
+		}
+		if (hlen != 0) {
+			error = fusefs_write_hole(np, uiop, hlen, maxlen);
+			hlen = 0;
+			if (error)
+				break;
+		}
+		/* The daemon may allocate blocks for these. */
+		fusefs_bmap_inval(np, uiop->uio_loffset, len);
+		if (copied) {
+			error = fusefs_write_kbuf(np, zbuf,
+			    uiop->uio_loffset, &rlen);
+			if (error == 0)
+				uioskip(uiop, rlen);
+		} else {
+			error = fusefs_call_write(ssp,
+			    np->n_fid, &rlen, uiop,
+			    np->n_rplen, np->n_rpath, NULL);
+		}
 		/*
 		 * Note: the above called uio_update, so
 		 * not doing that here as one might expect.
@@ -709,6 +967,17 @@ fusefs_write(vnode_t *vp, struct uio *uiop, int ioflag, cred_t *cr,
 		if (error || (rlen < len))
 			break;
 	}
+	if (hlen != 0) {
+		if (error == 0) {
+			error = fusefs_write_hole(np, uiop, hlen, maxlen);
+		} else {
+			/* Not done after all. */
+			uiop->uio_resid += hlen;
+			uiop->uio_loffset -= hlen;
+		}
+	}
+	if (zbuf != NULL)
+		kmem_free(zbuf, maxlen);
 	if (error && (save_resid != uiop->uio_resid)) {
 		/*
 		 * Stopped on an error after having
@@ -740,6 +1009,7 @@ fusefs_write(vnode_t *vp, struct uio *uiop, int ioflag, cred_t *cr,
 
 		if (ioflag & (FSYNC|FDSYNC)) {
 			/* Don't error the I/O if this fails. */
+			(void) fusefs_bmap_flush(np, B_FALSE);
 			(void) fusefs_call_flush(ssp, np->n_fid);
 		}
 	}
@@ -747,6 +1017,7 @@ fusefs_write(vnode_t *vp, struct uio *uiop, int ioflag, cred_t *cr,
 serlk_out:
 	fusefs_rw_exit(&np->r_lkserlock);
 
+out:
 	/* undo adjustment of resid */
 	uiop->uio_resid += past_limit;
 
@@ -754,6 +1025,115 @@ serlk_out:
 }
 
 
+/*
+ * Is this buffer all zeros?  It's 8-byte aligned and its length
+ * a multiple of 64.  We can't use the vector unit here without
+ * saving its state, so test eight words per iteration, OR'd
+ * together; that's one branch per 64 bytes, and data that isn't
+ * zeros usually shows it in the first few words.
+ */
+static boolean_t
+fusefs_iszero(const void *buf, size_t len)
+{
+	const uint64_t	*p = buf;
+	const uint64_t	*end = p + len / sizeof (uint64_t);
+
+	ASSERT(((uintptr_t)buf & 7) == 0 && (len % 64) == 0);
+
+	for (; p < end; p += 8) {
+		if ((p[0] | p[1] | p[2] | p[3] |
+		    p[4] | p[5] | p[6] | p[7]) != 0)
+			return (B_FALSE);
+	}
+	return (B_TRUE);
+}
+
+/*
+ * fusefs_write of len bytes we have in a kernel buffer.
+ * Like fusefs_call_write, *rlenp is what was written.
+ */
+static int
+fusefs_write_kbuf(fusenode_t *np, caddr_t buf, offset_t off,
+	uint32_t *rlenp)
+{
+	fusefs_ssn_t	*ssp = np->n_mount->fmi_ssn;
+	iovec_t		iov;
+	uio_t		uio;
+
+	iov.iov_base = buf;
+	iov.iov_len = *rlenp;
+	bzero(&uio, sizeof (uio));
+	uio.uio_iov = &iov;
+	uio.uio_iovcnt = 1;
+	uio.uio_loffset = off;
+	uio.uio_segflg = UIO_SYSSPACE;
+	uio.uio_fmode = FWRITE;
+	uio.uio_llimit = MAXOFFSET_T;
+	uio.uio_resid = *rlenp;
+
+	return (fusefs_call_write(ssp, np->n_fid, rlenp, &uio,
+	    np->n_rplen, np->n_rpath, NULL));
+}
+
+/*
+ * Make the hlen bytes of zeros fusefs_write skipped (just before
+ * uio_loffset) read as zeros: punch a hole there, and have the
+ * daemon make the file at least that long (which, unlike a
+ * truncate, can't lose data if our idea of the size is stale).
+ * If the file system can't punch holes, write the zeros after
+ * all, and stop trying on this mount.  Whatever isn't done is
+ * given back to the uio, as for past_limit in fusefs_write.
+ */
+static int
+fusefs_write_hole(fusenode_t *np, uio_t *uiop, size_t hlen,
+	uint32_t maxlen)
+{
+	fusemntinfo_t	*fmi = np->n_mount;
+	fusefs_ssn_t	*ssp = fmi->fmi_ssn;
+	offset_t	off = uiop->uio_loffset - hlen;
+	caddr_t		zeros;
+	size_t		done = 0;
+	uint32_t	len, rlen;
+	int		error;
+
+	fusefs_bmap_inval(np, off, hlen);
+	if ((fmi->fmi_status & SM_STATUS_NOFALLOC) == 0) {
+		error = fusefs_call_fallocate(ssp, np->n_fid,
+		    FUSE_FALLOC_PUNCH_HOLE | FUSE_FALLOC_KEEP_SIZE |
+		    FUSE_FALLOC_EXTEND, off, hlen,
+		    np->n_rplen, np->n_rpath);
+		if (error == 0)
+			return (0);
+		if (error != ENOSYS && error != ENOTSUP &&
+		    error != EOPNOTSUPP)
+			goto out;
+		mutex_enter(&fmi->fmi_lock);
+		fmi->fmi_status |= SM_STATUS_NOFALLOC;
+		mutex_exit(&fmi->fmi_lock);
+	}
+
+	zeros = kmem_zalloc(maxlen, KM_SLEEP);
+	error = 0;
+	while (done < hlen) {
+		rlen = len = (uint32_t)MIN(maxlen, hlen - done);
+		error = fusefs_write_kbuf(np, zeros, off + done, &rlen);
+		if (error)
+			break;
+		done += rlen;
+		if (rlen < len) {
+			/* As for a short write, callers see the count. */
+			error = ENOSPC;
+			break;
+		}
+	}
+	kmem_free(zeros, maxlen);
+
+out:
+	uiop->uio_resid += hlen - done;
+	uiop->uio_loffset -= hlen - done;
+	return (error);
+}
+
 /*
  * Return either cached or remote attributes. If get remote attr
  * use them to check and invalidate caches, then cache the new attributes.
@@ -837,6 +1217,7 @@ fusefs_setattr(vnode_t *vp, struct vattr *vap, int flags, cred_t *cr,
 	 * Note that the file UID+GID can be different from
 	 * the mount owner, and we need to check the _mount_
 	 * owner here.  See _access_rwx
+	 * With -o acl it's the file's own owner that counts.
 	 */
 	bzero(&oldva, sizeof (oldva));
 	oldva.va_mask = AT_TYPE | AT_MODE;
@@ -844,8 +1225,10 @@ fusefs_setattr(vnode_t *vp, struct vattr *vap, int flags, cred_t *cr,
 	if (error)
 		return (error);
 	oldva.va_mask |= AT_UID | AT_GID;
-	oldva.va_uid = fmi->fmi_uid;
-	oldva.va_gid = fmi->fmi_gid;
+	if ((fmi->fmi_flags & FMI_ACL) == 0) {
+		oldva.va_uid = fmi->fmi_uid;
+		oldva.va_gid = fmi->fmi_gid;
+	}
 
 	error = secpolicy_vnode_setattr(cr, vp, vap, &oldva, flags,
 	    fusefs_accessx, vp);
@@ -889,6 +1272,15 @@ fusefssetattr(vnode_t *vp, struct vattr *vap, int flags, cred_t *cr)
 
 	ASSERT(curproc->p_zone == VTOFMI(vp)->fmi_zone);
 
+	/*
+	 * Changes to a provisional node go with its
+	 * create.  See fusefs_asyncns.c
+	 */
+	error = fusefs_ans_setattr(np, vap, cr);
+	if (error != ENOTSUP)
+		return (error);
+	error = 0;
+
 	/*
 	 * If our caller is trying to set multiple attributes, they
 	 * can make no assumption about what order they are done in.
@@ -897,9 +1289,20 @@ fusefssetattr(vnode_t *vp, struct vattr *vap, int flags, cred_t *cr)
 	 * with a partially complete request.
 	 */
 
+	/*
+	 * A size change may free blocks that fusefs_bmap_rw is
+	 * doing I/O on, so keep reads and writes out meanwhile.
+	 */
+	if ((mask & AT_SIZE) &&
+	    fusefs_rw_enter_sig(&np->r_rwlock, RW_WRITER, FUSEINTR(vp)))
+		return (EINTR);
+
 	/* Shared lock for (possible) n_fid use. */
-	if (fusefs_rw_enter_sig(&np->r_lkserlock, RW_READER, FUSEINTR(vp)))
+	if (fusefs_rw_enter_sig(&np->r_lkserlock, RW_READER, FUSEINTR(vp))) {
+		if (mask & AT_SIZE)
+			fusefs_rw_exit(&np->r_rwlock);
 		return (EINTR);
+	}
 
 	if (mask & AT_SIZE) {
 		/*
@@ -910,6 +1313,12 @@ fusefssetattr(vnode_t *vp, struct vattr *vap, int flags, cred_t *cr)
 		 * fusefs_putapage() is not yet implemented.
 		 */
 
+		/*
+		 * Blocks may be freed or allocated: forget where
+		 * they were before the file system can move them.
+		 */
+		fusefs_bmap_inval(np, 0, 0);
+
 		/*
 		 * Set the file size to vap->va_size.
 		 * Use the FID if we have one with VWRITE.
@@ -947,7 +1356,7 @@ fusefssetattr(vnode_t *vp, struct vattr *vap, int flags, cred_t *cr)
 	if (mask & (AT_ATIME | AT_MTIME)) {
 		error = fusefs_call_utimes(ssp,
 		    np->n_rplen, np->n_rpath,
-		    atime, mtime);
+		    atime, mtime, NULL);
 		if (error)
 			goto out;
 		modified = 1;
@@ -956,7 +1365,7 @@ fusefssetattr(vnode_t *vp, struct vattr *vap, int flags, cred_t *cr)
 	if (mask & AT_MODE) {
 		error = fusefs_call_chmod(ssp,
 		    np->n_rplen, np->n_rpath,
-		    vap->va_mode);
+		    vap->va_mode, NULL);
 		if (error)
 			goto out;
 		modified = 1;
@@ -969,7 +1378,7 @@ fusefssetattr(vnode_t *vp, struct vattr *vap, int flags, cred_t *cr)
 	if (mask & (AT_UID | AT_GID)) {
 		error = fusefs_call_chown(ssp,
 		    np->n_rplen, np->n_rpath,
-		    uid, gid);
+		    uid, gid, NULL);
 		if (error)
 			goto out;
 		modified = 1;
@@ -985,6 +1394,8 @@ out:
 	}
 
 	fusefs_rw_exit(&np->r_lkserlock);
+	if (mask & AT_SIZE)
+		fusefs_rw_exit(&np->r_rwlock);
 
 	return (error);
 }
@@ -1096,6 +1507,8 @@ fusefs_accessx(void *arg, int mode, cred_t *cr)
 	 * the FMI_DEAD and VFS_UNMOUNTED flags, etc.
 	 * XXX: Call FUSE:access here?
 	 */
+	if (VTOFMI(vp)->fmi_flags & FMI_ACL)
+		return (fusefs_acl_access(vp, mode, cr));
 	return (fusefs_access_rwx(vp->v_vfsp, vp->v_type, mode, cr));
 }
 
@@ -1116,6 +1529,10 @@ fusefs_access(vnode_t *vp, int mode, int flags, cred_t *cr,
 	if (fmi->fmi_flags & FMI_DEAD || vfsp->vfs_flag & VFS_UNMOUNTED)
 		return (EIO);
 
+	/* With -o acl, the file's own permissions.  See fusefs_acl.c */
+	if (fmi->fmi_flags & FMI_ACL)
+		return (fusefs_acl_access(vp, mode, cr));
+
 	return (fusefs_access_rwx(vfsp, vp->v_type, mode, cr));
 }
 
@@ -1150,11 +1567,29 @@ fusefs_fsync(vnode_t *vp, int syncflag, cred_t *cr, caller_context_t *ct)
 	if ((syncflag & (FSYNC|FDSYNC)) == 0)
 		return (0);
 
+	/*
+	 * Provisional creates: wait for this one, or for
+	 * a directory, all of them (simpler than finding
+	 * the ones in it).  Report any that failed.
+	 */
+	if (vp->v_type == VDIR)
+		error = fusefs_ans_sync(fmi, B_TRUE);
+	else
+		error = fusefs_ans_wait(np);
+	if (error == 0)
+		error = fusefs_ans_error(np, B_TRUE);
+	if (error)
+		return (error);
+
 	/* Shared lock for n_fid use in _flush */
 	if (fusefs_rw_enter_sig(&np->r_lkserlock, RW_READER, FUSEINTR(vp)))
 		return (EINTR);
 
-	if (np->n_fidrefs > 0)
+	/* Data we wrote on the device (-o blkdev) */
+	if (vp->v_type == VREG)
+		error = fusefs_bmap_flush(np, B_TRUE);
+
+	if (error == 0 && np->n_fidrefs > 0 && np->n_fid != FUSE_FID_UNUSED)
 		error = fusefs_call_flush(fmi->fmi_ssn, np->n_fid);
 
 	fusefs_rw_exit(&np->r_lkserlock);
@@ -1207,6 +1642,10 @@ fusefs_inactive(vnode_t *vp, cred_t *cr, caller_context_t *ct)
 		fusefs_rele_fid(np);
 	}
 
+	/* Created, but never opened. */
+	if (np->n_flag & NCREATEFID)
+		fusefs_drop_createfid(np);
+
 	fusefs_rw_exit(&np->r_lkserlock);
 
 	fusefs_addfree(np);
@@ -1377,6 +1816,13 @@ fusefslookup(vnode_t *dvp, char *nm, vnode_t **vpp, cred_t *cr,
 		return (0);
 	}
 
+	/*
+	 * A file we unlinked while it was open is gone,
+	 * though the daemon has it until the last close.
+	 */
+	if (fusefs_node_unlinked(dnp, name, nmlen))
+		return (ENOENT);
+
 	/*
 	 * Normal lookup of a name under this directory.
 	 * Note we handled "", ".", ".." above.
@@ -1395,12 +1841,30 @@ fusefslookup(vnode_t *dvp, char *nm, vnode_t **vpp, cred_t *cr,
 			*vpp = vp;
 			return (0);
 		}
+
+		/*
+		 * Not in the node cache, but if we have listed
+		 * this whole directory, we know the answer.
+		 * Note: lookup_cache just validated dvp attrs.
+		 */
+		error = fusefs_dircache_lookup(dvp, nm, nmlen, &vp);
+		if (error)
+			return (error);
+		if (vp != NULL) {
+			/* hold taken in dircache_lookup */
+			*vpp = vp;
+			return (0);
+		}
 	}
 
 	/*
 	 * OK, go over-the-wire to get the attributes,
-	 * then create the node.
+	 * then create the node.  Any provisional creates
+	 * need to get there first.
 	 */
+	error = fusefs_ans_sync(fmi, B_TRUE);
+	if (error)
+		return (error);
 	error = fusefs_call_getattr2(fmi->fmi_ssn,
 	    dnp->n_rplen, dnp->n_rpath,
 	    nmlen, name, &fa);
@@ -1537,6 +2001,9 @@ fusefs_create(vnode_t *dvp, char *nm, struct vattr *va, enum vcexcl exclusive,
 	const char *name = (const char *)nm;
 	int		nmlen = strlen(nm);
 	uint64_t	fid;
+	uint32_t	rflags;
+	char		*upath;
+	int		uplen;
 
 	vfsp = dvp->v_vfsp;
 	fmi = VFTOFMI(vfsp);
@@ -1581,6 +2048,28 @@ fusefs_create(vnode_t *dvp, char *nm, struct vattr *va, enum vcexcl exclusive,
 	if (fusefs_rw_enter_sig(&dnp->r_rwlock, RW_WRITER, FUSEINTR(dvp)))
 		return (EINTR);
 
+	/*
+	 * With -o asyncns, a name we know is not there can
+	 * be created later.  See fusefs_asyncns.c
+	 */
+	if (fmi->fmi_ans_tq != NULL) {
+		error = fusefs_create_prov(dvp, nm, nmlen, &vattr,
+		    mode, vpp, cr, ct);
+		if (error != ENOTSUP)
+			goto out;
+	}
+
+	/*
+	 * If the daemon can create (or open) and return the
+	 * handle and attributes in one call, do it that way.
+	 */
+	if (fmi->fmi_ssn->ss_opts & FUSE_INIT_CREATE2) {
+		error = fusefs_create2(dvp, name, nmlen, &vattr,
+		    exclusive, mode, vpp, cr, ct);
+		if (error != ENOTSUP)
+			goto out;
+	}
+
 	/*
 	 * NFS needs to go over the wire, just to be sure whether the
 	 * file exists or not.  Using a cached result is dangerous in
@@ -1648,13 +2137,27 @@ fusefs_create(vnode_t *dvp, char *nm, struct vattr *va, enum vcexcl exclusive,
 	if (error)
 		goto out;
 
+	/*
+	 * The name may still be held by a file we unlinked while
+	 * open.  The daemon would open that one, and its last
+	 * close would delete the new file, so delete it now.
+	 */
+	if ((upath = fusefs_node_unlinked_claim(dnp, name, nmlen,
+	    &uplen)) != NULL) {
+		error = fusefs_call_delete(fmi->fmi_ssn, uplen, upath);
+		kmem_free(upath, uplen + 1);
+		if (error != 0 && error != ENOENT)
+			goto out;
+	}
+
 	/*
 	 * Create (or open) a new child node.
 	 * Cannot be "." and ".." now.
 	 */
+	rflags = 0;
 	error = fusefs_call_create(fmi->fmi_ssn,
 	    dnp->n_rplen, dnp->n_rpath,
-	    nmlen, name, mode, &fid);
+	    nmlen, name, mode, &fid, &rflags, NULL);
 	if (error)
 		goto out;
 
@@ -1663,8 +2166,13 @@ fusefs_create(vnode_t *dvp, char *nm, struct vattr *va, enum vcexcl exclusive,
 		FUSEFS_DEBUG("error %d closing %s/%s\n",
 		    cerror, dnp->n_rpath, name);
 
-	/* Modified the directory. */
+	/*
+	 * Modified the directory, unless someone else created
+	 * it since our lookup (or the daemon doesn't say).
+	 */
 	fusefs_attr_touchdir(dnp);
+	if (rflags & FUSE_CREATE_CREATED)
+		fusefs_dircache_enter(dnp, name, nmlen, VREG);
 
 	/*
 	 * Get attributes we want for creating the node.
@@ -1691,33 +2199,250 @@ out:
 	return (error);
 }
 
-/* ARGSUSED */
+/*
+ * Helper for fusefs_create and fusefs_mkdir (-o asyncns).
+ * When the directory name index says the name is not there,
+ * and the caller may create it, make a provisional node now
+ * and let fusefs_asyncns.c have the daemon create it later.
+ *
+ * Returns ENOTSUP when the caller should do it the usual way
+ * (which also gets the error right when we can't do this).
+ * Caller holds dnp->r_rwlock (writer).
+ */
 static int
-fusefs_remove(vnode_t *dvp, char *nm, cred_t *cr, caller_context_t *ct,
-	int flags)
+fusefs_create_prov(vnode_t *dvp, char *name, int nmlen, struct vattr *vap,
+	int mode, vnode_t **vpp, cred_t *cr, caller_context_t *ct)
 {
+	vnode_t		*vp = NULL;
 	int		error;
-	vnode_t		*vp;
-	fusenode_t	*np;
-	fusenode_t	*dnp;
-	/* enum fusefsstat status; */
-	fusemntinfo_t	*fmi;
 
-	fmi = VTOFMI(dvp);
+	/* As in fusefslookup */
+	if (fusefs_access(dvp, VEXEC, 0, cr, ct) != 0 ||
+	    fusefs_node_unlinked(VTOFUSE(dvp), name, nmlen))
+		return (ENOTSUP);
+
+	/* Must know that it's not there. */
+	error = fusefslookup_cache(dvp, name, nmlen, &vp, cr);
+	if (error != 0)
+		return (ENOTSUP);
+	if (vp == NULL)
+		error = fusefs_dircache_lookup(dvp, name, nmlen, &vp);
+	if (vp != NULL) {
+		VN_RELE(vp);
+		return (ENOTSUP);
+	}
+	if (error != ENOENT)
+		return (ENOTSUP);
 
-	if (curproc->p_zone != fmi->fmi_zone)
-		return (EPERM);
+	/* As in fusefs_create */
+	if (fusefs_access(dvp, VWRITE, 0, cr, ct) != 0)
+		return (ENOTSUP);
+	if (vap->va_type == VREG &&
+	    fusefs_access_rwx(dvp->v_vfsp, VREG, mode, cr) != 0)
+		return (ENOTSUP);
 
-	if (fmi->fmi_flags & FMI_DEAD || dvp->v_vfsp->vfs_flag & VFS_UNMOUNTED)
-		return (EIO);
+	return (fusefs_ans_create(dvp, name, nmlen, vap, vpp, cr));
+}
+
+/*
+ * Helper for fusefs_create, using FUSE_OP_CREATE2.
+ *
+ * The old way costs a lookup, a create, a close, a getattr,
+ * then an open from the VOP_OPEN that follows (and a setattr
+ * for O_TRUNC).  Here it's one call, which returns the handle
+ * and attributes, and we keep the handle for VOP_OPEN.
+ *
+ * We still need to know whether the file exists to do the
+ * access checks, so when the caches can't say, we ask the
+ * daemon to create it (needing VWRITE in the directory) and
+ * check access on the attributes it returns if it was there
+ * after all.  Truncation waits for that check.
+ *
+ * Returns ENOTSUP when the caller should do it the old way.
+ * Caller holds dnp->r_rwlock (writer).
+ */
+static int
+fusefs_create2(vnode_t *dvp, char *name, int nmlen, struct vattr *vap,
+	enum vcexcl exclusive, int mode, vnode_t **vpp, cred_t *cr,
+	caller_context_t *ct)
+{
+	struct vattr	vattr;
+	fusefattr_t	fa;
+	fusemntinfo_t	*fmi;
+	fusenode_t	*dnp;
+	vnode_t		*vp = NULL;
+	uint64_t	fid;
+	uint32_t	flags, rflags;
+	boolean_t	trunc;
+	int		rights, error, cerror;
 
+	fmi = VTOFMI(dvp);
 	dnp = VTOFUSE(dvp);
-	if (fusefs_rw_enter_sig(&dnp->r_rwlock, RW_WRITER, FUSEINTR(dvp)))
-		return (EINTR);
 
-	/*
-	 * Verify access to the dirctory.
-	 */
+	trunc = (vap->va_mask & AT_SIZE) != 0 && vap->va_size == 0;
+	rights = FREAD;
+	if (mode & VWRITE)
+		rights |= FWRITE;
+
+	/* As in fusefslookup */
+	error = fusefs_access(dvp, VEXEC, 0, cr, ct);
+	if (error)
+		return (error);
+
+	/*
+	 * Do the caches know it exists?  (No OtW lookup;
+	 * that's one of the calls we're here to save.)
+	 */
+	error = fusefslookup_cache(dvp, name, nmlen, &vp, cr);
+	if (error)
+		return (error);
+	if (vp == NULL) {
+		error = fusefs_dircache_lookup(dvp, name, nmlen, &vp);
+		if (error != 0 && error != ENOENT)
+			return (error);
+	}
+
+	if (vp != NULL) {
+		/*
+		 * It exists.  Checks as in fusefs_create.
+		 */
+		if (exclusive == EXCL) {
+			error = EEXIST;
+			goto out;
+		}
+		error = fusefs_access(vp, mode, 0, cr, ct);
+		if (error)
+			goto out;
+
+		/*
+		 * Nothing to gain if it's already open (or not
+		 * a file): just truncate if requested.
+		 */
+		if (vp->v_type != VREG || VTOFUSE(vp)->n_fidrefs > 0) {
+			if (trunc) {
+				vattr.va_mask = AT_SIZE;
+				vattr.va_size = 0;
+				error = fusefssetattr(vp, &vattr, 0, cr);
+			}
+			goto out;
+		}
+		flags = trunc ? FUSE_CREATE_TRUNC : 0;
+	} else {
+		/*
+		 * It may not exist.  Need VWRITE in the directory,
+		 * and see fusefs_create about the open mode.  If we
+		 * don't have these, it may still be OK to open an
+		 * existing file, so let the caller find out.
+		 */
+		if (fusefs_access(dvp, VWRITE, 0, cr, ct) != 0 ||
+		    fusefs_access_rwx(dvp->v_vfsp, VREG, mode, cr) != 0)
+			return (ENOTSUP);
+		/* See fusefs_create */
+		if (fusefs_node_unlinked(dnp, name, nmlen))
+			return (ENOTSUP);
+		flags = FUSE_CREATE_CREAT;
+		if (exclusive == EXCL)
+			flags |= FUSE_CREATE_EXCL;
+	}
+
+	error = fusefs_call_create2(fmi->fmi_ssn,
+	    dnp->n_rplen, dnp->n_rpath, nmlen, name,
+	    flags, vap->va_mode & MODEMASK, rights,
+	    &fid, &fa, &rflags, NULL);
+	if (error == ENOENT && vp != NULL) {
+		/* Someone else removed it.  Start over. */
+		error = ENOTSUP;
+	}
+	if (error)
+		goto out;
+
+	if (rflags & FUSE_CREATE_CREATED) {
+		/* Modified the directory. */
+		fusefs_attr_touchdir(dnp);
+		fusefs_dircache_enter(dnp, name, nmlen, VREG);
+	}
+
+	if (vp != NULL) {
+		VN_RELE(vp);
+		vp = NULL;
+	}
+	error = fusefs_nget(dvp, name, nmlen, &fa, &vp);
+	if (error)
+		goto closeout;
+
+	/*
+	 * If it was there after all, now we have the attributes
+	 * for the checks we could not do before.
+	 */
+	if ((flags & FUSE_CREATE_CREAT) != 0 &&
+	    (rflags & FUSE_CREATE_CREATED) == 0) {
+		error = fusefs_access(vp, mode, 0, cr, ct);
+		if (error == 0 && trunc) {
+			vattr.va_mask = AT_SIZE;
+			vattr.va_size = 0;
+			error = fusefssetattr(vp, &vattr, 0, cr);
+		}
+		if (error)
+			goto closeout;
+	}
+
+	if (rflags & FUSE_CREATE_OPENED)
+		fusefs_keep_createfid(VTOFUSE(vp), fid, rights);
+
+	/* Success! */
+	*vpp = vp;
+	return (0);
+
+closeout:
+	if (rflags & FUSE_CREATE_OPENED) {
+		cerror = fusefs_call_close(fmi->fmi_ssn, fid);
+		if (cerror)
+			FUSEFS_DEBUG("error %d closing %s/%s\n",
+			    cerror, dnp->n_rpath, name);
+	}
+
+out:
+	if (error) {
+		if (vp != NULL)
+			VN_RELE(vp);
+	} else {
+		*vpp = vp;
+	}
+	return (error);
+}
+
+/* ARGSUSED */
+static int
+fusefs_remove(vnode_t *dvp, char *nm, cred_t *cr, caller_context_t *ct,
+	int flags)
+{
+	int		error;
+	vnode_t		*vp;
+	fusenode_t	*np;
+	fusenode_t	*dnp;
+	/* enum fusefsstat status; */
+	fusemntinfo_t	*fmi;
+
+	fmi = VTOFMI(dvp);
+
+	if (curproc->p_zone != fmi->fmi_zone)
+		return (EPERM);
+
+	if (fmi->fmi_flags & FMI_DEAD || dvp->v_vfsp->vfs_flag & VFS_UNMOUNTED)
+		return (EIO);
+
+	/* Provisional creates first.  See fusefs_asyncns.c */
+	error = fusefs_ans_sync(fmi, B_TRUE);
+	if (error)
+		return (error);
+
+	dnp = VTOFUSE(dvp);
+	if (fusefs_rw_enter_sig(&dnp->r_rwlock, RW_WRITER, FUSEINTR(dvp)))
+		return (EINTR);
+
+	/*
+	 * Verify access to the dirctory.
+	 */
 	error = fusefs_access(dvp, VWRITE|VEXEC, 0, cr, ct);
 	if (error)
 		goto out;
@@ -1736,20 +2461,35 @@ fusefs_remove(vnode_t *dvp, char *nm, cred_t *cr, caller_context_t *ct,
 
 	/*
 	 * Now we have the real reference count on the vnode
-	 * Do we have the file open?
+	 * Do we have the file open?  Hold off opens and
+	 * closes (r_lkserlock) while we decide.
 	 */
 	np = VTOFUSE(vp);
+	if (fusefs_rw_enter_sig(&np->r_lkserlock, RW_WRITER, FUSEINTR(vp))) {
+		VN_RELE(vp);
+		error = EINTR;
+		goto out;
+	}
 	mutex_enter(&np->r_statelock);
 	if ((vp->v_count > 1) && (np->n_fidrefs > 0)) {
 		/*
-		 * NFS does a rename on remove here.
-		 * Do that for FUSE too?
+		 * NFS does a rename on remove here, but that
+		 * costs the back end a rename, shows up in
+		 * listings, and is left behind after a crash.
+		 * Instead, hide the name here and delete the
+		 * file at the last close (fusefs_rele_fid).
 		 */
 		mutex_exit(&np->r_statelock);
-		error = EBUSY;
+		fusefs_node_unlink(np, B_TRUE);
+		fusefs_rw_exit(&np->r_lkserlock);
+
+		fusefs_attr_touchdir(dnp);
+		fusefs_dircache_remove(dnp, nm, strlen(nm));
+		error = 0;
 	} else {
 		fusefs_attrcache_rm_locked(np);
 		mutex_exit(&np->r_statelock);
+		fusefs_rw_exit(&np->r_lkserlock);
 
 		error = fusefs_call_delete(fmi->fmi_ssn,
 		    np->n_rplen, np->n_rpath);
@@ -1764,6 +2504,7 @@ fusefs_remove(vnode_t *dvp, char *nm, cred_t *cr, caller_context_t *ct,
 		case 0:
 			/* Modified the directory. */
 			fusefs_attr_touchdir(dnp);
+			fusefs_dircache_remove(dnp, nm, strlen(nm));
 			/* FALLTHROUGH */
 		case ENOENT:
 			fusefs_attrcache_prune(np);
@@ -1786,6 +2527,7 @@ fusefs_rename(vnode_t *odvp, char *onm, vnode_t *ndvp, char *nnm, cred_t *cr,
 	caller_context_t *ct, int flags)
 {
 	/* vnode_t		*realvp; */
+	int		error;
 
 	if (curproc->p_zone != VTOFMI(odvp)->fmi_zone ||
 	    curproc->p_zone != VTOFMI(ndvp)->fmi_zone)
@@ -1797,6 +2539,11 @@ fusefs_rename(vnode_t *odvp, char *onm, vnode_t *ndvp, char *nnm, cred_t *cr,
 	    ndvp->v_vfsp->vfs_flag & VFS_UNMOUNTED)
 		return (EIO);
 
+	/* Provisional creates first.  See fusefs_asyncns.c */
+	error = fusefs_ans_sync(VTOFMI(odvp), B_TRUE);
+	if (error)
+		return (error);
+
 	return (fusefsrename(odvp, onm, ndvp, nnm, cr, ct));
 }
 
@@ -1815,6 +2562,8 @@ fusefsrename(vnode_t *odvp, char *onm, vnode_t *ndvp, char *nnm, cred_t *cr,
 	fusenode_t	*nnp;
 	fusenode_t	*odnp;
 	fusenode_t	*ndnp;
+	char		*upath;
+	int		uplen;
 	int		error;
 	int		nvp_locked = 0;
 
@@ -1951,38 +2700,48 @@ fusefsrename(vnode_t *odvp, char *onm, vnode_t *ndvp, char *nnm, cred_t *cr,
 		 * Otherwise this similar to fusefs_remove.
 		 */
 		nnp = VTOFUSE(nvp);
+		if (fusefs_rw_enter_sig(&nnp->r_lkserlock, RW_WRITER,
+		    FUSEINTR(nvp))) {
+			error = EINTR;
+			goto out;
+		}
 		mutex_enter(&nnp->r_statelock);
 		if ((nvp->v_count > 2) && (nnp->n_fidrefs > 0)) {
 			/*
 			 * The target file exists, is not the same as
-			 * the source file, and is active.  Other FS
-			 * implementations unlink the target here.
-			 * For FUSE, we don't assume we can remove an
-			 * open file.  Return an error instead.
+			 * the source file, and is active.  Leave it to
+			 * the rename below to replace it, and take the
+			 * node out of the cache so the new name gets
+			 * a new node.  Nothing to delete later.
 			 */
 			mutex_exit(&nnp->r_statelock);
-			error = EBUSY;
-			goto out;
-		}
-
-		/*
-		 * Target file is not active. Try to remove it.
-		 */
-		fusefs_attrcache_rm_locked(nnp);
-		mutex_exit(&nnp->r_statelock);
+			fusefs_node_unlink(nnp, B_FALSE);
+			fusefs_rw_exit(&nnp->r_lkserlock);
+			fusefs_dircache_remove(ndnp, nnm, strlen(nnm));
+			error = 0;
+		} else {
+			/*
+			 * Target file is not active. Try to remove it.
+			 */
+			fusefs_attrcache_rm_locked(nnp);
+			mutex_exit(&nnp->r_statelock);
+			fusefs_rw_exit(&nnp->r_lkserlock);
 
-		error = fusefs_call_delete(fmi->fmi_ssn,
-		    nnp->n_rplen, nnp->n_rpath);
+			error = fusefs_call_delete(fmi->fmi_ssn,
+			    nnp->n_rplen, nnp->n_rpath);
 
-		/*
-		 * Similar to fusefs_remove
-		 */
-		switch (error) {
-		case 0:
-		case ENOENT:
-		case ENOTDIR:
-			fusefs_attrcache_prune(nnp);
-			break;
+			/*
+			 * Similar to fusefs_remove
+			 */
+			switch (error) {
+			case 0:
+				fusefs_dircache_remove(ndnp, nnm, strlen(nnm));
+				/* FALLTHROUGH */
+			case ENOENT:
+			case ENOTDIR:
+				fusefs_attrcache_prune(nnp);
+				break;
+			}
 		}
 
 		if (error)
@@ -2002,15 +2761,30 @@ fusefsrename(vnode_t *odvp, char *onm, vnode_t *ndvp, char *nnm, cred_t *cr,
 
 	error = fusefs_call_rename(fmi->fmi_ssn,
 	    onp->n_rplen, onp->n_rpath,
-	    nnp->n_rplen, nnp->n_rpath,
+	    ndnp->n_rplen, ndnp->n_rpath,
 	    strlen(nnm), nnm);
 
 	/*
 	 * If the old name should no longer exist,
-	 * discard any cached attributes under it.
+	 * discard any cached attributes under it,
+	 * and move the name in the directory index.
+	 * Names under the old node are gone too.
 	 */
-	if (error == 0)
+	if (error == 0) {
 		fusefs_attrcache_prune(onp);
+		fusefs_dircache_remove(odnp, onm, strlen(onm));
+		fusefs_dircache_enter(ndnp, nnm, strlen(nnm), ovp->v_type);
+		if (ovp->v_type == VDIR)
+			fusefs_dircache_purge(onp);
+		/* Files unlinked under it moved too. */
+		fusefs_node_unlinked_rename(fmi, onp->n_rpath, onp->n_rplen,
+		    ndnp, nnm, strlen(nnm));
+		/* A file we unlinked while open had the new name. */
+		upath = fusefs_node_unlinked_claim(ndnp, nnm, strlen(nnm),
+		    &uplen);
+		if (upath != NULL)
+			kmem_free(upath, uplen + 1);
+	}
 
 out:
 	if (nvp) {
@@ -2035,6 +2809,7 @@ fusefs_mkdir(vnode_t *dvp, char *nm, struct vattr *va, vnode_t **vpp,
 	vnode_t		*vp;
 	struct fusenode	*dnp = VTOFUSE(dvp);
 	struct fusemntinfo *fmi = VTOFMI(dvp);
+	struct vattr	vattr;
 	fusefattr_t	fa;
 	const char		*name = (const char *) nm;
 	int		nmlen = strlen(name);
@@ -2060,14 +2835,28 @@ fusefs_mkdir(vnode_t *dvp, char *nm, struct vattr *va, vnode_t **vpp,
 	if (error)
 		goto out;
 
+	/*
+	 * With -o asyncns, a name we know is not there can
+	 * be made later.  See fusefs_asyncns.c
+	 */
+	if (fmi->fmi_ans_tq != NULL) {
+		vattr = *va;
+		vattr.va_type = VDIR;
+		error = fusefs_create_prov(dvp, nm, nmlen, &vattr,
+		    0, vpp, cr, ct);
+		if (error != ENOTSUP)
+			goto out;
+	}
+
 	error = fusefs_call_mkdir(fmi->fmi_ssn,
 	    dnp->n_rplen, dnp->n_rpath,
-	    nmlen, name);
+	    nmlen, name, NULL);
 	if (error)
 		goto out;
 
 	/* Modified the directory. */
 	fusefs_attr_touchdir(dnp);
+	fusefs_dircache_enter(dnp, name, nmlen, VDIR);
 
 	error = fusefs_call_getattr2(fmi->fmi_ssn,
 	    dnp->n_rplen, dnp->n_rpath,
@@ -2105,6 +2894,11 @@ fusefs_rmdir(vnode_t *dvp, char *nm, vnode_t *cdir, cred_t *cr,
 	if (fmi->fmi_flags & FMI_DEAD || dvp->v_vfsp->vfs_flag & VFS_UNMOUNTED)
 		return (EIO);
 
+	/* Provisional creates first.  See fusefs_asyncns.c */
+	error = fusefs_ans_sync(fmi, B_TRUE);
+	if (error)
+		return (error);
+
 	if (fusefs_rw_enter_sig(&dnp->r_rwlock, RW_WRITER, FUSEINTR(dvp)))
 		return (EINTR);
 
@@ -2158,10 +2952,12 @@ fusefs_rmdir(vnode_t *dvp, char *nm, vnode_t *cdir, cred_t *cr,
 	case 0:
 		/* Modified the directory. */
 		fusefs_attr_touchdir(dnp);
+		fusefs_dircache_remove(dnp, nm, strlen(nm));
 		/* FALLTHROUGH */
 	case ENOENT:
 	case ENOTDIR:
 		fusefs_attrcache_prune(np);
+		fusefs_dircache_purge(np);
 		fusefs_rmhash(np);
 		break;
 	}
@@ -2204,6 +3000,11 @@ fusefs_readdir(vnode_t *vp, struct uio *uiop, cred_t *cr, int *eofp,
 
 	ASSERT(fusefs_rw_lock_held(&np->r_rwlock, RW_READER));
 
+	/* Provisional creates first, to be listed. */
+	error = fusefs_ans_sync(fmi, B_TRUE);
+	if (error)
+		return (error);
+
 	/*
 	 * I am serializing the entire readdir opreation
 	 * now since we have not yet implemented readdir
@@ -2269,6 +3070,9 @@ fusefs_readvdir(vnode_t *vp, uio_t *uio, cred_t *cr, int *eofp,
 	    (int)uio->uio_offset, (int)uio->uio_resid);
 	eof = error = 0;
 
+	/* Directory name index (maybe) */
+	fusefs_dircache_begin(np, offset, cr);
+
 	/*
 	 * While there's room in the caller's buffer:
 	 *	get a directory entry from FUSE,
@@ -2300,6 +3104,29 @@ fusefs_readvdir(vnode_t *vp, uio_t *uio, cred_t *cr, int *eofp,
 		}
 		dp->d_reclen = reclen;
 
+		/*
+		 * What's the next offset?  Can't be zero,
+		 * so we'll replace that with INT32_MAX.
+		 */
+		offset = dp->d_off;
+		if (offset == 0)
+			eof = 1;
+
+		/*
+		 * We want d_off == zero on the last entry.
+		 * Also set the special EOF offset.
+		 */
+		if (eof) {
+			dp->d_off = 0;
+			offset = INT32_MAX;
+		}
+
+		/* Hide files we unlinked while open. */
+		if (fusefs_node_unlinked(np, dp->d_name, nmlen)) {
+			uio->uio_offset = offset;
+			continue;
+		}
+
 		/*
 		 * We don't get the stat info with . or ..
 		 * but fusefslookup can get it for us.
@@ -2318,26 +3145,14 @@ fusefs_readvdir(vnode_t *vp, uio_t *uio, cred_t *cr, int *eofp,
 			dp->d_ino = VTOFUSE(newvp)->n_ino;
 			VN_RELE(newvp);
 			newvp = NULL;
+		} else if ((fmi->fmi_ssn->ss_opts & FUSE_INIT_INO) != 0 &&
+		    fa.st_ino != 0) {
+			dp->d_ino = fa.st_ino;
 		} else {
 			dp->d_ino = fusefs_getino(np, dp->d_name, nmlen);
 		}
 
-		/*
-		 * What's the next offset?  Can't be zero,
-		 * so we'll replace that with INT32_MAX.
-		 */
-		offset = dp->d_off;
-		if (offset == 0)
-			eof = 1;
-
-		/*
-		 * We want d_off == zero on the last entry.
-		 * Also set the special EOF offset.
-		 */
-		if (eof) {
-			dp->d_off = 0;
-			offset = INT32_MAX;
-		}
+		fusefs_dircache_fill(np, dp->d_name, nmlen, &fa, offset);
 
 		error = uiomove(dp, dp->d_reclen, UIO_READ, uio);
 		if (error)
@@ -2349,6 +3164,8 @@ fusefs_readvdir(vnode_t *vp, uio_t *uio, cred_t *cr, int *eofp,
 		 */
 		uio->uio_offset = offset;
 	}
+	if (eof && error == 0)
+		fusefs_dircache_done(np, cr);
 	if (eofp)
 		*eofp = eof;
 
@@ -2359,6 +3176,40 @@ fusefs_readvdir(vnode_t *vp, uio_t *uio, cred_t *cr, int *eofp,
 	return (error);
 }
 
+/*
+ * File handle for the NFS server, made from the inode number
+ * and generation the daemon gives.  See fusefs_fh.c
+ */
+/* ARGSUSED */
+static int
+fusefs_fid(vnode_t *vp, fid_t *fidp, caller_context_t *ct)
+{
+	struct vattr	va;
+	fusenode_t	*np;
+	fusemntinfo_t	*fmi;
+	int		error;
+
+	np = VTOFUSE(vp);
+	fmi = VTOFMI(vp);
+
+	if (curproc->p_zone != fmi->fmi_zone)
+		return (EIO);
+
+	if (fmi->fmi_flags & FMI_DEAD || vp->v_vfsp->vfs_flag & VFS_UNMOUNTED)
+		return (EIO);
+
+	/* A provisional file has no inode number yet. */
+	if ((error = fusefs_ans_wait(np)) != 0)
+		return (error);
+
+	/* Make sure we have the inode number and generation. */
+	va.va_mask = AT_NODEID;
+	if ((error = fusefsgetattr(vp, &va, CRED())) != 0)
+		return (error);
+
+	return (fusefs_fh_fid(np, fidp));
+}
+
 
 /*
  * The pair of functions VOP_RWLOCK, VOP_RWUNLOCK
@@ -2551,6 +3402,15 @@ fusefs_pathconf(vnode_t *vp, int cmd, ulong_t *valp, cred_t *cr,
 		*valp = 1000L;
 		break;
 
+	case _PC_ACL_ENABLED:
+		/* POSIX draft ACLs, if the daemon has them. */
+		if ((fmi->fmi_ssn->ss_opts & FUSE_INIT_ACL) != 0 &&
+		    (fmi->fmi_status & SM_STATUS_NOACL) == 0)
+			*valp = _ACL_ACLENT_ENABLED;
+		else
+			*valp = 0;
+		break;
+
 	default:
 		return (fs_pathconf(vp, cmd, valp, cr, ct));
 	}
@@ -2558,6 +3418,40 @@ fusefs_pathconf(vnode_t *vp, int cmd, ulong_t *valp, cred_t *cr,
 }
 
 
+/*
+ * ACLs, see fusefs_acl.c
+ */
+/* ARGSUSED */
+static int
+fusefs_setsecattr(vnode_t *vp, vsecattr_t *vsa, int flag, cred_t *cr,
+	caller_context_t *ct)
+{
+	fusemntinfo_t	*fmi = VTOFMI(vp);
+
+	if (curproc->p_zone != fmi->fmi_zone)
+		return (EIO);
+
+	if (fmi->fmi_flags & FMI_DEAD || vp->v_vfsp->vfs_flag & VFS_UNMOUNTED)
+		return (EIO);
+
+	return (fusefs_acl_setsecattr(vp, vsa, flag, cr));
+}
+
+static int
+fusefs_getsecattr(vnode_t *vp, vsecattr_t *vsa, int flag, cred_t *cr,
+	caller_context_t *ct)
+{
+	fusemntinfo_t	*fmi = VTOFMI(vp);
+
+	if (curproc->p_zone != fmi->fmi_zone)
+		return (EIO);
+
+	if (fmi->fmi_flags & FMI_DEAD || vp->v_vfsp->vfs_flag & VFS_UNMOUNTED)
+		return (EIO);
+
+	return (fusefs_acl_getsecattr(vp, vsa, flag, cr, ct));
+}
+
 /*
  * XXX
  * This op should eventually support PSARC 2007/268.
@@ -2576,3 +3470,395 @@ fusefs_shrlock(vnode_t *vp, int cmd, struct shrlock *shr, int flag, cred_t *cr,
 		return (ENOSYS);
 	}
 }
+
+/*
+ * Poll is forwarded to the FUSE daemon, which reports the events
+ * ready on the open file.  If nothing is ready, we ask the daemon
+ * to notify us when that may have changed, and return our pollhead
+ * to sleep on.  See fusefs_notify.c
+ */
+/* ARGSUSED */
+static int
+fusefs_poll(vnode_t *vp, short events, int anyyet, short *reventsp,
+	struct pollhead **phpp, caller_context_t *ct)
+{
+	fusenode_t	*np;
+	fusemntinfo_t	*fmi;
+	fusefs_ssn_t	*ssp;
+	uint64_t	kh;
+	uint_t		gen = 0;
+	int		error, flags, revents, tries;
+
+	np = VTOFUSE(vp);
+	fmi = VTOFMI(vp);
+	ssp = fmi->fmi_ssn;
+
+	if (curproc->p_zone != fmi->fmi_zone)
+		return (EIO);
+
+	if (fmi->fmi_flags & FMI_DEAD || vp->v_vfsp->vfs_flag & VFS_UNMOUNTED)
+		return (EIO);
+
+	/*
+	 * Directories, and daemons that don't implement poll,
+	 * get the usual "always ready" behavior.
+	 */
+	if (vp->v_type != VREG || (fmi->fmi_status & SM_STATUS_NOPOLL))
+		return (fs_poll(vp, events, anyyet, reventsp, phpp, ct));
+
+	/* A provisional file must be created first. */
+	if ((error = fusefs_ans_wait(np)) != 0)
+		return (error);
+
+	/* Shared lock for n_fid use in fusefs_call_poll */
+	if (fusefs_rw_enter_sig(&np->r_lkserlock, RW_READER, FUSEINTR(vp)))
+		return (EINTR);
+
+	/* Make sure fid is valid. */
+	if (np->n_fidrefs == 0 ||
+	    np->n_fid == FUSE_FID_UNUSED ||
+	    np->n_ssgenid != ssp->ss_genid) {
+		error = ESTALE;
+		goto serlk_out;
+	}
+
+	/*
+	 * Only ask for a notification if we're going to sleep,
+	 * and there's a notify thread to deliver it.  If one
+	 * arrives while we're asking, the answer we got may be
+	 * out of date, so ask again (a few times).
+	 */
+	for (tries = 0; ; tries++) {
+		kh = anyyet ? 0 : fusefs_poll_register(np, &gen);
+		flags = kh ? FUSE_POLL_SCHEDULE_NOTIFY : 0;
+		revents = 0;
+		error = fusefs_call_poll(ssp, np->n_fid,
+		    np->n_rplen, np->n_rpath,
+		    kh, events, flags, &revents);
+		if (error || (revents & events) || kh == 0 || tries >= 3)
+			break;
+		mutex_enter(&fmi->fmi_lock);
+		if (np->n_pollgen == gen) {
+			mutex_exit(&fmi->fmi_lock);
+			break;
+		}
+		mutex_exit(&fmi->fmi_lock);
+	}
+
+serlk_out:
+	fusefs_rw_exit(&np->r_lkserlock);
+
+	if (error == ENOSYS) {
+		mutex_enter(&fmi->fmi_lock);
+		fmi->fmi_status |= SM_STATUS_NOPOLL;
+		mutex_exit(&fmi->fmi_lock);
+		return (fs_poll(vp, events, anyyet, reventsp, phpp, ct));
+	}
+	if (error)
+		return (error);
+
+	*reventsp = (short)(revents & events);
+	if (*reventsp == 0 && !anyyet) {
+		/*
+		 * Without a notify thread nothing would ever wake
+		 * n_pollhead, so fall back to "always ready".
+		 */
+		if (kh == 0) {
+			return (fs_poll(vp, events, anyyet, reventsp,
+			    phpp, ct));
+		}
+		*phpp = &np->n_pollhead;
+	}
+
+	return (0);
+}
+
+/*
+ * FUSEFS_IOC_DIGEST: ask the daemon for a digest of the file, so
+ * the caller needn't read it all.  See FUSE_OP_DIGEST.
+ */
+static int
+fusefs_digest(vnode_t *vp, intptr_t arg, int flag)
+{
+	fusenode_t	*np = VTOFUSE(vp);
+	fusemntinfo_t	*fmi = VTOFMI(vp);
+	struct fuse_digest *dp;
+	int		error;
+
+	if (vp->v_type != VREG)
+		return (EINVAL);
+	if ((flag & FREAD) == 0)
+		return (EBADF);
+
+	dp = kmem_zalloc(sizeof (*dp), KM_SLEEP);
+	if (ddi_copyin((void *)arg, dp->fd_alg, sizeof (dp->fd_alg), flag)) {
+		error = EFAULT;
+		goto out;
+	}
+	dp->fd_alg[sizeof (dp->fd_alg) - 1] = '\0';
+
+	/* A provisional file must be created first. */
+	if ((error = fusefs_ans_wait(np)) != 0)
+		goto out;
+
+	/* Let the daemon see the mtime of writes done on the device. */
+	(void) fusefs_bmap_flush(np, B_FALSE);
+
+	error = fusefs_call_digest(fmi->fmi_ssn, np->n_rplen, np->n_rpath,
+	    dp->fd_alg, dp->fd_digest);
+	if (error == ENOSYS)
+		error = ENOTSUP;
+	if (error == 0 && ddi_copyout(dp, (void *)arg, sizeof (*dp), flag))
+		error = EFAULT;
+
+out:
+	kmem_free(dp, sizeof (*dp));
+	return (error);
+}
+
+/*
+ * FUSEFS_IOC_RMTREE: remove directory dvp/name and everything under
+ * it in one call to the daemon.  See FUSE_OP_RMTREE.  The checks are
+ * those of rmdir, and EBUSY if a file under it is open or something
+ * is mounted under it; the caller then walks the tree as rm -r does.
+ * With -o acl each directory under it has permissions of its own,
+ * which the daemon doesn't check, so the caller always does that.
+ */
+static int
+fusefs_rmtree(vnode_t *dvp, intptr_t arg, int flag, cred_t *cr,
+	caller_context_t *ct)
+{
+	fusemntinfo_t	*fmi = VTOFMI(dvp);
+	fusenode_t	*dnp = VTOFUSE(dvp);
+	fusenode_t	*np;
+	vnode_t		*vp = NULL;
+	vnode_t		*cdir;
+	struct fuse_rmtree *rp;
+	char		*nm;
+	int		vp_locked = 0;
+	int		error;
+
+	if (dvp->v_type != VDIR)
+		return (ENOTDIR);
+	if (fmi->fmi_flags & FMI_ACL)
+		return (ENOTSUP);
+
+	rp = kmem_alloc(sizeof (*rp), KM_SLEEP);
+	if (ddi_copyin((void *)arg, rp, sizeof (*rp), flag)) {
+		kmem_free(rp, sizeof (*rp));
+		return (EFAULT);
+	}
+	nm = rp->fr_name;
+	nm[sizeof (rp->fr_name) - 1] = '\0';
+	if (nm[0] == '\0' || strcmp(nm, ".") == 0 || strcmp(nm, "..") == 0 ||
+	    strchr(nm, '/') != NULL) {
+		kmem_free(rp, sizeof (*rp));
+		return (EINVAL);
+	}
+
+	/* Provisional creates first.  See fusefs_asyncns.c */
+	error = fusefs_ans_sync(fmi, B_TRUE);
+	if (error) {
+		kmem_free(rp, sizeof (*rp));
+		return (error);
+	}
+
+	if (fusefs_rw_enter_sig(&dnp->r_rwlock, RW_WRITER, FUSEINTR(dvp))) {
+		kmem_free(rp, sizeof (*rp));
+		return (EINTR);
+	}
+
+	/* As for rmdir: w/x access here, the server checks the rest. */
+	error = fusefs_access(dvp, VEXEC|VWRITE, 0, cr, ct);
+	if (error)
+		goto out;
+
+	error = fusefslookup(dvp, nm, &vp, cr, 0, ct);
+	if (error)
+		goto out;
+	np = VTOFUSE(vp);
+
+	mutex_enter(&curproc->p_lock);
+	cdir = PTOU(curproc)->u_cdir;
+	mutex_exit(&curproc->p_lock);
+	if ((vp == dvp) || (vp == cdir) || (vp->v_flag & VROOT)) {
+		error = EINVAL;
+		goto out;
+	}
+	if (vp->v_type != VDIR) {
+		error = ENOTDIR;
+		goto out;
+	}
+	if (vn_vfsrlock(vp)) {
+		error = EBUSY;
+		goto out;
+	}
+	vp_locked = 1;
+
+	/*
+	 * With opens held off, check nothing under it is in use,
+	 * then keep opens out of just this tree (fusefs_open)
+	 * until the daemon is done with it.
+	 */
+	rw_enter(&fmi->fmi_rmtree_lk, RW_WRITER);
+	if (vn_mountedvfs(vp) != NULL || fusefs_subtree_busy(np)) {
+		rw_exit(&fmi->fmi_rmtree_lk);
+		error = EBUSY;
+		goto out;
+	}
+	mutex_enter(&fmi->fmi_lock);
+	list_insert_tail(&fmi->fmi_rmtrees, np);
+	mutex_exit(&fmi->fmi_lock);
+	rw_exit(&fmi->fmi_rmtree_lk);
+
+	fusefs_attrcache_remove(np);
+	error = fusefs_call_rmtree(fmi->fmi_ssn,
+	    np->n_rplen, np->n_rpath);
+
+	mutex_enter(&fmi->fmi_lock);
+	list_remove(&fmi->fmi_rmtrees, np);
+	cv_broadcast(&fmi->fmi_rmtree_cv);
+	mutex_exit(&fmi->fmi_lock);
+	if (error == ENOSYS)
+		error = ENOTSUP;
+
+	/*
+	 * Even a failed call may have removed some of it, so forget
+	 * what we know of the subtree, unless it wasn't tried.
+	 */
+	if (error != ENOTSUP) {
+		fusefs_subtree_gone(np);
+		fusefs_dircache_purge(np);
+	}
+	switch (error) {
+	case 0:
+		/* Modified the directory. */
+		fusefs_attr_touchdir(dnp);
+		fusefs_dircache_remove(dnp, nm, strlen(nm));
+		vnevent_rmdir(vp, dvp, nm, ct);
+		/* FALLTHROUGH */
+	case ENOENT:
+	case ENOTDIR:
+		fusefs_rmhash(np);
+		break;
+	}
+
+out:
+	if (vp) {
+		if (vp_locked)
+			vn_vfsunlock(vp);
+		VN_RELE(vp);
+	}
+	fusefs_rw_exit(&dnp->r_rwlock);
+	kmem_free(rp, sizeof (*rp));
+
+	return (error);
+}
+
+/*
+ * FUSEFS_IOC_SUMTREE: ask the daemon what the file or directory and
+ * everything under it use, so du needn't get the attributes of each
+ * entry.  See FUSE_OP_SUMTREE.  Data written here but still cached
+ * may not be counted yet.
+ */
+static int
+fusefs_sumtree(vnode_t *vp, intptr_t arg, int flag)
+{
+	fusenode_t	*np = VTOFUSE(vp);
+	fusemntinfo_t	*fmi = VTOFMI(vp);
+	struct fuse_treesum ts;
+	int		error;
+
+	if ((flag & FREAD) == 0)
+		return (EBADF);
+
+	/* Provisional creates first.  See fusefs_asyncns.c */
+	error = fusefs_ans_sync(fmi, B_TRUE);
+	if (error)
+		return (error);
+
+	bzero(&ts, sizeof (ts));
+	error = fusefs_call_sumtree(fmi->fmi_ssn, np->n_rplen, np->n_rpath,
+	    &ts);
+	if (error == ENOSYS)
+		error = ENOTSUP;
+	if (error == 0 && ddi_copyout(&ts, (void *)arg, sizeof (ts), flag))
+		error = EFAULT;
+
+	return (error);
+}
+
+/*
+ * Ioctls are forwarded to the FUSE daemon (fuse_operations.ioctl)
+ * in "restricted" mode: what's copied in and out is what the
+ * command's encoding says (_IOR, _IOW, _IOWR in sys/ioccom.h),
+ * so the daemon never gets at other memory of the caller.
+ * Commands in the 'f' group (sys/filio.h) are the system's,
+ * not the file system's, and aren't forwarded, nor are ours.
+ */
+/* ARGSUSED */
+static int
+fusefs_ioctl(vnode_t *vp, int cmd, intptr_t arg, int flag, cred_t *cr,
+	int *rvalp, caller_context_t *ct)
+{
+	fusenode_t	*np;
+	fusemntinfo_t	*fmi;
+	fusefs_ssn_t	*ssp;
+	int		error;
+
+	np = VTOFUSE(vp);
+	fmi = VTOFMI(vp);
+	ssp = fmi->fmi_ssn;
+
+	if (curproc->p_zone != fmi->fmi_zone)
+		return (EIO);
+
+	if (fmi->fmi_flags & FMI_DEAD || vp->v_vfsp->vfs_flag & VFS_UNMOUNTED)
+		return (EIO);
+
+	switch (cmd) {
+	case FUSEFS_IOC_DIGEST:
+		return (fusefs_digest(vp, arg, flag));
+	case FUSEFS_IOC_RMTREE:
+		return (fusefs_rmtree(vp, arg, flag, cr, ct));
+	case FUSEFS_IOC_SUMTREE:
+		return (fusefs_sumtree(vp, arg, flag));
+	}
+
+	if (vp->v_type != VREG || ((cmd >> 8) & 0xff) == 'f' ||
+	    (fmi->fmi_status & SM_STATUS_NOIOCTL))
+		return (ENOTTY);
+
+	/* A provisional file must be created first. */
+	if ((error = fusefs_ans_wait(np)) != 0)
+		return (error);
+
+	/* Shared lock for n_fid use in fusefs_call_ioctl */
+	if (fusefs_rw_enter_sig(&np->r_lkserlock, RW_READER, FUSEINTR(vp)))
+		return (EINTR);
+
+	/* Make sure fid is valid. */
+	if (np->n_fidrefs == 0 ||
+	    np->n_fid == FUSE_FID_UNUSED ||
+	    np->n_ssgenid != ssp->ss_genid) {
+		error = ESTALE;
+		goto serlk_out;
+	}
+
+	/* flag has the caller's data model, and FKIOCTL. */
+	error = fusefs_call_ioctl(ssp, np->n_fid,
+	    np->n_rplen, np->n_rpath,
+	    cmd, arg, flag, 0, rvalp);
+
+serlk_out:
+	fusefs_rw_exit(&np->r_lkserlock);
+
+	if (error == ENOSYS) {
+		mutex_enter(&fmi->fmi_lock);
+		fmi->fmi_status |= SM_STATUS_NOIOCTL;
+		mutex_exit(&fmi->fmi_lock);
+		return (ENOTTY);
+	}
+
+	return (error);
+}
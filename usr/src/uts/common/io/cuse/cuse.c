@@ -0,0 +1,861 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2012 Nexenta Systems, Inc.  All rights reserved.
+ */
+
+/*
+ * CUSE: character devices in user space.
+ *
+ * A FUSE daemon built with cuse_lowlevel_main() opens the control
+ * node (minor 0, /dev/cuse/ctl) and attaches its door with
+ * CUSE_IOC_ATTACH, giving a device name.  We make the INIT call
+ * (the daemon must answer with FUSE_INIT_CUSE) and create a minor
+ * node by that name, which devfsadm links as /dev/cuse/<name>.
+ * The door protocol and up-calls are those of fusefs, so this
+ * module depends on it.
+ *
+ * Opens of a device node are cloned, so each open(2) gets its own
+ * minor, and its own handle (fid) from the daemon.  The entry points
+ * on that minor are forwarded over the door: open, close (flush and
+ * release), read and write (FUSE_OP_DEVREAD and FUSE_OP_DEVWRITE,
+ * which move up to FUSE_DEVIO_MAX per call, and tell the daemon if
+ * the caller is non-blocking), ioctl and poll.  Poll works as it
+ * does in fusefs: when nothing is ready, the daemon is asked to send
+ * FUSE_NOTIFY_POLL with the open's handle, which the device's notify
+ * thread turns into a pollwakeup.
+ *
+ * When the daemon closes the control node (or exits), the device
+ * node goes away and the device is marked dead: opens of it that
+ * are still around get ENXIO, and their pollers POLLHUP.  The device
+ * is freed with its last hold (the control open, each open of the
+ * device, and the notify thread have one).
+ *
+ * Locking: cuse_lock protects the device list and the minor soft
+ * state.  cd_lock protects a device's flags, its pollers list and
+ * their poll handles.  Neither is held across an up-call or across
+ * pollwakeup; cm_pollbusy keeps a poller around while we're in
+ * pollwakeup.
+ */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <sys/stat.h>
+
+#include <sys/file.h>
+#include <sys/open.h>
+#include <sys/poll.h>
+#include <sys/uio.h>
+#include <sys/cred.h>
+#include <sys/kmem.h>
+#include <sys/list.h>
+#include <sys/id_space.h>
+#include <sys/thread.h>
+#include <sys/disp.h>
+#include <sys/zone.h>
+#include <sys/sysmacros.h>
+#include <sys/modctl.h>
+#include <sys/conf.h>
+#include <sys/ddi.h>
+#include <sys/sunddi.h>
+
+#include <sys/cuse.h>
+#include <sys/fs/fuse_door.h>
+
+#include "fusefs.h"
+#include "fusefs_calls.h"
+
+#define	CUSE_CTL_MINOR	0
+
+/*
+ * Events reported to pollwakeup for FUSE_NOTIFY_POLL.  As in fusefs,
+ * the daemon doesn't say which changed, so chpoll sorts it out.
+ */
+#define	CUSE_POLL_ANY	\
+	(POLLIN | POLLRDNORM | POLLRDBAND | POLLPRI | POLLOUT | POLLWRBAND)
+
+typedef struct cuse_dev {
+	list_node_t	cd_node;	/* on cuse_devs */
+	char		cd_name[CUSE_NAMELEN];
+	minor_t		cd_minor;	/* of the device node */
+	fusefs_ssn_t	*cd_ssn;
+	kmutex_t	cd_lock;
+	kcondvar_t	cd_cv;
+	uint_t		cd_refs;
+	boolean_t	cd_dead;	/* daemon detached */
+	kthread_t	*cd_notify_thread;
+	list_t		cd_pollers;	/* cuse_minor_t */
+	uint64_t	cd_pollkh;	/* last poll handle given out */
+} cuse_dev_t;
+
+typedef enum {
+	CUSE_M_CTL = 1,		/* an open of the control node */
+	CUSE_M_DEV,		/* a device node */
+	CUSE_M_OPEN		/* an open of a device node */
+} cuse_mtype_t;
+
+typedef struct cuse_minor {
+	cuse_mtype_t	cm_type;
+	cuse_dev_t	*cm_dev;	/* held, but not by CUSE_M_DEV */
+	uint64_t	cm_fid;		/* daemon's handle for an open */
+
+	/* Poll.  Under cd_lock */
+	pollhead_t	cm_pollhead;
+	list_node_t	cm_poll_node;
+	uint64_t	cm_pollkh;
+	uint_t		cm_pollgen;	/* notifications seen */
+	uint_t		cm_pollbusy;	/* in pollwakeup */
+} cuse_minor_t;
+
+static dev_info_t *cuse_dip;
+static void *cuse_state;
+static id_space_t *cuse_minors;
+static kmutex_t cuse_lock;
+static list_t cuse_devs;
+
+static int cuse_open(dev_t *, int, int, cred_t *);
+static int cuse_close(dev_t, int, int, cred_t *);
+static int cuse_read(dev_t, struct uio *, cred_t *);
+static int cuse_write(dev_t, struct uio *, cred_t *);
+static int cuse_ioctl(dev_t dev, int cmd, intptr_t arg, int mode,
+				cred_t *credp, int *rvalp);
+static int cuse_chpoll(dev_t, short, int, short *, struct pollhead **);
+
+static int cuse_attach(dev_info_t *, ddi_attach_cmd_t);
+static int cuse_detach(dev_info_t *, ddi_detach_cmd_t);
+static int cuse_getinfo(dev_info_t *, ddi_info_cmd_t, void *, void **);
+
+/* DDI declarations */
+static struct cb_ops cuse_cb_ops = {
+	cuse_open,		/* open */
+	cuse_close,		/* close */
+	nodev,			/* strategy */
+	nodev,			/* print */
+	nodev,			/* dump */
+	cuse_read,		/* read */
+	cuse_write,		/* write */
+	cuse_ioctl,		/* ioctl */
+	nodev,			/* devmap */
+	nodev,			/* mmap */
+	nodev,			/* segmap */
+	cuse_chpoll,		/* chpoll */
+	ddi_prop_op,		/* prop_op */
+	NULL,			/* streamtab  */
+	(D_NEW | D_MP),		/* cb_flag */
+	CB_REV,			/* cb_rev */
+	nodev,			/* aread */
+	nodev			/* awrite */
+};
+
+static struct dev_ops cuse_ops = {
+	DEVO_REV,		/* devo_rev, */
+	0,			/* refcnt  */
+	cuse_getinfo,		/* get_dev_info */
+	nulldev,		/* identify */
+	nulldev,		/* probe */
+	cuse_attach,		/* attach */
+	cuse_detach,		/* detach */
+	nodev,			/* reset */
+	&cuse_cb_ops,		/* driver operations */
+	NULL,			/* bus operations */
+	NULL,			/* power */
+	ddi_quiesce_not_needed,		/* quiesce */
+};
+
+/* Modlinkage */
+static struct modldrv modldrv = {
+	&mod_driverops,
+	"CUSE character devices",
+	&cuse_ops
+};
+
+static struct modlinkage modlinkage = {	MODREV_1, { &modldrv, NULL } };
+
+
+/* DDI glue */
+
+int
+_init(void)
+{
+	int error;
+
+	error = ddi_soft_state_init(&cuse_state, sizeof (cuse_minor_t), 0);
+	if (error != 0)
+		return (error);
+	cuse_minors = id_space_create("cuse_minors", 1, MAXMIN32);
+	mutex_init(&cuse_lock, NULL, MUTEX_DEFAULT, NULL);
+	list_create(&cuse_devs, sizeof (cuse_dev_t),
+	    offsetof(cuse_dev_t, cd_node));
+
+	error = mod_install(&modlinkage);
+	if (error != 0) {
+		list_destroy(&cuse_devs);
+		mutex_destroy(&cuse_lock);
+		id_space_destroy(cuse_minors);
+		ddi_soft_state_fini(&cuse_state);
+	}
+	return (error);
+}
+
+int
+_fini(void)
+{
+	int error;
+
+	error = mod_remove(&modlinkage);
+	if (error != 0)
+		return (error);
+
+	list_destroy(&cuse_devs);
+	mutex_destroy(&cuse_lock);
+	id_space_destroy(cuse_minors);
+	ddi_soft_state_fini(&cuse_state);
+	return (0);
+}
+
+int
+_info(struct modinfo *modinfop)
+{
+	return (mod_info(&modlinkage, modinfop));
+}
+
+static int
+cuse_attach(dev_info_t *dip, ddi_attach_cmd_t cmd)
+{
+	if (cmd != DDI_ATTACH)
+		return (DDI_FAILURE);
+
+	if (ddi_create_minor_node(dip, "ctl", S_IFCHR, CUSE_CTL_MINOR,
+	    DDI_PSEUDO, 0) == DDI_FAILURE) {
+		ddi_remove_minor_node(dip, NULL);
+		return (DDI_FAILURE);
+	}
+
+	cuse_dip = dip;
+
+	return (DDI_SUCCESS);
+}
+
+static int
+cuse_detach(dev_info_t *dip, ddi_detach_cmd_t cmd)
+{
+	if (cmd != DDI_DETACH)
+		return (DDI_FAILURE);
+
+	/* Not while any daemon has a device attached. */
+	mutex_enter(&cuse_lock);
+	if (!list_is_empty(&cuse_devs)) {
+		mutex_exit(&cuse_lock);
+		return (DDI_FAILURE);
+	}
+	cuse_dip = NULL;
+	mutex_exit(&cuse_lock);
+
+	ddi_remove_minor_node(dip, NULL);
+
+	return (DDI_SUCCESS);
+}
+
+/*ARGSUSED*/
+static int
+cuse_getinfo(dev_info_t *dip, ddi_info_cmd_t infocmd, void *arg, void **result)
+{
+	int error;
+
+	switch (infocmd) {
+	case DDI_INFO_DEVT2DEVINFO:
+		*result = cuse_dip;
+		error = DDI_SUCCESS;
+		break;
+	case DDI_INFO_DEVT2INSTANCE:
+		*result = (void *)0;
+		error = DDI_SUCCESS;
+		break;
+	default:
+		error = DDI_FAILURE;
+	}
+	return (error);
+}
+
+/*
+ * Minors and devices
+ */
+
+/* Caller holds cuse_lock */
+static cuse_minor_t *
+cuse_minor_alloc(cuse_mtype_t type, cuse_dev_t *cd, minor_t *minorp)
+{
+	cuse_minor_t *cm;
+	id_t id;
+
+	ASSERT(MUTEX_HELD(&cuse_lock));
+
+	id = id_alloc(cuse_minors);
+	if (ddi_soft_state_zalloc(cuse_state, id) != DDI_SUCCESS) {
+		id_free(cuse_minors, id);
+		return (NULL);
+	}
+	cm = ddi_get_soft_state(cuse_state, id);
+	cm->cm_type = type;
+	cm->cm_dev = cd;
+
+	*minorp = (minor_t)id;
+	return (cm);
+}
+
+/* Caller holds cuse_lock */
+static void
+cuse_minor_free(minor_t minor)
+{
+	ASSERT(MUTEX_HELD(&cuse_lock));
+
+	ddi_soft_state_free(cuse_state, minor);
+	id_free(cuse_minors, (id_t)minor);
+}
+
+/* The soft state of an open of a device, or NULL */
+static cuse_minor_t *
+cuse_open_minor(dev_t dev)
+{
+	cuse_minor_t *cm;
+
+	cm = ddi_get_soft_state(cuse_state, getminor(dev));
+	if (cm == NULL || cm->cm_type != CUSE_M_OPEN)
+		return (NULL);
+	return (cm);
+}
+
+static void
+cuse_dev_hold(cuse_dev_t *cd)
+{
+	mutex_enter(&cd->cd_lock);
+	cd->cd_refs++;
+	mutex_exit(&cd->cd_lock);
+}
+
+static void
+cuse_dev_rele(cuse_dev_t *cd)
+{
+	mutex_enter(&cd->cd_lock);
+	ASSERT(cd->cd_refs > 0);
+	if (--cd->cd_refs > 0) {
+		mutex_exit(&cd->cd_lock);
+		return;
+	}
+	mutex_exit(&cd->cd_lock);
+
+	ASSERT(list_is_empty(&cd->cd_pollers));
+	ASSERT(cd->cd_notify_thread == NULL);
+	fusefs_ssn_rele(cd->cd_ssn);
+	list_destroy(&cd->cd_pollers);
+	cv_destroy(&cd->cd_cv);
+	mutex_destroy(&cd->cd_lock);
+	kmem_free(cd, sizeof (*cd));
+}
+
+/*
+ * Device names become minor node names, and /dev/cuse links.
+ */
+static boolean_t
+cuse_name_ok(const char *name)
+{
+	const char *p;
+
+	if (name[0] == '\0' || name[0] == '.' || strcmp(name, "ctl") == 0)
+		return (B_FALSE);
+	for (p = name; *p != '\0'; p++) {
+		if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+		    (*p >= '0' && *p <= '9') ||
+		    *p == '.' || *p == '_' || *p == '-')
+			continue;
+		return (B_FALSE);
+	}
+	return (B_TRUE);
+}
+
+/*
+ * Poll support.  See fusefs_notify.c for the scheme.
+ */
+
+static uint64_t
+cuse_poll_register(cuse_minor_t *cm, uint_t *genp)
+{
+	cuse_dev_t *cd = cm->cm_dev;
+	uint64_t kh = 0;
+
+	mutex_enter(&cd->cd_lock);
+	if (cd->cd_notify_thread != NULL && !cd->cd_dead) {
+		if (cm->cm_pollkh == 0) {
+			cm->cm_pollkh = ++cd->cd_pollkh;
+			list_insert_tail(&cd->cd_pollers, cm);
+		}
+		kh = cm->cm_pollkh;
+	}
+	*genp = cm->cm_pollgen;
+	mutex_exit(&cd->cd_lock);
+
+	return (kh);
+}
+
+/* Caller holds cd_lock, which is dropped around the pollwakeup. */
+static void
+cuse_poll_wake(cuse_dev_t *cd, cuse_minor_t *cm, short events)
+{
+	ASSERT(MUTEX_HELD(&cd->cd_lock));
+
+	cm->cm_pollgen++;
+	cm->cm_pollbusy++;
+	mutex_exit(&cd->cd_lock);
+
+	pollwakeup(&cm->cm_pollhead, events);
+
+	mutex_enter(&cd->cd_lock);
+	if (--cm->cm_pollbusy == 0)
+		cv_broadcast(&cd->cd_cv);
+}
+
+static void
+cuse_notify_poll(cuse_dev_t *cd, uint64_t kh)
+{
+	cuse_minor_t *cm;
+
+	mutex_enter(&cd->cd_lock);
+	for (cm = list_head(&cd->cd_pollers); cm != NULL;
+	    cm = list_next(&cd->cd_pollers, cm)) {
+		if (cm->cm_pollkh == kh)
+			break;
+	}
+	if (cm != NULL)
+		cuse_poll_wake(cd, cm, CUSE_POLL_ANY);
+	mutex_exit(&cd->cd_lock);
+}
+
+/* The device is dead; wake everyone so they see POLLHUP. */
+static void
+cuse_poll_hangup(cuse_dev_t *cd)
+{
+	cuse_minor_t *cm;
+
+	mutex_enter(&cd->cd_lock);
+	for (cm = list_head(&cd->cd_pollers); cm != NULL;
+	    cm = list_next(&cd->cd_pollers, cm)) {
+		/* cm stays on the list while busy. */
+		cuse_poll_wake(cd, cm, POLLHUP | POLLERR);
+	}
+	mutex_exit(&cd->cd_lock);
+}
+
+/* An open is going away (last close). */
+static void
+cuse_poll_inactive(cuse_minor_t *cm)
+{
+	cuse_dev_t *cd = cm->cm_dev;
+
+	mutex_enter(&cd->cd_lock);
+	if (cm->cm_pollkh != 0) {
+		list_remove(&cd->cd_pollers, cm);
+		cm->cm_pollkh = 0;
+	}
+	while (cm->cm_pollbusy != 0)
+		cv_wait(&cd->cd_cv, &cd->cd_lock);
+	mutex_exit(&cd->cd_lock);
+
+	pollhead_clean(&cm->cm_pollhead);
+}
+
+/*
+ * Keep a FUSE_OP_NOTIFY call outstanding, and wake the pollers
+ * the daemon tells us about.  Ends when the daemon answers ESRCH
+ * (after FUSE_OP_DESTROY) or goes away.
+ */
+static void
+cuse_notify_thread(void *arg)
+{
+	cuse_dev_t *cd = arg;
+	struct fuse_notify_ret *retp;
+	int error, i;
+
+	retp = kmem_alloc(sizeof (*retp), KM_SLEEP);
+
+	for (;;) {
+		error = fusefs_call_notify(cd->cd_ssn, retp);
+		if (error != 0)
+			break;
+		/* Only poll notifications mean anything for a device. */
+		for (i = 0; i < retp->ret_count; i++) {
+			if (retp->ret_ents[i].ne_code == FUSE_NOTIFY_POLL)
+				cuse_notify_poll(cd, retp->ret_ents[i].ne_kh);
+		}
+	}
+
+	kmem_free(retp, sizeof (*retp));
+
+	mutex_enter(&cd->cd_lock);
+	cd->cd_notify_thread = NULL;
+	cv_broadcast(&cd->cd_cv);
+	mutex_exit(&cd->cd_lock);
+
+	cuse_dev_rele(cd);
+	thread_exit();
+}
+
+/*
+ * CUSE_IOC_ATTACH on an open of the control node.
+ */
+static int
+cuse_attach_dev(cuse_minor_t *ctl, intptr_t arg, int mode, cred_t *cr)
+{
+	cuse_attach_t ca;
+	cuse_dev_t *cd, *ocd;
+	fusefs_ssn_t *ssn;
+	minor_t minor;
+	int error;
+
+	if (crgetzoneid(cr) != GLOBAL_ZONEID)
+		return (EPERM);
+	if (ddi_copyin((void *)arg, &ca, sizeof (ca), mode) != 0)
+		return (EFAULT);
+	ca.ca_name[CUSE_NAMELEN - 1] = '\0';
+	if (!cuse_name_ok(ca.ca_name))
+		return (EINVAL);
+	if (ctl->cm_dev != NULL)
+		return (EBUSY);
+
+	/* This makes the INIT call. */
+	error = fusefs_ssn_create(ca.ca_doorfd, &ssn);
+	if (error != 0)
+		return (error);
+	if ((ssn->ss_opts & FUSE_INIT_CUSE) == 0) {
+		/* A file system daemon, not ours. */
+		fusefs_ssn_rele(ssn);
+		return (EINVAL);
+	}
+
+	cd = kmem_zalloc(sizeof (*cd), KM_SLEEP);
+	(void) strlcpy(cd->cd_name, ca.ca_name, sizeof (cd->cd_name));
+	cd->cd_ssn = ssn;
+	cd->cd_refs = 1;	/* the control open's */
+	mutex_init(&cd->cd_lock, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&cd->cd_cv, NULL, CV_DEFAULT, NULL);
+	list_create(&cd->cd_pollers, sizeof (cuse_minor_t),
+	    offsetof(cuse_minor_t, cm_poll_node));
+
+	/* Before anyone can open it, so the first poll can wait. */
+	if ((ssn->ss_opts & FUSE_INIT_NOTIFY) != 0) {
+		cd->cd_refs++;
+		cd->cd_notify_thread = thread_create(NULL, 0,
+		    cuse_notify_thread, cd, 0, &p0, TS_RUN, minclsyspri);
+	}
+
+	mutex_enter(&cuse_lock);
+	for (ocd = list_head(&cuse_devs); ocd != NULL;
+	    ocd = list_next(&cuse_devs, ocd)) {
+		if (strcmp(ocd->cd_name, cd->cd_name) == 0)
+			break;
+	}
+	if (ocd != NULL || ctl->cm_dev != NULL || cuse_dip == NULL) {
+		error = (ocd != NULL) ? EEXIST : EBUSY;
+		goto fail;
+	}
+	if (cuse_minor_alloc(CUSE_M_DEV, cd, &minor) == NULL) {
+		error = ENOMEM;
+		goto fail;
+	}
+	if (ddi_create_minor_node(cuse_dip, cd->cd_name, S_IFCHR, minor,
+	    DDI_PSEUDO, 0) != DDI_SUCCESS) {
+		cuse_minor_free(minor);
+		error = ENXIO;
+		goto fail;
+	}
+	cd->cd_minor = minor;
+	list_insert_tail(&cuse_devs, cd);
+	ctl->cm_dev = cd;
+	mutex_exit(&cuse_lock);
+
+	return (0);
+
+fail:
+	mutex_exit(&cuse_lock);
+	/* Stops the notify thread, if any. */
+	fusefs_ssn_kill(ssn);
+	cuse_dev_rele(cd);
+	return (error);
+}
+
+/*
+ * The daemon closed the control node.  Take the device node away,
+ * and fail what's still open of it.
+ */
+static void
+cuse_detach_dev(cuse_dev_t *cd)
+{
+	mutex_enter(&cuse_lock);
+	if (cuse_dip != NULL)
+		ddi_remove_minor_node(cuse_dip, cd->cd_name);
+	cuse_minor_free(cd->cd_minor);
+	list_remove(&cuse_devs, cd);
+	mutex_exit(&cuse_lock);
+
+	mutex_enter(&cd->cd_lock);
+	cd->cd_dead = B_TRUE;
+	mutex_exit(&cd->cd_lock);
+
+	cuse_poll_hangup(cd);
+	fusefs_ssn_kill(cd->cd_ssn);
+	cuse_dev_rele(cd);
+}
+
+/*
+ * Entry points
+ */
+
+/*ARGSUSED3*/
+static int
+cuse_open(dev_t *devp, int flag, int otyp, cred_t *credp)
+{
+	cuse_minor_t *cm, *ncm;
+	cuse_dev_t *cd;
+	minor_t minor;
+	int error;
+
+	if (otyp != OTYP_CHR)
+		return (EINVAL);
+
+	mutex_enter(&cuse_lock);
+	if (getminor(*devp) == CUSE_CTL_MINOR) {
+		ncm = cuse_minor_alloc(CUSE_M_CTL, NULL, &minor);
+		mutex_exit(&cuse_lock);
+		if (ncm == NULL)
+			return (ENOMEM);
+		*devp = makedevice(getmajor(*devp), minor);
+		return (0);
+	}
+
+	cm = ddi_get_soft_state(cuse_state, getminor(*devp));
+	if (cm == NULL || cm->cm_type != CUSE_M_DEV) {
+		mutex_exit(&cuse_lock);
+		return (ENXIO);
+	}
+	cd = cm->cm_dev;
+	cuse_dev_hold(cd);
+	ncm = cuse_minor_alloc(CUSE_M_OPEN, cd, &minor);
+	mutex_exit(&cuse_lock);
+	if (ncm == NULL) {
+		cuse_dev_rele(cd);
+		return (ENOMEM);
+	}
+
+	/* The daemon gets the sys/file.h flags (FREAD, FNONBLOCK...) */
+	error = fusefs_call_open(cd->cd_ssn, 1, "/", flag, &ncm->cm_fid,
+	    NULL);
+	if (error != 0) {
+		mutex_enter(&cuse_lock);
+		cuse_minor_free(minor);
+		mutex_exit(&cuse_lock);
+		cuse_dev_rele(cd);
+		return (error);
+	}
+
+	*devp = makedevice(getmajor(*devp), minor);
+	return (0);
+}
+
+/*ARGSUSED*/
+static int
+cuse_close(dev_t dev, int flag, int otyp, cred_t *credp)
+{
+	cuse_minor_t *cm;
+	cuse_dev_t *cd;
+
+	cm = ddi_get_soft_state(cuse_state, getminor(dev));
+	if (cm == NULL)
+		return (ENXIO);
+
+	switch (cm->cm_type) {
+	case CUSE_M_CTL:
+		if (cm->cm_dev != NULL)
+			cuse_detach_dev(cm->cm_dev);
+		break;
+
+	case CUSE_M_OPEN:
+		cd = cm->cm_dev;
+		cuse_poll_inactive(cm);
+		if (!cd->cd_dead) {
+			(void) fusefs_call_flush(cd->cd_ssn, cm->cm_fid);
+			(void) fusefs_call_close(cd->cd_ssn, cm->cm_fid);
+		}
+		cuse_dev_rele(cd);
+		break;
+
+	default:
+		/* Device nodes are cloned, never open themselves. */
+		return (0);
+	}
+
+	mutex_enter(&cuse_lock);
+	cuse_minor_free(getminor(dev));
+	mutex_exit(&cuse_lock);
+
+	return (0);
+}
+
+static int
+cuse_ioflags(struct uio *uio)
+{
+	return ((uio->uio_fmode & (FNONBLOCK | FNDELAY)) != 0 ?
+	    FUSE_DEVIO_NONBLOCK : 0);
+}
+
+/*
+ * A device gives what it has, so one read(2) is one call,
+ * for as much as the caller wants, up to FUSE_DEVIO_MAX.
+ */
+/*ARGSUSED*/
+static int
+cuse_read(dev_t dev, struct uio *uio, cred_t *credp)
+{
+	cuse_minor_t *cm;
+	cuse_dev_t *cd;
+	uint32_t len;
+
+	if ((cm = cuse_open_minor(dev)) == NULL)
+		return (ENXIO);
+	cd = cm->cm_dev;
+	if (cd->cd_dead)
+		return (ENXIO);
+
+	len = MIN(uio->uio_resid, FUSE_DEVIO_MAX);
+	if (len == 0)
+		return (0);
+
+	return (fusefs_call_devread(cd->cd_ssn, cm->cm_fid,
+	    cuse_ioflags(uio), &len, uio));
+}
+
+/*
+ * Writes go in FUSE_DEVIO_MAX pieces, until one comes up short.
+ */
+/*ARGSUSED*/
+static int
+cuse_write(dev_t dev, struct uio *uio, cred_t *credp)
+{
+	cuse_minor_t *cm;
+	cuse_dev_t *cd;
+	ssize_t resid;
+	uint32_t len, want;
+	int error = 0;
+
+	if ((cm = cuse_open_minor(dev)) == NULL)
+		return (ENXIO);
+	cd = cm->cm_dev;
+	if (cd->cd_dead)
+		return (ENXIO);
+
+	resid = uio->uio_resid;
+	while (uio->uio_resid > 0) {
+		want = len = MIN(uio->uio_resid, FUSE_DEVIO_MAX);
+		error = fusefs_call_devwrite(cd->cd_ssn, cm->cm_fid,
+		    cuse_ioflags(uio), &len, uio);
+		if (error != 0 || len < want)
+			break;
+	}
+
+	/* Report what was written, if anything was. */
+	if (error != 0 && uio->uio_resid < resid)
+		error = 0;
+	return (error);
+}
+
+/*ARGSUSED*/
+static int
+cuse_ioctl(dev_t dev, int cmd, intptr_t arg, int mode,	/* model.h */
+	cred_t *cr, int *rvalp)
+{
+	cuse_minor_t *cm;
+	cuse_dev_t *cd;
+
+	cm = ddi_get_soft_state(cuse_state, getminor(dev));
+	if (cm == NULL)
+		return (ENXIO);
+
+	if (cm->cm_type == CUSE_M_CTL) {
+		if (cmd != CUSE_IOC_ATTACH)
+			return (ENOTTY);
+		return (cuse_attach_dev(cm, arg, mode, cr));
+	}
+	if (cm->cm_type != CUSE_M_OPEN)
+		return (ENXIO);
+	cd = cm->cm_dev;
+	if (cd->cd_dead)
+		return (ENXIO);
+
+	/*
+	 * The daemon may ask for buffers the command's encoding
+	 * doesn't describe; libfuse only lets it if the device was
+	 * set up with CUSE_UNRESTRICTED_IOCTL.
+	 */
+	return (fusefs_call_ioctl(cd->cd_ssn, cm->cm_fid, 0, "",
+	    cmd, arg, mode, FUSE_IOCTLF_UNRESTRICTED, rvalp));
+}
+
+static int
+cuse_chpoll(dev_t dev, short events, int anyyet, short *reventsp,
+	struct pollhead **phpp)
+{
+	cuse_minor_t *cm;
+	cuse_dev_t *cd;
+	uint64_t kh;
+	uint_t gen = 0;
+	int error, flags, revents, tries;
+
+	if ((cm = cuse_open_minor(dev)) == NULL)
+		return (ENXIO);
+	cd = cm->cm_dev;
+	if (cd->cd_dead) {
+		*reventsp = POLLHUP | POLLERR;
+		return (0);
+	}
+
+	/*
+	 * As in fusefs_poll: ask for a notification only if we're
+	 * going to sleep, and ask again if one came in meanwhile.
+	 */
+	for (tries = 0; ; tries++) {
+		kh = anyyet ? 0 : cuse_poll_register(cm, &gen);
+		flags = kh ? FUSE_POLL_SCHEDULE_NOTIFY : 0;
+		revents = 0;
+		error = fusefs_call_poll(cd->cd_ssn, cm->cm_fid, 0, "",
+		    kh, events, flags, &revents);
+		if (error || (revents & events) || kh == 0 || tries >= 3)
+			break;
+		mutex_enter(&cd->cd_lock);
+		if (cm->cm_pollgen == gen) {
+			mutex_exit(&cd->cd_lock);
+			break;
+		}
+		mutex_exit(&cd->cd_lock);
+	}
+
+	if (error == ENOSYS) {
+		/* No poll in the daemon: always ready. */
+		*reventsp = events & (POLLIN | POLLRDNORM | POLLOUT);
+		return (0);
+	}
+	if (error)
+		return (error);
+
+	*reventsp = (short)(revents & events);
+	if (*reventsp == 0 && !anyyet)
+		*phpp = &cm->cm_pollhead;
+
+	return (0);
+}
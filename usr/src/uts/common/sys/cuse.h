@@ -0,0 +1,45 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2012 Nexenta Systems, Inc.  All rights reserved.
+ */
+
+#ifndef _SYS_CUSE_H
+#define	_SYS_CUSE_H
+
+/*
+ * CUSE: character devices served by a FUSE daemon.
+ *
+ * The daemon opens the control node and attaches its door (the
+ * same door protocol as fusefs, see sys/fs/fuse_door.h) under a
+ * device name.  The device node CUSE_DEV_DIR/<name> then exists
+ * until the daemon closes the control node (or exits).
+ */
+
+#include <sys/types.h>
+
+#define	CUSE_CTL_PATH	"/dev/cuse/ctl"
+#define	CUSE_DEV_DIR	"/dev/cuse"
+
+/* Device names: letters, digits, and "._-" */
+#define	CUSE_NAMELEN	32
+
+#define	CUSE_IOC		(('C' << 16) | ('U' << 8))
+#define	CUSE_IOC_ATTACH		(CUSE_IOC | 1)
+
+typedef struct cuse_attach {
+	int32_t		ca_doorfd;
+	uint32_t	ca_flags;	/* none yet */
+	char		ca_name[CUSE_NAMELEN];
+} cuse_attach_t;
+
+#endif	/* _SYS_CUSE_H */
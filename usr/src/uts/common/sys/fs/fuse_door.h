@@ -18,6 +18,7 @@
 
 #include <sys/param.h>
 #include <sys/time.h>
+#include <sys/ioccom.h>
 #include <sys/fs/fuse_ktypes.h>
 
 /*
@@ -58,14 +59,73 @@ typedef enum {			/* arg type, ret type */
 	FUSE_OP_RENAME,		/* path2, generic */
 	FUSE_OP_MKDIR,		/* path, generic */
 	FUSE_OP_RMDIR,		/* path, generic */
+
+	FUSE_OP_POLL,		/* poll, poll */
+	FUSE_OP_NOTIFY,		/* generic, notify */
+	FUSE_OP_TRACE,		/* trace + another op's arg, its ret */
+	FUSE_OP_CREATE2,	/* create, create */
+	FUSE_OP_IOCTL,		/* ioctl, ioctl */
+	FUSE_OP_DEVREAD,	/* devio, devio + data */
+	FUSE_OP_DEVWRITE,	/* devio + data, devio */
+	FUSE_OP_FALLOCATE,	/* fallocate, generic */
+	FUSE_OP_BMAP,		/* bmap, bmap */
+	FUSE_OP_FHLOOKUP,	/* fhlookup, fhlookup */
+	FUSE_OP_GETACL,		/* path, getacl */
+	FUSE_OP_SETACL,		/* setacl, generic */
+	FUSE_OP_DIGEST,		/* digest, digest */
+	FUSE_OP_RMTREE,		/* path, generic */
+	FUSE_OP_SUMTREE,	/* path, sumtree */
 } fuse_opcode_t;
 
+/*
+ * When the daemon sets FUSE_INIT_PRIO, fusefs puts the priority
+ * class of the calling thread in the top byte of arg_opcode.
+ * Zero (normal) is what older kernels send.
+ */
+#define	FUSE_OP_PRIO_SHIFT	24
+#define	FUSE_OP_CODE(op)	((op) & ((1 << FUSE_OP_PRIO_SHIFT) - 1))
+#define	FUSE_OP_PRIO(op)	((uint32_t)(op) >> FUSE_OP_PRIO_SHIFT)
+
+#define	FUSE_PRIO_NORMAL	0
+#define	FUSE_PRIO_HIGH		1	/* interactive, real-time, nice < 0 */
+#define	FUSE_PRIO_LOW		2	/* nice > 0 */
+#define	FUSE_PRIO_MAX		3
+
+/*
+ * Flags in fuse_generic_ret.ret_flags from FUSE_OP_INIT
+ */
+#define	FUSE_INIT_NOTIFY	1	/* daemon answers FUSE_OP_NOTIFY */
+#define	FUSE_INIT_PRIO		2	/* daemon takes FUSE_OP_PRIO */
+#define	FUSE_INIT_TRACE		4	/* daemon takes FUSE_OP_TRACE */
+#define	FUSE_INIT_CREATE2	8	/* daemon answers FUSE_OP_CREATE2 */
+#define	FUSE_INIT_INO		16	/* st_ino is the file's inode number */
+#define	FUSE_INIT_CUSE		32	/* daemon serves a CUSE device */
+#define	FUSE_INIT_FALLOCATE	64	/* daemon answers FUSE_OP_FALLOCATE */
+#define	FUSE_INIT_BMAP		128	/* daemon answers FUSE_OP_BMAP */
+#define	FUSE_INIT_FHANDLE	256	/* daemon answers FUSE_OP_FHLOOKUP */
+#define	FUSE_INIT_ACL		512	/* daemon answers FUSE_OP_GETACL */
+
 /* For ops that don't send data. */
 struct fuse_generic_arg {
 	int32_t arg_opcode;
 	uint32_t arg_flags;
 };
 
+/*
+ * FUSE_OP_TRACE: when the daemon sets FUSE_INIT_TRACE, fusefs puts
+ * this in front of the args of each call, followed by the args of
+ * the real call (op code and all).  The request ID is unique since
+ * boot, and the times are from gethrtime(), so the daemon can put
+ * its own times for the request on the same timeline.
+ */
+struct fuse_trace_arg {
+	uint32_t arg_opcode;	/* FUSE_OP_TRACE */
+	uint32_t arg_flags;
+	uint64_t arg_reqid;
+	int64_t arg_t_enter;	/* upcall started */
+	int64_t arg_t_call;	/* door call made (after I/O limits) */
+};
+
 /* For ops that don't return data. */
 struct fuse_generic_ret {
 	int32_t ret_err;
@@ -120,6 +180,37 @@ struct fuse_path2_arg {
 	char arg_path2[MAXPATHLEN];
 };
 
+/*
+ * FUSE_OP_CREATE2: create and/or open a file (like open(2) with
+ * O_CREAT, O_EXCL and O_TRUNC) and return the open handle with the
+ * attributes, all in one call.  If the name exists but is not a
+ * regular file, only its attributes come back (no FUSE_CREATE_OPENED).
+ */
+#define	FUSE_CREATE_CREAT	1	/* create if it doesn't exist */
+#define	FUSE_CREATE_EXCL	2	/* fail with EEXIST if it does */
+#define	FUSE_CREATE_TRUNC	4	/* truncate if it does */
+
+/* ret_flags (FUSE_CREATE_CREATED also for FUSE_OP_CREATE) */
+#define	FUSE_CREATE_CREATED	1	/* the file was created */
+#define	FUSE_CREATE_OPENED	2	/* ret_fid is an open handle */
+
+struct fuse_create_arg {
+	uint32_t arg_opcode;
+	uint32_t arg_flags;
+	uint32_t arg_mode;	/* permissions, if created */
+	uint32_t arg_rights;	/* sys/file.h FREAD, FWRITE */
+	uint32_t arg__pad;
+	uint32_t arg_pathlen;
+	char arg_path[MAXPATHLEN];
+};
+
+struct fuse_create_ret {
+	uint32_t ret_err;
+	uint32_t ret_flags;
+	uint64_t ret_fid;
+	struct fuse_stat ret_st;
+};
+
 struct fuse_readdir_ret {
 	uint32_t ret_err;
 	uint32_t ret_flags;	/* EOF flag */
@@ -187,4 +278,305 @@ struct fuse_utimes_arg {
 	char arg_path[MAXPATHLEN];
 };
 
+/*
+ * FUSE_OP_POLL: ask the daemon for the ready events on an open file.
+ * With FUSE_POLL_SCHEDULE_NOTIFY, the daemon is also asked to send
+ * a FUSE_NOTIFY_POLL carrying arg_kh when the readiness changes.
+ */
+#define	FUSE_POLL_SCHEDULE_NOTIFY	1
+
+struct fuse_poll_arg {
+	uint32_t arg_opcode;
+	uint32_t arg_flags;
+	uint64_t arg_fid;
+	uint64_t arg_kh;	/* kernel handle, for notify */
+	uint32_t arg_events;
+	/* FUSE wants the path here too. */
+	uint32_t arg_pathlen;
+	char arg_path[MAXPATHLEN];
+};
+
+struct fuse_poll_ret {
+	uint32_t ret_err;
+	uint32_t ret_revents;
+};
+
+/*
+ * FUSE_OP_NOTIFY: fusefs keeps one of these calls outstanding
+ * per mount (when the daemon sets FUSE_INIT_NOTIFY) and the
+ * daemon answers it when it has notifications to deliver.
+ * The daemon answers ESRCH when it's shutting down.
+ *
+ * Path names are offsets into ret_paths, null terminated.
+ * An entry without a second path has FUSE_NOTIFY_NOPATH there
+ * (zero is a valid offset).
+ */
+#define	FUSE_NOTIFY_MAX		32
+#define	FUSE_NOTIFY_PATHSZ	(4 * MAXPATHLEN)
+#define	FUSE_NOTIFY_NOPATH	((uint32_t)-1)
+
+typedef enum {
+	FUSE_NOTIFY_POLL = 1,	/* wake pollers of ne_kh */
+	FUSE_NOTIFY_MODIFIED,	/* ne_path1 changed */
+	FUSE_NOTIFY_CREATED,	/* ne_path1 was created */
+	FUSE_NOTIFY_REMOVED,	/* ne_path1 was removed */
+	FUSE_NOTIFY_RENAMED,	/* ne_path1 was renamed to ne_path2 */
+} fuse_notify_code_t;
+
+struct fuse_notify_ent {
+	uint32_t ne_code;
+	uint32_t ne_flags;
+	uint64_t ne_kh;
+	uint32_t ne_path1;
+	uint32_t ne_path2;
+};
+
+struct fuse_notify_ret {
+	uint32_t ret_err;
+	uint32_t ret_count;
+	struct fuse_notify_ent ret_ents[FUSE_NOTIFY_MAX];
+	char ret_paths[FUSE_NOTIFY_PATHSZ];
+};
+
+/*
+ * FUSE_OP_IOCTL: an ioctl on an open file or CUSE device.
+ *
+ * The data that goes with the command follows the fixed part of
+ * the arg (arg_insize bytes) and of the ret (ret_outsize bytes).
+ * How much goes each way comes from the command's encoding
+ * (sys/ioccom.h IOC_IN, IOC_OUT), or, when the caller allows it
+ * (FUSE_IOCTLF_UNRESTRICTED), the daemon may answer with
+ * FUSE_IOCTLF_RETRY and a list of user buffers of the caller:
+ * ret_in_iovs to copy in, then ret_out_iovs to copy out to.
+ * The call is then made again with that data.
+ */
+#define	FUSE_IOCTL_MAXDATA	(16 * 1024)
+#define	FUSE_IOCTL_MAXIOV	32
+#define	FUSE_IOCTL_MAXTRY	4
+
+/* arg_flags */
+#define	FUSE_IOCTLF_UNRESTRICTED	1	/* retry allowed */
+#define	FUSE_IOCTLF_32BIT		2	/* caller is a 32-bit process */
+
+/* ret_flags */
+#define	FUSE_IOCTLF_RETRY		1	/* iovecs follow */
+
+struct fuse_ioctl_arg {
+	uint32_t arg_opcode;
+	uint32_t arg_flags;
+	uint64_t arg_fid;
+	uint64_t arg_arg;	/* the caller's argument, as is */
+	uint32_t arg_cmd;
+	uint32_t arg_insize;
+	uint32_t arg_outsize;	/* room for data back */
+	uint32_t arg_pathlen;
+	char arg_path[MAXPATHLEN];
+	/* arg_insize bytes of data follow */
+};
+
+struct fuse_ioctl_ret {
+	uint32_t ret_err;
+	uint32_t ret_flags;
+	int32_t ret_result;	/* ioctl return value */
+	uint32_t ret_outsize;
+	uint32_t ret_in_iovs;
+	uint32_t ret_out_iovs;
+	/* ret_outsize bytes of data, or the iovecs, follow */
+};
+
+struct fuse_ioctl_iovec {
+	uint64_t iov_base;
+	uint64_t iov_len;
+};
+
+/*
+ * FUSE_OP_DEVREAD, FUSE_OP_DEVWRITE: I/O on an open CUSE device.
+ * There's no path, and the data (for a write, in the arg; for a
+ * read, in the ret) follows the fixed part, so a call is only as
+ * big as the transfer, which may be up to FUSE_DEVIO_MAX.
+ */
+#define	FUSE_DEVIO_MAX		(128 * 1024)
+
+/* arg_flags */
+#define	FUSE_DEVIO_NONBLOCK	1	/* caller has O_NONBLOCK set */
+
+struct fuse_devio_arg {
+	uint32_t arg_opcode;
+	uint32_t arg_flags;
+	uint64_t arg_fid;
+	off64_t arg_offset;
+	uint32_t arg_length;
+	uint32_t arg__pad;
+	/* FUSE_OP_DEVWRITE: arg_length bytes of data follow */
+};
+
+struct fuse_devio_ret {
+	uint32_t ret_err;
+	uint32_t ret_length;
+	/* FUSE_OP_DEVREAD: ret_length bytes of data follow */
+};
+
+/*
+ * FUSE_OP_FALLOCATE: preallocate or (FUSE_FALLOC_PUNCH_HOLE) free
+ * space in an open file, as Linux fallocate(2), whose mode values
+ * these are.  With FUSE_FALLOC_EXTEND (ours, not passed on to the
+ * file system) the daemon then makes sure the file is at least
+ * arg_offset + arg_length long, so a range punched past EOF reads
+ * as zeros, like a write of zeros there would.
+ */
+#define	FUSE_FALLOC_KEEP_SIZE	0x01
+#define	FUSE_FALLOC_PUNCH_HOLE	0x02
+#define	FUSE_FALLOC_EXTEND	0x100
+
+struct fuse_fallocate_arg {
+	uint32_t arg_opcode;
+	uint32_t arg_flags;
+	uint64_t arg_fid;
+	off64_t arg_offset;
+	off64_t arg_length;
+	uint32_t arg_mode;
+	uint32_t arg_pathlen;
+	char arg_path[MAXPATHLEN];
+};
+
+/*
+ * FUSE_OP_BMAP: where a file's blocks are on the device or image
+ * the file system lives on (-o blkdev), in arg_blocksize units.
+ * The answer is a run of up to arg_nblocks blocks from arg_block:
+ * contiguous on the device from ret_devblock, or (ret_devblock
+ * zero) not mapped.
+ */
+struct fuse_bmap_arg {
+	uint32_t arg_opcode;
+	uint32_t arg_flags;
+	uint64_t arg_block;
+	uint32_t arg_blocksize;
+	uint32_t arg_nblocks;
+	uint32_t arg_pathlen;
+	char arg_path[MAXPATHLEN];
+};
+
+struct fuse_bmap_ret {
+	uint32_t ret_err;
+	uint32_t ret_nblocks;
+	uint64_t ret_devblock;
+};
+
+/*
+ * FUSE_OP_FHLOOKUP: find a file from the inode number and
+ * generation (st_ino, st_gen) the daemon gave for it, which
+ * fusefs puts in file handles for NFS.  The answer is a path
+ * to the file and its attributes, or ESTALE.
+ */
+struct fuse_fhlookup_arg {
+	uint32_t arg_opcode;
+	uint32_t arg_gen;
+	uint64_t arg_ino;
+};
+
+struct fuse_fhlookup_ret {
+	uint32_t ret_err;
+	uint32_t ret_pathlen;
+	struct fuse_stat ret_st;
+	char ret_path[MAXPATHLEN];
+};
+
+/*
+ * FUSE_OP_GETACL, FUSE_OP_SETACL: a file's POSIX draft ACL, the
+ * access entries and then (for directories) the default entries.
+ * a_type is as in aclent_t (USER_OBJ ... OTHER_OBJ, ACL_DEFAULT),
+ * which are also the tag values of the Linux ACL xattrs the daemon
+ * keeps them in.  a_perm is rwx as 4, 2, 1.  No entries means the
+ * file has no ACL beyond its mode.  GETACL also gets the file's
+ * attributes, so fusefs can cache the two together.
+ */
+#define	FUSE_ACL_MAX	64
+
+struct fuse_aclent {
+	uint32_t a_type;
+	uint32_t a_id;
+	uint32_t a_perm;
+};
+
+struct fuse_getacl_ret {
+	uint32_t ret_err;
+	uint32_t ret_count;
+	struct fuse_stat ret_st;
+	struct fuse_aclent ret_ent[FUSE_ACL_MAX];
+};
+
+struct fuse_setacl_arg {
+	uint32_t arg_opcode;
+	uint32_t arg_count;
+	struct fuse_aclent arg_ent[FUSE_ACL_MAX];
+	uint32_t arg_pathlen;
+	char arg_path[MAXPATHLEN];
+};
+
+/*
+ * FUSE_OP_DIGEST: a digest of a file's contents, if the file system
+ * can give one without us reading the whole file through the door
+ * (it has it already, as object stores do, or can work it out where
+ * the data is).  Named by algorithm ("md5", "sha1", "sha256"...),
+ * in lowercase hex.  ENOTSUP if the file system can't.
+ *
+ * Programs ask for one with the FUSEFS_IOC_DIGEST ioctl on a file
+ * open for reading: fd_alg in, fd_digest out (NUL terminated).
+ */
+#define	FUSE_DIGEST_ALGLEN	16
+#define	FUSE_DIGEST_MAX		128	/* hex digits, enough for sha512 */
+
+struct fuse_digest {
+	char fd_alg[FUSE_DIGEST_ALGLEN];
+	char fd_digest[FUSE_DIGEST_MAX + 1];
+};
+
+#define	FUSEFS_IOC_DIGEST	_IOWR('u', 1, struct fuse_digest)
+
+struct fuse_digest_arg {
+	uint32_t arg_opcode;
+	uint32_t arg_pathlen;
+	char arg_alg[FUSE_DIGEST_ALGLEN];
+	char arg_path[MAXPATHLEN];
+};
+
+struct fuse_digest_ret {
+	uint32_t ret_err;
+	uint32_t ret_len;
+	char ret_digest[FUSE_DIGEST_MAX + 1];
+};
+
+/*
+ * FUSE_OP_RMTREE: remove a directory and everything under it.
+ * FUSE_OP_SUMTREE: the space used by a file or directory and
+ * everything under it, as du(1) counts it.  For file systems that
+ * can do these in bulk (object stores, databases), rather than
+ * rm -r and du making a call for each entry.  ENOTSUP if the file
+ * system can't; programs then walk the tree as usual.
+ *
+ * Programs use FUSEFS_IOC_RMTREE on the parent directory, with the
+ * name to remove, and FUSEFS_IOC_SUMTREE on the file or directory
+ * to count.  A struct fuse_rmtree is too big for the size field of
+ * _IOW(), hence the plain command number.
+ */
+struct fuse_rmtree {
+	char fr_name[MAXNAMELEN];
+};
+
+#define	FUSEFS_IOC_RMTREE	(('u' << 8) | 2)
+
+struct fuse_treesum {
+	uint64_t ts_bytes;	/* sum of file sizes */
+	uint64_t ts_blocks;	/* DEV_BSIZE blocks allocated */
+	uint64_t ts_entries;	/* files and directories, the top too */
+};
+
+#define	FUSEFS_IOC_SUMTREE	_IOR('u', 3, struct fuse_treesum)
+
+struct fuse_sumtree_ret {
+	int32_t ret_err;
+	uint32_t ret_flags;
+	struct fuse_treesum ret_sum;
+};
+
 #endif /* !_FS_FUSEFS_FUSE_DOOR_H_ */
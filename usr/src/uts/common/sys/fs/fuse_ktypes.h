@@ -55,7 +55,7 @@ struct fuse_stat {
 	uint32_t	st_gid;
 	uint32_t	st_rdev;
 	uint32_t	st_blksize;
-	uint32_t	st__pad;
+	uint32_t	st_gen;		/* generation, see FUSE_OP_FHLOOKUP */
 	/* Intentionally ommit: dev */
 };
 
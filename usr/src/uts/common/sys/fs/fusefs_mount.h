@@ -32,6 +32,13 @@
 #define	FUSEFS_MF_ACREGMAX	0x0200	/* set max secs for file attr cache */
 #define	FUSEFS_MF_ACDIRMIN	0x0400	/* set min secs for dir attr cache */
 #define	FUSEFS_MF_ACDIRMAX	0x0800	/* set max secs for dir attr cache */
+#define	FUSEFS_MF_MEMLIMIT	0x1000	/* set cache memory limit */
+#define	FUSEFS_MF_QOS		0x2000	/* set I/O limits (rbw, wbw, iops) */
+#define	FUSEFS_MF_QOSZONE	0x4000	/* also charge the zone's I/O limits */
+#define	FUSEFS_MF_SWR		0x8000	/* serve stale attrs while refreshing */
+#define	FUSEFS_MF_ASYNCNS	0x10000	/* provisional create and mkdir */
+#define	FUSEFS_MF_BLKDEV	0x20000	/* direct I/O to blkfd (bmap) */
+#define	FUSEFS_MF_ACL		0x40000	/* per-file access checks, ACLs */
 
 /* Layout of the mount control block for an fuse file system. */
 struct fusefs_args {
@@ -46,6 +53,12 @@ struct fusefs_args {
 	int		acregmax;		/* attr cache file max secs */
 	int		acdirmin;		/* attr cache dir min secs */
 	int		acdirmax;		/* attr cache dir max secs */
+	uint_t		memlimit;		/* cache memory limit, KB */
+	uint_t		rbw;			/* read limit, KB/sec */
+	uint_t		wbw;			/* write limit, KB/sec */
+	uint_t		iops;			/* upcall limit, per sec */
+	int		swr;			/* max staleness, secs */
+	int		blkfd;			/* backing device, or -1 */
 };
 
 #ifdef _SYSCALL32
@@ -63,6 +76,12 @@ struct fusefs_args32 {
 	int32_t		acregmax;		/* attr cache file max secs */
 	int32_t		acdirmin;		/* attr cache dir min secs */
 	int32_t		acdirmax;		/* attr cache dir max secs */
+	uint32_t	memlimit;		/* cache memory limit, KB */
+	uint32_t	rbw;			/* read limit, KB/sec */
+	uint32_t	wbw;			/* write limit, KB/sec */
+	uint32_t	iops;			/* upcall limit, per sec */
+	int32_t		swr;			/* max staleness, secs */
+	int32_t		blkfd;			/* backing device, or -1 */
 };
 
 #endif /* _SYSCALL32 */